@@ -0,0 +1,118 @@
+#ifndef BINARYFRAMING_H
+#define BINARYFRAMING_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Binary framed transport for the serial console
+//
+// Frame:   [SOF] [type] [seq u16] [length u16] [0 0] [payload] [pad] [crc u32]
+//
+// The payload is zero padded to a multiple of 4 bytes. The CRC is the STM32
+// CRC unit value (CRC-32 0x04C11DB7, init 0xFFFFFFFF, no reflection, no final
+// xor) over the header and padded payload taken as little endian words.
+// Multi byte values are little endian.
+//
+// Host -> device
+//  DATA      One G-code line. seq increments by 1 for each DATA frame
+//  REALTIME  One real-time command byte ('?', '!', '~', 0x18)
+//  EXIT      Back to the text protocol
+//
+// Device -> host
+//  ACK       [next expected seq u16] [received mask u16]
+//            Bit n of the mask set means seq (next + 1 + n) was received out
+//            of order and is held. Sent whenever the state changes and on
+//            every bad or unexpected frame, so it also works as a NAK: the
+//            host resends only the frames not covered by the ACK
+//  RESULT    [result i32] for the DATA frame with the same seq
+//  TELEMETRY [TELEMETRY_SAMPLE]* (see MotionTelemetry.h). Also sent in text
+//            mode once enabled with $T<hz>
+//
+// The host keeps up to the window size (given in the $B reply) DATA frames
+// unacknowledged. Frames outside the window are dropped and ACKed again.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define FRAME_SOF                   0xA5
+
+#define FRAME_HEADER_SIZE           8
+#define FRAME_CRC_SIZE              4
+#define FRAME_MAX_PAYLOAD           256
+#define FRAME_MAX_SIZE              (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE)
+
+#define FRAME_MAX_WINDOW            8       // Frames held out of order (power of 2)
+
+#define FRAME_TYPE_DATA             0x01
+#define FRAME_TYPE_REALTIME         0x02
+#define FRAME_TYPE_EXIT             0x03
+#define FRAME_TYPE_ACK              0x81
+#define FRAME_TYPE_RESULT           0x82
+#define FRAME_TYPE_TELEMETRY        0x83
+
+///////////////////////////////////////////////////////////////////////////////
+
+typedef void (*FRAME_OUTPUT_FUNC)(const uint8_t* data, uint32_t size, void* context);
+typedef void (*FRAME_DELIVER_FUNC)(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length, void* context);
+
+typedef struct FRAMING_STATS
+{
+    uint32_t    FramesReceived;
+    uint32_t    CrcErrors;
+    uint32_t    OutOfOrder;
+    uint32_t    Duplicates;
+
+}FRAMING_STATS;
+
+///////////////////////////////////////////////////////////////////////////////
+
+class BinaryFraming
+{
+public:
+    BinaryFraming();
+
+    void Reset(uint32_t window);
+
+    void AssociateOutput(FRAME_OUTPUT_FUNC output, void* context) { m_output = output; m_output_context = context; }
+    void AssociateDelivery(FRAME_DELIVER_FUNC deliver, void* context) { m_deliver = deliver; m_deliver_context = context; }
+
+    // Received bytes. Complete frames are delivered in sequence order
+    void Feed(const uint8_t* data, uint32_t size);
+
+    inline bool IsAckPending() { return m_ack_pending; }
+    inline uint32_t GetWindow() { return m_window; }
+    inline const FRAMING_STATS& GetStats() { return m_stats; }
+
+    void SendAck();
+    void SendResult(uint16_t seq, int32_t result);
+    void SendFrame(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length);
+
+protected:
+    // Frames are handled as words for the CRC unit
+    uint32_t            m_rx_frame[FRAME_MAX_SIZE / 4];
+    uint32_t            m_rx_count;
+
+    uint32_t            m_tx_frame[FRAME_MAX_SIZE / 4];
+
+    uint32_t            m_held_payload[FRAME_MAX_WINDOW][FRAME_MAX_PAYLOAD / 4];
+    uint16_t            m_held_length[FRAME_MAX_WINDOW];
+    uint32_t            m_held_mask;        // Bit n = seq (m_expected_seq + 1 + n) held
+
+    uint16_t            m_expected_seq;
+    uint32_t            m_window;
+    bool                m_ack_pending;
+
+    FRAMING_STATS       m_stats;
+
+    FRAME_OUTPUT_FUNC   m_output;
+    void*               m_output_context;
+    FRAME_DELIVER_FUNC  m_deliver;
+    void*               m_deliver_context;
+
+    uint32_t    frame_size(uint32_t payload_length) { return FRAME_HEADER_SIZE + ((payload_length + 3) & ~3) + FRAME_CRC_SIZE; }
+
+    void        resync();
+    void        accept_frame();
+};
+
+#endif
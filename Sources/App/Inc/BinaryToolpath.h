@@ -0,0 +1,129 @@
+#ifndef BINARYTOOLPATH_H
+#define BINARYTOOLPATH_H
+
+#include <stdint.h>
+#include "GCodeParser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Precompiled toolpath format
+//
+// A toolpath file is an 8 byte header followed by a stream of records. The
+// records hold what the G-code parser hands over to the planner and machine
+// (already in machine coordinates and mm), so they can be executed without
+// any text parsing.
+//
+// Header:  'O' 'P' 'T' 'P' | version | 3 reserved bytes
+//
+// Record:  [type | flags] [payload]
+//
+//  LINE     [axis mask] [feed f32]? [spindle f32]? [zigzag varint delta]*
+//           One delta per axis in the mask (bit 0 = X ... bit 5 = C), in
+//           TOOLPATH_COUNTS_PER_MM units from the previous position.
+//           The feed (mm/s) and spindle speed only follow when they changed.
+//  ARC      [axis mask | plane] [feed f32]? [spindle f32]? [zigzag varint delta]*
+//           [zigzag varint centre offset]{2}
+//           A G2/G3 arc, cut into lines by the controller with its own arc
+//           settings. The end point as in a LINE record, the plane (G17, G18,
+//           G19 as 0, 1, 2) in bits 6..7 of the mask, then the centre from the
+//           start point along the two axes of the plane (X Y, X Z, Y Z), in
+//           counts. Clockwise (G2) when TOOLPATH_FLAG_CLOCKWISE is set.
+//  SPINDLE  [mode u8] [speed f32]
+//  COOLANT  [mode u8]
+//  DWELL    [seconds f32]
+//  END
+//
+// Multi byte values are little endian. A flag or mask bit a record does not
+// define makes the toolpath invalid.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define TOOLPATH_HEADER_SIZE            8
+#define TOOLPATH_VERSION                2           // Version 1 files have no ARC records
+#define TOOLPATH_COUNTS_PER_MM          10000.0f
+#define TOOLPATH_MAX_MM                 100000.0f   // Positions and deltas fit in 32 bit counts
+
+#define TOOLPATH_MAX_RECORD_SIZE        (2 + 4 + 4 + ((TOTAL_AXES_COUNT + 2) * 5))
+
+// Record type [bits 0..3]
+#define TOOLPATH_RECORD_LINE            0x01
+#define TOOLPATH_RECORD_SPINDLE         0x02
+#define TOOLPATH_RECORD_COOLANT         0x03
+#define TOOLPATH_RECORD_DWELL           0x04
+#define TOOLPATH_RECORD_END             0x05
+#define TOOLPATH_RECORD_ARC             0x06
+
+#define TOOLPATH_RECORD_TYPE_MASK       0x0F
+
+// Line & Arc record flags [bits 4..7]
+#define TOOLPATH_FLAG_FEED              (1 << 4)
+#define TOOLPATH_FLAG_SPINDLE_SPEED     (1 << 5)
+#define TOOLPATH_FLAG_INVERSE_TIME      (1 << 6)
+#define TOOLPATH_FLAG_CLOCKWISE         (1 << 7)    // Arc records only
+
+// Axis mask [bits 0..5], plane of arc records [bits 6..7]
+#define TOOLPATH_AXIS_MASK              0x3F
+#define TOOLPATH_PLANE_SHIFT            6
+
+#define TOOLPATH_PLANE_XY               0
+#define TOOLPATH_PLANE_XZ               1
+#define TOOLPATH_PLANE_YZ               2
+
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct TOOLPATH_RECORD
+{
+    uint8_t type;
+    uint8_t mode;                       // Spindle/Coolant records
+    uint8_t plane;                      // Arc records [TOOLPATH_PLANE_XY..YZ]
+    bool    inverse_time;               // Line & Arc records
+    bool    clockwise;                  // Arc records
+
+    float   target[TOTAL_AXES_COUNT];   // Line & Arc records [mm]
+    float   offset[2];                  // Arc records, centre from the start point [mm]
+    float   rate;                       // Line & Arc records [mm/s]
+    float   spindle_speed;              // Line, Arc & Spindle records
+    float   seconds;                    // Dwell records
+
+}TOOLPATH_RECORD;
+
+typedef void (*TOOLPATH_OUTPUT_FUNC)(const uint8_t* data, uint32_t size, void* context);
+
+///////////////////////////////////////////////////////////////////////////////
+
+class BinaryToolpath
+{
+public:
+    BinaryToolpath();
+
+    void Reset();
+
+    // Encoder side. Every record is handed to the output function as soon as it is built
+    void AssociateOutput(TOOLPATH_OUTPUT_FUNC output, void* context) { m_output = output; m_output_context = context; }
+
+    int WriteHeader();
+    int WriteLine(const float* target_mm, float rate_mm_s, bool inverse_time, float spindle_speed);
+    int WriteArc(const float* target_mm, const float* offset_mm, bool clockwise, uint8_t plane, float rate_mm_s, bool inverse_time, float spindle_speed);
+    int WriteSpindle(uint8_t mode, float spindle_speed);
+    int WriteCoolant(uint8_t mode);
+    int WriteDwell(float seconds);
+    int WriteEnd();
+
+    // Decoder side. used = 0 means that more data is needed to complete the record
+    int ReadHeader(const uint8_t* data, uint32_t size, uint32_t& used);
+    int ReadRecord(const uint8_t* data, uint32_t size, TOOLPATH_RECORD& record, uint32_t& used);
+
+protected:
+    int32_t                 m_position[TOTAL_AXES_COUNT];   // Last position [counts]
+    float                   m_rate;
+    float                   m_spindle_speed;
+
+    TOOLPATH_OUTPUT_FUNC    m_output;
+    void*                   m_output_context;
+
+    int     emit(const uint8_t* data, uint32_t size);
+    int     put_motion(uint8_t* record, uint8_t*& ptr, const float* target_mm, float rate_mm_s, float spindle_speed);
+    int     get_motion(const uint8_t* data, uint32_t size, TOOLPATH_RECORD& record, uint32_t& pos);
+};
+
+#endif
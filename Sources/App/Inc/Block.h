@@ -15,6 +15,9 @@
 
 #pragma anon_unions
 
+// Step ticker rate, the unit of the block timing (total_move_ticks)
+#define STEP_TICKER_FREQUENCY 100000
+
 static const double fp_scale = 461168601.8427387904; // optimize to store this as it does not change
 
 // this is the data needed to determine when each motor needs to be issued a step
@@ -67,6 +70,9 @@ class Block
         uint32_t decelerate_after;
         uint32_t total_move_ticks;
         uint8_t  direction_bits;     // Direction for each axis in bit form, relative to the direction port's mask
+        uint32_t line_number;        // Last N word seen when the block was planned (0 = none)
+        uint8_t  source;             // GCODE_SOURCE_OPTIONS value of the line that produced the block
+        uint8_t  checkpoint;         // JobCheckpoint tag of the first block of a checkpoint line (0 = none)
 
         // need info for each active motor
         tickinfo_t *tick_info;
@@ -14,6 +14,8 @@
 
 #pragma anon_unions
 
+#define CONVEYOR_QUEUE_LENGTH   32
+
 class Block;
 
 
@@ -31,6 +33,7 @@ public:
     void wait_for_idle(bool wait_for_motors = true);
     bool is_queue_empty() { return queue.is_empty(); };
     bool is_queue_full() { return queue.is_full(); };
+    unsigned int get_queue_count() const { return queue.count(); };
     bool is_idle() const;
 
     // returns next available block writes it to block and returns true
@@ -39,25 +42,42 @@ public:
 
     void flush_queue();
     float get_current_feedrate() const { return current_feedrate; }
+    uint32_t get_current_line_number() const { return current_line_number; }
+    uint8_t get_current_source() const { return current_source; }
     void force_queue() { check_queue(true); }
 
     void force_flush_queue();
 
+    // Check mode (MachineCore::SetCheckMode): the blocks are planned as usual but never go to
+    // the step ticker. The parsing task retires them in order, adding up their planned time
+    void set_check_mode(bool enable);
+    bool is_check_mode() const { return check_mode; }
+    void add_check_time(float seconds);
+    uint64_t get_check_time_ms() const;
+    uint32_t get_check_blocks() const { return check_blocks; }
+
 private:
     void check_queue(bool force= false);
     void queue_head_block();
+    void retire_tail_block();
 
     BlockQueue queue;  // Queue of Blocks
 
     uint32_t queue_delay_time_ms;
     size_t queue_size;
     float current_feedrate; // actual nominal feedrate that current block is running at in mm/sec
+    uint32_t current_line_number; // line number of the last block handed to the step ticker
+    uint8_t current_source; // source of the last block handed to the step ticker
+
+    uint64_t check_ticks; // planned time of the retired blocks and the dwells (check mode)
+    uint32_t check_blocks;
 
     struct 
     {
         volatile bool running:1;
         volatile bool allow_fetch:1;
         bool flush:1;
+        volatile bool check_mode:1;
     };
 
 };
@@ -6,6 +6,26 @@
 
 #define NUM_TO_STR_BUF_SIZE     32
 
+// Significant digits of a decimal number kept in its integer mantissa, and in
+// all. A float is never more than half an ulp away from a decimal of 113
+// significant digits or less (the midpoints between subnormals have the most),
+// so past DECIMAL_MAX_DIGITS only whether the rest of the digits are zero counts
+#define DECIMAL_MANTISSA_DIGITS     9
+#define DECIMAL_MAX_DIGITS          120
+
+// The integer written by the digits of Mantissa followed by those of Extra, 
+// times 10^Exponent10. A little more than that (less than a unit of the last
+// digit kept) when Inexact is set
+typedef struct DecimalNumber
+{
+    uint32_t    Mantissa;       // First DECIMAL_MANTISSA_DIGITS significant digits
+    uint32_t    Digits;         // Significant digits kept, in Mantissa and Extra
+    int32_t     Exponent10;     // Power of ten of the last digit kept
+    bool        Inexact;        // Non zero digits dropped after the last one kept
+    uint8_t     Extra[DECIMAL_MAX_DIGITS - DECIMAL_MANTISSA_DIGITS];
+    
+}DecimalNumber;
+
 class DataConverter
 {
     public:
@@ -19,6 +39,49 @@ class DataConverter
         static const char* FloatToStringTruncate(float f, int maxlen = 0);
         static const char* IntegerToString(int32_t value);
     
+        // Decimal numbers are accumulated digit by digit (see DecimalNumber) and then
+        // converted to the nearest float, ties to even, the same result as strtof()
+        static inline void ClearDecimal(DecimalNumber & number)
+        {
+            number.Mantissa = 0;
+            number.Digits = 0;
+            number.Exponent10 = 0;
+            number.Inexact = false;
+        }
+    
+        static inline void AccumulateDigit(DecimalNumber & number, uint32_t digit, bool fractional)
+        {
+            if (number.Digits < DECIMAL_MANTISSA_DIGITS)
+            {
+                number.Mantissa = (number.Mantissa * 10) + digit;
+                
+                // Leading zeros are not significant
+                if (number.Mantissa != 0)
+                    number.Digits++;
+            }
+            else if (number.Digits < DECIMAL_MAX_DIGITS)
+            {
+                number.Extra[number.Digits - DECIMAL_MANTISSA_DIGITS] = (uint8_t)digit;
+                number.Digits++;
+            }
+            else
+            {
+                // Past the digits kept only whether any is not zero matters
+                if (digit != 0)
+                    number.Inexact = true;
+                
+                if (fractional == false)
+                    number.Exponent10++;
+                
+                return;
+            }
+            
+            if (fractional != false)
+                number.Exponent10--;
+        }
+        
+        static float DecimalToFloat(const DecimalNumber & number, bool negative);
+        
     protected:
         static const uint32_t BIT_NEGATIVE = (1 << 15);
         static const uint32_t BIT_DIGITS   = (1 << 1);
@@ -0,0 +1,96 @@
+#ifndef FILEUPLOAD_H
+#define FILEUPLOAD_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "disk_task.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// File upload to the SD card over the serial console
+//
+//  host:   $U<size>,<name>
+//  device: ok                      (or error:N, nothing else is expected)
+//  host:   <size raw bytes> <crc u32>
+//  device: [UPL:<bytes>,<ms>,<KB/s>]
+//          ok / error:N
+//
+// The CRC is the usual CRC-32 (zlib, reflected 0xEDB88320) of the file
+// data, sent little endian. Every byte is file data during the transfer,
+// real-time commands are not recognized.
+//
+// Data goes through two word aligned buffers: while the disk task writes
+// one to the card (whole sectors, multi-block DMA) the serial task fills
+// the other one from the CDC FIFO. The file is written under a temporary
+// name and only renamed to <name> once the CRC matched, so a failed upload
+// never replaces a good file. Works while a job runs from the card (the
+// volume is only shared, see disk_task.h).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define UPLOAD_BUFFER_SIZE      4096        // Each of the two buffers (8 sectors)
+#define UPLOAD_MAX_NAME         64
+#define UPLOAD_TEMP_NAME        "/upload.tmp"
+#define UPLOAD_TIMEOUT          pdMS_TO_TICKS(5000)     // Without data from the host
+#define UPLOAD_WRITE_POLL_TIME  pdMS_TO_TICKS(10)
+
+typedef struct UPLOAD_STATS
+{
+    uint32_t    Bytes;
+    uint32_t    Milliseconds;               // First data byte to file closed
+    uint32_t    KBytesPerSecond;
+
+}UPLOAD_STATS;
+
+///////////////////////////////////////////////////////////////////////////////
+
+class FileUpload
+{
+public:
+    FileUpload();
+
+    // Returns a GCODE_STATUS_RESULTS value. The caller must be the task calling Feed()
+    int32_t Begin(const char* name, uint32_t size);
+
+    // Received bytes. Returns the bytes taken, less than size once the CRC is in
+    uint32_t Feed(const uint8_t* data, uint32_t size);
+
+    inline bool IsActive() { return m_active; }
+    inline bool IsComplete() { return m_active && m_received == (m_size + sizeof(m_crc_received)); }
+    inline bool IsTimedOut() { return m_active && (xTaskGetTickCount() - m_last_data_tick) >= UPLOAD_TIMEOUT; }
+
+    // Once complete. Returns a GCODE_STATUS_RESULTS value
+    int32_t Finish(UPLOAD_STATS& stats);
+
+    // Drops a partial upload (timeout, host gone)
+    void Abort();
+
+protected:
+    // Words, so the data can go straight to the card by DMA
+    uint32_t            m_buffers[2][UPLOAD_BUFFER_SIZE / 4];
+    DISK_WRITE_REQUEST  m_requests[2];
+    uint32_t            m_current;          // Buffer being filled
+    uint32_t            m_fill;
+
+    FF_FILE*            m_file;
+    char                m_name[UPLOAD_MAX_NAME + 2];
+
+    uint32_t            m_size;
+    uint32_t            m_received;         // Data and CRC bytes
+    uint32_t            m_crc;
+    uint8_t             m_crc_received[4];
+    bool                m_active;
+    bool                m_failed;
+
+    TickType_t          m_start_tick;
+    TickType_t          m_last_data_tick;
+
+    bool    wait_for_buffer(uint32_t index);
+    void    write_current_buffer();
+    void    close_file();
+};
+
+#endif
@@ -8,7 +8,9 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #define MM_PER_INCH     25.4f
+#ifndef M_PI
 #define M_PI            3.1415926535897932384626433832795f
+#endif
 
 #define COORDINATE_LINEAR_AXES_COUNT		3
 #define COORDINATE_ROTATIONAL_AXES_COUNT	3
@@ -136,6 +138,27 @@ enum GCODE_STATUS_RESULTS
     GCODE_ERROR_HOMING_CONFIRM_LIMITS,
     GCODE_ERROR_HOMING_FINISH_RELEASE,
     
+    /* Precompiled toolpath errors */
+    GCODE_ERROR_INVALID_TOOLPATH_DATA,
+    GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH,
+    GCODE_ERROR_TOOLPATH_RANGE,
+    
+    /* Communication errors */
+    GCODE_ERROR_LINE_TOO_LONG,
+    GCODE_ERROR_SOURCE_LOCKED,
+    
+    /* Storage errors */
+    GCODE_ERROR_DISK_NOT_AVAILABLE,
+    GCODE_ERROR_DISK_ACCESS,
+    GCODE_ERROR_INVALID_FILE_REQUEST,
+    GCODE_ERROR_UPLOAD_CRC,
+    GCODE_ERROR_UPLOAD_TIMEOUT,
+    GCODE_ERROR_SETTINGS_NOT_SAVED,
+    GCODE_ERROR_NO_JOB_CHECKPOINT,
+    GCODE_ERROR_RESUME_NOT_HOMED,
+    GCODE_ERROR_JOB_FILE_CHANGED,
+    GCODE_ERROR_RESTART_STATE,
+    GCODE_ERROR_RESTART_LINE,
     
 };
 
@@ -414,6 +437,23 @@ typedef struct GCodeModalData
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Parser state a job can be resumed from (JobCheckpoint.h). Machine coordinates in mm
+typedef struct GCodeJobState
+{
+    GCodeModalData  modal_state;
+    
+    float           feed_rate;
+    float           spindle_speed;
+    uint32_t        tool_number;
+    
+    float           work_coord_sys[TOTAL_AXES_COUNT];
+    float           g92_coord_offset[TOTAL_AXES_COUNT];
+    float           machine_pos[TOTAL_AXES_COUNT];
+    
+}GCodeJobState;
+
+///////////////////////////////////////////////////////////////////////////////
+
 typedef struct GCodeBlockData
 {
     // Block Non-modal Code
@@ -450,6 +490,8 @@ typedef struct GCodeBlockData
 ///////////////////////////////////////////////////////////////////////////////
 
 class Planner;
+class BinaryToolpath;
+struct TOOLPATH_RECORD;
 
 class GCodeParser
 {
@@ -459,21 +501,41 @@ public:
 
         void AssociatePlanner(Planner* planner) { m_planner_ref = planner; }
     
+        // While a toolpath writer is associated, motion and machine commands are 
+        // compiled into binary records instead of being executed. Nothing reaches the
+        // machine or the settings then: commands that would change them (G10, G28.1, 
+        // G30.1, M0, M32, M36, M38, homing) are rejected and G92 offsets are not saved
+        void AssociateToolpathWriter(BinaryToolpath* writer) { m_toolpath_writer = writer; }
+    
         void ResetParser();
-        int ParseLine(char* line);
+        int ParseLine(const char* line);
+        int ExecuteToolpathRecord(const TOOLPATH_RECORD& record);
 
-        inline void EnableCheckMode() { m_check_mode = true; }
-        inline void DisableCheckMode() { m_check_mode = false; } 
+        // Check mode (MachineCore::SetCheckMode): the lines are planned but spindle, coolant,
+        // feed hold and homing are left out. The position from before the check comes back
+        // when it ends
+        void SetCheckMode(bool enable);
         inline bool IsCheckModeActive() { return m_check_mode; } 
 
+        // Restart scans (disk_task.h): the lines only update the parser state, nothing is 
+        // planned or switched and arcs go straight to their end point. The position from 
+        // before the scan comes back when it ends, the machine never moved
+        void SetScanMode(bool enable);
+        inline bool IsScanModeActive() const { return m_scan_mode; } 
+
         static const char*  GetErrorText(uint32_t error_code);
         
         void ReadParserModalState(GCodeModalData* block) const;
+        
+        // Returns false if the state can't be rebuilt by plain G-code lines (arc or canned 
+        // cycle motion modes, compensation)
+        bool ReadJobState(GCodeJobState* state) const;
         inline const float* ReadOriginCoords() const { return m_work_coord_sys; } 
         inline const float* ReadOffsetCoords() const { return m_g92_coord_offset; } 
+        inline const float* ReadTargetCoords() const { return m_gcode_machine_pos; } 
         
     protected:
-        char*           m_line;
+        const char*     m_line;
     
         GCodeModalData  m_parser_modal_state;
         
@@ -502,8 +564,12 @@ public:
         GCodeBlockData  m_block_data;
         
         bool            m_check_mode;
+        float           m_check_start_pos[TOTAL_AXES_COUNT];
+        bool            m_scan_mode;
+        float           m_scan_start_pos[TOTAL_AXES_COUNT];
         
         Planner*        m_planner_ref;  
+        BinaryToolpath* m_toolpath_writer;
         
         float           m_mm_per_arc_segment;           
         float           m_mm_max_arc_error;             
@@ -522,7 +588,13 @@ public:
 
         ///////////////////////////////////////////////////////////////////////////////////////////
 
-        int     cleanup_and_lowercase_line(uint32_t & line_len);
+        int     parse_block_words(uint32_t & modal_group_flags);
+        int     skip_blanks();
+        int     check_remaining_comments();
+        char    peek_number_char();
+        float   read_float(uint32_t & success);
+        int     read_integer(uint32_t & success);
+
         float   convert_to_mm(float value);
         void    reset_modal_params();
 
@@ -531,10 +603,18 @@ public:
         int     check_unused_codes();
 
         void    handle_coordinate_system_select();
+        void    select_plane(GCODE_MODAL_PLANE_SELECT_MODES plane);
         int     handle_non_modal_codes();
         int     handle_motion_commands();
         
         int     motion_append_line(const float * target_pos);
+        int     motion_append_line(const float * target_pos, float move_rate, bool inverse_time_rate);
+        int     motion_append_arc(const float * target, const float * offsets, bool clockwise, float move_rate, bool inverse_time_rate);
+        
+        int     send_spindle_command(GCODE_MODAL_SPINDLE_MODES mode, float speed);
+        int     send_coolant_command(GCODE_MODAL_COOLANT_MODES mode);
+        int     send_dwell_command(float seconds);
+        int     wait_for_idle();
         
         void    canned_cycle_reset_stycky();
         void    canned_cycle_update_sticky();
@@ -0,0 +1,129 @@
+#ifndef JOBCHECKPOINT_H
+#define JOBCHECKPOINT_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "GCodeParser.h"
+#include "settings_manager.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Job checkpoints (power loss recovery of SD card jobs)
+//
+// While a job runs from the card, the parsing task picks a line once every
+// JOB_CHECKPOINT_INTERVAL and takes a snapshot of the parser before parsing
+// it (GCodeJobState: modal state, feed, spindle, tool, work offsets and the
+// machine position the line starts from). The first block of the line gets
+// a tag. When the step ticker starts that block every block before it is
+// done and the machine stands at the snapshot position, so the snapshot
+// becomes the checkpoint. The settings task (the only one writing to the
+// flash) stores it with the file name, size, offset and number of the line.
+// Lines without motion or with a state the resume lines can't rebuild (arc
+// and canned cycle modes, see GCodeParser::ReadJobState) are skipped, the
+// next line is tried.
+//
+// Storage: JOB_CHECKPOINT_SECTORS of the W25Q16 after the settings journal,
+// one record per page, written in sequence around the ring. A sector is
+// erased when the ring enters it: at the default interval each sector is
+// erased once every 43 minutes of cutting (100k cycles = 8 years non-stop).
+// The newest record with a good CRC counts, so a power cut while a record
+// is programmed (or a sector erased) leaves the previous checkpoint. A job
+// that completes writes a record that clears it.
+//
+// Resume (disk_task.h): all axes homed and the file still the same size.
+// The resume lines set the work offsets, travel in machine coordinates to
+// X Y A B C at the current height (the top of Z after homing), start spindle
+// and coolant, go down to Z and put back the modal state. The file goes on
+// from the checkpoint line.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define JOB_CHECKPOINT_START_ADDRESS    (SETTINGS_DATA_START_ADDRESS + SETTINGS_JOURNAL_SECTORS * SETTINGS_JOURNAL_SECTOR_SIZE)
+#define JOB_CHECKPOINT_SECTORS          16          // 64 KB of the flash
+#define JOB_CHECKPOINT_SECTOR_SIZE      4096
+#define JOB_CHECKPOINT_RECORD_SIZE      256         // One page, 16 records per sector
+#define JOB_CHECKPOINT_MAGIC            0x504B434A  // JCKP
+#define JOB_CHECKPOINT_INTERVAL         pdMS_TO_TICKS(10000)
+#define JOB_CHECKPOINT_MAX_NAME         64
+
+#define JOB_CHECKPOINT_RECORDS          ((JOB_CHECKPOINT_SECTORS * JOB_CHECKPOINT_SECTOR_SIZE) / JOB_CHECKPOINT_RECORD_SIZE)
+#define JOB_CHECKPOINT_NONE             0xFFFFFFFF  // Record index
+
+#define JOB_RESUME_LINES                9
+
+// Fits a record (JOB_CHECKPOINT_RECORD_SIZE). Zeroed before it is filled, so the padding
+// bytes covered by the CRC are always the same
+typedef struct JOB_CHECKPOINT
+{
+    uint32_t        Magic;
+    uint32_t        Sequence;
+    uint32_t        Completed;          // The job ended, nothing to resume
+
+    char            FileName[JOB_CHECKPOINT_MAX_NAME + 4];
+    uint32_t        FileSize;
+    uint32_t        LineOffset;         // In the file
+    uint32_t        LineNumber;         // 1 based
+
+    GCodeJobState   State;              // Before the line
+
+    uint32_t        Crc;                // Settings_Manager::CalculateCRC of the words before it
+
+}JOB_CHECKPOINT;
+
+///////////////////////////////////////////////////////////////////////////////
+
+class MachineCore;
+
+class JobCheckpoint
+{
+public:
+    // [Settings task] Finds the newest record, before anything else
+    static void Initialize();
+
+    // [Disk task] A job from the card starts (line numbers from the file) and ends. Only a
+    // completed job clears the checkpoint, and only its own (same file name and size): a
+    // stopped or failed one can still be resumed, and so can an older job
+    static void BeginJob(const char* name, uint32_t size);
+    static void EndJob(bool completed);
+
+    // [Parsing task] Around each job line, number = 0 for lines not from the file
+    static void BeginLine(MachineCore* core, uint32_t offset, uint32_t number);
+    static void EndLine(MachineCore* core);
+
+    // [Step ticker ISR] A block with a tag started
+    static void OnBlockStarted(uint8_t tag);
+
+    // [Settings task] Writes a reached checkpoint or a clear record
+    static void Service();
+
+    // [Any task] Returns false if there is nothing to resume
+    static bool GetLatest(JOB_CHECKPOINT* checkpoint);
+
+    // Resume line index (0 .. JOB_RESUME_LINES - 1) of a state (checkpoint, restart line) into
+    // text, at least GCODE_MAX_LINE_LENGTH bytes. Returns the length, 0 if nothing is needed
+    static uint32_t BuildResumeLine(const GCodeJobState& state, uint32_t index, char* text);
+
+protected:
+    static JOB_CHECKPOINT       m_latest;           // Newest record in the flash
+    static uint32_t             m_latest_index;     // JOB_CHECKPOINT_NONE if none
+    static volatile bool        m_loaded;
+
+    static JOB_CHECKPOINT       m_candidate;        // Filled by the parsing task
+    static JOB_CHECKPOINT       m_record;           // Being written
+    static volatile uint8_t     m_stage;
+    static volatile uint8_t     m_tag;
+    static volatile bool        m_active;
+    static volatile bool        m_clear_request;
+    static char                 m_clear_name[JOB_CHECKPOINT_MAX_NAME + 4];  // Job of the clear request
+    static uint32_t             m_clear_size;
+    static TickType_t           m_last_tick;
+
+    static bool write_record(void);
+    static bool read_record(uint32_t index, JOB_CHECKPOINT* record);
+    static bool is_erased(uint32_t address, uint32_t length);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef JOBINDEX_H
+#define JOBINDEX_H
+
+#include <stdint.h>
+
+#include "GCodeParser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Sparse line index of the last job file (restart from a line, disk_task.h)
+//
+// Restarting at line N needs the parser state at N, so the lines before it are
+// scanned (GCodeParser::SetScanMode). The index saves most of that: while a
+// file goes through the parser (job, restart scan or resume) the parsing task
+// keeps the file offset and the parser state (GCodeJobState) of a line every
+// m_interval lines. A restart seeks to the last entry before N, rebuilds its
+// state with the resume lines (JobCheckpoint::BuildResumeLine) in scan mode
+// and only scans from there.
+//
+// The table is in RAM, for one file (name and size) and it is filled the first
+// time the file runs. When it is full every other entry is dropped and the
+// interval doubles: JOB_INDEX_ENTRIES entries cover any file, a 1M line file
+// ends with an entry every 32768 lines. Lines in arc or canned cycle modes
+// can't be entries, the next line is tried.
+//
+// Files written through the firmware or the USB host drop the index.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define JOB_INDEX_ENTRIES           32
+#define JOB_INDEX_FIRST_INTERVAL    1024        // Lines
+#define JOB_INDEX_MAX_NAME          64
+
+typedef struct JOB_INDEX_ENTRY
+{
+    uint32_t        LineOffset;
+    uint32_t        LineNumber;
+    GCodeJobState   State;              // Before the line
+
+}JOB_INDEX_ENTRY;
+
+class MachineCore;
+
+class JobIndex
+{
+public:
+    // [Disk task] A job starts, the index is kept only for the same file
+    static void BeginJob(const char* name, uint32_t size);
+
+    // [Parsing task] Before each job line, number = 0 for lines not from the file
+    static void OnLine(MachineCore* core, uint32_t offset, uint32_t number);
+
+    // [Disk task, no job running] Last entry before the line. False if there is none
+    static bool Find(const char* name, uint32_t size, uint32_t line, JOB_INDEX_ENTRY* entry);
+
+    // [Any task] The file system changed
+    static void Invalidate();
+
+protected:
+    static JOB_INDEX_ENTRY      m_entries[JOB_INDEX_ENTRIES];
+    static volatile uint32_t    m_count;
+    static uint32_t             m_interval;
+    static uint32_t             m_next_line;        // Of the next entry
+
+    static char                 m_name[JOB_INDEX_MAX_NAME + 1];
+    static uint32_t             m_size;
+    static volatile bool        m_valid;
+};
+
+#endif
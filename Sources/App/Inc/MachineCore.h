@@ -18,6 +18,7 @@
 #include "StepTicker.h"
 #include "CoolantController.h"
 #include "SpindleController.h"
+#include "BinaryToolpath.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -82,6 +83,7 @@ typedef struct GLOBAL_STATUS_REPORT_DATA
     GCodeModalData ModalState;
     
     float CurrentFeedRate;
+    uint32_t CurrentLineNumber;
     uint32_t CurrentSpindleRPM;
     uint8_t CurrentSpindleTool;
     
@@ -126,6 +128,9 @@ public:
     // Called from EXTI interrupt context
     BaseType_t NotifyOfEvent(uint32_t it_evt_src);
     
+    // Real-time reset request (task context). The safety task halts the machine
+    void RequestReset();
+    
     inline void EnterFeedHold() { m_feed_hold = true; }
     inline void ExitFeedHold() { m_feed_hold = false; }
     
@@ -144,11 +149,37 @@ public:
     inline bool AreMotorsStillMoving() { return m_step_ticker->AreMotorsStillMoving(); }
     
     inline float GetCurrentFeedrate() { return m_conveyor->get_current_feedrate(); }
+    inline uint32_t GetPlannerQueueCount() { return m_conveyor->get_queue_count(); }
+    
+    // Planning stage (Planner::QueueLine), in a task of its own next to the parsing task
+    void AssociatePlannerInput(PLANNER_INPUT_FUNC input, void* context) { m_planner->AssociateInput(input, context); }
+    void PlanLine(const PLANNER_LINE & line) { m_planner->PlanLine(line); }
+    uint32_t GetQueuedPlannerLines() { return m_planner->GetQueuedLines(); }
     inline const float* GetCurrentPosition() { return m_current_stepper_pos; }
     
-    int ParseGCodeLine(char* line) { return m_gcode_parser->ParseLine(line); }
+    int ParseGCodeLine(GCODE_SOURCE_OPTIONS source, const char* line);
+    int ExecuteToolpathRecord(GCODE_SOURCE_OPTIONS source, const TOOLPATH_RECORD& record);
+    
+    // Toolpath compiler (GCodeParser::AssociateToolpathWriter), NULL ends it
+    void AssociateToolpathWriter(BinaryToolpath* writer) { m_gcode_parser->AssociateToolpathWriter(writer); }
     const char* GetGCodeErrorText(uint32_t code) { return GCodeParser::GetErrorText(code); } 
     
+    // Job checkpoints and restarts (parsing task, or a task that holds the parser idle)
+    bool ReadJobState(GCodeJobState* state) { return m_gcode_parser->ReadJobState(state); }
+    void MarkNextBlock(uint8_t tag) { m_planner->MarkNextBlock(tag); }
+    bool IsBlockMarkPending() { return m_planner->IsBlockMarkPending(); }
+    
+    // Restart scans (parsing task, or any task while the parser is idle)
+    void SetScanMode(bool enable) { m_gcode_parser->SetScanMode(enable); }
+    
+    // Check mode, $C (parsing task). Planned time of the moves and dwells since it started
+    int SetCheckMode(bool enable);
+    bool IsCheckModeActive() { return m_gcode_parser->IsCheckModeActive(); }
+    uint64_t GetCheckTime_ms() { return m_conveyor->get_check_time_ms(); }
+    uint32_t GetCheckBlocks() { return m_conveyor->get_check_blocks(); }
+    bool GetCheckExtents(float* min_mm, float* max_mm) { return m_planner->GetCheckExtents(min_mm, max_mm); }
+    float GetCheckPeakSpeed() { return m_planner->GetCheckPeakSpeed(); }
+    
     int GoHome(float* target, uint32_t spec_value_mask, bool isG28);
     int DoProbe(float* target, uint32_t spec_value_mask);
     int SendSpindleCommand(GCODE_MODAL_SPINDLE_MODES mode, float spindle_rpm);
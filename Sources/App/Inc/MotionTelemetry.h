@@ -0,0 +1,97 @@
+#ifndef MOTIONTELEMETRY_H
+#define MOTIONTELEMETRY_H
+
+#include <stdint.h>
+#include "GCodeParser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Motion telemetry (tuning aid, off by default)
+//
+// The step ticker takes a sample every N ticks while a block is running and
+// stores it in a single producer / single consumer ring. The serial task
+// drains the ring and sends the samples in TELEMETRY frames (BinaryFraming),
+// several samples per frame.
+//
+// Sample (36 bytes, little endian):
+//  [seq u16] [block u16] [phase u8] [primary axis u8] [2 reserved]
+//  [rate u32] [steps i32 x 6]
+//
+//  seq      Increments with every sample taken, gaps mean the ring overflowed
+//  block    Increments with every block started by the step ticker
+//  phase    TELEMETRY_PHASE_xxx
+//  rate     Upper 32 bits of the 2.62 steps per tick of the primary axis.
+//           steps/s = rate * step frequency / 2^30
+//  steps    Absolute step counters
+//
+// ISR cost: one decrement and compare per step tick while enabled, plus
+// about 60 cycles (~0.4 us @ 168 MHz) for each sample taken. Nothing when
+// disabled besides a flag test.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define TELEMETRY_MAX_RATE_HZ       1000
+#define TELEMETRY_RING_SIZE         64      // Samples (power of 2)
+
+#define TELEMETRY_PHASE_IDLE        0
+#define TELEMETRY_PHASE_ACCEL       1
+#define TELEMETRY_PHASE_CRUISE      2
+#define TELEMETRY_PHASE_DECEL       3
+
+#pragma pack(1)
+typedef struct TELEMETRY_SAMPLE
+{
+    uint16_t    seq;
+    uint16_t    block;
+    uint8_t     phase;
+    uint8_t     primary_axis;
+    uint16_t    reserved;
+    uint32_t    rate;
+    int32_t     steps[TOTAL_AXES_COUNT];
+
+}TELEMETRY_SAMPLE;
+#pragma pack()
+
+///////////////////////////////////////////////////////////////////////////////
+
+class MotionTelemetry
+{
+public:
+    // rate_hz = 0 stops sampling. The step frequency gives the tick divisor
+    static void Start(uint32_t rate_hz, float step_frequency);
+    static void Stop();
+
+    static inline bool IsEnabled() { return m_enabled; }
+
+    // [Step ticker ISR] Returns true when a sample has to be taken on this tick
+    static inline bool Tick()
+    {
+        if (--m_countdown != 0)
+            return false;
+
+        m_countdown = m_divisor;
+        return true;
+    }
+
+    // [Step ticker ISR]
+    static void Write(uint16_t block, uint8_t phase, uint8_t primary_axis, uint32_t rate, const int32_t* steps);
+
+    // [Consumer] Returns the number of samples copied
+    static uint32_t Read(TELEMETRY_SAMPLE* samples, uint32_t max_count);
+
+    static inline uint32_t GetOverflowCount() { return m_overflows; }
+
+protected:
+    static TELEMETRY_SAMPLE     m_ring[TELEMETRY_RING_SIZE];
+
+    static volatile uint32_t    m_head;     // Written by the ISR only
+    static volatile uint32_t    m_tail;     // Written by the consumer only
+    static volatile bool        m_enabled;
+
+    static uint32_t             m_divisor;
+    static uint32_t             m_countdown;
+    static uint16_t             m_seq;
+    static uint32_t             m_overflows;
+};
+
+#endif
@@ -58,6 +58,23 @@ enum PLANNER_STATUS_RESULTS
 // Function pointers for callback functions (must be set to proper values pointing to user functions)
 // Included default dummy pointers
 
+// A move of the parser on its way to the planning stage, with the tags of its block
+typedef struct PLANNER_LINE
+{
+    float       target_mm[TOTAL_AXES_COUNT];
+    float       spindle_speed;
+    float       rate_mm_s;
+    bool        inverse_time;
+    uint8_t     source;
+    uint8_t     checkpoint_tag;
+    uint32_t    line_number;
+    uint32_t    generation;             // FlushQueuedLines count when queued
+
+}PLANNER_LINE;
+
+// Hands a line over to the planning stage, blocks while the stage has no room for it
+typedef void (*PLANNER_INPUT_FUNC)(const PLANNER_LINE & line, void* context);
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class Block;
@@ -76,9 +93,41 @@ public:
 
         int AppendLine(const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate = false);
         
+        // Planning stage (gcode_parsing_task.cpp). With an input associated, QueueLine hands the
+        // moves of the parser over to it and PlanLine plans them in the stage's task. Without
+        // one (single task tools) QueueLine plans at once, as AppendLine
+        void AssociateInput(PLANNER_INPUT_FUNC input, void* context) { m_input = input; m_input_context = context; }
+        int QueueLine(const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate);
+        void PlanLine(const PLANNER_LINE & line);
+        
+        // Lines queued and not planned yet. AppendLine, ResetPosition and the check mode calls
+        // are only made with none left (WaitForQueuedLines)
+        uint32_t GetQueuedLines() const { return m_queued_lines; }
+        void WaitForQueuedLines();
+        
+        // Lines queued so far are dropped by PlanLine (halt)
+        void FlushQueuedLines();
+        
         float max_allowable_speed( float acceleration, float target_velocity, float distance);
         
         void ResetPosition() { memset((void*)&m_position_steps[0], 0, sizeof(m_position_steps)); } 
+        
+        // Check mode (MachineCore::SetCheckMode) gives the position back when it ends. The moves
+        // appended meanwhile leave their extents (mm, machine coordinates) and peak speed (mm/s)
+        void SetCheckMode(bool enable);
+        bool GetCheckExtents(float* min_mm, float* max_mm) const;  // False if nothing moved
+        float GetCheckPeakSpeed() const { return m_check_peak_speed; }
+        
+        // Line number given to the blocks appended from now on
+        void SetLineNumber(uint32_t line_number) { m_line_number = line_number; }
+        
+        // Source (GCODE_SOURCE_OPTIONS) given to the blocks appended from now on
+        void SetSource(uint8_t source) { m_source = source; }
+        
+        // The next block appended gets the checkpoint tag (JobCheckpoint.h), 0 cancels. A queued
+        // line takes it, the planning stage gives it to the next block if the line had no motion
+        void MarkNextBlock(uint8_t tag) { m_checkpoint_tag = tag; }
+        bool IsBlockMarkPending() const { return (m_checkpoint_tag != 0); }
     
         static const char*  GetErrorText(uint32_t error_code);
 
@@ -88,6 +137,22 @@ public:
         float m_junction_deviation;
     
         int32_t m_position_steps[TOTAL_AXES_COUNT];
+        int32_t m_saved_position_steps[TOTAL_AXES_COUNT];
+        float m_check_min_mm[TOTAL_AXES_COUNT];
+        float m_check_max_mm[TOTAL_AXES_COUNT];
+        float m_check_peak_speed;
+        bool  m_check_mode;
+        bool  m_check_moved;
+        uint32_t m_line_number;
+        uint8_t  m_source;
+        uint8_t  m_checkpoint_tag;
+        uint8_t  m_carried_tag;                 // Planning stage, of a queued line without motion
+        uint32_t m_carried_generation;
+    
+        PLANNER_INPUT_FUNC      m_input;
+        void*                   m_input_context;
+        volatile uint32_t       m_queued_lines;
+        volatile uint32_t       m_generation;
     
         Conveyor * m_conveyor;
 
@@ -95,7 +160,12 @@ public:
         
         float limit_value_by_axis_maximum(float limit_value, const float * max_values, const float * unit_vector);
     
+        void make_line(PLANNER_LINE & line, const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate);
+        bool plan_line(const PLANNER_LINE & line);      // False if nothing moves
+        
         void recalculate();
+        
+        void update_check_stats(const int32_t* target_steps, float speed);
 };
 
 #endif
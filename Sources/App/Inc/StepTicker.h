@@ -66,6 +66,10 @@ private:
     Block *current_block;
     uint32_t current_tick;
 
+    // Telemetry
+    uint16_t block_counter;
+    uint8_t primary_axis;
+
     Conveyor* m_conveyor;
 
     volatile bool running;
@@ -0,0 +1,34 @@
+#ifndef DEBUG_LOG_TASK_H
+#define DEBUG_LOG_TASK_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+// Deferred debug log on USART1
+//
+// DebugLog() only stores the format string pointer and the raw arguments in a lock-free ring,
+// so it can be called from any task or ISR (any priority) without blocking. The debug log task
+// formats the records later and sends the text out by DMA:
+//
+//  [seconds.microseconds] text\r\n
+//
+// The format string must stay valid (string literal) and so must any %s argument. Only 32 bit
+// integer conversions are supported (%d %u %x %c %s, no floats). Records are dropped when the
+// ring is full, the count is reported on the next line sent.
+
+#define DEBUG_LOG_RING_SIZE         64      // Records (power of 2)
+#define DEBUG_LOG_MAX_LINE          96      // Formatted line, longer ones are truncated
+#define DEBUG_LOG_TX_BUFFER_SIZE    512     // Each of the two DMA buffers
+#define DEBUG_LOG_POLL_TIME         pdMS_TO_TICKS(10)
+
+extern TaskHandle_t debug_log_task_handle;
+
+void DebugLogTask_Initialize(void);
+void DebugLogTask_Entry(void * pvParam);
+
+// [Any context]
+void DebugLog(const char* format, uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0, uint32_t arg3 = 0);
+
+#endif
@@ -1,11 +1,122 @@
 #ifndef DISK_TASK_H
 #define DISK_TASK_H
 
+#include <stdint.h>
+
 #include "FreeRTOS.h"
 #include "task.h"
 
+#include "ff_stdio.h"
+
+// SD card volume
+//
+// The disk task mounts the card ("/") with FreeRTOS+FAT. The volume has one owner at a time:
+//
+//  FIRMWARE    Shared. Anything reading or writing files (job streaming, uploads) acquires the
+//              volume first and releases it when its files are closed
+//  USB_HOST    Exclusive. The FAT volume is unmounted while a host works on the raw sectors,
+//              so the firmware never reads a file system that is being changed under it
+//
+// A host acquire fails while any firmware user holds the volume (e.g. a job running from the
+// card) and firmware acquires fail while the host holds it.
+
+#define DISK_MOUNT_RETRY_TIME       pdMS_TO_TICKS(2000)
+#define DISK_WRITE_QUEUE_LENGTH     2
+
+// Job streaming. The file is read in large chunks into two buffers: while the lines of one are
+// handed to the parser, the other one is refilled whenever the parser is busy, so the card
+// latency is hidden behind the parser and planner queues. The margin is the file data read
+// ahead of the line being submitted (lowest value seen during the job), an underrun is a read
+// the parser had to wait for.
+#define DISK_JOB_BUFFER_SIZE        4096    // Each of the two buffers (8 sectors)
+#define DISK_JOB_POLL_TIME          pdMS_TO_TICKS(5)
+
+// Raw read benchmark for each request size and buffer offset (0 = word aligned, direct DMA; 1 =
+// through the driver bounce buffer): DISK_BENCH_BYTES read in order after the first
+// DISK_BENCH_BYTES of the card (served by the driver read-ahead), then the first ones from the
+// last request down (a new transfer each, no read-ahead). Both rates on the debug log. Reads
+// only, runs in the job buffers so not while a job runs
+#define DISK_BENCH_BYTES            (256 * 1024)
+
+typedef enum DISK_VOLUME_OWNER
+{
+    DISK_OWNER_NONE = 0,
+    DISK_OWNER_FIRMWARE,
+    DISK_OWNER_USB_HOST,
+
+}DISK_VOLUME_OWNER;
+
+// File write done by the disk task, so the caller can fill its next buffer in the meantime.
+// The request and the data must stay untouched until Done is set
+typedef struct DISK_WRITE_REQUEST
+{
+    FF_FILE*            File;
+    const void*         Data;
+    uint32_t            Length;
+    TaskHandle_t        NotifyTask;     // Gets a notification (xTaskNotifyGive) when done
+
+    volatile bool       Done;
+    volatile bool       Failed;
+
+}DISK_WRITE_REQUEST;
+
+typedef enum DISK_JOB_STATE
+{
+    DISK_JOB_IDLE = 0,
+    DISK_JOB_RUNNING,
+    DISK_JOB_DONE,
+    DISK_JOB_FAILED,            // Result holds the error
+    DISK_JOB_STOPPED,
+
+}DISK_JOB_STATE;
+
+typedef struct DISK_JOB_STATS
+{
+    DISK_JOB_STATE  State;
+    int32_t         Result;
+    uint32_t        Lines;              // Records for a precompiled toolpath
+    uint32_t        LinesPerSecond;     // Average since the job started
+    uint32_t        Milliseconds;
+    uint32_t        MinMargin;          // Bytes
+    uint32_t        Underruns;
+
+}DISK_JOB_STATS;
+
 extern TaskHandle_t disk_task_handle;
 
+bool DiskTask_Initialize(void);
 void DiskTask_Entry(void * pvParam);
 
+// Called from any task
+bool DiskTask_AcquireVolume(DISK_VOLUME_OWNER owner);
+void DiskTask_ReleaseVolume(DISK_VOLUME_OWNER owner);
+DISK_VOLUME_OWNER DiskTask_GetOwner(void);
+bool DiskTask_IsMounted(void);
+
+// The caller must hold the volume (FIRMWARE). Returns false if the queue is full
+bool DiskTask_QueueWrite(DISK_WRITE_REQUEST* request);
+
+// Runs a G-code file or a precompiled toolpath (BinaryToolpath.h) from the card. Returns a
+// GCODE_STATUS_RESULTS value
+int32_t DiskTask_StartJob(const char* name);
+
+// Runs the file of the last job checkpoint (JobCheckpoint.h) from its line, after the resume
+// lines. X, Y and Z must be homed and the file must have the same size
+int32_t DiskTask_ResumeJob(void);
+
+// Runs a file from a line. The lines before it are scanned (parser state only, GCodeParser::
+// SetScanMode), from the closest entry of the line index (JobIndex.h) if the file ran before.
+// Then the resume lines take the machine to the state at the line, as for a checkpoint
+int32_t DiskTask_RestartJob(const char* name, uint32_t line);
+void DiskTask_StopJob(void);
+void DiskTask_GetJobStats(DISK_JOB_STATS* stats);
+
+// Returns a GCODE_STATUS_RESULTS value, the benchmark runs later in the disk task
+int32_t DiskTask_StartBenchmark(void);
+
+// Raw sector access, only for the USB_HOST owner (block device class callbacks)
+uint32_t DiskTask_GetSectorCount(void);
+bool DiskTask_ReadSectors(uint32_t sector, uint32_t count, void* buffer);
+bool DiskTask_WriteSectors(uint32_t sector, uint32_t count, const void* buffer);
+
 #endif
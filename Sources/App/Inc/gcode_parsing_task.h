@@ -4,8 +4,63 @@
 #include "FreeRTOS.h"
 #include "task.h"
 
+#include "MachineCore.h"
+
+#define GCODE_LINE_BUFFER_SIZE_SERIAL   512     // Raw line bytes queued ahead of the parser, per source
+#define GCODE_LINE_BUFFER_SIZE_SD       512     // Lines with their file position
+#define GCODE_LINE_BUFFER_SIZE_JOG      128
+#define GCODE_MAX_LINE_LENGTH           256
+#define GCODE_RESULT_QUEUE_LENGTH       32      // Per source
+#define GCODE_PLANNER_QUEUE_LENGTH      8       // Moves parsed ahead of the planning stage
+
+typedef struct GCODE_PIPELINE_STATS
+{
+    uint32_t    LinesProcessed;         // Since power up
+    uint32_t    LinesPerSecond;         // Over the last second
+    uint32_t    ParserBusyPercent;      // Parsing time over the last second (a full planning stage included)
+    uint32_t    PlannerBusyPercent;     // Planning time over the last second (a full block queue included)
+    uint32_t    LineBufferPeak;         // Max bytes waiting for the parser
+    uint32_t    PlannerLinesPeak;       // Max moves parsed and not planned yet
+    uint32_t    PlannerQueueBlocks;     // Blocks in the planner queue (sampled once per second)
+
+}GCODE_PIPELINE_STATS;
+
+// Lines of the SD source carry their position in the file (job checkpoints, JobCheckpoint.h)
+// and whether they are only scanned (restart from a line, disk_task.h). The text of a
+// TOOLPATH line is a TOOLPATH_RECORD the source decoded from a precompiled toolpath file
+#define GCODE_JOB_LINE_SCAN             0x01
+#define GCODE_JOB_LINE_TOOLPATH         0x02
+
+typedef struct GCODE_JOB_LINE
+{
+    uint32_t    Offset;
+    uint32_t    Number;                 // 1 based, 0 = not from the file
+    uint32_t    Flags;                  // GCODE_JOB_LINE_xxx
+    char        Text[GCODE_MAX_LINE_LENGTH + 1];
+
+}GCODE_JOB_LINE;
+
 extern TaskHandle_t gcode_task_handle;
+extern TaskHandle_t gcode_plan_task_handle;
 
+// Also associates the planning stage with the planner of the machine
+bool GCodeParsingTask_Initialize(void);
 void GCodeParsingTask_Entry(void * pvParam);
+void GCodePlanningTask_Entry(void * pvParam);
+
+// Called from any source task
+bool GCodeParsingTask_SubmitLine(GCODE_SOURCE_OPTIONS source, const char* line, uint32_t length, TickType_t wait);
+bool GCodeParsingTask_SubmitJobLine(GCODE_SOURCE_OPTIONS source, const GCODE_JOB_LINE* line, uint32_t length, TickType_t wait);
+bool GCodeParsingTask_GetResult(GCODE_SOURCE_OPTIONS source, int32_t* result, TickType_t wait);
+void GCodeParsingTask_GetStats(GCODE_PIPELINE_STATS* stats);
+
+// A source running a job locks the other sources out until it ends the job (see the .cpp)
+// Returns false if another source owns the machine
+bool GCodeParsingTask_BeginJob(GCODE_SOURCE_OPTIONS source);
+void GCodeParsingTask_EndJob(GCODE_SOURCE_OPTIONS source);
+GCODE_SOURCE_OPTIONS GCodeParsingTask_GetJobOwner(void);
+
+// The task (if any) gets a notification (xTaskNotifyGive) each time a result is queued for the source
+void GCodeParsingTask_SetResultNotify(GCODE_SOURCE_OPTIONS source, TaskHandle_t task);
 
 #endif
@@ -16,6 +16,7 @@
 
 #define TOUCH_SCREEN_EVENT      (1 << 10)
 #define STEPPER_FAULT_EVENT     (1 << 11)
+#define SOFT_RESET_EVENT        (1 << 12)
 
 void Init_GPIO_Pins(void);
 
@@ -11,4 +11,8 @@ extern TaskHandle_t serial_task_handle;
 
 void SerialTask_Entry(void * pvParam);
 
+// Real-time commands ('?', '!', '~', Ctrl-X). Acts on them and removes them from the
+// received data. Called from the USB task for each packet. Returns the bytes left
+uint32_t SerialTask_FilterRealtimeCommands(uint8_t* data, uint32_t count);
+
 #endif
@@ -137,6 +137,37 @@ typedef struct SETTINGS_DATA
 #define SETTINGS_DATA_START_ADDRESS     0x00000000
 #define SETTINGS_HEADER_VALUE           0x7A534859  // YHSz
 
+/*
+ * Settings journal (W25Q16)
+ *
+ * Settings are kept as an append-only log in a ring of flash sectors starting at
+ * SETTINGS_DATA_START_ADDRESS. Save() only programs the words that changed since the last
+ * save, as one record:
+ *
+ *  header  (RECORD_MAGIC << 16) | payload words
+ *  payload runs of changed words: (first word << 16) | word count, then the words
+ *  crc     CRC-32 (CalculateCRC) of header and payload
+ *
+ * The first record of a sector is a full copy of the settings (a single run). When a record
+ * doesn't fit, the next sector of the ring is erased, the full copy is written to it and only
+ * then its header (SECTOR_MAGIC, sequence) is programmed, so a power cut at any point leaves
+ * either the old or the new sector valid. Load() replays the sector with the highest sequence
+ * up to the first blank or damaged record, a torn record is dropped (the next save moves to a
+ * new sector). Erases rotate over the whole ring.
+ *
+ * The old single-copy format (sector 0, no journal) is still read, the first save moves it
+ * into the journal starting at sector 1.
+ */
+#define SETTINGS_JOURNAL_SECTORS        8           // 32 KB of the flash
+#define SETTINGS_JOURNAL_SECTOR_SIZE    4096
+#define SETTINGS_JOURNAL_PAGE_SIZE      256
+#define SETTINGS_JOURNAL_SECTOR_MAGIC   0x4C4E4A53  // SJNL
+#define SETTINGS_JOURNAL_RECORD_MAGIC   0x5E70
+#define SETTINGS_JOURNAL_HEADER_SIZE    8           // Magic, sequence
+
+// Full copy: header, one run, the words, crc. Change sets bigger than that are saved as a full copy
+#define SETTINGS_JOURNAL_MAX_RECORD_WORDS   (SETTINGS_DATA_SIZE_WORDS_NO_CRC + 3)
+
 
 
 class Settings_Manager
@@ -149,6 +180,9 @@ public:
 
 	static void ResetToDefaults();
 
+    // CRC-32 (hardware unit, shared with other modules). Works on whole 32 bit words
+    static uint32_t CalculateCRC(const uint32_t* data, uint32_t word_count);
+
 	static int ReadCoordinateValues(uint32_t coord_index, float * buffer);
 	static int WriteCoordinateValues(uint32_t coord_index, const float * buffer);
 
@@ -201,7 +235,21 @@ protected:
     
     static void Internal_AllocMemory(void);
 
+    static bool Journal_Load(void);
+    static bool Journal_Replay(uint32_t sector);
+    static bool Journal_Append(uint32_t payload_words);
+    static void Journal_Compact(void);
+    static uint32_t Journal_BuildChanges(void);
+    static uint32_t Journal_BuildFullCopy(const SETTINGS_DATA* source);
+    static void Journal_Program(uint32_t address, const void* data, uint32_t length);
+    static bool Journal_IsErased(uint32_t address, uint32_t length);
+
 	static SETTINGS_DATA * m_data;
+    static SETTINGS_DATA * m_saved;         // Settings as they are in the journal
+
+    static uint32_t m_journal_sector;       // Active sector (ring index)
+    static uint32_t m_journal_sequence;
+    static uint32_t m_journal_address;      // Next record, 0 = no usable sector (full copy needed)
 };
 
 #endif
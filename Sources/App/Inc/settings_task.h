@@ -0,0 +1,34 @@
+#ifndef SETTINGS_TASK_H
+#define SETTINGS_TASK_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+// Deferred settings persistence
+//
+// Settings changes go to RAM right away (Settings_Manager setters). Saving them to flash may
+// erase a sector (tens of ms with the SPI busy), so the parser only requests it and this low
+// priority task calls Settings_Manager::Save() once no new request came for the quiet time.
+// A burst of requests ends up as a single journal record. The time each save took is on the
+// debug log.
+//
+// Before power is removed on purpose, SettingsTask_Flush() writes whatever is pending.
+//
+// Being the only task writing to the flash, it also writes the job checkpoints (JobCheckpoint.h).
+
+#define SETTINGS_SAVE_QUIET_TIME    pdMS_TO_TICKS(1000)
+#define SETTINGS_FLUSH_POLL_TIME    pdMS_TO_TICKS(10)
+
+extern TaskHandle_t settings_task_handle;
+
+void SettingsTask_Entry(void * pvParam);
+
+// [Any task]
+void SettingsTask_RequestSave(void);
+
+// [Any task] Returns once nothing is pending (false on timeout)
+bool SettingsTask_Flush(TickType_t timeout);
+
+#endif
@@ -3,8 +3,12 @@
 
 #include <stm32f4xx_hal.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 extern SPI_HandleTypeDef hspi1;
-extern SPI_HandleTypeDef hspi3;
+extern SPI_HandleTypeDef hspi3;      // Also used by the SD card driver (ff_sddisk.c)
 
 
 void Init_Flash_SPI1(void);
@@ -16,13 +20,17 @@ void W25QXX_Write_SR(uint8_t sr);
 uint16_t W25QXX_ReadID(void);
 void W25QXX_Write_Enable(void);
 void W25QXX_Write_Disable(void);
-void W25QXX_Read(uint8_t * pBuffer,uint32_t ReadAddr, uint16_t NumByteToRead);
+// HAL_ERROR if the read failed, the buffer is then all zeros (no CRC passes, nothing reads as
+// erased)
+HAL_StatusTypeDef W25QXX_Read(uint8_t * pBuffer,uint32_t ReadAddr, uint16_t NumByteToRead);
 void W25QXX_Write_Page(uint8_t * pBuffer, uint32_t WriteAddr, uint16_t NumByteToWrite);
 void W25QXX_Erase_Chip(void);
 void W25QXX_Erase_Sector(uint32_t Dst_Addr);
 void W25QXX_PowerDown(void);
 void W25QXX_WakeUp(void);
 
-
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -10,21 +10,30 @@
 #define UI_TASK_STACK_SIZE          (configMINIMAL_STACK_SIZE * 8)
 
 #define USB_TASK_PRIORITY           (configMAX_PRIORITIES - 2)
-#define USB_TASK_STACK_SIZE         (configMINIMAL_STACK_SIZE * 3)
+#define USB_TASK_STACK_SIZE         (configMINIMAL_STACK_SIZE * 4)     // Unmounts and mounts the SD card for the USB host (usb_storage.cpp)
 
 #define GCODE_TASK_PRIORITY         (configMAX_PRIORITIES - 4)
-#define GCODE_TASK_STACK_SIZE       (configMINIMAL_STACK_SIZE * 2)
+#define GCODE_TASK_STACK_SIZE       (configMINIMAL_STACK_SIZE * 3)     // DecimalNumber and the exact conversion (DataConverter)
+
+#define GCODE_PLAN_TASK_PRIORITY    (configMAX_PRIORITIES - 4)
+#define GCODE_PLAN_TASK_STACK_SIZE  (configMINIMAL_STACK_SIZE * 2)
 
 #define LISTENER_TASK_PRIORITY      (configMAX_PRIORITIES - 4)
 #define LISTENER_TASK_STACK_SIZE    (configMINIMAL_STACK_SIZE * 1)
 
 #define DISK_TASK_PRIORITY          (configMAX_PRIORITIES - 4)
-#define DISK_TASK_STACK_SIZE        (configMINIMAL_STACK_SIZE * 1)
+#define DISK_TASK_STACK_SIZE        (configMINIMAL_STACK_SIZE * 4)
 
 #define SERIAL_TASK_PRIORITY        (configMAX_PRIORITIES - 4)
-#define SERIAL_TASK_STACK_SIZE      (configMINIMAL_STACK_SIZE * 2)
+#define SERIAL_TASK_STACK_SIZE      (configMINIMAL_STACK_SIZE * 6)     // File names on the stack (FreeRTOS+FAT)
 
 #define SAFETY_TASK_PRIORITY        (configMAX_PRIORITIES - 3)
 #define SAFETY_TASK_STACK_SIZE      (configMINIMAL_STACK_SIZE * 1)
 
+#define DEBUG_LOG_TASK_PRIORITY     1       // Just above idle
+#define DEBUG_LOG_TASK_STACK_SIZE   (configMINIMAL_STACK_SIZE * 2)
+
+#define SETTINGS_TASK_PRIORITY      1       // Flash erases must not hold back anything else
+#define SETTINGS_TASK_STACK_SIZE    (configMINIMAL_STACK_SIZE * 2)
+
 #endif
@@ -0,0 +1,37 @@
+#ifndef USB_STORAGE_H
+#define USB_STORAGE_H
+
+#include <stdint.h>
+
+// SD card as a USB mass storage device (MSC interface of the composite device)
+//
+// The class callbacks run in the USB task. The host gets the card on its first TEST UNIT
+// READY, when no firmware user holds it (DiskTask_AcquireVolume(DISK_OWNER_USB_HOST)): the
+// FAT volume is unmounted and the sectors are read and written raw. While a job runs from
+// the card the host sees no medium and keeps polling.
+//
+// Ejecting the drive on the PC gives the card back to the firmware (remount), for instance
+// to run the job just copied. It stays with the firmware until the next USB mount. A USB
+// reset, disconnect or suspend gives it back too.
+//
+// Card IO is done by the USB task, the CDC port waits for at most one transfer of the class
+// buffer (CFG_TUD_MSC_EP_BUFSIZE, 8 sectors) behind it.
+
+typedef struct USB_STORAGE_STATS
+{
+    bool        HostOwner;          // The host holds the card
+    uint32_t    SectorsRead;        // Since the host got the card
+    uint32_t    SectorsWritten;
+    uint32_t    Milliseconds;       // Spent in card IO
+    uint32_t    Errors;
+
+}USB_STORAGE_STATS;
+
+// Called from the USB task (tud_mount_cb / tud_umount_cb / tud_suspend_cb)
+void UsbStorage_Connected(void);
+void UsbStorage_Disconnected(void);
+
+// Called from any task
+void UsbStorage_GetStats(USB_STORAGE_STATS* stats);
+
+#endif
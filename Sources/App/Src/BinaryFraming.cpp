@@ -0,0 +1,241 @@
+#include "BinaryFraming.h"
+#include "settings_manager.h"
+
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+BinaryFraming::BinaryFraming()
+{
+    m_output = NULL;
+    m_output_context = NULL;
+    m_deliver = NULL;
+    m_deliver_context = NULL;
+
+    Reset(FRAME_MAX_WINDOW);
+}
+
+void BinaryFraming::Reset(uint32_t window)
+{
+    if (window == 0 || window > FRAME_MAX_WINDOW)
+        window = FRAME_MAX_WINDOW;
+
+    m_window = window;
+    m_rx_count = 0;
+    m_held_mask = 0;
+    m_expected_seq = 0;
+    m_ack_pending = false;
+
+    memset((void*)&m_stats, 0, sizeof(m_stats));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void BinaryFraming::Feed(const uint8_t* data, uint32_t size)
+{
+    uint8_t* frame = (uint8_t*)m_rx_frame;
+    uint32_t needed;
+    uint32_t count;
+
+    while (size != 0 || m_rx_count >= FRAME_HEADER_SIZE)
+    {
+        if (m_rx_count == 0)
+        {
+            // Hunting for the start of a frame
+            const uint8_t* sof = (const uint8_t*)memchr(data, FRAME_SOF, size);
+
+            if (sof == NULL)
+                return;
+
+            size -= (uint32_t)(sof - data);
+            data = sof;
+        }
+
+        needed = FRAME_HEADER_SIZE;
+
+        if (m_rx_count >= FRAME_HEADER_SIZE)
+        {
+            uint32_t length = (uint32_t)frame[4] | ((uint32_t)frame[5] << 8);
+
+            // Sanity check the header before waiting for a (possibly huge) bogus frame
+            if (length > FRAME_MAX_PAYLOAD || frame[6] != 0 || frame[7] != 0)
+            {
+                resync();
+                continue;
+            }
+
+            needed = frame_size(length);
+        }
+
+        if (m_rx_count < needed)
+        {
+            if (size == 0)
+                return;
+
+            count = needed - m_rx_count;
+
+            if (count > size)
+                count = size;
+
+            memcpy(&frame[m_rx_count], data, count);
+
+            m_rx_count += count;
+            data += count;
+            size -= count;
+            continue;
+        }
+
+        // Complete frame
+        if (Settings_Manager::CalculateCRC(m_rx_frame, (needed - FRAME_CRC_SIZE) / 4) != m_rx_frame[(needed / 4) - 1])
+        {
+            m_stats.CrcErrors++;
+            m_ack_pending = true;
+
+            resync();
+            continue;
+        }
+
+        m_stats.FramesReceived++;
+
+        accept_frame();
+        m_rx_count = 0;
+    }
+}
+
+// Drops the first byte of the frame being received and looks for the next SOF in what is left
+void BinaryFraming::resync()
+{
+    uint8_t* frame = (uint8_t*)m_rx_frame;
+    const uint8_t* sof = NULL;
+
+    if (m_rx_count > 1)
+        sof = (const uint8_t*)memchr(&frame[1], FRAME_SOF, m_rx_count - 1);
+
+    if (sof == NULL)
+    {
+        m_rx_count = 0;
+        return;
+    }
+
+    m_rx_count -= (uint32_t)(sof - frame);
+    memmove(frame, sof, m_rx_count);
+}
+
+void BinaryFraming::accept_frame()
+{
+    const uint8_t* frame = (const uint8_t*)m_rx_frame;
+    uint8_t type = frame[1];
+    uint16_t seq = (uint16_t)(frame[2] | (frame[3] << 8));
+    uint32_t length = (uint32_t)frame[4] | ((uint32_t)frame[5] << 8);
+    uint16_t distance;
+    uint32_t slot;
+
+    if (type != FRAME_TYPE_DATA)
+    {
+        // Control frames are not sequenced
+        if (m_deliver != NULL)
+            m_deliver(type, seq, &frame[FRAME_HEADER_SIZE], length, m_deliver_context);
+
+        return;
+    }
+
+    m_ack_pending = true;
+    distance = (uint16_t)(seq - m_expected_seq);
+
+    if (distance == 0)
+    {
+        if (m_deliver != NULL)
+            m_deliver(type, seq, &frame[FRAME_HEADER_SIZE], length, m_deliver_context);
+
+        m_expected_seq++;
+
+        // Release the frames that were waiting for this one
+        while ((m_held_mask & 1) != 0)
+        {
+            slot = m_expected_seq & (FRAME_MAX_WINDOW - 1);
+
+            if (m_deliver != NULL)
+                m_deliver(type, m_expected_seq, (const uint8_t*)m_held_payload[slot], m_held_length[slot], m_deliver_context);
+
+            m_expected_seq++;
+            m_held_mask >>= 1;
+        }
+
+        m_held_mask >>= 1;
+    }
+    else if (distance < m_window)
+    {
+        // Ahead of a missing frame. Hold it until the gap is filled
+        if ((m_held_mask & (1 << (distance - 1))) == 0)
+        {
+            slot = seq & (FRAME_MAX_WINDOW - 1);
+
+            memcpy(m_held_payload[slot], &frame[FRAME_HEADER_SIZE], length);
+            m_held_length[slot] = (uint16_t)length;
+
+            m_held_mask |= (1 << (distance - 1));
+        }
+
+        m_stats.OutOfOrder++;
+    }
+    else
+    {
+        // Already delivered (the ACK got lost) or beyond the window
+        m_stats.Duplicates++;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void BinaryFraming::SendAck()
+{
+    uint8_t payload[4];
+
+    payload[0] = (uint8_t)(m_expected_seq);
+    payload[1] = (uint8_t)(m_expected_seq >> 8);
+    payload[2] = (uint8_t)(m_held_mask);
+    payload[3] = (uint8_t)(m_held_mask >> 8);
+
+    m_ack_pending = false;
+
+    SendFrame(FRAME_TYPE_ACK, m_expected_seq, payload, sizeof(payload));
+}
+
+void BinaryFraming::SendResult(uint16_t seq, int32_t result)
+{
+    uint8_t payload[4];
+
+    payload[0] = (uint8_t)(result);
+    payload[1] = (uint8_t)(result >> 8);
+    payload[2] = (uint8_t)(result >> 16);
+    payload[3] = (uint8_t)(result >> 24);
+
+    SendFrame(FRAME_TYPE_RESULT, seq, payload, sizeof(payload));
+}
+
+void BinaryFraming::SendFrame(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length)
+{
+    uint8_t* frame = (uint8_t*)m_tx_frame;
+    uint32_t size = frame_size(length);
+
+    if (m_output == NULL || length > FRAME_MAX_PAYLOAD)
+        return;
+
+    frame[0] = FRAME_SOF;
+    frame[1] = type;
+    frame[2] = (uint8_t)(seq);
+    frame[3] = (uint8_t)(seq >> 8);
+    frame[4] = (uint8_t)(length);
+    frame[5] = (uint8_t)(length >> 8);
+    frame[6] = 0;
+    frame[7] = 0;
+
+    // Zero padding
+    m_tx_frame[(size / 4) - 2] = 0;
+
+    memcpy(&frame[FRAME_HEADER_SIZE], payload, length);
+
+    m_tx_frame[(size / 4) - 1] = Settings_Manager::CalculateCRC(m_tx_frame, (size - FRAME_CRC_SIZE) / 4);
+
+    m_output(frame, size, m_output_context);
+}
@@ -0,0 +1,463 @@
+#include "BinaryToolpath.h"
+
+#include <string.h>
+#include <math.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint8_t ToolpathMagic[4] = { 'O', 'P', 'T', 'P' };
+
+// Little endian helpers
+static inline uint8_t* put_float(uint8_t* ptr, float value)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    *ptr++ = (uint8_t)(bits);
+    *ptr++ = (uint8_t)(bits >> 8);
+    *ptr++ = (uint8_t)(bits >> 16);
+    *ptr++ = (uint8_t)(bits >> 24);
+
+    return ptr;
+}
+
+static inline float get_float(const uint8_t* ptr)
+{
+    uint32_t bits;
+    float value;
+
+    bits = (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+// Signed deltas are zigzag mapped (0, -1, 1, -2, ...) so short moves take 1 or 2 bytes
+static inline uint8_t* put_varint(uint8_t* ptr, int32_t value)
+{
+    uint32_t zz = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+    while (zz >= 0x80)
+    {
+        *ptr++ = (uint8_t)(zz | 0x80);
+        zz >>= 7;
+    }
+
+    *ptr++ = (uint8_t)zz;
+    return ptr;
+}
+
+// Returns the number of bytes read, 0 when the value is incomplete
+static inline uint32_t get_varint(const uint8_t* ptr, uint32_t size, int32_t& value)
+{
+    uint32_t zz = 0;
+    uint32_t index;
+
+    for (index = 0; index < size && index < 5; index++)
+    {
+        zz |= (uint32_t)(ptr[index] & 0x7F) << (7 * index);
+
+        if ((ptr[index] & 0x80) == 0)
+        {
+            value = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+            return (index + 1);
+        }
+    }
+
+    return 0;
+}
+
+// The varint at pos, length = 0 when it is cut short
+static inline int get_delta(const uint8_t* data, uint32_t size, uint32_t pos, int32_t& value, uint32_t& length)
+{
+    length = get_varint(&data[pos], size - pos, value);
+
+    // Either truncated or longer than 5 bytes
+    if (length == 0 && (size - pos) >= 5)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    return GCODE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+BinaryToolpath::BinaryToolpath()
+{
+    m_output = NULL;
+    m_output_context = NULL;
+
+    Reset();
+}
+
+void BinaryToolpath::Reset()
+{
+    memset((void*)m_position, 0, sizeof(m_position));
+
+    m_rate = 0.0f;
+    m_spindle_speed = 0.0f;
+}
+
+int BinaryToolpath::emit(const uint8_t* data, uint32_t size)
+{
+    if (m_output == NULL)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    m_output(data, size, m_output_context);
+    return GCODE_OK;
+}
+
+int BinaryToolpath::WriteHeader()
+{
+    uint8_t header[TOOLPATH_HEADER_SIZE];
+
+    Reset();
+
+    memcpy(&header[0], ToolpathMagic, sizeof(ToolpathMagic));
+    header[4] = TOOLPATH_VERSION;
+    header[5] = header[6] = header[7] = 0;
+
+    return emit(header, sizeof(header));
+}
+
+// Feed, spindle speed and end point deltas of a motion record, from &record[2]. The
+// axis mask is added to record[1]. Nothing changes for a target out of range (NaN included)
+int BinaryToolpath::put_motion(uint8_t* record, uint8_t*& ptr, const float* target_mm, float rate_mm_s, float spindle_speed)
+{
+    int32_t counts[TOTAL_AXES_COUNT];
+    uint32_t index;
+
+    for (index = COORD_X; index < TOTAL_AXES_COUNT; index++)
+    {
+        if ((fabsf(target_mm[index]) <= TOOLPATH_MAX_MM) == false)
+            return GCODE_ERROR_TOOLPATH_RANGE;
+    }
+
+    ptr = &record[2];
+
+    if (rate_mm_s != m_rate)
+    {
+        record[0] |= TOOLPATH_FLAG_FEED;
+        ptr = put_float(ptr, rate_mm_s);
+        m_rate = rate_mm_s;
+    }
+
+    if (spindle_speed != m_spindle_speed)
+    {
+        record[0] |= TOOLPATH_FLAG_SPINDLE_SPEED;
+        ptr = put_float(ptr, spindle_speed);
+        m_spindle_speed = spindle_speed;
+    }
+
+    // Positions are kept as integers, so there is no drift from summing deltas
+    for (index = COORD_X; index < TOTAL_AXES_COUNT; index++)
+    {
+        counts[index] = (int32_t)roundf(target_mm[index] * TOOLPATH_COUNTS_PER_MM);
+
+        if (counts[index] != m_position[index])
+        {
+            record[1] |= (1 << index);
+            ptr = put_varint(ptr, counts[index] - m_position[index]);
+            m_position[index] = counts[index];
+        }
+    }
+
+    return GCODE_OK;
+}
+
+int BinaryToolpath::WriteLine(const float* target_mm, float rate_mm_s, bool inverse_time, float spindle_speed)
+{
+    uint8_t record[TOOLPATH_MAX_RECORD_SIZE];
+    uint8_t* ptr;
+    int result;
+
+    record[0] = TOOLPATH_RECORD_LINE;
+    record[1] = 0;
+
+    if (inverse_time != false)
+        record[0] |= TOOLPATH_FLAG_INVERSE_TIME;
+
+    result = put_motion(record, ptr, target_mm, rate_mm_s, spindle_speed);
+
+    if (result != GCODE_OK)
+        return result;
+
+    return emit(record, (uint32_t)(ptr - &record[0]));
+}
+
+int BinaryToolpath::WriteArc(const float* target_mm, const float* offset_mm, bool clockwise, uint8_t plane, float rate_mm_s, bool inverse_time, float spindle_speed)
+{
+    uint8_t record[TOOLPATH_MAX_RECORD_SIZE];
+    uint8_t* ptr;
+    uint32_t index;
+    int result;
+
+    if (plane > TOOLPATH_PLANE_YZ)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    for (index = 0; index < 2; index++)
+    {
+        if ((fabsf(offset_mm[index]) <= TOOLPATH_MAX_MM) == false)
+            return GCODE_ERROR_TOOLPATH_RANGE;
+    }
+
+    record[0] = TOOLPATH_RECORD_ARC;
+    record[1] = (plane << TOOLPATH_PLANE_SHIFT);
+
+    if (inverse_time != false)
+        record[0] |= TOOLPATH_FLAG_INVERSE_TIME;
+
+    if (clockwise != false)
+        record[0] |= TOOLPATH_FLAG_CLOCKWISE;
+
+    result = put_motion(record, ptr, target_mm, rate_mm_s, spindle_speed);
+
+    if (result != GCODE_OK)
+        return result;
+
+    // The centre is taken from the start point as the controller has it (in counts)
+    for (index = 0; index < 2; index++)
+        ptr = put_varint(ptr, (int32_t)roundf(offset_mm[index] * TOOLPATH_COUNTS_PER_MM));
+
+    return emit(record, (uint32_t)(ptr - &record[0]));
+}
+
+int BinaryToolpath::WriteSpindle(uint8_t mode, float spindle_speed)
+{
+    uint8_t record[6];
+
+    record[0] = TOOLPATH_RECORD_SPINDLE;
+    record[1] = mode;
+    put_float(&record[2], spindle_speed);
+
+    return emit(record, sizeof(record));
+}
+
+int BinaryToolpath::WriteCoolant(uint8_t mode)
+{
+    uint8_t record[2];
+
+    record[0] = TOOLPATH_RECORD_COOLANT;
+    record[1] = mode;
+
+    return emit(record, sizeof(record));
+}
+
+int BinaryToolpath::WriteDwell(float seconds)
+{
+    uint8_t record[5];
+
+    record[0] = TOOLPATH_RECORD_DWELL;
+    put_float(&record[1], seconds);
+
+    return emit(record, sizeof(record));
+}
+
+int BinaryToolpath::WriteEnd()
+{
+    uint8_t record = TOOLPATH_RECORD_END;
+
+    return emit(&record, sizeof(record));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int BinaryToolpath::ReadHeader(const uint8_t* data, uint32_t size, uint32_t& used)
+{
+    used = 0;
+
+    if (size < TOOLPATH_HEADER_SIZE)
+        return GCODE_OK;
+
+    if (memcmp(data, ToolpathMagic, sizeof(ToolpathMagic)) != 0 || data[4] == 0 || data[4] > TOOLPATH_VERSION)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    Reset();
+
+    used = TOOLPATH_HEADER_SIZE;
+    return GCODE_OK;
+}
+
+// Line and Arc records. pos = 0 when the record is cut short, the state is only
+// updated once the whole record is available
+int BinaryToolpath::get_motion(const uint8_t* data, uint32_t size, TOOLPATH_RECORD& record, uint32_t& pos)
+{
+    int32_t position[TOTAL_AXES_COUNT];
+    int32_t offset[2];
+    float rate = m_rate;
+    float spindle_speed = m_spindle_speed;
+    uint8_t flags = TOOLPATH_FLAG_FEED | TOOLPATH_FLAG_SPINDLE_SPEED | TOOLPATH_FLAG_INVERSE_TIME;
+    uint8_t plane = 0;
+    uint32_t length;
+    uint32_t index;
+    int32_t delta;
+    int result;
+
+    pos = 0;
+
+    if (size < 2)
+        return GCODE_OK;
+
+    if (record.type == TOOLPATH_RECORD_ARC)
+    {
+        flags |= TOOLPATH_FLAG_CLOCKWISE;
+        plane = (data[1] >> TOOLPATH_PLANE_SHIFT);
+
+        if (plane > TOOLPATH_PLANE_YZ)
+            return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+    }
+    else if ((data[1] & ~TOOLPATH_AXIS_MASK) != 0)
+    {
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+    }
+
+    if ((data[0] & ~(TOOLPATH_RECORD_TYPE_MASK | flags)) != 0)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    index = 2;
+
+    if ((data[0] & TOOLPATH_FLAG_FEED) != 0)
+    {
+        if (size < index + 4)
+            return GCODE_OK;
+
+        rate = get_float(&data[index]);
+        index += 4;
+    }
+
+    if ((data[0] & TOOLPATH_FLAG_SPINDLE_SPEED) != 0)
+    {
+        if (size < index + 4)
+            return GCODE_OK;
+
+        spindle_speed = get_float(&data[index]);
+        index += 4;
+    }
+
+    pos = index;
+
+    // Decode into a copy first
+    memcpy(&position[0], &m_position[0], sizeof(position));
+
+    for (index = COORD_X; index < TOTAL_AXES_COUNT; index++)
+    {
+        if ((data[1] & (1 << index)) != 0)
+        {
+            result = get_delta(data, size, pos, delta, length);
+
+            if (result != GCODE_OK || length == 0)
+            {
+                pos = 0;
+                return result;
+            }
+
+            position[index] += delta;
+            pos += length;
+        }
+    }
+
+    if (record.type == TOOLPATH_RECORD_ARC)
+    {
+        for (index = 0; index < 2; index++)
+        {
+            result = get_delta(data, size, pos, offset[index], length);
+
+            if (result != GCODE_OK || length == 0)
+            {
+                pos = 0;
+                return result;
+            }
+
+            pos += length;
+        }
+
+        record.plane = plane;
+        record.clockwise = ((data[0] & TOOLPATH_FLAG_CLOCKWISE) != 0);
+
+        for (index = 0; index < 2; index++)
+            record.offset[index] = (float)offset[index] / TOOLPATH_COUNTS_PER_MM;
+    }
+
+    memcpy(&m_position[0], &position[0], sizeof(m_position));
+    m_rate = rate;
+    m_spindle_speed = spindle_speed;
+
+    for (index = COORD_X; index < TOTAL_AXES_COUNT; index++)
+        record.target[index] = (float)m_position[index] / TOOLPATH_COUNTS_PER_MM;
+
+    record.rate = m_rate;
+    record.spindle_speed = m_spindle_speed;
+    record.inverse_time = ((data[0] & TOOLPATH_FLAG_INVERSE_TIME) != 0);
+
+    return GCODE_OK;
+}
+
+int BinaryToolpath::ReadRecord(const uint8_t* data, uint32_t size, TOOLPATH_RECORD& record, uint32_t& used)
+{
+    uint32_t pos;
+
+    used = 0;
+
+    if (size == 0)
+        return GCODE_OK;
+
+    record.type = (data[0] & TOOLPATH_RECORD_TYPE_MASK);
+
+    // Only motion records have flags
+    if (record.type != TOOLPATH_RECORD_LINE && record.type != TOOLPATH_RECORD_ARC && data[0] != record.type)
+        return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+    switch (record.type)
+    {
+        case TOOLPATH_RECORD_LINE:
+        case TOOLPATH_RECORD_ARC:
+        {
+            int result = get_motion(data, size, record, pos);
+
+            if (result != GCODE_OK || pos == 0)
+                return result;
+        }
+        break;
+
+        case TOOLPATH_RECORD_SPINDLE:
+        {
+            if (size < 6)
+                return GCODE_OK;
+
+            record.mode = data[1];
+            record.spindle_speed = get_float(&data[2]);
+            pos = 6;
+        }
+        break;
+
+        case TOOLPATH_RECORD_COOLANT:
+        {
+            if (size < 2)
+                return GCODE_OK;
+
+            record.mode = data[1];
+            pos = 2;
+        }
+        break;
+
+        case TOOLPATH_RECORD_DWELL:
+        {
+            if (size < 5)
+                return GCODE_OK;
+
+            record.seconds = get_float(&data[1]);
+            pos = 5;
+        }
+        break;
+
+        case TOOLPATH_RECORD_END:
+            pos = 1;
+            break;
+
+        default:
+            return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+    }
+
+    used = pos;
+    return GCODE_OK;
+}
@@ -15,8 +15,6 @@
 
 #include "Block.h"
 
-#define STEP_TICKER_FREQUENCY 100000
-
 // A block represents a movement, it's length for each stepper motor, and the corresponding acceleration curves.
 // It's stacked on a queue, and that queue is then executed in order, to move the motors.
 // Most of the accel math is also done in this class
@@ -45,6 +43,9 @@ void Block::clear()
     accelerate_until    = 0;
     decelerate_after    = 0;
     direction_bits      = 0;
+    line_number         = 0;
+    source              = 0;
+    checkpoint          = 0;
     recalculate_flag    = false;
     nominal_length_flag = false;
     max_entry_speed     = 0.0F;
@@ -130,6 +130,14 @@ bool BlockQueue::is_full(void) const
     return r;
 }
 
+unsigned int BlockQueue::count(void) const
+{
+    unsigned int h = head_i;
+    unsigned int t = tail_i;
+
+    return (h >= t) ? (h - t) : (length - t + h);
+}
+
 void BlockQueue::flush_now()
 {
     tail_i = head_i;
@@ -20,6 +20,7 @@
 
 #include "user_tasks.h"
 #include "MachineCore.h"
+#include "JobCheckpoint.h"
 
 /*
  * The conveyor holds the queue of blocks, takes care of creating them, and starting the executing chain of blocks
@@ -54,13 +55,18 @@ Conveyor::Conveyor()
     running = false;
     allow_fetch = false;
     flush= false;
+    check_mode = false;
     current_feedrate = 0;
+    current_line_number = 0;
+    current_source = 0;
+    check_ticks = 0;
+    check_blocks = 0;
 }
 
 // we allocate the queue here after config is completed so we do not run out of memory during config
 void Conveyor::start()
 {
-    queue.resize(32);
+    queue.resize(CONVEYOR_QUEUE_LENGTH);
     queue_delay_time_ms = (100);
     running = true;
 }
@@ -103,6 +109,23 @@ bool Conveyor::is_idle() const
 // Wait for the queue to be empty and for all the jobs to finish in step ticker
 void Conveyor::wait_for_idle(bool wait_for_motors)
 {
+    // Check mode: nothing steps, the queue is retired here (planned time added) or, flushing
+    // (halt), handed to on_idle for clean up
+    if (check_mode)
+    {
+        if (flush)
+        {
+            taskENTER_CRITICAL();
+            queue.isr_tail_i = queue.head_i;
+            taskEXIT_CRITICAL();
+        }
+        else
+        {
+            while (!queue.is_empty() && machine->IsHalted() == false)
+                retire_tail_block();
+        }
+    }
+
     // wait for the job queue to empty, this means cycling everything on the block queue into the job queue
     // forcing them to be jobs
     running = false; // stops on_idle calling check_queue
@@ -134,7 +157,11 @@ void Conveyor::queue_head_block()
     // upstream caller will block on this until there is room in the queue
     while (queue.is_full() && machine->IsHalted() == false) 
     {
-        vTaskDelay(pdMS_TO_TICKS(500));
+        // In check mode the room is made at once, the oldest block is done
+        if (check_mode)
+            retire_tail_block();
+        else
+            vTaskDelay(pdMS_TO_TICKS(500));
     }
 
     if (machine->IsHalted())
@@ -147,16 +174,86 @@ void Conveyor::queue_head_block()
 
     queue.produce_head();
 
+    // nothing moves in check mode
+    if (check_mode)
+        return;
+
     // not sure if this is the correct place but we need to turn on the motors if they were not already on    
     // turn all enable pins on
     machine->EnableSteppers();
 }
 
+/*
+ * check mode: the tail block is done as if the step ticker had run it. Its planned time is added
+ * and the next block starts, so from now on the planner leaves it alone (see get_next_block()).
+ * The planner keeps the same look ahead it has in a real run, which is what makes the junction
+ * speeds and the estimate match.
+ * Called from the parsing task only. on_idle() has nothing to collect (isr_tail_i follows tail),
+ * unless a flush handed it the queue.
+ */
+void Conveyor::retire_tail_block()
+{
+    Block* block = queue.tail_ref();
+
+    check_ticks += block->total_move_ticks;
+    check_blocks++;
+
+    this->current_line_number = block->line_number;
+    this->current_source = block->source;
+
+    block->clear();
+
+    taskENTER_CRITICAL();
+
+    if (queue.isr_tail_i == queue.tail_i)
+    {
+        queue.consume_tail();
+        queue.isr_tail_i = queue.tail_i;
+    }
+
+    taskEXIT_CRITICAL();
+
+    if (!queue.is_empty())
+    {
+        block = queue.tail_ref();
+        block->is_ticking = true;
+        block->recalculate_flag = false;
+    }
+}
+
+void Conveyor::set_check_mode(bool enable)
+{
+    // Switched with an empty queue (MachineCore::SetCheckMode). The estimate of the last check
+    // stays readable after it ends
+    if (enable)
+    {
+        check_ticks = 0;
+        check_blocks = 0;
+    }
+
+    check_mode = enable;
+}
+
+void Conveyor::add_check_time(float seconds)
+{
+    if (seconds > 0.0f)
+        check_ticks += (uint64_t)(seconds * STEP_TICKER_FREQUENCY);
+}
+
+uint64_t Conveyor::get_check_time_ms() const
+{
+    return check_ticks / (STEP_TICKER_FREQUENCY / 1000);
+}
+
 void Conveyor::check_queue(bool force)
 {
     static uint32_t last_time_check = xTaskGetTickCount();
     static bool idle_timer_running = false;
 
+    // Check mode: the blocks never go to the step ticker
+    if (check_mode)
+        return;
+
     if (queue.is_empty()) 
     {
         allow_fetch = false;
@@ -209,7 +306,7 @@ bool Conveyor::get_next_block(Block **block)
     // default the feerate to zero if there is no block available
     this->current_feedrate = 0;
 
-    if (machine->IsHalted() == true || queue.isr_tail_i == queue.head_i) 
+    if (machine->IsHalted() == true || check_mode || queue.isr_tail_i == queue.head_i) 
         return false; // we do not have anything to give
 
     // wait for queue to fill up, optimizes planning
@@ -229,6 +326,13 @@ bool Conveyor::get_next_block(Block **block)
         b->is_ticking = true;
         b->recalculate_flag = false;
         this->current_feedrate = b->nominal_speed;
+        this->current_line_number = b->line_number;
+        this->current_source = b->source;
+        
+        // Every block before this one is done
+        if (b->checkpoint != 0)
+            JobCheckpoint::OnBlockStarted(b->checkpoint);
+        
         *block = b;
         return true;
     }
@@ -1,3 +1,6 @@
+#include <string.h>
+#include <float.h>
+
 #include "DataConverter.h"
 
 char DataConverter::NumberToStrBuffer[NUM_TO_STR_BUF_SIZE];
@@ -6,64 +9,7 @@ char DataConverter::NumberToStrBuffer[NUM_TO_STR_BUF_SIZE];
 
 float DataConverter::StringToFloat(char** text, uint32_t * success)
 {
-    float result = 0.0f;
-	float exponent = 1.0f;
-	int bits = 0;
-	int ch;
-
-	// Check for sign
-	ch = *(*text);
-
-	if (ch == '+')
-		(*text)++;
-	else if (ch == '-')
-	{
-		(*text)++;
-		bits = DataConverter::BIT_NEGATIVE;
-	}
-
-	// Get integer part
-	for ( ; (ch = *(*text)) != '\0'; (*text)++)
-	{
-		if (ch < '0' || ch > '9')
-			break;
-
-		result = (result * 10.0f) + (ch - '0');
-		bits |= DataConverter::BIT_DIGITS;
-	}
-
-	// Check for decimal point
-	if (ch == '.')
-	{
-		bits |= DataConverter::BIT_DECIMAL;
-		(*text)++;
-	}
-
-	// Get decimal part
-	for ( ; (ch = *(*text)) != '\0'; (*text)++)
-	{
-		if (ch < '0' || ch > '9')
-			break;
-
-		exponent *= 10.0f;
-		result = (result * 10.0f) + (ch - '0');
-		bits |= DataConverter::BIT_DIGITS;
-	}
-
-	// Prepare result
-	result /= (exponent);
-
-	if (bits & DataConverter::BIT_NEGATIVE)
-		result *= -1.0f;
-
-	// Update check variable
-	if (success != NULL)
-	{
-		// success = 1 -> OK, success = 0 -> No digits
-		*success = (((bits & DataConverter::BIT_DIGITS) != 0)) ? 1 : 0;
-	}
-
-	return (result);
+    return DataConverter::StringToFloat2(*text, text, success);
 }
 
 int DataConverter::StringToInteger(char** text, uint32_t * success)
@@ -111,11 +57,12 @@ int DataConverter::StringToInteger(char** text, uint32_t * success)
 
 float DataConverter::StringToFloat2(char* text, char** stopPos, uint32_t * success)
 {
-    float result = 0.0f;
-	float exponent = 1.0f;
+    DecimalNumber number;
 	int bits = 0;
 	int ch;
 
+    DataConverter::ClearDecimal(number);
+    
 	// Check for sign
 	ch = *text;
 
@@ -133,7 +80,7 @@ float DataConverter::StringToFloat2(char* text, char** stopPos, uint32_t * succe
 		if (ch < '0' || ch > '9')
 			break;
 
-		result = (result * 10.0f) + (ch - '0');
+		DataConverter::AccumulateDigit(number, (ch - '0'), false);
 		bits |= DataConverter::BIT_DIGITS;
 	}
 
@@ -150,17 +97,10 @@ float DataConverter::StringToFloat2(char* text, char** stopPos, uint32_t * succe
 		if (ch < '0' || ch > '9')
 			break;
 
-		exponent *= 10.0f;
-		result = (result * 10.0f) + (ch - '0');
+		DataConverter::AccumulateDigit(number, (ch - '0'), true);
 		bits |= DataConverter::BIT_DIGITS;
 	}
 
-	// Prepare result
-	result /= (exponent);
-
-	if (bits & DataConverter::BIT_NEGATIVE)
-		result *= -1.0f;
-
 	// Update check variable
 	if (success != NULL)
 	{
@@ -169,7 +109,7 @@ float DataConverter::StringToFloat2(char* text, char** stopPos, uint32_t * succe
 	}
 
     *stopPos = text;
-	return (result);
+	return DataConverter::DecimalToFloat(number, ((bits & DataConverter::BIT_NEGATIVE) != 0));
 }
 
 int DataConverter::StringToInteger2(char* text, char** stopPos, uint32_t * success)
@@ -214,6 +154,407 @@ int DataConverter::StringToInteger2(char* text, char** stopPos, uint32_t * succe
 	return result;
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Powers of ten exactly representable in uint32_t, float (5^10 < 2^24) and double (5^22 < 2^53)
+static const uint32_t PowersOfTenInteger[] = 
+{
+    1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL
+};
+
+static const float PowersOfTenFloat[] = 
+{
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+static const double PowersOfTenDouble[] = 
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11, 
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POW10_INTEGER     9
+#define MAX_EXACT_POW10_FLOAT       10
+#define MAX_EXACT_POW10_DOUBLE      22
+#define MAX_EXACT_MANTISSA_FLOAT    (1UL << 24)
+
+// Mantissas are below 2^30: from 10^39 up they are past FLT_MAX, from 10^-56 
+// down below half the smallest subnormal
+#define MIN_OVERFLOW_POW10          39
+#define MIN_UNDERFLOW_POW10         56
+
+// A little past the midpoints rounding goes to zero or infinity from, far more than
+// the error of two double precision scalings
+#define FLOAT_UNDERFLOW_BOUND       7.0e-46
+#define FLOAT_OVERFLOW_BOUND        3.41e38
+
+#define FLOAT_BITS_INFINITY         0x7F800000UL
+
+// True if the double is exactly halfway between two floats (or zero and the 
+// smallest subnormal). Rounding it to float then can't tell which way the value
+// it was rounded from lies
+static bool is_float_midpoint(double value)
+{
+    uint64_t bits;
+    uint64_t significand;
+    int32_t exponent;
+    uint32_t low_bits;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    
+    exponent = (int32_t)((bits >> 52) & 0x7FF) - 1023;
+    significand = (bits & ((1ULL << 52) - 1)) | (1ULL << 52);
+    
+    // Bits of the double below the last one of a float of this size (subnormal floats have fewer)
+    low_bits = 52 - 23;
+    
+    if (exponent < -126)
+        low_bits += (uint32_t)(-126 - exponent);
+    
+    if (low_bits > 53)
+        return false;
+    
+    return ((significand & ((1ULL << low_bits) - 1)) == (1ULL << (low_bits - 1)));
+}
+
+// Float nearest to (mantissa * 10^exponent10), when it can be told from one
+// rounding. Returns false when the scaling isn't exact or the double precision
+// result lands on a midpoint between two floats
+static bool scale_to_float(uint32_t mantissa, int32_t exponent10, float & result)
+{
+    double value;
+    
+    if (mantissa == 0 || exponent10 <= -MIN_UNDERFLOW_POW10)
+    {
+        result = 0.0f;
+        return true;
+    }
+    
+    if (exponent10 == 0)
+    {
+        result = (float)mantissa;
+        return true;
+    }
+    
+    if (exponent10 < 0)
+    {
+        exponent10 = -exponent10;
+        
+        if (mantissa <= MAX_EXACT_MANTISSA_FLOAT && exponent10 <= MAX_EXACT_POW10_FLOAT)
+        {
+            result = (float)mantissa / PowersOfTenFloat[exponent10];
+            return true;
+        }
+        
+        if (exponent10 > MAX_EXACT_POW10_DOUBLE)
+        {
+            // Tiny numbers, zero unless close to half the smallest subnormal
+            for (value = mantissa; exponent10 > MAX_EXACT_POW10_DOUBLE; exponent10 -= MAX_EXACT_POW10_DOUBLE)
+                value /= PowersOfTenDouble[MAX_EXACT_POW10_DOUBLE];
+            
+            value /= PowersOfTenDouble[exponent10];
+            result = 0.0f;
+            return (value < FLOAT_UNDERFLOW_BOUND);
+        }
+        
+        value = (double)mantissa / PowersOfTenDouble[exponent10];
+    }
+    else
+    {
+        // mantissa < 2^30, the product always fits in 64 bits
+        if (exponent10 <= MAX_EXACT_POW10_INTEGER)
+        {
+            result = (float)((uint64_t)mantissa * PowersOfTenInteger[exponent10]);
+            return true;
+        }
+        
+        if (exponent10 >= MIN_OVERFLOW_POW10)
+        {
+            result = (float)((double)mantissa * 1e39);  // Out of float range
+            return true;
+        }
+        
+        if (exponent10 > MAX_EXACT_POW10_DOUBLE)
+        {
+            // Huge numbers, out of range unless close to FLT_MAX
+            value = ((double)mantissa * PowersOfTenDouble[MAX_EXACT_POW10_DOUBLE]) * PowersOfTenDouble[exponent10 - MAX_EXACT_POW10_DOUBLE];
+            result = (float)value;
+            return (value > FLOAT_OVERFLOW_BOUND);
+        }
+        
+        value = (double)mantissa * PowersOfTenDouble[exponent10];
+    }
+    
+    result = (float)value;
+    return (is_float_midpoint(value) == false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Exact conversion, for the numbers the scaling above can't round: those with
+// more significant digits than the mantissa keeps that fall close to a midpoint
+// between two floats, and the few on a midpoint of double precision rounding.
+// The decimal is compared to the midpoints around a first guess as integers,
+// at most DECIMAL_MAX_DIGITS digits times powers of 5 (10^-166 is the smallest
+// needed) and 2, within BIG_NUMBER_WORDS words
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define BIG_NUMBER_WORDS    16
+#define POW5_13             1220703125UL    // Largest power of five in 32 bits
+
+typedef struct BigNumber
+{
+    uint32_t    Word[BIG_NUMBER_WORDS];     // Least significant first
+    uint32_t    Count;
+    
+}BigNumber;
+
+static void big_set(BigNumber & number, uint32_t value)
+{
+    number.Word[0] = value;
+    number.Count = (value != 0) ? 1 : 0;
+}
+
+static void big_multiply_add(BigNumber & number, uint32_t factor, uint32_t addend)
+{
+    uint64_t carry = addend;
+    uint32_t index;
+    
+    for (index = 0; index < number.Count; index++)
+    {
+        carry += (uint64_t)number.Word[index] * factor;
+        number.Word[index] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    
+    if (carry != 0 && number.Count < BIG_NUMBER_WORDS)
+        number.Word[number.Count++] = (uint32_t)carry;
+}
+
+static void big_multiply_pow5(BigNumber & number, uint32_t exponent)
+{
+    static const uint32_t PowersOfFive[] = { 1, 5, 25, 125, 625, 3125, 15625, 78125, 390625, 1953125, 9765625, 48828125, 244140625 };
+    
+    for ( ; exponent >= 13; exponent -= 13)
+        big_multiply_add(number, POW5_13, 0);
+    
+    if (exponent != 0)
+        big_multiply_add(number, PowersOfFive[exponent], 0);
+}
+
+static uint32_t big_bit_length(const BigNumber & number)
+{
+    uint32_t top, bits;
+    
+    if (number.Count == 0)
+        return 0;
+    
+    top = number.Word[number.Count - 1];
+    
+    for (bits = 0; top != 0; bits++)
+        top >>= 1;
+    
+    return (number.Count - 1) * 32 + bits;
+}
+
+// The caller makes sure the result fits
+static void big_shift_left(BigNumber & number, uint32_t shift)
+{
+    uint32_t words = shift / 32;
+    uint32_t bits = shift % 32;
+    int32_t index;
+    
+    if (number.Count == 0)
+        return;
+    
+    if (bits != 0 && (number.Word[number.Count - 1] >> (32 - bits)) != 0)
+        number.Word[number.Count++] = 0;
+    
+    for (index = (int32_t)number.Count - 1; index >= 0; index--)
+    {
+        uint32_t word = number.Word[index] << bits;
+        
+        if (bits != 0 && index > 0)
+            word |= number.Word[index - 1] >> (32 - bits);
+        
+        number.Word[index + words] = word;
+    }
+    
+    for (index = 0; index < (int32_t)words; index++)
+        number.Word[index] = 0;
+    
+    number.Count += words;
+}
+
+static int big_compare(const BigNumber & a, const BigNumber & b)
+{
+    int32_t index;
+    
+    if (a.Count != b.Count)
+        return (a.Count > b.Count) ? 1 : -1;
+    
+    for (index = (int32_t)a.Count - 1; index >= 0; index--)
+    {
+        if (a.Word[index] != b.Word[index])
+            return (a.Word[index] > b.Word[index]) ? 1 : -1;
+    }
+    
+    return 0;
+}
+
+// Sign of (number - (midpoint * 2^exponent2))
+static int compare_to_midpoint(const DecimalNumber & number, uint32_t midpoint, int32_t exponent2)
+{
+    BigNumber decimal, binary;
+    int32_t decimal_shift, binary_shift, exponent10;
+    uint32_t index, decimal_bits, binary_bits;
+    int result;
+    
+    big_set(decimal, number.Mantissa);
+    
+    for (index = DECIMAL_MANTISSA_DIGITS; index < number.Digits; index++)
+        big_multiply_add(decimal, 10, number.Extra[index - DECIMAL_MANTISSA_DIGITS]);
+    
+    big_set(binary, midpoint);
+    
+    // digits * 5^e * 2^e against midpoint * 2^exponent2, the negative powers moved to the other side
+    exponent10 = number.Exponent10;
+    
+    if (exponent10 >= 0)
+    {
+        big_multiply_pow5(decimal, (uint32_t)exponent10);
+        decimal_shift = exponent10;
+        binary_shift = exponent2;
+    }
+    else
+    {
+        big_multiply_pow5(binary, (uint32_t)-exponent10);
+        decimal_shift = 0;
+        binary_shift = exponent2 - exponent10;
+    }
+    
+    // Different sizes tell it before any shift
+    decimal_bits = big_bit_length(decimal);
+    binary_bits = big_bit_length(binary);
+    
+    if ((int32_t)decimal_bits + decimal_shift != (int32_t)binary_bits + binary_shift)
+        result = ((int32_t)decimal_bits + decimal_shift > (int32_t)binary_bits + binary_shift) ? 1 : -1;
+    else
+    {
+        if (decimal_shift > binary_shift)
+            big_shift_left(decimal, (uint32_t)(decimal_shift - binary_shift));
+        else
+            big_shift_left(binary, (uint32_t)(binary_shift - decimal_shift));
+        
+        result = big_compare(decimal, binary);
+    }
+    
+    // The digits dropped put it above, never on the midpoint (see DECIMAL_MAX_DIGITS)
+    if (result == 0 && number.Inexact != false)
+        result = 1;
+    
+    return result;
+}
+
+static float exact_decimal_to_float(const DecimalNumber & number)
+{
+    uint32_t float_bits, significand;
+    int32_t exponent2, exponent10;
+    double guess;
+    float result;
+    int order;
+    
+    // First guess from the mantissa alone, less than an ulp away. Two floats below it is under the value
+    guess = number.Mantissa;
+    exponent10 = number.Exponent10 + (int32_t)((number.Digits > DECIMAL_MANTISSA_DIGITS) ? (number.Digits - DECIMAL_MANTISSA_DIGITS) : 0);
+    
+    for ( ; exponent10 > 0; exponent10--)
+        guess *= 10.0;
+    
+    for ( ; exponent10 < 0; exponent10++)
+        guess /= 10.0;
+    
+    result = (guess < FLT_MAX) ? (float)guess : FLT_MAX;
+    memcpy(&float_bits, &result, sizeof(float_bits));
+    
+    float_bits = (float_bits > 2) ? (float_bits - 2) : 0;
+    
+    // Up the floats while the number is past the midpoint to the next one
+    for ( ; float_bits < FLOAT_BITS_INFINITY; float_bits++)
+    {
+        if (float_bits < 0x00800000UL)
+        {
+            significand = float_bits;       // Subnormal
+            exponent2 = -149;
+        }
+        else
+        {
+            significand = (float_bits & 0x007FFFFFUL) | 0x00800000UL;
+            exponent2 = (int32_t)(float_bits >> 23) - 150;
+        }
+        
+        order = compare_to_midpoint(number, (2 * significand) + 1, exponent2 - 1);
+        
+        // Ties go to the even one
+        if (order < 0 || (order == 0 && (float_bits & 1) == 0))
+            break;
+    }
+    
+    memcpy(&result, &float_bits, sizeof(result));
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Returns the float nearest to the decimal number, ties to even.
+// When both the mantissa and the power of ten are exact in single precision (the
+// usual case for coordinates like 123.4567) the result comes from one correctly
+// rounded FPU multiply/divide. Integers (N, G, M, T words...) skip the scaling 
+// completely. Larger mantissas go through double precision, unless the result
+// lands on a midpoint between floats. Digits past the mantissa only need the 
+// exact path when the mantissa and the mantissa plus one round apart
+float DataConverter::DecimalToFloat(const DecimalNumber & number, bool negative)
+{
+    int32_t exponent10 = number.Exponent10;
+    uint32_t extra_digits = 0;
+    uint32_t index;
+    bool rounded;
+    float result, upper;
+    
+    if (number.Digits > DECIMAL_MANTISSA_DIGITS)
+    {
+        extra_digits = number.Digits - DECIMAL_MANTISSA_DIGITS;
+        exponent10 += (int32_t)extra_digits;
+        
+        // Trailing zeros (1.50000000000) change nothing
+        for (index = 0; index < extra_digits; index++)
+        {
+            if (number.Extra[index] != 0)
+                break;
+        }
+        
+        if (index == extra_digits && number.Inexact == false)
+            extra_digits = 0;
+    }
+    
+    if (extra_digits == 0)
+        rounded = scale_to_float(number.Mantissa, exponent10, result);
+    else
+    {
+        rounded = (scale_to_float(number.Mantissa, exponent10, result) != false) &&
+                  (scale_to_float(number.Mantissa + 1, exponent10, upper) != false) && 
+                  (result == upper);
+    }
+    
+    if (rounded == false)
+        result = exact_decimal_to_float(number);
+    
+    return (negative != false) ? -result : result;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 // This method is not thread safe. It returns a pointer to static data
 // This data will be modified in a new call to FloatToStringTruncate or 
 // IntegerToString. 
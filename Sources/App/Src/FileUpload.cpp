@@ -0,0 +1,212 @@
+#include "FileUpload.h"
+#include "GCodeParser.h"
+#include "JobIndex.h"
+
+#include "ff_headers.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////////////
+
+FileUpload::FileUpload()
+{
+    m_file = NULL;
+    m_active = false;
+    m_failed = false;
+    m_size = 0;
+    m_received = 0;
+}
+
+int32_t FileUpload::Begin(const char* name, uint32_t size)
+{
+    uint32_t length = strlen(name);
+    uint32_t index;
+
+    if (m_active != false || length == 0 || length > UPLOAD_MAX_NAME)
+        return GCODE_ERROR_INVALID_FILE_REQUEST;
+
+    // Names are taken from the root directory unless a path is given
+    m_name[0] = '/';
+    memcpy(&m_name[(name[0] == '/') ? 0 : 1], name, length + 1);
+
+    if (DiskTask_AcquireVolume(DISK_OWNER_FIRMWARE) == false)
+        return GCODE_ERROR_DISK_NOT_AVAILABLE;
+
+    m_file = ff_fopen(UPLOAD_TEMP_NAME, "w");
+
+    if (m_file == NULL)
+    {
+        DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+        return GCODE_ERROR_DISK_ACCESS;
+    }
+
+    for (index = 0; index < 2; index++)
+    {
+        m_requests[index].NotifyTask = xTaskGetCurrentTaskHandle();
+        m_requests[index].Done = true;
+        m_requests[index].Failed = false;
+    }
+
+    m_current = 0;
+    m_fill = 0;
+    m_size = size;
+    m_received = 0;
+    m_crc = 0xFFFFFFFF;
+    m_failed = false;
+    m_start_tick = m_last_data_tick = xTaskGetTickCount();
+    m_active = true;
+
+    return GCODE_OK;
+}
+
+uint32_t FileUpload::Feed(const uint8_t* data, uint32_t size)
+{
+    uint8_t* buffer;
+    uint32_t taken = 0;
+    uint32_t count;
+    uint32_t crc;
+
+    if (m_active == false || size == 0)
+        return 0;
+
+    m_last_data_tick = xTaskGetTickCount();
+
+    if (m_received == 0)
+        m_start_tick = m_last_data_tick;
+
+    while (size != 0 && m_received < m_size)
+    {
+        count = std::min(std::min(size, m_size - m_received), UPLOAD_BUFFER_SIZE - m_fill);
+        buffer = (uint8_t*)m_buffers[m_current] + m_fill;
+
+        memcpy(buffer, data, count);
+
+        m_fill += count;
+        m_received += count;
+        data += count;
+        size -= count;
+        taken += count;
+
+        for (crc = m_crc; count != 0; count--)
+            crc = (crc >> 8) ^ crc32_table[(crc ^ *buffer++) & 0xFF];
+
+        m_crc = crc;
+
+        if (m_fill == UPLOAD_BUFFER_SIZE)
+            write_current_buffer();
+    }
+
+    while (size != 0 && m_received < (m_size + sizeof(m_crc_received)))
+    {
+        m_crc_received[m_received - m_size] = *data++;
+        m_received++;
+        size--;
+        taken++;
+    }
+
+    return taken;
+}
+
+int32_t FileUpload::Finish(UPLOAD_STATS& stats)
+{
+    uint32_t crc;
+    int32_t result = GCODE_OK;
+
+    // Last (partial) buffer
+    write_current_buffer();
+
+    if (wait_for_buffer(m_current ^ 1) == false)
+        m_failed = true;
+
+    close_file();
+
+    stats.Bytes = m_size;
+    stats.Milliseconds = std::max((uint32_t)((xTaskGetTickCount() - m_start_tick) * portTICK_PERIOD_MS), (uint32_t)1);
+    stats.KBytesPerSecond = (uint32_t)(((uint64_t)m_size * 1000) / ((uint64_t)stats.Milliseconds * 1024));
+
+    crc = (uint32_t)m_crc_received[0] | ((uint32_t)m_crc_received[1] << 8) |
+          ((uint32_t)m_crc_received[2] << 16) | ((uint32_t)m_crc_received[3] << 24);
+
+    if (m_failed != false)
+        result = GCODE_ERROR_DISK_ACCESS;
+    else if (crc != (m_crc ^ 0xFFFFFFFF))
+        result = GCODE_ERROR_UPLOAD_CRC;
+    else if (ff_rename(UPLOAD_TEMP_NAME, m_name, pdTRUE) != 0)
+        result = GCODE_ERROR_DISK_ACCESS;
+    else
+        JobIndex::Invalidate();     // May have replaced the indexed file
+
+    if (result != GCODE_OK)
+        ff_remove(UPLOAD_TEMP_NAME);
+
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+    m_active = false;
+
+    return result;
+}
+
+void FileUpload::Abort()
+{
+    if (m_active == false)
+        return;
+
+    // The disk task may still be writing from the buffers
+    wait_for_buffer(0);
+    wait_for_buffer(1);
+
+    close_file();
+    ff_remove(UPLOAD_TEMP_NAME);
+
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+    m_active = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool FileUpload::wait_for_buffer(uint32_t index)
+{
+    while (m_requests[index].Done == false)
+        ulTaskNotifyTake(pdTRUE, UPLOAD_WRITE_POLL_TIME);
+
+    return (m_requests[index].Failed == false);
+}
+
+// Hands the buffer being filled to the disk task and switches to the other one
+void FileUpload::write_current_buffer()
+{
+    DISK_WRITE_REQUEST& request = m_requests[m_current];
+
+    if (m_fill == 0)
+        return;
+
+    request.File = m_file;
+    request.Data = m_buffers[m_current];
+    request.Length = m_fill;
+
+    // Nothing more is written once a write failed, the upload ends with an error
+    if (m_failed != false || DiskTask_QueueWrite(&request) == false)
+    {
+        m_failed = true;
+        request.Done = true;
+    }
+
+    m_current ^= 1;
+    m_fill = 0;
+
+    // The other buffer may still be on its way to the card
+    if (wait_for_buffer(m_current) == false)
+        m_failed = true;
+}
+
+void FileUpload::close_file()
+{
+    if (m_file == NULL)
+        return;
+
+    if (ff_fclose(m_file) != 0)
+        m_failed = true;
+
+    m_file = NULL;
+}
@@ -1,20 +1,81 @@
 #include "GCodeParser.h"
 
 
-#include <ctype.h>
 #include <string.h>
 #include <math.h>
 
 #include "settings_manager.h"
+#include "settings_task.h"
 
 #include "user_tasks.h"
 #include "MachineCore.h"
+#include "BinaryToolpath.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Character classes for the line tokenizer
+#define CHAR_CLASS_INVALID          0
+#define CHAR_CLASS_END              1   // '\0'
+#define CHAR_CLASS_BLANK            2   // ' ', '\t', '\n', '\v', '\f', '\r'
+#define CHAR_CLASS_LETTER           3   // 'A'..'Z', 'a'..'z'
+#define CHAR_CLASS_DIGIT            4   // '0'..'9'
+#define CHAR_CLASS_SIGN             5   // '+', '-'
+#define CHAR_CLASS_DOT              6   // '.'
+#define CHAR_CLASS_COMMENT_OPEN     7   // '('
+#define CHAR_CLASS_COMMENT_CLOSE    8   // ')'
+
+#define CC_I  CHAR_CLASS_INVALID
+#define CC_E  CHAR_CLASS_END
+#define CC_W  CHAR_CLASS_BLANK
+#define CC_L  CHAR_CLASS_LETTER
+#define CC_D  CHAR_CLASS_DIGIT
+#define CC_S  CHAR_CLASS_SIGN
+#define CC_P  CHAR_CLASS_DOT
+#define CC_O  CHAR_CLASS_COMMENT_OPEN
+#define CC_C  CHAR_CLASS_COMMENT_CLOSE
+
+static const uint8_t CharClassTable[256] = 
+{
+//   0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+    CC_E, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_W, CC_W, CC_W, CC_W, CC_W, CC_I, CC_I,    // 0x00
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x10
+    CC_W, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_O, CC_C, CC_I, CC_S, CC_I, CC_S, CC_P, CC_I,    // 0x20
+    CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x30
+    CC_I, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L,    // 0x40
+    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x50
+    CC_I, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L,    // 0x60
+    CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_L, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x70
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x80
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0x90
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xA0
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xB0
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xC0
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xD0
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xE0
+    CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,    // 0xF0
+};
+
+#undef CC_I
+#undef CC_E
+#undef CC_W
+#undef CC_L
+#undef CC_D
+#undef CC_S
+#undef CC_P
+#undef CC_O
+#undef CC_C
+
+///////////////////////////////////////////////////////////////////////////////
 
 GCodeParser::GCodeParser(void)
 {
     ResetParser();
     
     m_planner_ref = NULL;
+    m_toolpath_writer = NULL;
+    
+    m_check_mode = false;
+    m_scan_mode = false;
 }
 
 
@@ -56,8 +117,6 @@ void GCodeParser::ResetParser()
         m_soft_limit_max_values[loop_index] = Settings_Manager::GetMaxTravel_mm_Axis(loop_index);
     }
     
-    m_check_mode = false;
-    
     m_mm_max_arc_error = Settings_Manager::GetMaxArcError_mm();
     m_mm_per_arc_segment = Settings_Manager::GetArcSegmentSize_mm();
     m_arc_correction_counter = 5;
@@ -73,22 +132,20 @@ void GCodeParser::ResetParser()
     canned_cycle_reset_stycky();
 }
 
-int GCodeParser::ParseLine(char * line)
+int GCodeParser::ParseLine(const char * line)
 {
-    uint32_t line_len = 0;
 	uint32_t modal_group_flags = 0;
     int32_t work_var;
-    char ch;
     
     m_line = line;
 	m_value_group_flags = 0;
     m_axis_command_type = AXIS_COMMAND_TYPE_NONE;
     
     // Start parsing
-    // Check/Clean up the input line [remove comments and whitespace too]
-    work_var = cleanup_and_lowercase_line(line_len);
+    // Skip leading whitespace and comments, nothing else to do on empty lines
+    work_var = skip_blanks();
 
-    if (work_var != GCODE_OK || line_len == 0)
+    if (work_var != GCODE_OK || *m_line == '\0')
         return work_var;
     
     // Reset all block values
@@ -102,12 +159,397 @@ int GCodeParser::ParseLine(char * line)
     m_block_data.spindle_speed = m_spindle_speed;   // Keep current spindle speed
     m_block_data.tool_number = m_tool_number;
 
+    // Read all words of this line
+    work_var = parse_block_words(modal_group_flags);
+    
+    if (work_var != GCODE_OK)
+    {
+        // A malformed comment anywhere in the line is reported before any word error
+        if (work_var < GCODE_ERROR_NESTED_COMMENT || work_var > GCODE_ERROR_UNCLOSED_COMMENT)
+        {
+            int32_t comment_status = check_remaining_comments();
+            
+            if (comment_status != GCODE_OK)
+                return comment_status;
+        }
+        
+        return work_var;
+    }
+
+    // Perform some checkings prior to execution of codes
+    work_var = check_codes_using_axes();
+
+	if (work_var != GCODE_OK)
+	{
+		// Reset motion mode as errors happened
+		m_parser_modal_state.motion_mode = MODAL_MOTION_MODE_CANCEL_MOTION;
+		return work_var;
+	}
+    
+    work_var = check_group_0_codes();
+
+    if (work_var != GCODE_OK)
+        return work_var;
+
+    work_var = check_unused_codes();
+
+    if (work_var != GCODE_OK)
+        return work_var;
+
+    // Try to execute the code of this line
+
+    // Update Parser Status Values:
+
+    /// 1 - Update Feed Rate Mode ///
+    m_parser_modal_state.feedrate_mode = m_block_data.block_modal_state.feedrate_mode;
+
+    /// 2 - Update Feed Rate Value (Only in units/min mode G94) ///
+    if (m_parser_modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_UNITS_PER_MIN)
+        m_feed_rate = m_block_data.feed_rate;
+
+    /// 3 - Update Spindle Speed Value ///
+    m_spindle_speed = m_block_data.spindle_speed;
+
+    /// 4 - Select Active Tool Number ///
+    m_tool_number = m_block_data.tool_number;
+
+    /// 5 - Handle a possible Tool Change [M6 Code] ///
+    if ((modal_group_flags & MODAL_GROUP_M6_BIT) != 0)
+    {
+        // Wait for idle condition before attempt to stop spindle for tool change
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        // Stop Spindle and leave coolant as currently is 
+        work_var = send_spindle_command(MODAL_SPINDLE_OFF, 0.0f);
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+
+    /// 6 - Handle Spindle Control Commands [M3, M4, M5] ///
+    if (m_parser_modal_state.spindle_mode != m_block_data.block_modal_state.spindle_mode)
+    {
+        m_parser_modal_state.spindle_mode = m_block_data.block_modal_state.spindle_mode;
+
+        // Wait for idle condition before attempt to change spindle operation
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        // Notify of spindle changes
+        work_var = send_spindle_command(m_parser_modal_state.spindle_mode, m_spindle_speed);
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+
+    /// 7 - Handle Coolant Control Commands [M7, M8, M9] ///
+    if (m_parser_modal_state.coolant_mode != m_block_data.block_modal_state.coolant_mode)
+    {
+        m_parser_modal_state.coolant_mode = m_block_data.block_modal_state.coolant_mode;
+
+        // Wait for idle condition before attempt to change coolant operation
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        // Notify of coolant changes
+        work_var = send_coolant_command(m_parser_modal_state.coolant_mode);
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+
+    /// 8 - Handle Speed/Feed Overrides [M48, M49] ///
+
+
+    /// 9 - Handle Dwell Command [G4] ///
+    if (m_block_data.non_modal_code == NON_MODAL_DWELL) // G4
+    {
+        // NOTE: Before executing dwell operations we must wait for the completion of previous 
+        // queued commands
+        
+        // Wait for idle condition before attempt to enter dwell mode
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        work_var = send_dwell_command(m_block_data.P_value);
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+
+    /// 10 - Handle Plane Selection Commands [G17, G18, G19] ///
+	if (m_parser_modal_state.plane_select != m_block_data.block_modal_state.plane_select)
+		select_plane(m_block_data.block_modal_state.plane_select);
+
+    /// 11 - Handle Length Units Selection Commands [G20, G21] ///
+    /// Internally always use millimeters
+    m_parser_modal_state.units_mode = m_block_data.block_modal_state.units_mode;
+
+    /// 12 - Handle Cutter Radius Compensation Commands [G40, G41, G42] ///
+    m_parser_modal_state.cutter_comp_mode = m_block_data.block_modal_state.cutter_comp_mode;
+    /// TODO: Implement this function ///
+
+    /// 13 - Handle Tool Length Offset Commands [G43, G49] ///
+    m_parser_modal_state.tool_len_ofs_mode = m_block_data.block_modal_state.tool_len_ofs_mode;
+
+    /// 14 - Handle Coordinate System Selection Commands [G54, G55, ...] ///
+    handle_coordinate_system_select();
+    
+    /// 15 - Handle Control Mode Commands [G61, G61.1, G64] ///
+    
+
+    /// 16 - Handle Distance Mode Commands [G90, G91] ///
+    m_parser_modal_state.distance_mode = m_block_data.block_modal_state.distance_mode;
+
+    /// 17 - Handle Retract Mode Commands [G98, G99]
+    m_parser_modal_state.canned_return_mode = m_block_data.block_modal_state.canned_return_mode;
+    
+    // Check if specified either G98/G99 to start a canned cycle
+    if ((modal_group_flags & MODAL_GROUP_G10_BIT) != 0)
+    {
+        // Wait for idle condition
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        // Update initial Z value [in Work Coord System]
+        m_cc_initial_z = m_gcode_machine_pos[COORD_Z] - m_work_coord_sys[COORD_Z] + m_g92_coord_offset[COORD_Z] - m_tool_offset[COORD_Z];
+        
+        // Reset sticky values
+        canned_cycle_reset_stycky();
+        
+        m_canned_cycle_active = true;
+    }
+
+    /// 18 - Handle Non-Modal Commands [G10, G28, G30, G92] ///
+    if (m_block_data.non_modal_code != 0)
+    {
+        work_var = handle_non_modal_codes();
+
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+
+    /// 19 - Execute Motion Commands [G0, G1, G2, G3, G38, G81-G89] ///
+    if ((m_axis_command_type == AXIS_COMMAND_TYPE_MOTION) ||
+		(m_axis_command_type == AXIS_COMMAND_TYPE_CANNED_CYCLE))
+    {		
+        work_var = handle_motion_commands();
+
+        if (work_var != GCODE_OK)
+            return work_var;
+    }
+    
+    /// 19.1 - Handle G80 stop command for canned cycles
+    if ( (m_block_data.block_modal_state.motion_mode == MODAL_MOTION_MODE_CANCEL_MOTION) &&
+         (m_canned_cycle_active != false) )
+    {
+        m_canned_cycle_active = false;
+        
+        if (m_parser_modal_state.canned_return_mode == MODAL_CANNED_RETURN_TO_R_POSITION)
+        {
+            // If retract mode is to R-plane -> Enqueue a last move to this position
+        
+            // TODO: Implement this
+        }
+    }
+
+    /// 20 - Handle Stop Commands [M0, M1, M2, M30]
+    if (m_parser_modal_state.prog_flow != m_block_data.block_modal_state.prog_flow)
+    {
+        // A pause can't be represented in a precompiled toolpath
+        if (m_toolpath_writer != NULL && m_block_data.block_modal_state.prog_flow == MODAL_FLOW_TEMPORARY_STOP)
+            return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+        
+        // Change in program flow. Update parser modal state
+        m_parser_modal_state.prog_flow = m_block_data.block_modal_state.prog_flow;
+        
+        // Before executing flow control operations we must wait for the completion of previous 
+        // queued commands
+        
+        // Wait for idle condition before attempt to change flow mode
+        work_var = wait_for_idle();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        if (m_parser_modal_state.prog_flow == MODAL_FLOW_TEMPORARY_STOP)    // M0 [Feed hold]
+        {
+            if (m_check_mode == false)
+            {
+                // Notify to other sub-systems of feed hold condition
+                machine->EnterFeedHold();
+            }                
+        }
+        else if ( (m_parser_modal_state.prog_flow == MODAL_FLOW_COMPLETED) ||       // M2
+                  (m_parser_modal_state.prog_flow == MODAL_FLOW_COMPLETED_PALLET))  // M30
+        {
+            // Program completed. Restore some defaults
+            m_parser_modal_state.motion_mode = MODAL_MOTION_MODE_LINEAR_FEED;   // G1
+            
+            m_parser_modal_state.plane_select = MODAL_PLANE_SELECT_XY;
+            m_axis_zero = COORD_X;
+            m_axis_one = COORD_Y;
+            m_axis_linear = COORD_Z;
+            
+            m_parser_modal_state.distance_mode = MODAL_DISTANCE_MODE_ABSOLUTE;
+            m_parser_modal_state.feedrate_mode = MODAL_FEEDRATE_MODE_UNITS_PER_MIN;
+            m_parser_modal_state.work_coord_sys_index = 0;
+            m_parser_modal_state.spindle_mode = MODAL_SPINDLE_OFF;
+            m_parser_modal_state.coolant_mode = MODAL_COOLANT_OFF;
+            
+            handle_coordinate_system_select();
+            
+            if (m_check_mode == false)
+            {
+                // Notify of spindle changes
+                work_var = send_spindle_command(m_parser_modal_state.spindle_mode, m_spindle_speed);
+                
+                if (work_var != GCODE_OK)
+                    return work_var;
+                
+                // Notify of coolant changes
+                work_var = send_coolant_command(m_parser_modal_state.coolant_mode);
+                
+                if (work_var != GCODE_OK)
+                    return work_var;
+            }
+            
+            if (m_toolpath_writer == NULL)
+                machine->ClearHalt();
+        }
+    }
+    
+    // Reset program flow mode to Default running
+    m_parser_modal_state.prog_flow = MODAL_FLOW_DEFAULT_RUNNING;
+    return GCODE_OK;
+}
+
+// Executes a record of a precompiled toolpath. Records already hold machine coordinates
+// in mm, so this only has to keep the parser state in sync and forward the command.
+int GCodeParser::ExecuteToolpathRecord(const TOOLPATH_RECORD& record)
+{
+    int work_var;
+    
+    switch (record.type)
+    {
+        case TOOLPATH_RECORD_LINE:
+        {
+            m_spindle_speed = record.spindle_speed;
+            
+            work_var = motion_append_line(&record.target[0], record.rate, record.inverse_time);
+            
+            if (work_var != GCODE_OK)
+                return work_var;
+            
+            memcpy(&m_gcode_machine_pos[0], &record.target[0], sizeof(m_gcode_machine_pos));
+        }
+        break;
+        
+        case TOOLPATH_RECORD_ARC:
+        {
+            float offsets[3];
+            
+            m_spindle_speed = record.spindle_speed;
+            
+            if (record.plane == TOOLPATH_PLANE_XZ)
+                select_plane(MODAL_PLANE_SELECT_XZ);
+            else if (record.plane == TOOLPATH_PLANE_YZ)
+                select_plane(MODAL_PLANE_SELECT_YZ);
+            else
+                select_plane(MODAL_PLANE_SELECT_XY);
+            
+            offsets[m_axis_zero] = record.offset[0];
+            offsets[m_axis_one] = record.offset[1];
+            offsets[m_axis_linear] = 0.0f;
+            
+            // Cut into lines here, with the arc settings of this controller
+            return motion_append_arc(&record.target[0], &offsets[0], record.clockwise, record.rate, record.inverse_time);
+        }
+        
+        case TOOLPATH_RECORD_SPINDLE:
+        {
+            work_var = machine->WaitForIdleCondition();
+            
+            if (work_var != GCODE_OK)
+                return work_var;
+            
+            m_parser_modal_state.spindle_mode = (GCODE_MODAL_SPINDLE_MODES)record.mode;
+            m_spindle_speed = record.spindle_speed;
+            
+            return send_spindle_command(m_parser_modal_state.spindle_mode, m_spindle_speed);
+        }
+        
+        case TOOLPATH_RECORD_COOLANT:
+        {
+            work_var = machine->WaitForIdleCondition();
+            
+            if (work_var != GCODE_OK)
+                return work_var;
+            
+            m_parser_modal_state.coolant_mode = (GCODE_MODAL_COOLANT_MODES)record.mode;
+            
+            return send_coolant_command(m_parser_modal_state.coolant_mode);
+        }
+        
+        case TOOLPATH_RECORD_DWELL:
+        {
+            work_var = machine->WaitForIdleCondition();
+            
+            if (work_var != GCODE_OK)
+                return work_var;
+            
+            return send_dwell_command(record.seconds);
+        }
+        
+        case TOOLPATH_RECORD_END:
+            break;
+        
+        default:
+            return GCODE_ERROR_INVALID_TOOLPATH_DATA;
+    }
+    
+    return GCODE_OK;
+}
+
+int GCodeParser::parse_block_words(uint32_t & modal_group_flags)
+{
+    int32_t work_var;
+    char ch;
+    
     // Iterate over all line until end of string or error is found
-    while ((ch = *m_line++) != '\0')
+    for ( ; ; )
     {
         float value;
         uint32_t success_bits;
         
+        // Whitespace and comments are skipped (and validated) in place
+        work_var = skip_blanks();
+        
+        if (work_var != GCODE_OK)
+            return work_var;
+        
+        ch = *m_line;
+        
+        if (ch == '\0')
+            break;
+        
+        m_line++;
+        
+        // Word letters are case insensitive
+        if (CharClassTable[(uint8_t)ch] == CHAR_CLASS_LETTER)
+            ch |= 0x20;
+        
         switch (ch)
 		{
 			case '/':   // Block delete, skip this line completely
@@ -116,11 +558,15 @@ int GCodeParser::ParseLine(char * line)
 			case 'n':
 			{
 				// Read line number
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
 
 				// Check for numbers >= 0 
 				if (work_var < 0 || success_bits == 0)
                     return GCODE_ERROR_INVALID_LINE_NUMBER;
+
+                // Tag the blocks of this line, so the executing line can be reported
+                if (m_planner_ref != NULL)
+                    m_planner_ref->SetLineNumber((uint32_t)work_var);
 			}
 			break;
 
@@ -131,7 +577,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_D_WORD; // Multiple definitions of D word value in the same line
                 
                 // Read integer value
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
 
                 if (success_bits == 0 || work_var < 0)
                     return GCODE_ERROR_INVALID_D_VALUE; // 
@@ -149,7 +595,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_H_WORD; // Multiple definitions of D word value in the same line
                 
                 // Read integer value
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
 
                 if (success_bits == 0 || work_var < 0)
                     return GCODE_ERROR_INVALID_H_VALUE; 
@@ -167,7 +613,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_Q_WORD; // Multiple definitions of Q word value in the same line
 
                 // read q value
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
                 if (success_bits == 0 || value <= 0.0f)
                     return GCODE_ERROR_INVALID_Q_VALUE;                
@@ -190,7 +636,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_SAME_COORD; // Multiple definition of a,b,c coordinates
 
 				// Try to read float value of coordinate
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
 				if (success_bits == 0)
                     return GCODE_ERROR_INVALID_COORDINATE_VALUE;
@@ -214,7 +660,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_SAME_COORD; // Multiple definition of x,y,z, a coordinates
 
 				// Try to read float value of coordinate
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
 				if (success_bits == 0)
                     return GCODE_ERROR_INVALID_COORDINATE_VALUE;
@@ -236,7 +682,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_SAME_OFFSET;    // Multiple definition of i,j,k offset
 
 				// Try to read float value of coordinate
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
 				if (success_bits == 0)
                     return  GCODE_ERROR_INVALID_OFFSET_VALUE;
@@ -254,7 +700,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_FEEDRATE;   // Multiple definition of feed rate in the same line
 
 				// Try to read feed rate float value
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
                 
 				if (success_bits == 0 || value < 0.0f)
                     return GCODE_ERROR_INVALID_FEEDRATE_VALUE;  // Invalid feed rate value
@@ -271,7 +717,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_L_WORD;
 
 				// Read integer
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
 
 				if (success_bits == 0 || work_var < 0)
                     return GCODE_ERROR_INVALID_L_VALUE;
@@ -289,7 +735,7 @@ int GCodeParser::ParseLine(char * line)
                     return GCODE_ERROR_MULTIPLE_DEF_P_WORD;
 
 				// Read float
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
 				if (success_bits == 0 || value < 0.0f)
                     return GCODE_ERROR_INVALID_P_VALUE;
@@ -306,7 +752,7 @@ int GCodeParser::ParseLine(char * line)
 				if ((m_value_group_flags & VALUE_SET_R_BIT) != 0)
                     return GCODE_ERROR_MULTIPLE_DEF_R_WORD;
 
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
 
 				if (success_bits == 0)
                     return GCODE_ERROR_INVALID_R_VALUE;
@@ -323,7 +769,7 @@ int GCodeParser::ParseLine(char * line)
 				if ((m_value_group_flags & VALUE_SET_S_BIT) != 0)
                     return GCODE_ERROR_MULTIPLE_DEF_SPINDLE_SPEED;
 
-				value = DataConverter::StringToFloat(&m_line, &success_bits);
+				value = read_float(success_bits);
 
 				if (success_bits == 0 || value < 0.0f)
                     return GCODE_ERROR_INVALID_SPINDLE_SPEED;
@@ -340,7 +786,7 @@ int GCodeParser::ParseLine(char * line)
 				if ((m_value_group_flags & VALUE_SET_T_BIT) != 0)
                     return GCODE_ERROR_MULTIPLE_DEF_TOOL_INDEX;
 
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
 
 				if (success_bits == 0 || work_var < 0)
                     return GCODE_ERROR_INVALID_TOOL_INDEX;
@@ -354,11 +800,21 @@ int GCodeParser::ParseLine(char * line)
             case 'm':
 			{
                 // Try to read integer value
-                work_var = DataConverter::StringToInteger(&m_line, &success_bits);
+                work_var = read_integer(success_bits);
                 
                 if (work_var < 0 || work_var > 99 || success_bits == 0)
                     return GCODE_ERROR_INVALID_M_CODE;
 
+                // Settings codes take effect right away, so the rest of the line
+                // must be free of comment errors before going ahead
+                if (work_var == 32 || work_var == 36 || work_var == 38)
+                {
+                    int32_t comment_status = check_remaining_comments();
+                    
+                    if (comment_status != GCODE_OK)
+                        return comment_status;
+                }
+
                 // Parse specific codes
                 switch (work_var)
                 {
@@ -393,6 +849,10 @@ int GCodeParser::ParseLine(char * line)
                     {
                         float fval;
                         
+                        // Settings changes are left to the machine that runs a toolpath
+                        if (m_toolpath_writer != NULL)
+                            return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+                        
                         if ((m_value_group_flags & VALUE_SET_X_BIT) != 0)
                         {
                             // Values specified in mm/min -> convert to mm/sec
@@ -418,6 +878,9 @@ int GCodeParser::ParseLine(char * line)
                     {
                         float fval;
                         
+                        if (m_toolpath_writer != NULL)
+                            return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+                        
                         // Values specified in mm/min2 -> convert to mm/sec2 (div 3600)
                         
                         if ((m_value_group_flags & VALUE_SET_X_BIT) != 0)
@@ -440,9 +903,12 @@ int GCodeParser::ParseLine(char * line)
                     }
                     break;
                     
-                    case 38:   // M38 Save settings to flash
+                    case 38:   // M38 Save settings to flash (settings task, after the changes settle)
                     {
-                        Settings_Manager::Save();
+                        if (m_toolpath_writer != NULL)
+                            return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+                        
+                        SettingsTask_RequestSave();
                     }
                     break;
                     
@@ -472,7 +938,7 @@ int GCodeParser::ParseLine(char * line)
 
 				// read G code                
                 // Try to read float value
-                value = DataConverter::StringToFloat(&m_line, &success_bits);
+                value = read_float(success_bits);
                 
                 // G codes must be positive
                 if (value < 0.0f || success_bits == 0)
@@ -694,332 +1160,153 @@ int GCodeParser::ParseLine(char * line)
                 return GCODE_ERROR_UNSUPPORTED_CODE_FOUND;
 
         }   //  end of 'switch (ch)'
-    }   // end 'while ( ... )'
-
-    // Perform some checkings prior to execution of codes
-    work_var = check_codes_using_axes();
-
-	if (work_var != GCODE_OK)
-	{
-		// Reset motion mode as errors happened
-		m_parser_modal_state.motion_mode = MODAL_MOTION_MODE_CANCEL_MOTION;
-		return work_var;
-	}
-    
-    work_var = check_group_0_codes();
-
-    if (work_var != GCODE_OK)
-        return work_var;
-
-    work_var = check_unused_codes();
-
-    if (work_var != GCODE_OK)
-        return work_var;
-
-    // Try to execute the code of this line
-
-    // Update Parser Status Values:
-
-    /// 1 - Update Feed Rate Mode ///
-    m_parser_modal_state.feedrate_mode = m_block_data.block_modal_state.feedrate_mode;
-
-    /// 2 - Update Feed Rate Value (Only in units/min mode G94) ///
-    if (m_parser_modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_UNITS_PER_MIN)
-        m_feed_rate = m_block_data.feed_rate;
-
-    /// 3 - Update Spindle Speed Value ///
-    m_spindle_speed = m_block_data.spindle_speed;
-
-    /// 4 - Select Active Tool Number ///
-    m_tool_number = m_block_data.tool_number;
-
-    /// 5 - Handle a possible Tool Change [M6 Code] ///
-    if ((modal_group_flags & MODAL_GROUP_M6_BIT) != 0)
-    {
-        // Wait for idle condition before attempt to stop spindle for tool change
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        // Stop Spindle and leave coolant as currently is 
-        work_var = machine->SendSpindleCommand(MODAL_SPINDLE_OFF, 0.0f);
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
-
-    /// 6 - Handle Spindle Control Commands [M3, M4, M5] ///
-    if (m_parser_modal_state.spindle_mode != m_block_data.block_modal_state.spindle_mode)
-    {
-        m_parser_modal_state.spindle_mode = m_block_data.block_modal_state.spindle_mode;
-
-        // Wait for idle condition before attempt to change spindle operation
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        // Notify of spindle changes
-        work_var = machine->SendSpindleCommand(m_parser_modal_state.spindle_mode, m_spindle_speed);
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
-
-    /// 7 - Handle Coolant Control Commands [M7, M8, M9] ///
-    if (m_parser_modal_state.coolant_mode != m_block_data.block_modal_state.coolant_mode)
-    {
-        m_parser_modal_state.coolant_mode = m_block_data.block_modal_state.coolant_mode;
-
-        // Wait for idle condition before attempt to change coolant operation
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        // Notify of coolant changes
-        work_var = machine->SendCoolantCommand(m_parser_modal_state.coolant_mode);
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
-
-    /// 8 - Handle Speed/Feed Overrides [M48, M49] ///
-
-
-    /// 9 - Handle Dwell Command [G4] ///
-    if (m_block_data.non_modal_code == NON_MODAL_DWELL) // G4
-    {
-        // NOTE: Before executing dwell operations we must wait for the completion of previous 
-        // queued commands
-        
-        // Wait for idle condition before attempt to enter dwell mode
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        work_var = machine->Dwell(m_block_data.P_value);
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
-
-    /// 10 - Handle Plane Selection Commands [G17, G18, G19] ///
-	if (m_parser_modal_state.plane_select != m_block_data.block_modal_state.plane_select)
-	{
-		m_parser_modal_state.plane_select = m_block_data.block_modal_state.plane_select;
-
-		switch (m_parser_modal_state.plane_select)
-		{
-			case MODAL_PLANE_SELECT_XY: 
-			{ 
-				m_axis_zero = COORD_X; 
-				m_axis_one = COORD_Y;
-				m_axis_linear = COORD_Z;
-			}
-			break;
-
-			case MODAL_PLANE_SELECT_XZ:
-			{
-				m_axis_zero = COORD_X;
-				m_axis_one = COORD_Z;
-				m_axis_linear = COORD_Y;
-			}
-			break;
-
-			default:	// case MODAL_PLANE_SELECT_YZ:
-			{
-				m_axis_zero = COORD_Y;
-				m_axis_one = COORD_Z;
-				m_axis_linear = COORD_X;
-			}
-			break;
-		}
-	}
-
-    /// 11 - Handle Length Units Selection Commands [G20, G21] ///
-    /// Internally always use millimeters
-    m_parser_modal_state.units_mode = m_block_data.block_modal_state.units_mode;
-
-    /// 12 - Handle Cutter Radius Compensation Commands [G40, G41, G42] ///
-    m_parser_modal_state.cutter_comp_mode = m_block_data.block_modal_state.cutter_comp_mode;
-    /// TODO: Implement this function ///
-
-    /// 13 - Handle Tool Length Offset Commands [G43, G49] ///
-    m_parser_modal_state.tool_len_ofs_mode = m_block_data.block_modal_state.tool_len_ofs_mode;
+    }   // end 'for ( ... )'
 
-    /// 14 - Handle Coordinate System Selection Commands [G54, G55, ...] ///
-    handle_coordinate_system_select();
-    
-    /// 15 - Handle Control Mode Commands [G61, G61.1, G64] ///
-    
+    return GCODE_OK;
+}
 
-    /// 16 - Handle Distance Mode Commands [G90, G91] ///
-    m_parser_modal_state.distance_mode = m_block_data.block_modal_state.distance_mode;
 
-    /// 17 - Handle Retract Mode Commands [G98, G99]
-    m_parser_modal_state.canned_return_mode = m_block_data.block_modal_state.canned_return_mode;
-    
-    // Check if specified either G98/G99 to start a canned cycle
-    if ((modal_group_flags & MODAL_GROUP_G10_BIT) != 0)
-    {
-        // Wait for idle condition
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        // Update initial Z value [in Work Coord System]
-        m_cc_initial_z = m_gcode_machine_pos[COORD_Z] - m_work_coord_sys[COORD_Z] + m_g92_coord_offset[COORD_Z] - m_tool_offset[COORD_Z];
-        
-        // Reset sticky values
-        canned_cycle_reset_stycky();
-        
-        m_canned_cycle_active = true;
-    }
+int GCodeParser::skip_blanks()
+{
+    uint8_t ch_class;
 
-    /// 18 - Handle Non-Modal Commands [G10, G28, G30, G92] ///
-    if (m_block_data.non_modal_code != 0)
+    for ( ; ; m_line++)
     {
-        work_var = handle_non_modal_codes();
-
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
+        ch_class = CharClassTable[(uint8_t)*m_line];
 
-    /// 19 - Execute Motion Commands [G0, G1, G2, G3, G38, G81-G89] ///
-    if ((m_axis_command_type == AXIS_COMMAND_TYPE_MOTION) ||
-		(m_axis_command_type == AXIS_COMMAND_TYPE_CANNED_CYCLE))
-    {		
-        work_var = handle_motion_commands();
+        if (ch_class == CHAR_CLASS_BLANK)
+            continue;
+        else if (ch_class == CHAR_CLASS_COMMENT_CLOSE)
+            return GCODE_ERROR_UNOPENED_COMMENT;
+        else if (ch_class != CHAR_CLASS_COMMENT_OPEN)
+            return GCODE_OK;    // Start of a word, number or end of line
 
-        if (work_var != GCODE_OK)
-            return work_var;
-    }
-    
-    /// 19.1 - Handle G80 stop command for canned cycles
-    if ( (m_block_data.block_modal_state.motion_mode == MODAL_MOTION_MODE_CANCEL_MOTION) &&
-         (m_canned_cycle_active != false) )
-    {
-        m_canned_cycle_active = false;
-        
-        if (m_parser_modal_state.canned_return_mode == MODAL_CANNED_RETURN_TO_R_POSITION)
+        // Skip comment contents up to the closing parenthesis
+        for (m_line++; ; m_line++)
         {
-            // If retract mode is to R-plane -> Enqueue a last move to this position
-        
-            // TODO: Implement this
-        }
-    }
+            ch_class = CharClassTable[(uint8_t)*m_line];
 
-    /// 20 - Handle Stop Commands [M0, M1, M2, M30]
-    if (m_parser_modal_state.prog_flow != m_block_data.block_modal_state.prog_flow)
-    {
-        // Change in program flow. Update parser modal state
-        m_parser_modal_state.prog_flow = m_block_data.block_modal_state.prog_flow;
-        
-        // Before executing flow control operations we must wait for the completion of previous 
-        // queued commands
-        
-        // Wait for idle condition before attempt to change flow mode
-        work_var = machine->WaitForIdleCondition();
-        
-        if (work_var != GCODE_OK)
-            return work_var;
-        
-        if (m_parser_modal_state.prog_flow == MODAL_FLOW_TEMPORARY_STOP)    // M0 [Feed hold]
-        {
-            if (m_check_mode != false)
-            {
-                // Notify to other sub-systems of feed hold condition
-                machine->EnterFeedHold();
-            }                
-        }
-        else if ( (m_parser_modal_state.prog_flow == MODAL_FLOW_COMPLETED) ||       // M2
-                  (m_parser_modal_state.prog_flow == MODAL_FLOW_COMPLETED_PALLET))  // M30
-        {
-            // Program completed. Restore some defaults
-            m_parser_modal_state.motion_mode = MODAL_MOTION_MODE_LINEAR_FEED;   // G1
-            
-            m_parser_modal_state.plane_select = MODAL_PLANE_SELECT_XY;
-            m_axis_zero = COORD_X;
-            m_axis_one = COORD_Y;
-            m_axis_linear = COORD_Z;
-            
-            m_parser_modal_state.distance_mode = MODAL_DISTANCE_MODE_ABSOLUTE;
-            m_parser_modal_state.feedrate_mode = MODAL_FEEDRATE_MODE_UNITS_PER_MIN;
-            m_parser_modal_state.work_coord_sys_index = 0;
-            m_parser_modal_state.spindle_mode = MODAL_SPINDLE_OFF;
-            m_parser_modal_state.coolant_mode = MODAL_COOLANT_OFF;
-            
-            handle_coordinate_system_select();
-            
-            if (m_check_mode == false)
-            {
-                // Notify of spindle changes
-                work_var = machine->SendSpindleCommand(m_parser_modal_state.spindle_mode, m_spindle_speed);
-                
-                if (work_var != GCODE_OK)
-                    return work_var;
-                
-                // Notify of coolant changes
-                work_var = machine->SendCoolantCommand(m_parser_modal_state.coolant_mode);
-                
-                if (work_var != GCODE_OK)
-                    return work_var;
-            }
-            
-            machine->ClearHalt();
+            if (ch_class == CHAR_CLASS_COMMENT_CLOSE)
+                break;
+            else if (ch_class == CHAR_CLASS_COMMENT_OPEN)
+                return GCODE_ERROR_NESTED_COMMENT;
+            else if (ch_class == CHAR_CLASS_END)
+                return GCODE_ERROR_UNCLOSED_COMMENT;
         }
     }
-    
-    // Reset program flow mode to Default running
-    m_parser_modal_state.prog_flow = MODAL_FLOW_DEFAULT_RUNNING;
-    return GCODE_OK;
 }
 
+int GCodeParser::check_remaining_comments()
+{
+    const char* saved_pos = m_line;
+    int status;
+
+    // Walk up to the end of line without consuming it
+    while ((status = skip_blanks()) == GCODE_OK && *m_line != '\0')
+        m_line++;
+
+    m_line = saved_pos;
+    return status;
+}
 
-int GCodeParser::cleanup_and_lowercase_line(uint32_t & line_len)
+char GCodeParser::peek_number_char()
 {
-    char * rd_ptr = m_line;
-	char * wr_ptr = m_line;
-	bool inside_comment = false;
-	char ch;
+    const char* saved_pos = m_line;
+    uint8_t ch_class = CharClassTable[(uint8_t)*m_line];
 
-	while ((ch = *rd_ptr++) != '\0')
-	{
-		if (inside_comment != false)
-		{
-			if  (ch == ')')
-				inside_comment = false;
-			else if (ch == '(')
-				return GCODE_ERROR_NESTED_COMMENT;
+    // Most numbers are written without any gap
+    if (ch_class != CHAR_CLASS_BLANK && ch_class != CHAR_CLASS_COMMENT_OPEN)
+        return *m_line;
 
-			continue;
-		}
-		else if (isspace(ch) != 0)
-		    continue;
-		else if (ch >= 'A' && ch <= 'Z')
-		    ch += 0x20; // make lower case
-		else if (ch == '(')
-		{
-			inside_comment = true;
-			continue;
-		}
-		else if (ch == ')')
-			return GCODE_ERROR_UNOPENED_COMMENT;
+    // Whitespace and comments are allowed between the characters of a number.
+    // On malformed comments stop here, the error is reported by the caller
+    if (skip_blanks() != GCODE_OK)
+    {
+        m_line = saved_pos;
+        return '\0';
+    }
 
-		*wr_ptr++ = ch;
-	}
+    return *m_line;
+}
+
+float GCodeParser::read_float(uint32_t & success)
+{
+    DecimalNumber number;
+    bool negative = false;
+    char ch;
 
-	if (inside_comment != false)
-		return GCODE_ERROR_UNCLOSED_COMMENT;
+    success = 0;
+    DataConverter::ClearDecimal(number);
+    ch = peek_number_char();
 
-	*wr_ptr = '\0';
-    
-    line_len = (uint32_t)(wr_ptr - m_line);
-	return GCODE_OK;
+    // Check for sign
+    if (CharClassTable[(uint8_t)ch] == CHAR_CLASS_SIGN)
+    {
+        negative = (ch == '-');
+        m_line++;
+        ch = peek_number_char();
+    }
+
+    // Get integer part
+    while (CharClassTable[(uint8_t)ch] == CHAR_CLASS_DIGIT)
+    {
+        DataConverter::AccumulateDigit(number, (ch - '0'), false);
+        success = 1;
+
+        m_line++;
+        ch = peek_number_char();
+    }
+
+    // Get decimal part
+    if (CharClassTable[(uint8_t)ch] == CHAR_CLASS_DOT)
+    {
+        m_line++;
+        ch = peek_number_char();
+
+        while (CharClassTable[(uint8_t)ch] == CHAR_CLASS_DIGIT)
+        {
+            DataConverter::AccumulateDigit(number, (ch - '0'), true);
+            success = 1;
+
+            m_line++;
+            ch = peek_number_char();
+        }
+    }
+
+    return DataConverter::DecimalToFloat(number, negative);
+}
+
+int GCodeParser::read_integer(uint32_t & success)
+{
+    int result = 0;
+    bool negative = false;
+    char ch;
+
+    success = 0;
+    ch = peek_number_char();
+
+    // Check for sign
+    if (CharClassTable[(uint8_t)ch] == CHAR_CLASS_SIGN)
+    {
+        negative = (ch == '-');
+        m_line++;
+        ch = peek_number_char();
+    }
+
+    // Get integer part
+    while (CharClassTable[(uint8_t)ch] == CHAR_CLASS_DIGIT)
+    {
+        result = (result * 10) + (ch - '0');
+        success = 1;
+
+        m_line++;
+        ch = peek_number_char();
+    }
+
+    if (negative != false)
+        result *= -1;
+
+    return result;
 }
 
 void GCodeParser::reset_modal_params()
@@ -1330,7 +1617,10 @@ void GCodeParser::handle_coordinate_system_select()
         m_parser_modal_state.work_coord_sys_index = m_block_data.block_modal_state.work_coord_sys_index;
 
         Settings_Manager::ReadCoordinateValues(m_parser_modal_state.work_coord_sys_index, &m_work_coord_sys[0]);
-        Settings_Manager::SetActiveCoordinateSystemIndex(m_parser_modal_state.work_coord_sys_index);
+        
+        // A compiled toolpath holds machine coordinates, the machine keeps its own selection
+        if (m_toolpath_writer == NULL)
+            Settings_Manager::SetActiveCoordinateSystemIndex(m_parser_modal_state.work_coord_sys_index);
     }
 }
 
@@ -1350,6 +1640,10 @@ int GCodeParser::handle_non_modal_codes()
 
             P_int = (uint32_t)m_block_data.P_value;
 
+            // Stored coordinate systems belong to the machine that runs a toolpath
+            if (m_toolpath_writer != NULL)
+                return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+
 			if ((m_value_group_flags & VALUE_SET_ANY_AXES_BITS) == 0)
 			{
 				// Don't waste time. Coordinates X, Y, Z, A, B, C are missing.
@@ -1395,6 +1689,10 @@ int GCodeParser::handle_non_modal_codes()
             float values[TOTAL_AXES_COUNT];
             uint32_t index;
             
+            // Homing cycles depend on the actual machine, they can not be precompiled
+            if (m_toolpath_writer != NULL)
+                return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+            
             // Wait for idle condition before attempt to perform any homing command
             work_var = machine->WaitForIdleCondition();
             
@@ -1409,6 +1707,14 @@ int GCodeParser::handle_non_modal_codes()
                     values[index] = m_block_data.coordinate_data[index];
             }
             
+            // Scanning a restart the machine is homed already, only the reset that follows
+            // a homing cycle is kept
+            if (m_scan_mode != false)
+            {
+                ResetParser();
+                break;
+            }
+            
             work_var = machine->GoHome(&values[0], m_value_group_flags, isG28);
             
             if (work_var != GCODE_OK)
@@ -1424,6 +1730,9 @@ int GCodeParser::handle_non_modal_codes()
         {
             float values[TOTAL_AXES_COUNT];
 
+            if (m_toolpath_writer != NULL)
+                return GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+
             // Read original G28/G30 values
             Settings_Manager::ReadCoordinateValues((isG28 ? 28 : 30), &values[0]);
 
@@ -1485,8 +1794,9 @@ int GCodeParser::handle_non_modal_codes()
                     if (m_value_group_flags & VALUE_SET_C_BIT)
                         values[COORD_C] = m_gcode_machine_pos[COORD_C] - m_work_coord_sys[COORD_C] - m_block_data.coordinate_data[COORD_C];
 
-                    // and save to parameters
-                    Settings_Manager::WriteCoordinateValues(92, &values[0]);
+                    // and save to parameters (not while compiling, the offsets are in the records)
+                    if (m_toolpath_writer == NULL)
+                        Settings_Manager::WriteCoordinateValues(92, &values[0]);
                 }
                 break;  
 
@@ -1496,7 +1806,7 @@ int GCodeParser::handle_non_modal_codes()
                     memset((void*)&values[0], 0, sizeof(values));
 
                     // Only save if G92.1
-                    if (action == 1)
+                    if (action == 1 && m_toolpath_writer == NULL)
                         Settings_Manager::WriteCoordinateValues(92, &values[0]);
                 }
                 break;
@@ -1624,8 +1934,9 @@ int GCodeParser::handle_motion_commands()
             {
                 float h_x2_div_d;
                                 
-                // Check if endpoint equals to current point in Radius format arcs
-                if (memcmp((const void*)&target[0], (const void*)&m_gcode_machine_pos[0], sizeof(target)) == 0)
+                // Check if endpoint equals to current point in Radius format arcs (in the
+                // plane, a move of the linear axis alone has no arc to fit the radius to)
+                if (delta_axis_0 == 0.0f && delta_axis_1 == 0.0f)
                     return GCODE_ERROR_INVALID_TARGET_FOR_R_ARC;
                 
                 // Radius format arc. R value provided. Need to calculate I, J, K offsets
@@ -1692,173 +2003,14 @@ int GCodeParser::handle_motion_commands()
                 }
             }
 
-			// In this point we should have all the required information to perform an arc move [X,Y,Z,A,B,C, F, R | (I,J,K)]
-			// The following processing is based on Smoothieware
-            float center_axis0 = m_gcode_machine_pos[m_axis_zero] + offsets[m_axis_zero];
-            float center_axis1 = m_gcode_machine_pos[m_axis_one]  + offsets[m_axis_one];
-            float linear_travel = target[m_axis_linear] - m_gcode_machine_pos[m_axis_linear];
-
-            float r_axis0 = -offsets[m_axis_zero]; // Radius vector from center to start position
-            float r_axis1 = -offsets[m_axis_one];
-
-            float rt_axis0 = target[m_axis_zero] - m_gcode_machine_pos[m_axis_zero] - offsets[m_axis_zero]; // Radius vector from center to target position
-            float rt_axis1 = target[m_axis_one]  - m_gcode_machine_pos[m_axis_one]  - offsets[m_axis_one];
-            float angular_travel = 0.0f;
-            
-            //check for condition where atan2 formula will fail due to everything canceling out exactly
-            if ((m_gcode_machine_pos[m_axis_zero] == target[m_axis_zero]) && 
-                (m_gcode_machine_pos[m_axis_one]  == target[m_axis_one])) 
-            {
-                if (cw_arc == true)
-                    angular_travel = (-2 * M_PI);   // set angular_travel to -2pi for a CW full circle
-                else 
-                    angular_travel = (+2 * M_PI);   // set angular_travel to +2pi for a CCW full circle
-            }
-            else 
-            {
-                // Patch from GRBL Firmware - Christoph Baumann 04072015
-                // CCW angle between position and target from circle center. Only one atan2() trig computation required.
-                // Only run if not a full circle or angular travel will incorrectly result in 0.0f
-                angular_travel = atan2f(r_axis0 * rt_axis1 - r_axis1 * rt_axis0, 
-                                        r_axis0 * rt_axis0 + r_axis1 * rt_axis1);
-                
-                if (m_axis_linear == COORD_Y) 
-                    cw_arc = !cw_arc; //Math for XZ plane is reverse of other 2 planes
-                
-                if (cw_arc == true)
-                { 
-                    // adjust angular_travel to be in the range of -2pi to 0 for clockwise arcs
-                    if (angular_travel > 0.0f)
-                        angular_travel -= (2 * M_PI);
-                }
-                else 
-                {
-                    // adjust angular_travel to be in the range of 0 to 2pi for counterclockwise arcs
-                    if (angular_travel < 0.0f) 
-                        angular_travel += (2 * M_PI); 
-                }
-            }
-
-            // Find the distance for this gcode
-            float millimeters_of_travel = hypotf(angular_travel * radius, fabsf(linear_travel));
-
-            // We don't care about non-XYZ moves
-            if ( millimeters_of_travel < 0.000001f )
-                return GCODE_OK;
-
-            // limit segments by maximum arc error
-            float arc_segment = this->m_mm_per_arc_segment;
-            
-            if ((this->m_mm_max_arc_error > 0) && (2.0f * radius > this->m_mm_max_arc_error)) 
-            {
-                float min_err_segment = 2.0f * sqrtf((this->m_mm_max_arc_error * (2.0f * radius - this->m_mm_max_arc_error)));
-        
-                if (this->m_mm_per_arc_segment < min_err_segment) 
-                {
-                    arc_segment = min_err_segment;
-                }
-            }
-            
-            // catch fall through on above
-            if (arc_segment < 0.0001f) 
-                arc_segment = 0.5F; /// the old default, so we avoid the divide by zero
-
-            // Figure out how many segments for this gcode
-            uint16_t segments = floorf(millimeters_of_travel / arc_segment);
-
-            if (segments > 1) 
-            {
-                float theta_per_segment = angular_travel / segments;
-                float linear_per_segment = linear_travel / segments;
-
-                /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
-                and phi is the angle of rotation. Based on the solution approach by Jens Geisler.
-                r_T = [cos(phi) -sin(phi);
-                sin(phi) cos(phi] * r ;
-                For arc generation, the center of the circle is the axis of rotation and the radius vector is
-                defined from the circle center to the initial position. Each line segment is formed by successive
-                vector rotations. This requires only two cos() and sin() computations to form the rotation
-                matrix for the duration of the entire arc. Error may accumulate from numerical round-off, since
-                all float numbers are single precision on the Arduino. (True float precision will not have
-                round off issues for CNC applications.) Single precision error can accumulate to be greater than
-                tool precision in some cases. Therefore, arc path correction is implemented.
-
-                Small angle approximation may be used to reduce computation overhead further. This approximation
-                holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
-                theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
-                to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for
-                numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
-                issue for CNC machines with the single precision Arduino calculations.
-                This approximation also allows mc_arc to immediately insert a line segment into the planner
-                without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
-                a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead.
-                This is important when there are successive arc motions.
-                */
-                // Vector rotation matrix values
-                float cos_T = 1.0f - (0.5f * theta_per_segment * theta_per_segment); // Small angle approximation
-                float sin_T = theta_per_segment;
-
-                // TODO we need to handle the ABC axis here by segmenting them
-                float arc_target[TOTAL_AXES_COUNT];
-                float sin_Ti;   
-                float cos_Ti;
-                float r_axisi;
-                int8_t count = 0;
-
-                // init array for all axis
-                memcpy((void*)&arc_target[0], &m_gcode_machine_pos[0], sizeof(arc_target));
-
-                // Initialize the linear axis (redundant?)
-                arc_target[m_axis_linear] = m_gcode_machine_pos[m_axis_linear];
-
-                for (index = 1; index < segments; index++) 
-                {
-                    // Increment (segments-1)
-                    // Check for abort conditions
-                    if (machine->IsHalted() == true)
-                        break;
-                    
-                    if (count < m_arc_correction_counter) 
-                    {
-                        // Apply vector rotation matrix
-                        r_axisi = r_axis0 * sin_T + r_axis1 * cos_T; // temp = r_axis0 * sin(theta) + r_axis1 * cos(theta)
-                        r_axis0 = r_axis0 * cos_T - r_axis1 * sin_T; // r_axis0' = r_axis0 * cos(theta) - r_axis1 * sin(theta)
-                        r_axis1 = r_axisi;                           // r_axis1' = temp
-                        count++;
-                    }
-                    else 
-                    {
-                        // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
-                        // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
-                        cos_Ti = cosf(index * theta_per_segment);
-                        sin_Ti = sinf(index * theta_per_segment);
-                        
-                        r_axis0 = -offsets[m_axis_zero] * cos_Ti + offsets[m_axis_one] * sin_Ti;
-                        r_axis1 = -offsets[m_axis_zero] * sin_Ti - offsets[m_axis_one] * cos_Ti;
-                        count = 0;
-                    }
+            float move_rate = m_block_data.feed_rate / 60.0f;
+            bool inverse_time_rate = (m_parser_modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_INVERSE_TIME) ? true : false;
 
-                    // Update arc_target location
-                    arc_target[m_axis_zero] = center_axis0 + r_axis0;
-                    arc_target[m_axis_one] = center_axis1 + r_axis1;
-                    arc_target[m_axis_linear] += linear_per_segment;
+            // The arc updates the machine position
+            work_var = this->motion_append_arc(target, offsets, cw_arc, move_rate, inverse_time_rate);
 
-                    // Append this segment to the queue
-                    work_var = this->motion_append_line(arc_target);
-                    
-                    if (work_var != GCODE_OK)
-                        return work_var;
-                }
-            }
-            
-            // Ensure to add at least one move
-            work_var = this->motion_append_line(target);
-            
             if (work_var != GCODE_OK)
                 return work_var;
-            
-            // Update global machine position after performing move
-            memcpy(&m_gcode_machine_pos[0], &target[0], sizeof(m_gcode_machine_pos));
 		}
         break;
 
@@ -1952,9 +2104,29 @@ int GCodeParser::handle_motion_commands()
 
 // TODO: Check this code for redundancy
 int GCodeParser::motion_append_line(const float * target_pos)
+{
+    float move_rate = (m_parser_modal_state.motion_mode == MODAL_MOTION_MODE_SEEK) ? SOME_LARGE_VALUE : (m_block_data.feed_rate / 60.0f);
+    bool inverse_time_rate = (m_parser_modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_INVERSE_TIME) ? true : false;
+    
+    // Inverse time feed rate mode does not affect Seek Movements
+    if (m_parser_modal_state.motion_mode == MODAL_MOTION_MODE_SEEK)
+        inverse_time_rate = false;
+    
+    return motion_append_line(target_pos, move_rate, inverse_time_rate);
+}
+
+int GCodeParser::motion_append_line(const float * target_pos, float move_rate, bool inverse_time_rate)
 {
     uint32_t index;
     
+    // Nothing moves during a scan, the limits are checked when the lines really run
+    if (m_scan_mode != false)
+        return GCODE_OK;
+    
+    // Compiling a toolpath, nothing gets executed. The limits are checked when the records run
+    if (m_toolpath_writer != NULL)
+        return m_toolpath_writer->WriteLine(target_pos, move_rate, inverse_time_rate, m_spindle_speed);
+    
     // check soft limits only for homed axis that are enabled
     if (Settings_Manager::AreSoftLimitsEnabled() == true)
     {
@@ -1971,8 +2143,11 @@ int GCodeParser::motion_append_line(const float * target_pos)
                     if ((target_pos[index] < 0.0f) ||
                         (target_pos[index] > this->m_soft_limit_max_values[index]))
                     {
-                        // Report violation of limit values. Stop the execution of commands.
-                        machine->Halt();
+                        // Report violation of limit values. Stop the execution of commands
+                        // (a check only reports it, nothing is moving)
+                        if (m_check_mode == false)
+                            machine->Halt();
+                        
                         return GCODE_ERROR_TARGET_OUTSIDE_LIMIT_VALUES;
                     }
                 }
@@ -1980,10 +2155,6 @@ int GCodeParser::motion_append_line(const float * target_pos)
         }
     }
     
-    // If currently in check mode then stop processing here.
-    if (m_check_mode != false)
-        return GCODE_OK;
-    
     // Check if currently in feed hold condition
     while (machine->IsFeedHoldActive() == true)
     {
@@ -1994,20 +2165,287 @@ int GCodeParser::motion_append_line(const float * target_pos)
         vTaskDelay(pdMS_TO_TICKS(100)); // Yield control to other tasks while the queue is being flushed
     }
 
-    // Finally call the planner to append a new block.
+    // Finally hand the move over to the planner (its stage, when it runs in a task of its own)
     if (m_planner_ref != NULL)
+        return m_planner_ref->QueueLine(target_pos, m_spindle_speed, move_rate, inverse_time_rate);
+    
+    return GCODE_ERROR_MISSING_PLANNER;    
+}
+
+int GCodeParser::motion_append_arc(const float * target, const float * offsets, bool clockwise, float move_rate, bool inverse_time_rate)
+{
+    bool cw_arc = clockwise;
+    uint32_t index;
+    int32_t work_var;
+
+    // In this point we should have all the required information to perform an arc move [X,Y,Z,A,B,C, F, R | (I,J,K)]
+    // The following processing is based on Smoothieware
+    float center_axis0 = m_gcode_machine_pos[m_axis_zero] + offsets[m_axis_zero];
+    float center_axis1 = m_gcode_machine_pos[m_axis_one]  + offsets[m_axis_one];
+    float linear_travel = target[m_axis_linear] - m_gcode_machine_pos[m_axis_linear];
+    float radius = hypotf(offsets[m_axis_zero], offsets[m_axis_one]);
+
+    float r_axis0 = -offsets[m_axis_zero]; // Radius vector from center to start position
+    float r_axis1 = -offsets[m_axis_one];
+
+    float rt_axis0 = target[m_axis_zero] - m_gcode_machine_pos[m_axis_zero] - offsets[m_axis_zero]; // Radius vector from center to target position
+    float rt_axis1 = target[m_axis_one]  - m_gcode_machine_pos[m_axis_one]  - offsets[m_axis_one];
+    float angular_travel = 0.0f;
+    
+    //check for condition where atan2 formula will fail due to everything canceling out exactly
+    if ((m_gcode_machine_pos[m_axis_zero] == target[m_axis_zero]) && 
+        (m_gcode_machine_pos[m_axis_one]  == target[m_axis_one])) 
     {
-        float move_rate = (m_parser_modal_state.motion_mode == MODAL_MOTION_MODE_SEEK) ? SOME_LARGE_VALUE : (m_block_data.feed_rate / 60.0f);
-        bool inverse_time_rate = (m_parser_modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_INVERSE_TIME) ? true : false;
-        
-        // Inverse time feed rate mode does not affect Seek Movements
-        if (m_parser_modal_state.motion_mode == MODAL_MOTION_MODE_SEEK)
-            inverse_time_rate = false;
-        
-        return m_planner_ref->AppendLine(target_pos, m_spindle_speed, move_rate, inverse_time_rate);
+        if (cw_arc == true)
+            angular_travel = (-2 * M_PI);   // set angular_travel to -2pi for a CW full circle
+        else 
+            angular_travel = (+2 * M_PI);   // set angular_travel to +2pi for a CCW full circle
+    }
+    else 
+    {
+        // Patch from GRBL Firmware - Christoph Baumann 04072015
+        // CCW angle between position and target from circle center. Only one atan2() trig computation required.
+        // Only run if not a full circle or angular travel will incorrectly result in 0.0f
+        angular_travel = atan2f(r_axis0 * rt_axis1 - r_axis1 * rt_axis0, 
+                                r_axis0 * rt_axis0 + r_axis1 * rt_axis1);
+        
+        if (m_axis_linear == COORD_Y) 
+            cw_arc = !cw_arc; //Math for XZ plane is reverse of other 2 planes
+        
+        if (cw_arc == true)
+        { 
+            // adjust angular_travel to be in the range of -2pi to 0 for clockwise arcs
+            if (angular_travel > 0.0f)
+                angular_travel -= (2 * M_PI);
+        }
+        else 
+        {
+            // adjust angular_travel to be in the range of 0 to 2pi for counterclockwise arcs
+            if (angular_travel < 0.0f) 
+                angular_travel += (2 * M_PI); 
+        }
+    }
+
+    // Find the distance for this gcode
+    float millimeters_of_travel = hypotf(angular_travel * radius, fabsf(linear_travel));
+
+    // We don't care about non-XYZ moves
+    if ( millimeters_of_travel < 0.000001f )
+        return GCODE_OK;
+
+    // Compiling a toolpath, the arc is kept whole and cut into lines when its record runs
+    if (m_toolpath_writer != NULL && m_scan_mode == false)
+    {
+        float plane_offsets[2] = { offsets[m_axis_zero], offsets[m_axis_one] };
+        uint8_t plane = TOOLPATH_PLANE_XY;
+
+        if (m_parser_modal_state.plane_select == MODAL_PLANE_SELECT_XZ)
+            plane = TOOLPATH_PLANE_XZ;
+        else if (m_parser_modal_state.plane_select == MODAL_PLANE_SELECT_YZ)
+            plane = TOOLPATH_PLANE_YZ;
+
+        work_var = m_toolpath_writer->WriteArc(target, plane_offsets, clockwise, plane, move_rate, inverse_time_rate, m_spindle_speed);
+
+        if (work_var != GCODE_OK)
+            return work_var;
+
+        memcpy(&m_gcode_machine_pos[0], &target[0], sizeof(m_gcode_machine_pos));
+        return GCODE_OK;
+    }
+
+    // limit segments by maximum arc error
+    float arc_segment = this->m_mm_per_arc_segment;
+    
+    if ((this->m_mm_max_arc_error > 0) && (2.0f * radius > this->m_mm_max_arc_error)) 
+    {
+        float min_err_segment = 2.0f * sqrtf((this->m_mm_max_arc_error * (2.0f * radius - this->m_mm_max_arc_error)));
+
+        if (this->m_mm_per_arc_segment < min_err_segment) 
+        {
+            arc_segment = min_err_segment;
+        }
     }
     
-    return GCODE_ERROR_MISSING_PLANNER;    
+    // catch fall through on above
+    if (arc_segment < 0.0001f) 
+        arc_segment = 0.5F; /// the old default, so we avoid the divide by zero
+
+    // Figure out how many segments for this gcode
+    uint16_t segments = floorf(millimeters_of_travel / arc_segment);
+    
+    // A scan only needs the end point
+    if (m_scan_mode != false)
+        segments = 0;
+
+    if (segments > 1) 
+    {
+        float theta_per_segment = angular_travel / segments;
+        float linear_per_segment = linear_travel / segments;
+
+        /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
+        and phi is the angle of rotation. Based on the solution approach by Jens Geisler.
+        r_T = [cos(phi) -sin(phi);
+        sin(phi) cos(phi] * r ;
+        For arc generation, the center of the circle is the axis of rotation and the radius vector is
+        defined from the circle center to the initial position. Each line segment is formed by successive
+        vector rotations. This requires only two cos() and sin() computations to form the rotation
+        matrix for the duration of the entire arc. Error may accumulate from numerical round-off, since
+        all float numbers are single precision on the Arduino. (True float precision will not have
+        round off issues for CNC applications.) Single precision error can accumulate to be greater than
+        tool precision in some cases. Therefore, arc path correction is implemented.
+
+        Small angle approximation may be used to reduce computation overhead further. This approximation
+        holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
+        theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
+        to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for
+        numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
+        issue for CNC machines with the single precision Arduino calculations.
+        This approximation also allows mc_arc to immediately insert a line segment into the planner
+        without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
+        a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead.
+        This is important when there are successive arc motions.
+        */
+        // Vector rotation matrix values
+        float cos_T = 1.0f - (0.5f * theta_per_segment * theta_per_segment); // Small angle approximation
+        float sin_T = theta_per_segment;
+
+        // TODO we need to handle the ABC axis here by segmenting them
+        float arc_target[TOTAL_AXES_COUNT];
+        float sin_Ti;   
+        float cos_Ti;
+        float r_axisi;
+        int8_t count = 0;
+
+        // init array for all axis
+        memcpy((void*)&arc_target[0], &m_gcode_machine_pos[0], sizeof(arc_target));
+
+        // Initialize the linear axis (redundant?)
+        arc_target[m_axis_linear] = m_gcode_machine_pos[m_axis_linear];
+
+        for (index = 1; index < segments; index++) 
+        {
+            // Increment (segments-1)
+            // Check for abort conditions
+            if (m_toolpath_writer == NULL && machine->IsHalted() == true)
+                break;
+            
+            if (count < m_arc_correction_counter) 
+            {
+                // Apply vector rotation matrix
+                r_axisi = r_axis0 * sin_T + r_axis1 * cos_T; // temp = r_axis0 * sin(theta) + r_axis1 * cos(theta)
+                r_axis0 = r_axis0 * cos_T - r_axis1 * sin_T; // r_axis0' = r_axis0 * cos(theta) - r_axis1 * sin(theta)
+                r_axis1 = r_axisi;                           // r_axis1' = temp
+                count++;
+            }
+            else 
+            {
+                // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
+                // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
+                cos_Ti = cosf(index * theta_per_segment);
+                sin_Ti = sinf(index * theta_per_segment);
+                
+                r_axis0 = -offsets[m_axis_zero] * cos_Ti + offsets[m_axis_one] * sin_Ti;
+                r_axis1 = -offsets[m_axis_zero] * sin_Ti - offsets[m_axis_one] * cos_Ti;
+                count = 0;
+            }
+
+            // Update arc_target location
+            arc_target[m_axis_zero] = center_axis0 + r_axis0;
+            arc_target[m_axis_one] = center_axis1 + r_axis1;
+            arc_target[m_axis_linear] += linear_per_segment;
+
+            // Append this segment to the queue
+            work_var = this->motion_append_line(arc_target, move_rate, inverse_time_rate);
+            
+            if (work_var != GCODE_OK)
+                return work_var;
+        }
+    }
+
+    // Ensure to add at least one move
+    work_var = this->motion_append_line(target, move_rate, inverse_time_rate);
+    
+    if (work_var != GCODE_OK)
+        return work_var;
+    
+    // Update global machine position after performing move
+    memcpy(&m_gcode_machine_pos[0], &target[0], sizeof(m_gcode_machine_pos));
+    
+    return GCODE_OK;
+}
+
+void GCodeParser::select_plane(GCODE_MODAL_PLANE_SELECT_MODES plane)
+{
+    m_parser_modal_state.plane_select = plane;
+
+    switch (plane)
+    {
+        case MODAL_PLANE_SELECT_XY: 
+        { 
+            m_axis_zero = COORD_X; 
+            m_axis_one = COORD_Y;
+            m_axis_linear = COORD_Z;
+        }
+        break;
+
+        case MODAL_PLANE_SELECT_XZ:
+        {
+            m_axis_zero = COORD_X;
+            m_axis_one = COORD_Z;
+            m_axis_linear = COORD_Y;
+        }
+        break;
+
+        default:	// case MODAL_PLANE_SELECT_YZ:
+        {
+            m_axis_zero = COORD_Y;
+            m_axis_one = COORD_Z;
+            m_axis_linear = COORD_X;
+        }
+        break;
+    }
+}
+
+int GCodeParser::send_spindle_command(GCODE_MODAL_SPINDLE_MODES mode, float speed)
+{
+    if (m_scan_mode != false || m_check_mode != false)
+        return GCODE_OK;
+    
+    if (m_toolpath_writer != NULL)
+        return m_toolpath_writer->WriteSpindle((uint8_t)mode, speed);
+    
+    return machine->SendSpindleCommand(mode, speed);
+}
+
+int GCodeParser::send_coolant_command(GCODE_MODAL_COOLANT_MODES mode)
+{
+    if (m_scan_mode != false || m_check_mode != false)
+        return GCODE_OK;
+    
+    if (m_toolpath_writer != NULL)
+        return m_toolpath_writer->WriteCoolant((uint8_t)mode);
+    
+    return machine->SendCoolantCommand(mode);
+}
+
+int GCodeParser::send_dwell_command(float seconds)
+{
+    if (m_scan_mode != false)
+        return GCODE_OK;
+    
+    if (m_toolpath_writer != NULL)
+        return m_toolpath_writer->WriteDwell(seconds);
+    
+    return machine->Dwell(seconds);
+}
+
+// Compiling a toolpath never waits on (or touches) the live machine
+int GCodeParser::wait_for_idle()
+{
+    if (m_toolpath_writer != NULL)
+        return GCODE_OK;
+    
+    return machine->WaitForIdleCondition();
 }
 
 float GCodeParser::convert_to_mm(float value)
@@ -2271,6 +2709,54 @@ const char* GCodeParser::GetErrorText(uint32_t error_code)
         
     case GCODE_ERROR_HOMING_FINISH_RELEASE:
         return("Homing Error: Could not complete homing. Limit switch(es) still engaged");
+
+    case GCODE_ERROR_INVALID_TOOLPATH_DATA:
+        return("Invalid precompiled toolpath data");
+        
+    case GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH:
+        return("Command not supported in precompiled toolpaths");
+        
+    case GCODE_ERROR_TOOLPATH_RANGE:
+        return("Target outside the precompiled toolpath range");
+        
+    case GCODE_ERROR_LINE_TOO_LONG:
+        return("Line too long");
+        
+    case GCODE_ERROR_SOURCE_LOCKED:
+        return("Another source is running a job");
+        
+    case GCODE_ERROR_DISK_NOT_AVAILABLE:
+        return("SD card not available");
+        
+    case GCODE_ERROR_DISK_ACCESS:
+        return("SD card access failed");
+        
+    case GCODE_ERROR_INVALID_FILE_REQUEST:
+        return("Invalid file name or size");
+        
+    case GCODE_ERROR_UPLOAD_CRC:
+        return("File upload CRC mismatch");
+        
+    case GCODE_ERROR_UPLOAD_TIMEOUT:
+        return("File upload timed out");
+    
+    case GCODE_ERROR_SETTINGS_NOT_SAVED:
+        return("Settings not saved to flash");
+    
+    case GCODE_ERROR_NO_JOB_CHECKPOINT:
+        return("No job checkpoint to resume");
+    
+    case GCODE_ERROR_RESUME_NOT_HOMED:
+        return("Home the machine before resuming");
+    
+    case GCODE_ERROR_JOB_FILE_CHANGED:
+        return("Job file changed since the checkpoint");
+    
+    case GCODE_ERROR_RESTART_STATE:
+        return("State at the restart line can't be rebuilt");
+    
+    case GCODE_ERROR_RESTART_LINE:
+        return("Restart line past the end of the file");
     
     default:
         return("Unknown error code");
@@ -2281,3 +2767,55 @@ void GCodeParser::ReadParserModalState(GCodeModalData* block) const
 {
     memcpy(block, &this->m_parser_modal_state, sizeof(GCodeModalData));
 }
+
+void GCodeParser::SetCheckMode(bool enable)
+{
+    if (enable == m_check_mode)
+        return;
+    
+    if (enable != false)
+        memcpy(m_check_start_pos, m_gcode_machine_pos, sizeof(m_check_start_pos));
+    else
+        memcpy(m_gcode_machine_pos, m_check_start_pos, sizeof(m_gcode_machine_pos));
+    
+    m_check_mode = enable;
+}
+
+void GCodeParser::SetScanMode(bool enable)
+{
+    if (enable == m_scan_mode)
+        return;
+    
+    if (enable != false)
+        memcpy(m_scan_start_pos, m_gcode_machine_pos, sizeof(m_scan_start_pos));
+    else
+        memcpy(m_gcode_machine_pos, m_scan_start_pos, sizeof(m_gcode_machine_pos));
+    
+    m_scan_mode = enable;
+}
+
+bool GCodeParser::ReadJobState(GCodeJobState* state) const
+{
+    // A motion mode is only restored along with a move, G0/G1 through the approach move
+    if (m_parser_modal_state.motion_mode != MODAL_MOTION_MODE_SEEK &&
+        m_parser_modal_state.motion_mode != MODAL_MOTION_MODE_LINEAR_FEED &&
+        m_parser_modal_state.motion_mode != MODAL_MOTION_MODE_CANCEL_MOTION)
+        return false;
+    
+    if (m_canned_cycle_active != false ||
+        m_parser_modal_state.cutter_comp_mode != MODAL_CUTTER_RAD_COMP_OFF ||
+        m_parser_modal_state.tool_len_ofs_mode != MODAL_TOOL_LEN_OFS_CANCEL)
+        return false;
+    
+    memcpy(&state->modal_state, &m_parser_modal_state, sizeof(state->modal_state));
+    
+    state->feed_rate = m_feed_rate;
+    state->spindle_speed = m_spindle_speed;
+    state->tool_number = m_tool_number;
+    
+    memcpy(&state->work_coord_sys[0], &m_work_coord_sys[0], sizeof(state->work_coord_sys));
+    memcpy(&state->g92_coord_offset[0], &m_g92_coord_offset[0], sizeof(state->g92_coord_offset));
+    memcpy(&state->machine_pos[0], &m_gcode_machine_pos[0], sizeof(state->machine_pos));
+    
+    return true;
+}
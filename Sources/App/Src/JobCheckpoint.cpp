@@ -0,0 +1,516 @@
+#include "JobCheckpoint.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "spi_ports.h"
+#include "settings_task.h"
+#include "MachineCore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define CHECKPOINT_IDLE         0
+#define CHECKPOINT_PARSING      1       // Snapshot taken, the line is being parsed
+#define CHECKPOINT_QUEUED       2       // Its first block waits in the planner queue
+#define CHECKPOINT_REACHED      3       // The block started, to be written
+
+#define CHECKPOINT_CRC_WORDS    (offsetof(JOB_CHECKPOINT, Crc) / 4)
+
+JOB_CHECKPOINT      JobCheckpoint::m_latest;
+uint32_t            JobCheckpoint::m_latest_index = JOB_CHECKPOINT_NONE;
+volatile bool       JobCheckpoint::m_loaded = false;
+
+JOB_CHECKPOINT      JobCheckpoint::m_candidate;
+JOB_CHECKPOINT      JobCheckpoint::m_record;
+volatile uint8_t    JobCheckpoint::m_stage = CHECKPOINT_IDLE;
+volatile uint8_t    JobCheckpoint::m_tag = 0;
+volatile bool       JobCheckpoint::m_active = false;
+volatile bool       JobCheckpoint::m_clear_request = false;
+char                JobCheckpoint::m_clear_name[JOB_CHECKPOINT_MAX_NAME + 4];
+uint32_t            JobCheckpoint::m_clear_size = 0;
+TickType_t          JobCheckpoint::m_last_tick = 0;
+
+// Read back of a programmed record
+static uint32_t     verify_buffer[JOB_CHECKPOINT_RECORD_SIZE / 4];
+
+///////////////////////////////////////////////////////////////////////////////
+
+void JobCheckpoint::Initialize()
+{
+    static JOB_CHECKPOINT record;
+    uint32_t index;
+
+    // The newest good record, a torn one fails its CRC
+    for (index = 0; index < JOB_CHECKPOINT_RECORDS; index++)
+    {
+        if (read_record(index, &record) == false)
+            continue;
+
+        if (m_latest_index == JOB_CHECKPOINT_NONE || (int32_t)(record.Sequence - m_latest.Sequence) > 0)
+        {
+            memcpy(&m_latest, &record, sizeof(m_latest));
+            m_latest_index = index;
+        }
+    }
+
+    m_loaded = true;
+}
+
+void JobCheckpoint::BeginJob(const char* name, uint32_t size)
+{
+    uint32_t length = strlen(name);
+
+    taskENTER_CRITICAL();
+
+    // A checkpoint of the previous job not written yet doesn't matter anymore
+    m_stage = CHECKPOINT_IDLE;
+    m_last_tick = xTaskGetTickCount();
+
+    // Nothing to resume from without the name
+    m_active = (length <= JOB_CHECKPOINT_MAX_NAME);
+
+    if (m_active != false)
+    {
+        memset(&m_candidate, 0, sizeof(m_candidate));
+        memcpy(m_candidate.FileName, name, length + 1);
+        m_candidate.FileSize = size;
+    }
+
+    taskEXIT_CRITICAL();
+}
+
+void JobCheckpoint::EndJob(bool completed)
+{
+    // Only the checkpoint of this job is cleared. Without a name it has none, and the newest
+    // record may be the one of an older job (a toolpath job never writes one)
+    completed = (completed != false && m_active != false);
+
+    taskENTER_CRITICAL();
+
+    m_active = false;
+
+    // A reached checkpoint is still written (before the clear record)
+    if (m_stage != CHECKPOINT_REACHED)
+        m_stage = CHECKPOINT_IDLE;
+
+    if (completed != false)
+    {
+        memcpy(m_clear_name, m_candidate.FileName, sizeof(m_clear_name));
+        m_clear_size = m_candidate.FileSize;
+        m_clear_request = true;
+    }
+
+    taskEXIT_CRITICAL();
+
+    if (completed != false)
+        xTaskNotifyGive(settings_task_handle);
+}
+
+void JobCheckpoint::BeginLine(MachineCore* core, uint32_t offset, uint32_t number)
+{
+    if (m_active == false || m_stage != CHECKPOINT_IDLE || number == 0)
+        return;
+
+    if ((xTaskGetTickCount() - m_last_tick) < JOB_CHECKPOINT_INTERVAL)
+        return;
+
+    if (core->ReadJobState(&m_candidate.State) == false)
+        return;
+
+    m_candidate.LineOffset = offset;
+    m_candidate.LineNumber = number;
+
+    // A new tag for every candidate, blocks of a dropped one may still be in the queue
+    m_tag = (m_tag == 255) ? 1 : (m_tag + 1);
+
+    m_stage = CHECKPOINT_PARSING;
+    core->MarkNextBlock(m_tag);
+}
+
+void JobCheckpoint::EndLine(MachineCore* core)
+{
+    bool no_motion;
+
+    if (m_stage != CHECKPOINT_PARSING)
+        return;
+
+    // No motion from this line, the next one is tried
+    no_motion = core->IsBlockMarkPending();
+
+    if (no_motion != false)
+        core->MarkNextBlock(0);
+
+    taskENTER_CRITICAL();
+
+    // The block may have started already
+    if (m_stage == CHECKPOINT_PARSING)
+        m_stage = (no_motion != false) ? CHECKPOINT_IDLE : CHECKPOINT_QUEUED;
+
+    taskEXIT_CRITICAL();
+}
+
+void JobCheckpoint::OnBlockStarted(uint8_t tag)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+
+    if (tag != m_tag || (m_stage != CHECKPOINT_PARSING && m_stage != CHECKPOINT_QUEUED))
+        return;
+
+    m_stage = CHECKPOINT_REACHED;
+    vTaskNotifyGiveFromISR(settings_task_handle, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+void JobCheckpoint::Service()
+{
+    bool pending = false;
+    bool clear;
+
+    if (m_loaded == false)
+        return;
+
+    taskENTER_CRITICAL();
+
+    if (m_stage == CHECKPOINT_REACHED)
+    {
+        memcpy(&m_record, &m_candidate, sizeof(m_record));
+
+        m_stage = CHECKPOINT_IDLE;
+        m_last_tick = xTaskGetTickCount();
+        pending = true;
+    }
+
+    taskEXIT_CRITICAL();
+
+    if (pending != false)
+    {
+        m_record.Completed = 0;
+        write_record();
+    }
+
+    if (m_clear_request != false)
+    {
+        taskENTER_CRITICAL();
+
+        m_clear_request = false;
+        clear = (m_latest_index != JOB_CHECKPOINT_NONE && m_latest.Completed == 0 &&
+                 m_latest.FileSize == m_clear_size && strcmp(m_latest.FileName, m_clear_name) == 0);
+
+        taskEXIT_CRITICAL();
+
+        // Nothing to clear, or the checkpoint of another job
+        if (clear == false)
+            return;
+
+        memcpy(&m_record, &m_latest, sizeof(m_record));
+        m_record.Completed = 1;
+        write_record();
+    }
+}
+
+bool JobCheckpoint::GetLatest(JOB_CHECKPOINT* checkpoint)
+{
+    bool result;
+
+    taskENTER_CRITICAL();
+
+    result = (m_loaded != false && m_latest_index != JOB_CHECKPOINT_NONE && m_latest.Completed == 0);
+
+    if (result != false)
+        memcpy(checkpoint, &m_latest, sizeof(m_latest));
+
+    taskEXIT_CRITICAL();
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// m_record goes to the slot after the newest one. A slot that isn't blank (torn record) or
+// fails to program moves the ring to the next sector.
+//
+// The flash has a single writer, the settings task: the records are written from Service and
+// Settings_Manager::Save runs in the same task, the settings are loaded before the scheduler
+// starts. No other task reaches SPI1, so the W25QXX calls go without a mutex
+bool JobCheckpoint::write_record(void)
+{
+    uint32_t index;
+    uint32_t address;
+    uint32_t attempt;
+
+    index = (m_latest_index == JOB_CHECKPOINT_NONE) ? 0 : ((m_latest_index + 1) % JOB_CHECKPOINT_RECORDS);
+
+    m_record.Magic = JOB_CHECKPOINT_MAGIC;
+    m_record.Sequence = (m_latest_index == JOB_CHECKPOINT_NONE) ? 1 : (m_latest.Sequence + 1);
+    m_record.Crc = Settings_Manager::CalculateCRC((const uint32_t*)&m_record, CHECKPOINT_CRC_WORDS);
+
+    for (attempt = 0; attempt < JOB_CHECKPOINT_SECTORS; attempt++)
+    {
+        address = JOB_CHECKPOINT_START_ADDRESS + index * JOB_CHECKPOINT_RECORD_SIZE;
+
+        if ((address % JOB_CHECKPOINT_SECTOR_SIZE) == 0)
+            W25QXX_Erase_Sector(address / JOB_CHECKPOINT_SECTOR_SIZE);
+
+        if (is_erased(address, sizeof(m_record)) != false)
+        {
+            W25QXX_Write_Page((uint8_t*)&m_record, address, sizeof(m_record));
+            if (W25QXX_Read((uint8_t*)verify_buffer, address, sizeof(m_record)) == HAL_OK &&
+                memcmp(verify_buffer, &m_record, sizeof(m_record)) == 0)
+            {
+                taskENTER_CRITICAL();
+                memcpy(&m_latest, &m_record, sizeof(m_latest));
+                m_latest_index = index;
+                taskEXIT_CRITICAL();
+
+                return true;
+            }
+        }
+
+        // Start of the next sector
+        index = ((index / (JOB_CHECKPOINT_SECTOR_SIZE / JOB_CHECKPOINT_RECORD_SIZE)) + 1) * (JOB_CHECKPOINT_SECTOR_SIZE / JOB_CHECKPOINT_RECORD_SIZE);
+        index %= JOB_CHECKPOINT_RECORDS;
+    }
+
+    return false;
+}
+
+bool JobCheckpoint::read_record(uint32_t index, JOB_CHECKPOINT* record)
+{
+    if (W25QXX_Read((uint8_t*)record, JOB_CHECKPOINT_START_ADDRESS + index * JOB_CHECKPOINT_RECORD_SIZE, sizeof(JOB_CHECKPOINT)) != HAL_OK)
+        return false;
+
+    if (record->Magic != JOB_CHECKPOINT_MAGIC)
+        return false;
+
+    return (Settings_Manager::CalculateCRC((const uint32_t*)record, CHECKPOINT_CRC_WORDS) == record->Crc);
+}
+
+bool JobCheckpoint::is_erased(uint32_t address, uint32_t length)
+{
+    uint32_t index;
+
+    if (W25QXX_Read((uint8_t*)verify_buffer, address, (uint16_t)length) != HAL_OK)
+        return false;
+
+    for (index = 0; index < (length / 4); index++)
+    {
+        if (verify_buffer[index] != 0xFFFFFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t append_text(char* text, const char* value)
+{
+    uint32_t length = strlen(value);
+
+    memcpy(text, value, length);
+    return length;
+}
+
+static uint32_t append_integer(char* text, uint32_t value)
+{
+    char digits[10];
+    uint32_t count = 0;
+    uint32_t length = 0;
+
+    do
+    {
+        digits[count++] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+    while (value != 0);
+
+    while (count != 0)
+        text[length++] = digits[--count];
+
+    return length;
+}
+
+// " X-12.3456", 4 decimals (0.1 um, well below a step)
+static uint32_t append_word(char* text, char letter, float value)
+{
+    uint32_t length = 0;
+    uint32_t whole;
+    uint32_t fraction;
+    uint32_t digit;
+
+    text[length++] = ' ';
+    text[length++] = letter;
+
+    if (value < 0.0f)
+    {
+        text[length++] = '-';
+        value = -value;
+    }
+
+    whole = (uint32_t)value;
+    fraction = (uint32_t)lroundf((value - (float)whole) * 10000.0f);
+
+    if (fraction >= 10000)
+    {
+        whole++;
+        fraction -= 10000;
+    }
+
+    length += append_integer(&text[length], whole);
+    text[length++] = '.';
+
+    for (digit = 1000; digit != 0; digit /= 10)
+        text[length++] = (char)('0' + ((fraction / digit) % 10));
+
+    return length;
+}
+
+static uint32_t append_axes(char* text, const float* values, uint32_t skip_axis)
+{
+    static const char letters[TOTAL_AXES_COUNT] = { 'X', 'Y', 'Z', 'A', 'B', 'C' };
+    uint32_t length = 0;
+    uint32_t axis;
+
+    for (axis = COORD_X; axis < TOTAL_AXES_COUNT; axis++)
+    {
+        if (axis != skip_axis)
+            length += append_word(&text[length], letters[axis], values[axis]);
+    }
+
+    return length;
+}
+
+uint32_t JobCheckpoint::BuildResumeLine(const GCodeJobState& state, uint32_t index, char* text)
+{
+    static const char* const wcs_codes[TOTAL_WCS_COUNT] =
+    {
+        "G54", "G55", "G56", "G57", "G58", "G59", "G59.1", "G59.2", "G59.3"
+    };
+
+    float values[TOTAL_AXES_COUNT];
+    uint32_t length = 0;
+    uint32_t axis;
+    bool feed_plunge = (state.feed_rate != 0.0f);
+
+    switch (index)
+    {
+        case 0:     // Known modes for the lines below (G80 ends a canned cycle started by G98/G99)
+        {
+            length += append_text(&text[length], "G21 G90 G94 G17");
+            length += append_text(&text[length], (state.modal_state.canned_return_mode == MODAL_CANNED_RETURN_TO_PREV_POSITION) ? " G98 G80" : " G99 G80");
+
+            if (feed_plunge != false)
+                length += append_word(&text[length], 'F', state.feed_rate);
+        }
+        break;
+
+        case 1:     // Offsets of the work coordinate system
+        {
+            if (state.modal_state.work_coord_sys_index >= TOTAL_WCS_COUNT)
+                return 0;
+
+            length += append_text(&text[length], "G10 L2 P");
+            length += append_integer(&text[length], state.modal_state.work_coord_sys_index + 1);
+            length += append_axes(&text[length], state.work_coord_sys, TOTAL_AXES_COUNT);
+        }
+        break;
+
+        case 2:
+        {
+            if (state.modal_state.work_coord_sys_index >= TOTAL_WCS_COUNT)
+                return 0;
+
+            length += append_text(&text[length], wcs_codes[state.modal_state.work_coord_sys_index]);
+        }
+        break;
+
+        case 3:     // Travel at the current height
+        {
+            length += append_text(&text[length], "G53 G0");
+            length += append_axes(&text[length], state.machine_pos, COORD_Z);
+        }
+        break;
+
+        case 4:
+        {
+            length += append_text(&text[length], "T");
+            length += append_integer(&text[length], state.tool_number);
+            length += append_word(&text[length], 'S', state.spindle_speed);
+
+            if (state.modal_state.spindle_mode == MODAL_SPINDLE_CW)
+                length += append_text(&text[length], " M3");
+            else if (state.modal_state.spindle_mode == MODAL_SPINDLE_CCW)
+                length += append_text(&text[length], " M4");
+            else
+                length += append_text(&text[length], " M5");
+
+            if (state.modal_state.coolant_mode == MODAL_COOLANT_MIST)
+                length += append_text(&text[length], " M7");
+            else if (state.modal_state.coolant_mode == MODAL_COOLANT_FLOOD)
+                length += append_text(&text[length], " M8");
+            else
+                length += append_text(&text[length], " M9");
+        }
+        break;
+
+        case 5:     // Down to the checkpoint height at the job feed rate
+        {
+            length += append_text(&text[length], (feed_plunge != false) ? "G53 G1" : "G53 G0");
+            length += append_word(&text[length], 'Z', state.machine_pos[COORD_Z]);
+        }
+        break;
+
+        case 6:     // G92 offsets, as the parser computes them from the position
+        {
+            for (axis = COORD_X; axis < TOTAL_AXES_COUNT; axis++)
+            {
+                if (state.g92_coord_offset[axis] != 0.0f)
+                    break;
+            }
+
+            if (axis == TOTAL_AXES_COUNT)
+                return append_text(text, "G92.1");
+
+            for (axis = COORD_X; axis < TOTAL_AXES_COUNT; axis++)
+                values[axis] = state.machine_pos[axis] - state.work_coord_sys[axis] - state.g92_coord_offset[axis];
+
+            length += append_text(&text[length], "G92");
+            length += append_axes(&text[length], values, TOTAL_AXES_COUNT);
+        }
+        break;
+
+        case 7:     // Motion mode, G1 is left by the approach move
+        {
+            if (state.modal_state.motion_mode == MODAL_MOTION_MODE_SEEK)
+            {
+                // Zero length move
+                length += append_text(&text[length], "G53 G0");
+                length += append_word(&text[length], 'Z', state.machine_pos[COORD_Z]);
+            }
+            else if (state.modal_state.motion_mode == MODAL_MOTION_MODE_CANCEL_MOTION)
+            {
+                length += append_text(&text[length], "G80");
+            }
+        }
+        break;
+
+        case 8:
+        {
+            length += append_text(&text[length], (state.modal_state.units_mode == MODAL_UNITS_MODE_INCHES) ? "G20" : "G21");
+            length += append_text(&text[length], (state.modal_state.distance_mode == MODAL_DISTANCE_MODE_INCREMENTAL) ? " G91" : " G90");
+
+            if (state.modal_state.plane_select == MODAL_PLANE_SELECT_XZ)
+                length += append_text(&text[length], " G18");
+            else if (state.modal_state.plane_select == MODAL_PLANE_SELECT_YZ)
+                length += append_text(&text[length], " G19");
+            else
+                length += append_text(&text[length], " G17");
+
+            length += append_text(&text[length], (state.modal_state.feedrate_mode == MODAL_FEEDRATE_MODE_INVERSE_TIME) ? " G93" : " G94");
+        }
+        break;
+    }
+
+    return length;
+}
@@ -0,0 +1,98 @@
+#include "JobIndex.h"
+
+#include <string.h>
+
+#include "MachineCore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+JOB_INDEX_ENTRY     JobIndex::m_entries[JOB_INDEX_ENTRIES];
+volatile uint32_t   JobIndex::m_count = 0;
+uint32_t            JobIndex::m_interval = JOB_INDEX_FIRST_INTERVAL;
+uint32_t            JobIndex::m_next_line = JOB_INDEX_FIRST_INTERVAL;
+
+char                JobIndex::m_name[JOB_INDEX_MAX_NAME + 1];
+uint32_t            JobIndex::m_size = 0;
+volatile bool       JobIndex::m_valid = false;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void JobIndex::BeginJob(const char* name, uint32_t size)
+{
+    uint32_t length = strlen(name);
+
+    if (m_valid != false && size == m_size && strcmp(name, m_name) == 0)
+        return;
+
+    m_valid = false;
+    m_count = 0;
+    m_interval = JOB_INDEX_FIRST_INTERVAL;
+    m_next_line = JOB_INDEX_FIRST_INTERVAL;
+
+    // Long names are not indexed, they just scan from the start
+    if (length > JOB_INDEX_MAX_NAME)
+        return;
+
+    memcpy(m_name, name, length + 1);
+    m_size = size;
+    m_valid = true;
+}
+
+void JobIndex::OnLine(MachineCore* core, uint32_t offset, uint32_t number)
+{
+    JOB_INDEX_ENTRY* entry;
+    uint32_t index;
+
+    if (m_valid == false || number < m_next_line)
+        return;
+
+    if (m_count == JOB_INDEX_ENTRIES)
+    {
+        // Full, every other entry goes
+        for (index = 1; index < (JOB_INDEX_ENTRIES / 2); index++)
+            memcpy(&m_entries[index], &m_entries[index * 2], sizeof(JOB_INDEX_ENTRY));
+
+        m_count = JOB_INDEX_ENTRIES / 2;
+        m_interval *= 2;
+        m_next_line = m_entries[m_count - 1].LineNumber + m_interval;
+
+        if (number < m_next_line)
+            return;
+    }
+
+    entry = &m_entries[m_count];
+
+    if (core->ReadJobState(&entry->State) == false)
+        return;
+
+    entry->LineOffset = offset;
+    entry->LineNumber = number;
+
+    m_count++;
+    m_next_line = number + m_interval;
+}
+
+bool JobIndex::Find(const char* name, uint32_t size, uint32_t line, JOB_INDEX_ENTRY* entry)
+{
+    uint32_t index;
+
+    if (m_valid == false || size != m_size || strcmp(name, m_name) != 0)
+        return false;
+
+    // The entries go up in line numbers
+    for (index = m_count; index != 0; index--)
+    {
+        if (m_entries[index - 1].LineNumber <= line)
+        {
+            memcpy(entry, &m_entries[index - 1], sizeof(JOB_INDEX_ENTRY));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void JobIndex::Invalidate()
+{
+    m_valid = false;
+}
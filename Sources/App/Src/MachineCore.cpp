@@ -78,7 +78,11 @@ MachineCore::MachineCore(void)
                                          
     m_fault_event_conditions = 0;
                                          
-    xTaskCreate(safety_task_entry, NULL, SAFETY_TASK_STACK_SIZE, (void*)this, SAFETY_TASK_PRIORITY, &m_safety_task_handle);
+    if (pdPASS != xTaskCreate(safety_task_entry, NULL, SAFETY_TASK_STACK_SIZE, (void*)this, SAFETY_TASK_PRIORITY, &m_safety_task_handle))
+    {
+        /* Notify failure and take action */
+        configASSERT(0);
+    }
 }
 
 
@@ -143,6 +147,7 @@ void MachineCore::Halt()                    // [Called from GCode parsing task]
     m_step_ticker->EnableStepperDrivers(false);
     m_step_ticker->DisableAllMotors();
     
+    m_planner->FlushQueuedLines();
     m_conveyor->flush_queue();
 }
 
@@ -191,6 +196,55 @@ BaseType_t MachineCore::NotifyOfEvent(uint32_t it_evt_src)
     return should_yield;
 }
 
+// Called from task context [USB task]
+void MachineCore::RequestReset()
+{
+    xTaskNotify(this->m_safety_task_handle, SOFT_RESET_EVENT, eSetBits);
+}
+
+// Called from the parsing task only, it owns the planner input
+int MachineCore::ParseGCodeLine(GCODE_SOURCE_OPTIONS source, const char* line)
+{
+    // $C toggles the check mode here, in line with the G-code of its source
+    if (line[0] == '$' && (line[1] == 'C' || line[1] == 'c') && line[2] == '\0')
+        return SetCheckMode(m_gcode_parser->IsCheckModeActive() == false);
+    
+    // Blocks planned from this line are tagged with its source
+    m_gcode_source = source;
+    m_planner->SetSource((uint8_t)source);
+
+    return m_gcode_parser->ParseLine(line);
+}
+
+int MachineCore::ExecuteToolpathRecord(GCODE_SOURCE_OPTIONS source, const TOOLPATH_RECORD& record)
+{
+    // Blocks planned from this record are tagged with its source
+    m_gcode_source = source;
+    m_planner->SetSource((uint8_t)source);
+
+    return m_gcode_parser->ExecuteToolpathRecord(record);
+}
+
+// Check mode: the parser and the planner take the lines as usual, the conveyor retires the blocks
+// without stepping and adds up their planned time (Block::calculate_trapezoid, with the same
+// junction speeds as a real run). Spindle, coolant, feed hold and homing are left out. When it
+// ends the positions go back to where the machine is, the modal state stays as the program left it
+int MachineCore::SetCheckMode(bool enable)
+{
+    if (enable == m_gcode_parser->IsCheckModeActive())
+        return GCODE_OK;
+    
+    // Entering, the moves queued so far run for real. Leaving, the rest of the check is retired
+    m_planner->WaitForQueuedLines();
+    m_conveyor->wait_for_idle();
+    
+    m_planner->SetCheckMode(enable);
+    m_gcode_parser->SetCheckMode(enable);
+    m_conveyor->set_check_mode(enable);
+    
+    return GCODE_OK;
+}
+
 int MachineCore::GoHome(float* target, uint32_t spec_value_mask, bool isG28) 
 {
     int status = GCODE_OK;
@@ -198,6 +252,18 @@ int MachineCore::GoHome(float* target, uint32_t spec_value_mask, bool isG28)
     uint16_t limit_read_value;
     bool idle_condition;
     
+    // A check takes the cycle as done, only the move to the target is planned
+    if (m_gcode_parser->IsCheckModeActive())
+    {
+        m_planner->ResetPosition();
+        m_gcode_parser->ResetParser();
+        
+        if ((spec_value_mask & VALUE_SET_ANY_AXES_BITS) != 0)
+            status = m_planner->AppendLine(target, 0.0f, SOME_LARGE_VALUE);
+        
+        return status;
+    }
+    
     // Notify we're homing now
     this->m_axes_homing_now = true;
         
@@ -463,9 +529,12 @@ int MachineCore::Dwell(float p_time_secs)
 { 
     int ms = (int)(p_time_secs * 1000);
     
-    // During check mode this method does nothing
+    // During check mode the time only goes into the estimate
     if (m_gcode_parser->IsCheckModeActive())
+    {
+        m_conveyor->add_check_time(p_time_secs);
         return 0;
+    }
     
     // Notify the system is dwelling
     m_dwell_active = true;
@@ -488,6 +557,7 @@ int MachineCore::Dwell(float p_time_secs)
     
 int MachineCore::WaitForIdleCondition() 
 { 
+    m_planner->WaitForQueuedLines();
     m_conveyor->wait_for_idle(); 
     return 0; 
 }
@@ -505,8 +575,8 @@ void MachineCore::GetGlobalStatusReport(GLOBAL_STATUS_REPORT_DATA & outData)
     
     outData.CurrentPositions = this->m_current_stepper_pos;
     
-    // TODO: Fix this
-    outData.TargetPositions = NULL;
+    // Last position programmed (machine coordinates), ahead of the current one while moving
+    outData.TargetPositions = this->m_gcode_parser->ReadTargetCoords();
     
     outData.ProbingPositions = this->m_probe_position;
     outData.HomingState = this->m_homing_state;
@@ -515,12 +585,13 @@ void MachineCore::GetGlobalStatusReport(GLOBAL_STATUS_REPORT_DATA & outData)
     this->m_gcode_parser->ReadParserModalState(&outData.ModalState);
     
     outData.CurrentFeedRate = this->m_conveyor->get_current_feedrate();
+    outData.CurrentLineNumber = this->m_conveyor->get_current_line_number();
     outData.CurrentSpindleRPM = this->m_spindle->GetCurrentRPM();
     outData.CurrentSpindleTool = this->m_spindle->GetCurrentToolNumber();
     
     outData.FileParsingPercent = 0;
     outData.CurrentFileName = NULL;
-    outData.GCodeSource = GCODE_SOURCE_SERIAL_CONSOLE;    
+    outData.GCodeSource = (GCODE_SOURCE_OPTIONS)this->m_conveyor->get_current_source();
 }
 
 void MachineCore::disable_limit_interrupts()
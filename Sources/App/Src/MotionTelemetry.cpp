@@ -0,0 +1,102 @@
+#include "MotionTelemetry.h"
+
+#include <stm32f4xx_hal.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+TELEMETRY_SAMPLE    MotionTelemetry::m_ring[TELEMETRY_RING_SIZE];
+
+volatile uint32_t   MotionTelemetry::m_head = 0;
+volatile uint32_t   MotionTelemetry::m_tail = 0;
+volatile bool       MotionTelemetry::m_enabled = false;
+
+uint32_t            MotionTelemetry::m_divisor = 1;
+uint32_t            MotionTelemetry::m_countdown = 1;
+uint16_t            MotionTelemetry::m_seq = 0;
+uint32_t            MotionTelemetry::m_overflows = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void MotionTelemetry::Start(uint32_t rate_hz, float step_frequency)
+{
+    uint32_t divisor;
+
+    if (rate_hz == 0)
+    {
+        Stop();
+        return;
+    }
+
+    if (rate_hz > TELEMETRY_MAX_RATE_HZ)
+        rate_hz = TELEMETRY_MAX_RATE_HZ;
+
+    divisor = (uint32_t)(step_frequency / rate_hz);
+
+    if (divisor == 0)
+        divisor = 1;
+
+    // The ISR does not run the sampling code until m_enabled is set
+    m_enabled = false;
+    __DMB();
+
+    m_divisor = divisor;
+    m_countdown = divisor;
+    m_overflows = 0;
+    m_tail = m_head;
+
+    __DMB();
+    m_enabled = true;
+}
+
+void MotionTelemetry::Stop()
+{
+    m_enabled = false;
+}
+
+void MotionTelemetry::Write(uint16_t block, uint8_t phase, uint8_t primary_axis, uint32_t rate, const int32_t* steps)
+{
+    uint32_t head = m_head;
+    TELEMETRY_SAMPLE* sample;
+
+    // Full. Drop the sample, the seq gap tells the host
+    if ((head - m_tail) >= TELEMETRY_RING_SIZE)
+    {
+        m_seq++;
+        m_overflows++;
+        return;
+    }
+
+    sample = &m_ring[head & (TELEMETRY_RING_SIZE - 1)];
+
+    sample->seq = m_seq++;
+    sample->block = block;
+    sample->phase = phase;
+    sample->primary_axis = primary_axis;
+    sample->reserved = 0;
+    sample->rate = rate;
+    memcpy((void*)sample->steps, (const void*)steps, sizeof(sample->steps));
+
+    // Sample data must be in memory before the consumer can see it
+    __DMB();
+    m_head = head + 1;
+}
+
+uint32_t MotionTelemetry::Read(TELEMETRY_SAMPLE* samples, uint32_t max_count)
+{
+    uint32_t tail = m_tail;
+    uint32_t count = m_head - tail;
+    uint32_t index;
+
+    if (count > max_count)
+        count = max_count;
+
+    for (index = 0; index < count; index++)
+        memcpy((void*)&samples[index], (const void*)&m_ring[(tail + index) & (TELEMETRY_RING_SIZE - 1)], sizeof(TELEMETRY_SAMPLE));
+
+    // Done with the slots before handing them back to the ISR
+    __DMB();
+    m_tail = tail + count;
+
+    return count;
+}
@@ -6,6 +6,9 @@
 
 #include <algorithm>
 
+#include "FreeRTOS.h"
+#include "task.h"
+
 #include "settings_manager.h"
 #include "Conveyor.h"
 
@@ -16,8 +19,24 @@ Planner::Planner(void)
     m_junction_deviation = Settings_Manager::GetJunctionDeviation_mm();
     
     memset((void*)&this->m_position_steps[0], 0, sizeof(this->m_position_steps));
+    memset((void*)&this->m_saved_position_steps[0], 0, sizeof(this->m_saved_position_steps));
+    memset((void*)&this->m_check_min_mm[0], 0, sizeof(this->m_check_min_mm));
+    memset((void*)&this->m_check_max_mm[0], 0, sizeof(this->m_check_max_mm));
+    m_check_peak_speed = 0.0f;
+    m_check_mode = false;
+    m_check_moved = false;
     
     m_conveyor = NULL;
+    m_line_number = 0;
+    m_source = 0;
+    m_checkpoint_tag = 0;
+    m_carried_tag = 0;
+    m_carried_generation = 0;
+    
+    m_input = NULL;
+    m_input_context = NULL;
+    m_queued_lines = 0;
+    m_generation = 0;
 }
 
 
@@ -25,10 +44,94 @@ Planner::~Planner(void)
 {
 }
 
+void Planner::make_line(PLANNER_LINE & line, const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate)
+{
+    memcpy(line.target_mm, target_mm, sizeof(line.target_mm));
+    line.spindle_speed = spindle_speed;
+    line.rate_mm_s = rate_mm_s;
+    line.inverse_time = inverseTimeRate;
+    line.source = m_source;
+    line.checkpoint_tag = m_checkpoint_tag;
+    line.line_number = m_line_number;
+    line.generation = m_generation;
+}
+
 int Planner::AppendLine(const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate)
+{
+    PLANNER_LINE line;
+    
+    make_line(line, target_mm, spindle_speed, rate_mm_s, inverseTimeRate);
+    
+    if (plan_line(line) != false)
+        m_checkpoint_tag = 0;
+    
+    return PLANNER_OK;
+}
+
+int Planner::QueueLine(const float* target_mm, float spindle_speed, float rate_mm_s, bool inverseTimeRate)
+{
+    PLANNER_LINE line;
+    
+    if (m_input == NULL)
+        return AppendLine(target_mm, spindle_speed, rate_mm_s, inverseTimeRate);
+    
+    make_line(line, target_mm, spindle_speed, rate_mm_s, inverseTimeRate);
+    m_checkpoint_tag = 0;
+    
+    taskENTER_CRITICAL();
+    m_queued_lines++;
+    taskEXIT_CRITICAL();
+    
+    // Back-pressure of the planner is felt here once the stage has no room
+    m_input(line, m_input_context);
+    
+    return PLANNER_OK;
+}
+
+void Planner::PlanLine(const PLANNER_LINE & line)
+{
+    PLANNER_LINE tagged;
+    
+    // A tag carried from before a flush belongs to a candidate that is gone
+    if (line.generation != m_carried_generation)
+    {
+        m_carried_tag = 0;
+        m_carried_generation = line.generation;
+    }
+    
+    // Lines queued before a flush are dropped
+    if (line.generation == m_generation)
+    {
+        memcpy(&tagged, &line, sizeof(tagged));
+        
+        if (tagged.checkpoint_tag == 0)
+            tagged.checkpoint_tag = m_carried_tag;
+        
+        m_carried_tag = (plan_line(tagged) != false) ? 0 : tagged.checkpoint_tag;
+    }
+    
+    taskENTER_CRITICAL();
+    m_queued_lines--;
+    taskEXIT_CRITICAL();
+}
+
+void Planner::WaitForQueuedLines()
+{
+    while (m_queued_lines != 0)
+        vTaskDelay(1);
+}
+
+void Planner::FlushQueuedLines()
+{
+    m_generation++;
+}
+
+bool Planner::plan_line(const PLANNER_LINE & line)
 {
     uint32_t index;
     int32_t target_steps[TOTAL_AXES_COUNT];
+    const float* target_mm = line.target_mm;
+    float rate_mm_s = line.rate_mm_s;
     
     float unit_vec[TOTAL_AXES_COUNT];
     float distance = 0.0f;
@@ -65,7 +168,7 @@ int Planner::AppendLine(const float* target_mm, float spindle_speed, float rate_
     
     // Check if any move 
     if (distance == 0.0f)
-        return PLANNER_OK;  // Nothing to do
+        return false;       // Nothing to do
     
     // Calculate square root of the sum of squares obtained previously
     distance = sqrtf(distance);
@@ -79,12 +182,16 @@ int Planner::AppendLine(const float* target_mm, float spindle_speed, float rate_
     rate_mm_s = limit_value_by_axis_maximum(rate_mm_s, Settings_Manager::GetMaxSpeed_mm_sec_all_axes(), unit_vec);
     
     // In case of inverse time feed rate mode convert to regular feed rate
-    if (inverseTimeRate == true)
+    if (line.inverse_time == true)
         rate_mm_s *= distance;
     
     // Limit acceleration value to maximum allowed
     block->acceleration = limit_value_by_axis_maximum(SOME_LARGE_VALUE, Settings_Manager::GetAcceleration_mm_sec2_all_axes(), unit_vec);
     
+    block->line_number = line.line_number;
+    block->source = line.source;
+    block->checkpoint = line.checkpoint_tag;
+    
     // Determine nominal speeds/rates
     if (distance > 0.0f)
     {
@@ -97,6 +204,9 @@ int Planner::AppendLine(const float* target_mm, float spindle_speed, float rate_
         block->nominal_rate = 0.0f;
     }        
     
+    if (m_check_mode != false)
+        update_check_stats(target_steps, block->nominal_speed);
+    
     // Calculate junction deviation speeds
     if (m_conveyor->is_queue_empty() == false)
     {
@@ -166,7 +276,61 @@ int Planner::AppendLine(const float* target_mm, float spindle_speed, float rate_
 
     m_conveyor->queue_head_block();
     
-    return PLANNER_OK;
+    return true;
+}
+
+void Planner::SetCheckMode(bool enable)
+{
+    if (enable != false)
+    {
+        memcpy(m_saved_position_steps, m_position_steps, sizeof(m_saved_position_steps));
+        
+        m_check_peak_speed = 0.0f;
+        m_check_moved = false;
+    }
+    else
+    {
+        memcpy(m_position_steps, m_saved_position_steps, sizeof(m_position_steps));
+    }
+    
+    m_check_mode = enable;
+}
+
+bool Planner::GetCheckExtents(float* min_mm, float* max_mm) const
+{
+    if (m_check_moved == false)
+        return false;
+    
+    memcpy(min_mm, m_check_min_mm, sizeof(m_check_min_mm));
+    memcpy(max_mm, m_check_max_mm, sizeof(m_check_max_mm));
+    
+    return true;
+}
+
+// Both ends of the move, in steps so the extents are where the motors would really go
+void Planner::update_check_stats(const int32_t* target_steps, float speed)
+{
+    uint32_t index;
+    float steps_per_mm, start_mm, end_mm;
+    
+    for (index = COORD_X; index < TOTAL_AXES_COUNT; index++)
+    {
+        steps_per_mm = Settings_Manager::GetStepsPer_mm_Axis(index);
+        start_mm = m_position_steps[index] / steps_per_mm;
+        end_mm = target_steps[index] / steps_per_mm;
+        
+        if (m_check_moved == false)
+        {
+            m_check_min_mm[index] = start_mm;
+            m_check_max_mm[index] = start_mm;
+        }
+        
+        m_check_min_mm[index] = std::min(m_check_min_mm[index], std::min(start_mm, end_mm));
+        m_check_max_mm[index] = std::max(m_check_max_mm[index], std::max(start_mm, end_mm));
+    }
+    
+    m_check_moved = true;
+    m_check_peak_speed = std::max(m_check_peak_speed, speed);
 }
 
 float Planner::limit_value_by_axis_maximum(float limit_value, const float * max_values, const float * unit_vector)
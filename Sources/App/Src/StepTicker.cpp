@@ -9,6 +9,7 @@
 
 #include "user_tasks.h"
 #include "MachineCore.h"
+#include "MotionTelemetry.h"
 
 
 StepTicker *StepTicker::instance;
@@ -33,6 +34,8 @@ StepTicker::StepTicker()
     this->running = false;
     this->current_block = NULL;    
     this->current_tick = 0;
+    this->block_counter = 0;
+    this->primary_axis = 0;
     
     this->motor_enable_bits = 0;
     this->inversion_mask_bits_steps = ((uint8_t)(Settings_Manager::GetSignalInversionMasks() & SIGNAL_INVERT_STEP_PINS_MASK));  
@@ -323,6 +326,22 @@ void StepTicker::step_tick (void)
         __HAL_TIM_ENABLE(&unstep_timer_handle);
     }
 
+    if (MotionTelemetry::IsEnabled() && MotionTelemetry::Tick())
+    {
+        uint8_t phase;
+        
+        if (current_tick < current_block->accelerate_until)
+            phase = TELEMETRY_PHASE_ACCEL;
+        else if (current_tick < current_block->decelerate_after)
+            phase = TELEMETRY_PHASE_CRUISE;
+        else
+            phase = TELEMETRY_PHASE_DECEL;
+        
+        MotionTelemetry::Write(this->block_counter, phase, this->primary_axis, 
+                               (uint32_t)(current_block->tick_info[this->primary_axis].steps_per_tick >> 32), 
+                               this->m_stepper_positions);
+    }
+
     // do this after so we start at tick 0
     current_tick++; // count number of ticks
 
@@ -372,6 +391,10 @@ bool StepTicker::start_next_block()
 
         ok = true; // mark at least one motor is moving
         
+        // The axis with the most steps gives the block's step rate
+        if (current_block->tick_info[motor_idx].steps_to_move == current_block->steps_event_count)
+            this->primary_axis = motor_idx;
+        
         // Only set direction bits for backward movements 
         if ((current_block->direction_bits & (1 << motor_idx)) != 0)
             direction_bits_value |= (1 << (5 - (motor_idx * 2)));
@@ -387,6 +410,8 @@ bool StepTicker::start_next_block()
 
     if (ok == true) 
     {   
+        this->block_counter++;
+        
         STEP_PINS_GPIO_PORT->BSRR = bits_to_update_bsrr;
         return true;
     }
@@ -0,0 +1,227 @@
+#include <stm32f4xx_hal.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "task_settings.h"
+#include "debug_log_task.h"
+#include "uart_ports.h"
+#include "dma.h"
+
+#include "lvgl.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+TaskHandle_t debug_log_task_handle;
+
+typedef struct DEBUG_LOG_RECORD
+{
+    const char* volatile    format;         // NULL until the record is complete
+    uint32_t                timestamp;      // DWT cycle counter
+    uint32_t                args[4];
+
+}DEBUG_LOG_RECORD;
+
+static DEBUG_LOG_RECORD     log_ring[DEBUG_LOG_RING_SIZE];
+
+static volatile uint32_t    log_head = 0;       // Next record to reserve (any producer)
+static volatile uint32_t    log_tail = 0;       // Next record to send (log task only)
+static volatile uint32_t    log_dropped = 0;
+
+static char                 tx_buffers[2][DEBUG_LOG_TX_BUFFER_SIZE];
+static volatile bool        tx_busy = false;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void DebugLogTask_Initialize(void)
+{
+    // Timestamps come from the cycle counter
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void DebugLog(const char* format, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    DEBUG_LOG_RECORD* record;
+    uint32_t head;
+
+    // Reserve a record. Exclusive access makes this safe against any task or ISR preempting
+    // between the load and the store (the store fails and the loop runs again)
+    do
+    {
+        head = __LDREXW(&log_head);
+
+        if ((head - log_tail) >= DEBUG_LOG_RING_SIZE)
+        {
+            __CLREX();
+
+            do
+            {
+                head = __LDREXW(&log_dropped);
+            }
+            while (__STREXW(head + 1, &log_dropped) != 0);
+
+            return;
+        }
+    }
+    while (__STREXW(head + 1, &log_head) != 0);
+
+    record = &log_ring[head & (DEBUG_LOG_RING_SIZE - 1)];
+
+    record->timestamp = DWT->CYCCNT;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    record->args[3] = arg3;
+
+    // Arguments must be in memory before the record is seen as complete
+    __DMB();
+    record->format = format;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t     log_cycles = 0;         // Cycle counter extended to 64 bits
+static uint32_t     log_last_timestamp = 0;
+
+static uint32_t format_record(char* text, const DEBUG_LOG_RECORD* record)
+{
+    uint32_t microseconds;
+    uint32_t length;
+    int result;
+
+    // Records are sent in reservation order, a preempting producer may have a slightly older
+    // timestamp. The signed difference handles both that and the counter wrap
+    log_cycles += (int64_t)(int32_t)(record->timestamp - log_last_timestamp);
+    log_last_timestamp = record->timestamp;
+
+    microseconds = (uint32_t)(log_cycles / (SystemCoreClock / 1000000));
+
+    result = lv_snprintf(text, DEBUG_LOG_MAX_LINE, "[%u.%06u] ", microseconds / 1000000, microseconds % 1000000);
+    length = (result > 0) ? (uint32_t)result : 0;
+
+    result = lv_snprintf(&text[length], DEBUG_LOG_MAX_LINE - 2 - length, record->format,
+                         record->args[0], record->args[1], record->args[2], record->args[3]);
+
+    if (result > 0)
+        length += std::min((uint32_t)result, DEBUG_LOG_MAX_LINE - 3 - length);
+
+    text[length++] = '\r';
+    text[length++] = '\n';
+
+    return length;
+}
+
+// Formats the complete records that fit in the buffer
+static uint32_t format_pending(char* buffer)
+{
+    DEBUG_LOG_RECORD* record;
+    uint32_t length = 0;
+    uint32_t dropped;
+    int result;
+
+    while ((DEBUG_LOG_TX_BUFFER_SIZE - length) >= DEBUG_LOG_MAX_LINE)
+    {
+        if (log_dropped != 0)
+        {
+            do
+            {
+                dropped = __LDREXW(&log_dropped);
+            }
+            while (__STREXW(0, &log_dropped) != 0);
+
+            result = lv_snprintf(&buffer[length], DEBUG_LOG_MAX_LINE, "[log] %u records dropped\r\n", dropped);
+            length += (result > 0) ? (uint32_t)result : 0;
+            continue;
+        }
+
+        if (log_tail == log_head)
+            break;
+
+        record = &log_ring[log_tail & (DEBUG_LOG_RING_SIZE - 1)];
+
+        // Reserved but still being written
+        if (record->format == NULL)
+            break;
+
+        length += format_record(&buffer[length], record);
+
+        record->format = NULL;
+
+        // Release the record to the producers
+        __DMB();
+        log_tail++;
+    }
+
+    return length;
+}
+
+void DebugLogTask_Entry(void * pvParam)
+{
+    uint32_t active = 0;
+    uint32_t length;
+    uint32_t start;
+
+    // Cost of a log call on this build, including the cycle counter reads
+    start = DWT->CYCCNT;
+    DebugLog("Debug log started");
+    start = DWT->CYCCNT - start;
+
+    DebugLog("Log call: %u cycles", start);
+
+    for ( ; ; )
+    {
+        length = format_pending(tx_buffers[active]);
+
+        if (length == 0)
+        {
+            // Producers never signal the task (they may run above the kernel interrupt priority)
+            ulTaskNotifyTake(pdTRUE, DEBUG_LOG_POLL_TIME);
+            continue;
+        }
+
+        // The other buffer may still be on its way out
+        while (tx_busy != false)
+            ulTaskNotifyTake(pdTRUE, DEBUG_LOG_POLL_TIME);
+
+        tx_busy = true;
+
+        if (HAL_UART_Transmit_DMA(&debug_uart_handle, (uint8_t*)tx_buffers[active], (uint16_t)length) != HAL_OK)
+            tx_busy = false;
+
+        active ^= 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+
+    if (huart->Instance != USART1)
+        return;
+
+    tx_busy = false;
+
+    if (debug_log_task_handle != NULL)
+    {
+        vTaskNotifyGiveFromISR(debug_log_task_handle, &higher_priority_task_woken);
+        portYIELD_FROM_ISR(higher_priority_task_woken);
+    }
+}
+
+extern "C" void DMA2_Stream7_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_usart1_tx);
+}
+
+extern "C" void USART1_IRQHandler(void)
+{
+    // Transfer complete (the DMA only signals the last byte written to DR)
+    HAL_UART_IRQHandler(&debug_uart_handle);
+}
@@ -1,26 +1,917 @@
 #include <stm32f4xx_hal.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "FreeRTOS.h"
 #include "task.h"
+#include "semphr.h"
+#include "queue.h"
 
-
+#include "ff_headers.h"
+#include "ff_sddisk.h"
 
 #include "task_settings.h"
 #include "disk_task.h"
+#include "debug_log_task.h"
 #include "settings_manager.h"
+#include "gcode_parsing_task.h"
+#include "GCodeParser.h"
+#include "BinaryToolpath.h"
+#include "JobCheckpoint.h"
+#include "JobIndex.h"
+#include "user_tasks.h"
 
 TaskHandle_t disk_task_handle;
 
+static SemaphoreHandle_t    volume_mutex;
+static QueueHandle_t        write_queue;
+static FF_Disk_t*           sd_disk = NULL;
+
+static DISK_VOLUME_OWNER    volume_owner = DISK_OWNER_NONE;
+static uint32_t             firmware_users = 0;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool DiskTask_Initialize(void)
+{
+    volume_mutex = xSemaphoreCreateMutex();
+    write_queue = xQueueCreate(DISK_WRITE_QUEUE_LENGTH, sizeof(DISK_WRITE_REQUEST*));
+
+    return (volume_mutex != NULL && write_queue != NULL);
+}
+
+bool DiskTask_AcquireVolume(DISK_VOLUME_OWNER owner)
+{
+    bool result = false;
+
+    xSemaphoreTake(volume_mutex, portMAX_DELAY);
+
+    if (sd_disk != NULL)
+    {
+        if (owner == DISK_OWNER_FIRMWARE)
+        {
+            if (volume_owner != DISK_OWNER_USB_HOST && sd_disk->xStatus.bIsMounted != pdFALSE)
+            {
+                volume_owner = DISK_OWNER_FIRMWARE;
+                firmware_users++;
+                result = true;
+            }
+        }
+        else if (owner == DISK_OWNER_USB_HOST)
+        {
+            if (volume_owner == DISK_OWNER_NONE)
+            {
+                // Nothing cached may be written after the host takes over
+                FF_SDDiskFlush(sd_disk);
+
+                if (FF_SDDiskUnmount(sd_disk) == pdPASS)
+                {
+                    // Any file may change
+                    JobIndex::Invalidate();
+                    volume_owner = DISK_OWNER_USB_HOST;
+                    result = true;
+
+                    DebugLog("SD volume handed to the USB host");
+                }
+            }
+        }
+    }
+
+    xSemaphoreGive(volume_mutex);
+    return result;
+}
+
+void DiskTask_ReleaseVolume(DISK_VOLUME_OWNER owner)
+{
+    xSemaphoreTake(volume_mutex, portMAX_DELAY);
+
+    if (owner == DISK_OWNER_FIRMWARE && volume_owner == DISK_OWNER_FIRMWARE)
+    {
+        if (--firmware_users == 0)
+            volume_owner = DISK_OWNER_NONE;
+    }
+    else if (owner == DISK_OWNER_USB_HOST && volume_owner == DISK_OWNER_USB_HOST)
+    {
+        volume_owner = DISK_OWNER_NONE;
+
+        // The host may have changed anything, read the file system again
+        if (FF_isERR(FF_SDDiskMount(sd_disk)) != pdFALSE)
+            DebugLog("SD volume remount failed");
+        else
+            DebugLog("SD volume back to the firmware");
+    }
+
+    xSemaphoreGive(volume_mutex);
+}
+
+DISK_VOLUME_OWNER DiskTask_GetOwner(void)
+{
+    return volume_owner;
+}
+
+bool DiskTask_IsMounted(void)
+{
+    return (sd_disk != NULL && sd_disk->xStatus.bIsMounted != pdFALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool DiskTask_QueueWrite(DISK_WRITE_REQUEST* request)
+{
+    request->Done = false;
+    request->Failed = false;
+
+    if (xQueueSend(write_queue, &request, 0) != pdTRUE)
+        return false;
+
+    xTaskNotifyGive(disk_task_handle);
+    return true;
+}
+
+static void process_write_requests(void)
+{
+    DISK_WRITE_REQUEST* request;
+    size_t written;
+
+    while (xQueueReceive(write_queue, &request, 0) == pdTRUE)
+    {
+        written = ff_fwrite(request->Data, 1, request->Length, request->File);
+
+        request->Failed = (written != request->Length);
+        request->Done = true;
+
+        if (request->NotifyTask != NULL)
+            xTaskNotifyGive(request->NotifyTask);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static FF_FILE* volatile    job_file = NULL;        // Handed to the disk task by DiskTask_StartJob
+static volatile bool        job_stop_request = false;
+static DISK_JOB_STATS       job_stats;
+static TickType_t           job_start_tick;
+
+// Words, so the card can read straight into them by DMA
+static uint32_t             job_buffers[2][DISK_JOB_BUFFER_SIZE / 4];
+static uint32_t             job_valid[2];           // Bytes read into each buffer, 0 = empty
+static uint32_t             job_offsets[2];         // File offset of each buffer
+static uint32_t             job_read_offset;        // Of the next read
+static bool                 job_eof;
+static bool                 job_read_error;
+
+static GCODE_JOB_LINE       job_line;
+
+// Files that start with a toolpath header (BinaryToolpath.h) go to the parser as decoded records
+static BinaryToolpath       job_toolpath;
+
+// Where the job starts (resume, restart). The resume lines rebuild the state of the first line
+// before it goes to the parser, only scanned when the restart line is further on
+static uint32_t             job_first_line;
+static GCodeJobState        job_resume_state;
+static bool                 job_resume_lines;
+static bool                 job_resume_scan;
+static uint32_t             job_restart_line;       // 0 = none, the lines before it are scanned
+static JOB_INDEX_ENTRY      job_index_entry;
+
+// A job checked ($C, nothing moves) leaves the checkpoint of the last real job alone
+static bool                 job_checked;
+
+static volatile bool        bench_request = false;
+
+// Opens the file and hands it to the disk task: from the start, from the checkpoint (resume)
+// or from a line (restart, from the closest index entry)
+static int32_t start_job(const char* name, const JOB_CHECKPOINT* resume, uint32_t restart_line)
+{
+    FF_FILE* file;
+    uint32_t size = 0;
+    uint32_t offset = 0;
+    int32_t result = GCODE_OK;
+
+    if (job_file != NULL || bench_request != false)
+        return GCODE_ERROR_SOURCE_LOCKED;
+
+    if (DiskTask_AcquireVolume(DISK_OWNER_FIRMWARE) == false)
+        return GCODE_ERROR_DISK_NOT_AVAILABLE;
+
+    if (GCodeParsingTask_BeginJob(GCODE_SOURCE_SD_STORAGE) == false)
+    {
+        DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+        return GCODE_ERROR_SOURCE_LOCKED;
+    }
+
+    file = ff_fopen(name, "r");
+
+    job_first_line = 1;
+    job_resume_lines = false;
+    job_resume_scan = false;
+    job_restart_line = 0;
+
+    if (file == NULL)
+    {
+        result = GCODE_ERROR_INVALID_FILE_REQUEST;
+    }
+    else
+    {
+        size = ff_filelength(file);
+
+        if (resume != NULL)
+        {
+            // The offset is only good for the same file
+            if (size != resume->FileSize)
+                result = GCODE_ERROR_JOB_FILE_CHANGED;
+
+            offset = resume->LineOffset;
+            job_first_line = resume->LineNumber;
+            memcpy(&job_resume_state, &resume->State, sizeof(job_resume_state));
+            job_resume_lines = true;
+        }
+        else if (restart_line > 1)
+        {
+            job_restart_line = restart_line;
+
+            if (JobIndex::Find(name, size, restart_line, &job_index_entry) != false)
+            {
+                offset = job_index_entry.LineOffset;
+                job_first_line = job_index_entry.LineNumber;
+                memcpy(&job_resume_state, &job_index_entry.State, sizeof(job_resume_state));
+                job_resume_lines = true;
+                job_resume_scan = true;
+            }
+        }
+
+        if (result == GCODE_OK && offset != 0 && ff_fseek(file, (long)offset, FF_SEEK_SET) != 0)
+            result = GCODE_ERROR_DISK_ACCESS;
+    }
+
+    if (result != GCODE_OK)
+    {
+        if (file != NULL)
+            ff_fclose(file);
+
+        GCodeParsingTask_EndJob(GCODE_SOURCE_SD_STORAGE);
+        DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+        return result;
+    }
+
+    job_read_offset = offset;
+
+    // Check mode can't change while the job owns the parser
+    job_checked = machine->IsCheckModeActive();
+
+    if (job_checked == false)
+        JobCheckpoint::BeginJob(name, size);
+
+    JobIndex::BeginJob(name, size);
+
+    taskENTER_CRITICAL();
+    memset((void*)&job_stats, 0, sizeof(job_stats));
+    job_stats.State = DISK_JOB_RUNNING;
+    job_stats.MinMargin = 2 * DISK_JOB_BUFFER_SIZE;
+    job_start_tick = xTaskGetTickCount();
+    taskEXIT_CRITICAL();
+
+    job_stop_request = false;
+    job_file = file;
+
+    xTaskNotifyGive(disk_task_handle);
+    return GCODE_OK;
+}
+
+// The resume lines travel in machine coordinates
+static bool is_machine_homed(void)
+{
+    uint32_t axis;
+
+    for (axis = COORD_X; axis <= COORD_Z; axis++)
+    {
+        if (machine->IsHomingNow() != false || machine->IsAxisHomed(axis) == false)
+            return false;
+    }
+
+    return true;
+}
+
+int32_t DiskTask_StartJob(const char* name)
+{
+    return start_job(name, NULL, 0);
+}
+
+int32_t DiskTask_ResumeJob(void)
+{
+    JOB_CHECKPOINT checkpoint;
+
+    if (JobCheckpoint::GetLatest(&checkpoint) == false)
+        return GCODE_ERROR_NO_JOB_CHECKPOINT;
+
+    if (is_machine_homed() == false)
+        return GCODE_ERROR_RESUME_NOT_HOMED;
+
+    return start_job(checkpoint.FileName, &checkpoint, 0);
+}
+
+int32_t DiskTask_RestartJob(const char* name, uint32_t line)
+{
+    if (line == 0)
+        return GCODE_ERROR_RESTART_LINE;
+
+    if (is_machine_homed() == false)
+        return GCODE_ERROR_RESUME_NOT_HOMED;
+
+    return start_job(name, NULL, line);
+}
+
+void DiskTask_StopJob(void)
+{
+    if (job_file != NULL)
+    {
+        job_stop_request = true;
+        xTaskNotifyGive(disk_task_handle);
+    }
+}
+
+void DiskTask_GetJobStats(DISK_JOB_STATS* stats)
+{
+    taskENTER_CRITICAL();
+    memcpy((void*)stats, (const void*)&job_stats, sizeof(job_stats));
+
+    if (stats->State == DISK_JOB_RUNNING)
+        stats->Milliseconds = (xTaskGetTickCount() - job_start_tick) * portTICK_PERIOD_MS;
+
+    taskEXIT_CRITICAL();
+
+    if (stats->Milliseconds != 0)
+        stats->LinesPerSecond = (uint32_t)(((uint64_t)stats->Lines * 1000) / stats->Milliseconds);
+}
+
+static void read_job_buffer(uint32_t index)
+{
+    size_t count = 0;
+
+    if (job_eof == false)
+    {
+        count = ff_fread(job_buffers[index], 1, DISK_JOB_BUFFER_SIZE, job_file);
+
+        job_offsets[index] = job_read_offset;
+        job_read_offset += count;
+
+        if (count < DISK_JOB_BUFFER_SIZE)
+        {
+            job_eof = true;
+            job_read_error = (ff_feof(job_file) == pdFALSE);
+        }
+    }
+
+    job_valid[index] = count;
+}
+
+// Decodes the next record of a precompiled toolpath into the job line, the record may continue
+// in the other buffer. ready stays false at the end of the toolpath
+static int32_t read_toolpath_record(uint32_t& current, uint32_t& position, bool& ready)
+{
+    uint8_t joined[2 * TOOLPATH_MAX_RECORD_SIZE];
+    TOOLPATH_RECORD record;
+    uint32_t count;
+    uint32_t tail;
+    uint32_t used;
+    int32_t result;
+
+    ready = false;
+
+    for ( ; ; )
+    {
+        if (position == job_valid[current])
+        {
+            // Done with this buffer, it can be refilled
+            job_valid[current] = 0;
+            position = 0;
+
+            if (job_valid[current ^ 1] == 0)
+            {
+                if (job_eof != false)
+                    return GCODE_OK;
+
+                job_stats.Underruns++;
+                read_job_buffer(current ^ 1);
+
+                if (job_valid[current ^ 1] == 0)
+                    return GCODE_OK;
+            }
+
+            current ^= 1;
+            continue;
+        }
+
+        count = job_valid[current] - position;
+        result = job_toolpath.ReadRecord((const uint8_t*)job_buffers[current] + position, count, record, used);
+
+        if (result != GCODE_OK)
+            return result;
+
+        if (used != 0)
+        {
+            position += used;
+            break;
+        }
+
+        // The record continues in the other buffer (a full one unless the file ends there)
+        if (job_valid[current ^ 1] == 0 && job_eof == false)
+        {
+            job_stats.Underruns++;
+            read_job_buffer(current ^ 1);
+        }
+
+        tail = std::min(job_valid[current ^ 1], (uint32_t)sizeof(joined) - count);
+
+        memcpy(&joined[0], (const uint8_t*)job_buffers[current] + position, count);
+        memcpy(&joined[count], job_buffers[current ^ 1], tail);
+
+        result = job_toolpath.ReadRecord(&joined[0], count + tail, record, used);
+
+        if (result != GCODE_OK)
+            return result;
+
+        // Cut short
+        if (used == 0)
+            return (job_read_error != false) ? GCODE_OK : GCODE_ERROR_INVALID_TOOLPATH_DATA;
+
+        job_valid[current] = 0;
+        current ^= 1;
+        position = used - count;
+        break;
+    }
+
+    // Nothing after the end record is run
+    if (record.type == TOOLPATH_RECORD_END)
+    {
+        job_valid[current] = position;
+        job_valid[current ^ 1] = 0;
+        job_eof = true;
+        return GCODE_OK;
+    }
+
+    memcpy(job_line.Text, &record, sizeof(record));
+    ready = true;
+
+    return GCODE_OK;
+}
+
+// Sends the job lines to the parser until the end of the file, an error or a stop request
+static void stream_job(void)
+{
+    uint32_t current = 0;
+    uint32_t position = 0;          // In the current buffer
+    uint32_t line_length = 0;
+    uint32_t line_offset;           // In the file, of the line being assembled
+    uint32_t line_number;
+    uint32_t next_offset = 0;
+    uint32_t resume_index = JOB_RESUME_LINES;
+    uint32_t resume_flags = 0;
+    uint32_t restart_line = job_restart_line;
+    uint32_t pending_results = 0;
+    uint32_t margin;
+    uint32_t count;
+    const char* data;
+    const char* eol;
+    bool line_ready = false;
+    bool file_line = true;          // The resume lines are not
+    bool toolpath = false;
+    int32_t result = GCODE_OK;
+    int32_t discarded;
+
+    job_eof = false;
+    job_read_error = false;
+
+    line_offset = job_read_offset;
+    line_number = job_first_line;
+
+    if (job_resume_lines != false)
+    {
+        resume_index = 0;
+        resume_flags = (job_resume_scan != false) ? GCODE_JOB_LINE_SCAN : 0;
+    }
+
+    read_job_buffer(0);
+    read_job_buffer(1);
+
+    // A toolpath only runs from its start: its records follow from the ones before them
+    if (line_offset == 0 && job_toolpath.ReadHeader((const uint8_t*)job_buffers[0], job_valid[0], position) == GCODE_OK && position != 0)
+    {
+        toolpath = true;
+
+        if (restart_line != 0)
+            result = GCODE_ERROR_UNSUPPORTED_IN_TOOLPATH;
+    }
+
+    for ( ; ; )
+    {
+        // Uploads keep going while the job runs
+        process_write_requests();
+
+        while (pending_results != 0 && GCodeParsingTask_GetResult(GCODE_SOURCE_SD_STORAGE, &result, 0) != false)
+        {
+            pending_results--;
+
+            if (result == GCODE_INFO_BLOCK_DELETE)
+                result = GCODE_OK;
+
+            if (result != GCODE_OK)
+                break;
+        }
+
+        if (result != GCODE_OK || job_read_error != false || job_stop_request != false)
+            break;
+
+        if (toolpath != false && line_ready == false)
+        {
+            result = read_toolpath_record(current, position, line_ready);
+
+            if (result != GCODE_OK)
+                break;
+
+            line_length = (line_ready != false) ? sizeof(TOOLPATH_RECORD) : 0;
+            file_line = false;
+        }
+
+        // The resume lines first, the steps with nothing to do are skipped
+        while (line_ready == false && resume_index < JOB_RESUME_LINES)
+        {
+            line_length = JobCheckpoint::BuildResumeLine(job_resume_state, resume_index++, job_line.Text);
+
+            line_ready = (line_length != 0);
+            file_line = false;
+        }
+
+        // Restart line reached once the parser is done with the scan: the resume lines take the
+        // machine to the state the scan left in the parser (idle, the job holds the other sources)
+        if (restart_line != 0 && line_number >= restart_line && line_ready == false && line_length == 0)
+        {
+            if (pending_results != 0)
+            {
+                ulTaskNotifyTake(pdTRUE, DISK_JOB_POLL_TIME);
+                continue;
+            }
+
+            if (machine->ReadJobState(&job_resume_state) == false)
+            {
+                result = GCODE_ERROR_RESTART_STATE;
+                break;
+            }
+
+            DebugLog("SD job: restart at line %u after %u ms", line_number, (xTaskGetTickCount() - job_start_tick) * portTICK_PERIOD_MS);
+
+            restart_line = 0;
+            resume_index = 0;
+            resume_flags = 0;
+            continue;
+        }
+
+        // Assemble the next line, it may continue in the other buffer
+        while (line_ready == false && toolpath == false)
+        {
+            if (position == job_valid[current])
+            {
+                // Done with this buffer, it can be refilled
+                job_valid[current] = 0;
+                position = 0;
+
+                if (job_valid[current ^ 1] == 0)
+                {
+                    if (job_eof != false)
+                        break;
+
+                    // The parser caught up with the reads
+                    job_stats.Underruns++;
+                    read_job_buffer(current ^ 1);
+
+                    if (job_valid[current ^ 1] == 0)
+                        break;
+                }
+
+                current ^= 1;
+                continue;
+            }
+
+            data = (const char*)job_buffers[current] + position;
+            count = job_valid[current] - position;
+
+            eol = (const char*)memchr(data, '\n', count);
+
+            if (eol != NULL)
+                count = (uint32_t)(eol - data);
+
+            if ((line_length + count) > GCODE_MAX_LINE_LENGTH)
+            {
+                result = GCODE_ERROR_LINE_TOO_LONG;
+                break;
+            }
+
+            memcpy(&job_line.Text[line_length], data, count);
+            line_length += count;
+            position += count;
+
+            if (eol != NULL)
+            {
+                position++;
+                next_offset = job_offsets[current] + position;
+
+                if (line_length > 0 && job_line.Text[line_length - 1] == '\r')
+                    line_length--;
+
+                // Blank lines are not worth a trip through the parser (but they are counted)
+                line_ready = (line_length != 0);
+                file_line = true;
+
+                if (line_ready == false)
+                {
+                    line_offset = next_offset;
+                    line_number++;
+                }
+            }
+        }
+
+        if (result != GCODE_OK)
+            break;
+
+        if (line_ready == false)
+        {
+            // Last line without a line feed
+            if (line_length > 0 && job_line.Text[line_length - 1] == '\r')
+                line_length--;
+
+            if (line_length != 0)
+            {
+                line_ready = true;
+                file_line = true;
+            }
+            else if (pending_results == 0)
+            {
+                break;
+            }
+        }
+
+        // The read-ahead runs out at the end of the file, that is no margin
+        if (line_ready != false && job_eof == false)
+        {
+            margin = (job_valid[current] - position) + job_valid[current ^ 1];
+
+            if (margin < job_stats.MinMargin)
+                job_stats.MinMargin = margin;
+        }
+
+        if (line_ready != false)
+        {
+            job_line.Offset = (file_line != false) ? line_offset : 0;
+            job_line.Number = (file_line != false) ? line_number : 0;
+
+            // Before the restart line the file lines are only scanned
+            if (toolpath != false)
+                job_line.Flags = GCODE_JOB_LINE_TOOLPATH;
+            else if (file_line != false)
+                job_line.Flags = (restart_line != 0) ? GCODE_JOB_LINE_SCAN : 0;
+            else
+                job_line.Flags = resume_flags;
+        }
+
+        // Never more lines in flight than the result queue can hold
+        if (line_ready != false && pending_results < GCODE_RESULT_QUEUE_LENGTH &&
+            GCodeParsingTask_SubmitJobLine(GCODE_SOURCE_SD_STORAGE, &job_line, line_length, 0) != false)
+        {
+            pending_results++;
+            job_stats.Lines++;
+
+            if (file_line != false)
+            {
+                line_offset = next_offset;
+                line_number++;
+            }
+
+            line_length = 0;
+            line_ready = false;
+            continue;
+        }
+
+        // The parser is busy, the best time to read ahead
+        if (job_valid[current ^ 1] == 0 && job_eof == false)
+        {
+            read_job_buffer(current ^ 1);
+            continue;
+        }
+
+        // Woken by each result (and by write requests)
+        ulTaskNotifyTake(pdTRUE, DISK_JOB_POLL_TIME);
+    }
+
+    // Results of the lines already submitted (stopped or failed job)
+    while (pending_results != 0)
+    {
+        if (GCodeParsingTask_GetResult(GCODE_SOURCE_SD_STORAGE, &discarded, DISK_JOB_POLL_TIME) != false)
+            pending_results--;
+
+        process_write_requests();
+    }
+
+    ff_fclose(job_file);
+
+    // The file ended before the restart line
+    if (restart_line != 0 && result == GCODE_OK && job_stop_request == false)
+        result = GCODE_ERROR_RESTART_LINE;
+
+    // A scan that didn't get to its end still has the parser away from the machine position
+    machine->SetScanMode(false);
+
+    taskENTER_CRITICAL();
+    job_stats.Milliseconds = (xTaskGetTickCount() - job_start_tick) * portTICK_PERIOD_MS;
+
+    if (job_read_error != false)
+        job_stats.Result = GCODE_ERROR_DISK_ACCESS;
+    else
+        job_stats.Result = result;
+
+    if (job_stats.Result != GCODE_OK)
+        job_stats.State = DISK_JOB_FAILED;
+    else if (job_stop_request != false)
+        job_stats.State = DISK_JOB_STOPPED;
+    else
+        job_stats.State = DISK_JOB_DONE;
+
+    if (job_stats.Milliseconds != 0)
+        job_stats.LinesPerSecond = (uint32_t)(((uint64_t)job_stats.Lines * 1000) / job_stats.Milliseconds);
+    taskEXIT_CRITICAL();
+
+    // A completed job clears the checkpoint, a stopped or failed one keeps it
+    if (job_checked == false)
+        JobCheckpoint::EndJob(job_stats.State == DISK_JOB_DONE);
+
+    GCodeParsingTask_EndJob(GCODE_SOURCE_SD_STORAGE);
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+
+    DebugLog("SD job end: state %u result %d lines %u", job_stats.State, job_stats.Result, job_stats.Lines);
+    DebugLog("SD job: %u lines/s, min margin %u bytes, %u underruns", job_stats.LinesPerSecond, job_stats.MinMargin, job_stats.Underruns);
+
+    job_file = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int32_t DiskTask_StartBenchmark(void)
+{
+    if (job_file != NULL || bench_request != false)
+        return GCODE_ERROR_SOURCE_LOCKED;
+
+    if (DiskTask_IsMounted() == false)
+        return GCODE_ERROR_DISK_NOT_AVAILABLE;
+
+    bench_request = true;
+    xTaskNotifyGive(disk_task_handle);
+
+    return GCODE_OK;
+}
+
+// KB/s of sectors read in ticks
+static uint32_t bench_rate(uint32_t sectors, uint32_t ticks)
+{
+    return (uint32_t)(((uint64_t)sectors * 512 * 1000) / ((uint64_t)ticks * portTICK_PERIOD_MS * 1024));
+}
+
+// One pass of count sectors from first in requests of size, in order (the driver reads ahead)
+// or from the last request down (a new transfer each). Returns the ticks, 0 if a read failed
+static uint32_t bench_pass(uint8_t* buffer, uint32_t first, uint32_t count, uint32_t size, bool ascending)
+{
+    uint32_t start = xTaskGetTickCount();
+    uint32_t requests = count / size;
+    uint32_t request;
+    uint32_t sector;
+
+    for (request = 0; request < requests; request++)
+    {
+        sector = first + size * ((ascending != false) ? request : (requests - 1 - request));
+
+        if (FF_isERR(FF_BlockRead(sd_disk->pxIOManager, sector, size, buffer, pdFALSE)) != pdFALSE)
+            return 0;
+    }
+
+    return std::max((uint32_t)(xTaskGetTickCount() - start), (uint32_t)1);
+}
+
+static void run_benchmark(void)
+{
+    static const uint8_t sizes[] = { 1, 4, 8, 15 };     // Sectors per request (15 + offset fit)
+    static const uint8_t offsets[] = { 0, 1 };
+
+    uint8_t* buffer;
+    uint32_t count;
+    uint32_t ahead_ticks;
+    uint32_t direct_ticks = 0;
+    uint32_t requested;
+    uint32_t size;
+    uint32_t offset;
+    bool failed = false;
+
+    if (DiskTask_AcquireVolume(DISK_OWNER_FIRMWARE) == false)
+    {
+        DebugLog("SD bench: volume not available");
+        return;
+    }
+
+    count = std::min((uint32_t)(DISK_BENCH_BYTES / 512), sd_disk->ulNumberOfSectors / 2);
+
+    for (offset = 0; offset < sizeof(offsets) && failed == false; offset++)
+    {
+        buffer = (uint8_t*)job_buffers + offsets[offset];
+
+        for (size = 0; size < sizeof(sizes) && failed == false; size++)
+        {
+            requested = (count / sizes[size]) * sizes[size];
+
+            // Fresh sectors for each pass, the ones of the other pass are not read ahead
+            ahead_ticks = bench_pass(buffer, count, count, sizes[size], true);
+
+            if (ahead_ticks != 0)
+                direct_ticks = bench_pass(buffer, 0, count, sizes[size], false);
+
+            if (ahead_ticks == 0 || direct_ticks == 0)
+            {
+                failed = true;
+                break;
+            }
+
+            DebugLog("SD bench: %u sectors, offset %u: %u KB/s read ahead, %u KB/s direct", sizes[size], offsets[offset],
+                     bench_rate(requested, ahead_ticks), bench_rate(requested, direct_ticks));
+        }
+    }
+
+    if (failed != false)
+        DebugLog("SD bench: read failed");
+
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t DiskTask_GetSectorCount(void)
+{
+    return (sd_disk != NULL) ? sd_disk->ulNumberOfSectors : 0;
+}
+
+bool DiskTask_ReadSectors(uint32_t sector, uint32_t count, void* buffer)
+{
+    if (volume_owner != DISK_OWNER_USB_HOST)
+        return false;
+
+    return (FF_isERR(FF_SDDiskReadSectors(sd_disk, sector, count, (uint8_t*)buffer)) == pdFALSE);
+}
+
+bool DiskTask_WriteSectors(uint32_t sector, uint32_t count, const void* buffer)
+{
+    if (volume_owner != DISK_OWNER_USB_HOST)
+        return false;
+
+    return (FF_isERR(FF_SDDiskWriteSectors(sd_disk, sector, count, (const uint8_t*)buffer)) == pdFALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
 void DiskTask_Entry(void * pvParam)
 {
+    FF_Disk_t* disk;
+
     // Initialize FAT Stack [SDCard Device]
-    
     for ( ; ; )
     {
-        vTaskSuspend(NULL); 
+        disk = FF_SDDiskInit("/");
+
+        if (disk != NULL)
+            break;
+
+        vTaskDelay(DISK_MOUNT_RETRY_TIME);
+    }
+
+    xSemaphoreTake(volume_mutex, portMAX_DELAY);
+    sd_disk = disk;
+    xSemaphoreGive(volume_mutex);
+
+    DebugLog("SD card mounted, %u MB", disk->ulNumberOfSectors / 2048);
+
+    GCodeParsingTask_SetResultNotify(GCODE_SOURCE_SD_STORAGE, disk_task_handle);
+
+    for ( ; ; )
+    {
+        process_write_requests();
+
+        if (bench_request != false)
+        {
+            run_benchmark();
+            bench_request = false;
+        }
+
+        if (job_file != NULL)
+            stream_job();
+        else
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-
@@ -3,6 +3,11 @@
 #include "dma.h"
 
 DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
+DMA_HandleTypeDef hdma_usart1_tx;         // Configured with the UART (HAL_UART_MspInit)
+DMA_HandleTypeDef hdma_spi3_rx;           // Configured with the SPI (HAL_SPI_MspInit)
+DMA_HandleTypeDef hdma_spi3_tx;
+DMA_HandleTypeDef hdma_spi1_rx;           // Configured with the SPI (HAL_SPI_MspInit)
+DMA_HandleTypeDef hdma_spi1_tx;
 
 /** 
   * Enable DMA controller clock
@@ -12,6 +17,7 @@ DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
 void Init_DMA_Controller(void) 
 {
     /* DMA controller clock enable */
+    __HAL_RCC_DMA1_CLK_ENABLE();
     __HAL_RCC_DMA2_CLK_ENABLE();
 
     /* Configure DMA request hdma_memtomem_dma2_stream0 on DMA2_Stream0 */
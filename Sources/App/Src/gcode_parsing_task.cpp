@@ -1,5 +1,13 @@
 #include <stm32f4xx_hal.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+#include "message_buffer.h"
 
 #include "user_tasks.h"
 
@@ -8,17 +16,383 @@
 #include "settings_manager.h"
 
 #include "GCodeParser.h"
+#include "BinaryToolpath.h"
+#include "JobCheckpoint.h"
+#include "JobIndex.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Raw lines go through one message buffer per source. The parsing task owns the parser (and
+// therefore the planner input), so the sources only have to deal with their transport. Results
+// go back in order through one queue per source.
+//
+// Arbitration: when several sources have lines waiting, the one first in gcode_source_priority
+// is served. A source running a job (GCodeParsingTask_BeginJob) locks the others out: their
+// lines are still taken in order, but answered with GCODE_ERROR_SOURCE_LOCKED without being
+// parsed. Real-time commands (feed hold, cycle start, reset) do not go through here, so they
+// are always accepted.
+//
+// The moves of the parser go on to the planning stage (Planner::QueueLine) through
+// gcode_planner_queue: the parser validates and converts the next lines (its modal state stays
+// with it) while the planning task computes the junctions and waits for room in the block
+// queue. Anything that needs the machine idle (M3, G4, homing, $C...) waits for the stage to
+// empty first (MachineCore::WaitForIdleCondition).
+
 TaskHandle_t gcode_task_handle;
+TaskHandle_t gcode_plan_task_handle;
+
+static const uint32_t gcode_line_buffer_sizes[GCODE_SOURCE_MAX_VALUE] =
+{
+    GCODE_LINE_BUFFER_SIZE_SERIAL,
+    GCODE_LINE_BUFFER_SIZE_SD,
+    GCODE_LINE_BUFFER_SIZE_JOG,
+};
+
+// Sources whose lines start with their file position (GCODE_JOB_LINE)
+static const bool gcode_line_positions[GCODE_SOURCE_MAX_VALUE] =
+{
+    false,
+    true,
+    false,
+};
+
+// Interactive commands first, a file last
+static const GCODE_SOURCE_OPTIONS gcode_source_priority[GCODE_SOURCE_MAX_VALUE] =
+{
+    GCODE_SOURCE_JOG,
+    GCODE_SOURCE_SERIAL_CONSOLE,
+    GCODE_SOURCE_SD_STORAGE,
+};
+
+static MessageBufferHandle_t    gcode_line_buffers[GCODE_SOURCE_MAX_VALUE];
+static SemaphoreHandle_t        gcode_submit_mutexes[GCODE_SOURCE_MAX_VALUE];  // Message buffers allow a single writer
+static QueueHandle_t            gcode_result_queues[GCODE_SOURCE_MAX_VALUE];
+static TaskHandle_t             gcode_result_notify[GCODE_SOURCE_MAX_VALUE];
+
+static QueueHandle_t            gcode_planner_queue;
+
+static volatile GCODE_SOURCE_OPTIONS    gcode_job_owner = GCODE_SOURCE_MAX_VALUE;   // None
+
+static volatile GCODE_PIPELINE_STATS    gcode_stats;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Planner input (parsing task), waits for room in the planning stage
+static void queue_planner_line(const PLANNER_LINE & line, void* context)
+{
+    xQueueSend(gcode_planner_queue, &line, portMAX_DELAY);
+}
+
+// Peaks are raised by more than one task
+static void update_peak(volatile uint32_t & peak, uint32_t value)
+{
+    taskENTER_CRITICAL();
 
+    if (value > peak)
+        peak = value;
 
+    taskEXIT_CRITICAL();
+}
+
+bool GCodeParsingTask_Initialize(void)
+{
+    uint32_t index;
+
+    for (index = 0; index < GCODE_SOURCE_MAX_VALUE; index++)
+    {
+        gcode_line_buffers[index] = xMessageBufferCreate(gcode_line_buffer_sizes[index]);
+        gcode_result_queues[index] = xQueueCreate(GCODE_RESULT_QUEUE_LENGTH, sizeof(int32_t));
+        gcode_submit_mutexes[index] = xSemaphoreCreateMutex();
+        gcode_result_notify[index] = NULL;
+
+        if (gcode_line_buffers[index] == NULL || gcode_result_queues[index] == NULL || gcode_submit_mutexes[index] == NULL)
+            return false;
+    }
+
+    gcode_planner_queue = xQueueCreate(GCODE_PLANNER_QUEUE_LENGTH, sizeof(PLANNER_LINE));
+
+    if (gcode_planner_queue == NULL)
+        return false;
+
+    machine->AssociatePlannerInput(queue_planner_line, NULL);
+
+    memset((void*)&gcode_stats, 0, sizeof(gcode_stats));
+    return true;
+}
+
+static bool submit_message(GCODE_SOURCE_OPTIONS source, const void* message, uint32_t length, TickType_t wait)
+{
+    size_t sent;
+    uint32_t pending = 0;
+    uint32_t index;
+
+    // Jog lines may come from more than one task
+    if (xSemaphoreTake(gcode_submit_mutexes[source], wait) != pdTRUE)
+        return false;
+
+    sent = xMessageBufferSend(gcode_line_buffers[source], message, length, wait);
+
+    // Keep track of how far ahead of the parser the sources are
+    for (index = 0; index < GCODE_SOURCE_MAX_VALUE; index++)
+        pending += gcode_line_buffer_sizes[index] - xMessageBufferSpacesAvailable(gcode_line_buffers[index]);
+
+    update_peak(gcode_stats.LineBufferPeak, pending);
+
+    xSemaphoreGive(gcode_submit_mutexes[source]);
+
+    if (sent != 0 && gcode_task_handle != NULL)
+        xTaskNotifyGive(gcode_task_handle);
+
+    return (sent != 0);
+}
+
+bool GCodeParsingTask_SubmitLine(GCODE_SOURCE_OPTIONS source, const char* line, uint32_t length, TickType_t wait)
+{
+    if (length > GCODE_MAX_LINE_LENGTH)
+        length = GCODE_MAX_LINE_LENGTH;
+
+    return submit_message(source, line, length, wait);
+}
+
+bool GCodeParsingTask_SubmitJobLine(GCODE_SOURCE_OPTIONS source, const GCODE_JOB_LINE* line, uint32_t length, TickType_t wait)
+{
+    if (length > GCODE_MAX_LINE_LENGTH)
+        length = GCODE_MAX_LINE_LENGTH;
+
+    return submit_message(source, line, offsetof(GCODE_JOB_LINE, Text) + length, wait);
+}
+
+bool GCodeParsingTask_BeginJob(GCODE_SOURCE_OPTIONS source)
+{
+    bool granted = false;
+
+    taskENTER_CRITICAL();
+
+    if (gcode_job_owner == GCODE_SOURCE_MAX_VALUE || gcode_job_owner == source)
+    {
+        gcode_job_owner = source;
+        granted = true;
+    }
+
+    taskEXIT_CRITICAL();
+
+    return granted;
+}
+
+void GCodeParsingTask_EndJob(GCODE_SOURCE_OPTIONS source)
+{
+    taskENTER_CRITICAL();
+
+    if (gcode_job_owner == source)
+        gcode_job_owner = GCODE_SOURCE_MAX_VALUE;
+
+    taskEXIT_CRITICAL();
+}
+
+GCODE_SOURCE_OPTIONS GCodeParsingTask_GetJobOwner(void)
+{
+    return gcode_job_owner;
+}
+
+bool GCodeParsingTask_GetResult(GCODE_SOURCE_OPTIONS source, int32_t* result, TickType_t wait)
+{
+    return (xQueueReceive(gcode_result_queues[source], result, wait) == pdTRUE);
+}
+
+void GCodeParsingTask_SetResultNotify(GCODE_SOURCE_OPTIONS source, TaskHandle_t task)
+{
+    gcode_result_notify[source] = task;
+}
+
+void GCodeParsingTask_GetStats(GCODE_PIPELINE_STATS* stats)
+{
+    taskENTER_CRITICAL();
+    memcpy((void*)stats, (const void*)&gcode_stats, sizeof(gcode_stats));
+    taskEXIT_CRITICAL();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Source with lines waiting, by priority (GCODE_SOURCE_MAX_VALUE if none)
+static GCODE_SOURCE_OPTIONS select_source(void)
+{
+    uint32_t index;
+
+    for (index = 0; index < GCODE_SOURCE_MAX_VALUE; index++)
+    {
+        if (xMessageBufferIsEmpty(gcode_line_buffers[gcode_source_priority[index]]) == pdFALSE)
+            return gcode_source_priority[index];
+    }
+
+    return GCODE_SOURCE_MAX_VALUE;
+}
 
 void GCodeParsingTask_Entry(void * pvParam)
 {
+    MachineCore* core = (MachineCore*)pvParam;
+    GCODE_SOURCE_OPTIONS source;
+    GCODE_SOURCE_OPTIONS owner;
+    GCODE_JOB_LINE* line;
+    TOOLPATH_RECORD record;
+    size_t length;
+    bool scan;
+    int32_t result;
+
+    TickType_t now;
+    TickType_t wait_start;
+    TickType_t window_start;
+    uint32_t window_wait_ticks = 0;
+    uint32_t window_lines = 0;
+
+    /* Reserve memory for the line being processed [position + text + terminator] */
+    line = new GCODE_JOB_LINE;
+
+    window_start = xTaskGetTickCount();
+
+    for ( ; ; )
+    {
+        source = select_source();
+
+        if (source == GCODE_SOURCE_MAX_VALUE)
+        {
+            // Every submitted line comes with a notification
+            wait_start = xTaskGetTickCount();
+
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(250));
+
+            now = xTaskGetTickCount();
+            window_wait_ticks += (now - wait_start);
+        }
+        else
+        {
+            if (gcode_line_positions[source] != false)
+            {
+                length = xMessageBufferReceive(gcode_line_buffers[source], line, offsetof(GCODE_JOB_LINE, Text) + GCODE_MAX_LINE_LENGTH, 0);
+                length = (length >= offsetof(GCODE_JOB_LINE, Text)) ? (length - offsetof(GCODE_JOB_LINE, Text)) : 0;
+            }
+            else
+            {
+                length = xMessageBufferReceive(gcode_line_buffers[source], line->Text, GCODE_MAX_LINE_LENGTH, 0);
+                line->Offset = 0;
+                line->Number = 0;
+                line->Flags = 0;
+            }
+            
+            line->Text[length] = '\0';
+
+            owner = gcode_job_owner;
+
+            if (owner != GCODE_SOURCE_MAX_VALUE && owner != source)
+            {
+                result = GCODE_ERROR_SOURCE_LOCKED;
+            }
+            else if ((line->Flags & GCODE_JOB_LINE_TOOLPATH) != 0)
+            {
+                // Records carry no file position, they are not checkpointed
+                core->SetScanMode(false);
+                
+                if (length == sizeof(TOOLPATH_RECORD))
+                {
+                    memcpy(&record, line->Text, sizeof(record));
+                    result = core->ExecuteToolpathRecord(source, record);
+                }
+                else
+                {
+                    result = GCODE_ERROR_INVALID_TOOLPATH_DATA;
+                }
+            }
+            else
+            {
+                // Any other line ends a scan (and brings the position back)
+                scan = ((line->Flags & GCODE_JOB_LINE_SCAN) != 0);
+                core->SetScanMode(scan);
+                
+                // Scanned lines never move, nothing to checkpoint
+                JobIndex::OnLine(core, line->Offset, line->Number);
+                JobCheckpoint::BeginLine(core, line->Offset, (scan != false) ? 0 : line->Number);
+                
+                // Parse, the moves go on to the planning stage. Back-pressure is felt here once
+                // the stage is full
+                result = core->ParseGCodeLine(source, line->Text);
+                JobCheckpoint::EndLine(core);
+            }
+
+            xQueueSend(gcode_result_queues[source], &result, portMAX_DELAY);
+
+            if (gcode_result_notify[source] != NULL)
+                xTaskNotifyGive(gcode_result_notify[source]);
+
+            window_lines++;
+            now = xTaskGetTickCount();
+        }
+
+        // Update statistics once per second
+        if ((now - window_start) >= pdMS_TO_TICKS(1000))
+        {
+            uint32_t elapsed = (now - window_start);
+
+            if (window_wait_ticks > elapsed)
+                window_wait_ticks = elapsed;
+
+            taskENTER_CRITICAL();
+            gcode_stats.LinesProcessed += window_lines;
+            gcode_stats.LinesPerSecond = (window_lines * configTICK_RATE_HZ) / elapsed;
+            gcode_stats.ParserBusyPercent = ((elapsed - window_wait_ticks) * 100) / elapsed;
+            gcode_stats.PlannerQueueBlocks = core->GetPlannerQueueCount();
+            taskEXIT_CRITICAL();
+
+            window_start = now;
+            window_wait_ticks = 0;
+            window_lines = 0;
+        }
+    }
+}
+
+// Planning stage: the moves the parser queued are planned in order
+void GCodePlanningTask_Entry(void * pvParam)
+{
+    MachineCore* core = (MachineCore*)pvParam;
+    PLANNER_LINE line;
+    bool received;
+
+    TickType_t now;
+    TickType_t wait_start;
+    TickType_t window_start;
+    uint32_t window_wait_ticks = 0;
+
+    window_start = xTaskGetTickCount();
+
     for ( ; ; )
     {
-        vTaskSuspend(NULL);
+        wait_start = xTaskGetTickCount();
+
+        received = (xQueueReceive(gcode_planner_queue, &line, pdMS_TO_TICKS(250)) == pdTRUE);
+
+        now = xTaskGetTickCount();
+        window_wait_ticks += (now - wait_start);
+
+        if (received != false)
+        {
+            // Parsed and not planned yet, this one included
+            update_peak(gcode_stats.PlannerLinesPeak, core->GetQueuedPlannerLines());
+
+            core->PlanLine(line);
+            now = xTaskGetTickCount();
+        }
+
+        if ((now - window_start) >= pdMS_TO_TICKS(1000))
+        {
+            uint32_t elapsed = (now - window_start);
+
+            if (window_wait_ticks > elapsed)
+                window_wait_ticks = elapsed;
+
+            taskENTER_CRITICAL();
+            gcode_stats.PlannerBusyPercent = ((elapsed - window_wait_ticks) * 100) / elapsed;
+            taskEXIT_CRITICAL();
+
+            window_start = now;
+            window_wait_ticks = 0;
+        }
     }
 }
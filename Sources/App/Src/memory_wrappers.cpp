@@ -3,6 +3,11 @@
 
 #pragma import(__use_no_semihosting)
 
+// The FreeRTOS heap (heap_4.c) fills the CCM data RAM (IRAM2 of the target):
+// it takes the whole region, so the linker places nothing else there and the
+// buffers the DMA uses stay in SRAM. Budget in FreeRTOSConfig.h
+extern "C" uint8_t ucHeap[configTOTAL_HEAP_SIZE] __attribute__((at(configHEAP_ADDRESS), zero_init));
+
 void* operator new(size_t alloc_size)
 {
     return pvPortMalloc(alloc_size);
@@ -13,11 +13,21 @@
 #include "serial_task.h"
 #include "usb_task.h"
 #include "settings_manager.h"
+#include "settings_task.h"
 
 #include "uart_ports.h"
 #include "pins.h"
 
 #include "GCodeParser.h"
+#include "Conveyor.h"
+#include "gcode_parsing_task.h"
+#include "BinaryFraming.h"
+#include "MotionTelemetry.h"
+#include "FileUpload.h"
+#include "disk_task.h"
+#include "debug_log_task.h"
+#include "JobCheckpoint.h"
+#include "StepTicker.h"
 #include "tusb.h"
 #include "cdc_device.h"
 
@@ -37,7 +47,21 @@ TaskHandle_t serial_task_handle;
 //    "M30"
 //};
 
-//static const char * hello_msg = "\r\nGrbl 1.1h ['$' for help]\r\n";
+// Streaming protocol (Grbl compatible)
+//
+// Every line gets exactly one compact response, "ok" or "error:N" (N = GCODE_STATUS_RESULTS
+// value), and nothing is echoed. A sender can therefore count the characters of the lines
+// still waiting for a response and keep up to SERIAL_RX_CAPACITY bytes in flight instead of
+// waiting for each response. The capacity is advertised in the [OPT:] line of the $I report.
+// Anything beyond it is simply held back by USB flow control (NAK) so it is never lost.
+//
+// The device only takes an OUT packet once the RX FIFO has room for a whole one, so the
+// capacity leaves a packet free: a real-time byte gets in even with the capacity in flight
+// and the parser held (the '~' after a '!' that stopped it with the FIFO full)
+
+#define SERIAL_RX_CAPACITY      (CFG_TUD_CDC_RX_BUFSIZE - CFG_TUD_CDC_EP_BUFSIZE)
+
+static const char * hello_msg = "\r\nGrbl 1.1h ['$' for help]\r\n";
 
 //static const char * fake_settings = \
 //    "$0=10\r\n$1=25\r\n$2=0\r\n$3=0\r\n$4=0\r\n$5=0\r\n$6=0\r\n" \
@@ -49,112 +73,1141 @@ TaskHandle_t serial_task_handle;
 //    "$120=10\r\n$121=10\r\n$122=10\r\n" \
 //    "$130=360\r\n$131=360\r\n$132=200\r\n";
 
-void SerialTask_Entry(void * pvParam)
-{   
-    char * line;    
+// Wait for room in the CDC TX FIFO instead of dropping part of a response,
+// a counting sender would stall forever waiting for the lost "ok"
+static void cdc_write(const char* data, uint32_t length)
+{
+    uint32_t written;
     
-    char ch = 0;
-    char prev_ch = 0;
+    while (length != 0 && tud_cdc_n_connected(0) != false)
+    {
+        written = tud_cdc_n_write(0, data, length);
+        
+        data += written;
+        length -= written;
+        
+        if (length != 0)
+        {
+            tud_cdc_n_write_flush(0);
+            vTaskDelay(1);
+        }
+    }
+}
+
+// Responses are batched in tx_buffer and handed to the CDC FIFO a packet at a time, or once
+// the oldest byte waited SERIAL_TX_FLUSH_DEADLINE (or right away when no more results are due)
+// so the bus carries full packets instead of one short packet per "ok"
+
+#define SERIAL_TX_FLUSH_SIZE        64      // One full speed bulk packet
+#define SERIAL_TX_FLUSH_DEADLINE    pdMS_TO_TICKS(2)
+
+static char         tx_buffer[TX_BUFFER_SIZE];
+static uint32_t     tx_count;
+static TickType_t   tx_first_tick;
+
+static void tx_flush(void)
+{
+    if (tx_count == 0)
+        return;
     
-    uint32_t ch_counter = 0;
-    uint32_t avail;
-    bool allow_processing = false;   
+    cdc_write(tx_buffer, tx_count);
+    tud_cdc_n_write_flush(0);
     
-    /* Reserve memory for line copy/processing */
-    line = new char[RX_BUFFER_SIZE + 1];
+    tx_count = 0;
+}
+
+static void tx_put(const char* data, uint32_t length)
+{
+    if ((tx_count + length) > TX_BUFFER_SIZE)
+        tx_flush();
     
-    for ( ; ; )
+    // Does not fit in the buffer at all, straight to the FIFO behind what was batched
+    if (length > TX_BUFFER_SIZE)
+    {
+        cdc_write(data, length);
+        return;
+    }
+    
+    if (tx_count == 0)
+        tx_first_tick = xTaskGetTickCount();
+    
+    memcpy(&tx_buffer[tx_count], data, length);
+    tx_count += length;
+    
+    if (tx_count >= SERIAL_TX_FLUSH_SIZE)
+        tx_flush();
+}
+
+static uint32_t append_decimal(char* text, uint32_t value)
+{
+    char digits[10];
+    uint32_t count = 0;
+    uint32_t length = 0;
+    
+    do
     {
-        // Try to receive data from CDC FIFO buffer
-        avail = tud_cdc_n_available(0);
+        digits[count++] = '0' + (char)(value % 10);
+        value /= 10;
+    } while (value != 0);
+    
+    while (count != 0)
+        text[length++] = digits[--count];
+    
+    return length;
+}
 
-        if (avail != 0)
-        {
-            ch = (char)tud_cdc_n_read_char(0);
+// Values are reported with 3 decimals. Kept as integers so changes can be told exactly
+static inline int32_t to_fixed3(float value)
+{
+    return (int32_t)((value >= 0.0f) ? (value * 1000.0f + 0.5f) : (value * 1000.0f - 0.5f));
+}
+
+static uint32_t append_fixed3(char* text, int32_t scaled)
+{
+    uint32_t magnitude;
+    uint32_t length = 0;
+    
+    if (scaled < 0)
+        text[length++] = '-';
+    
+    magnitude = (scaled < 0) ? (uint32_t)(-scaled) : (uint32_t)scaled;
+    
+    length += append_decimal(&text[length], magnitude / 1000);
+    text[length++] = '.';
+    text[length++] = '0' + (char)((magnitude / 100) % 10);
+    text[length++] = '0' + (char)((magnitude / 10) % 10);
+    text[length++] = '0' + (char)(magnitude % 10);
+    
+    return length;
+}
+
+static void send_response(int32_t result)
+{
+    char text[20];
+    uint32_t length;
+    
+    if (result == GCODE_OK || result == GCODE_INFO_BLOCK_DELETE)
+    {
+        tx_put("ok\r\n", 4);
+        return;
+    }
+    
+    memcpy(text, "error:", 6);
+    length = 6;
+    length += append_decimal(&text[length], (uint32_t)result);
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+}
+
+static void send_build_info(void)
+{
+    char text[32];
+    uint32_t length;
+    
+    // [OPT:<options>,<planner blocks>,<rx buffer bytes>]
+    memcpy(text, "[OPT:,", 6);
+    length = 6;
+    length += append_decimal(&text[length], CONVEYOR_QUEUE_LENGTH - 1);
+    text[length++] = ',';
+    length += append_decimal(&text[length], SERIAL_RX_CAPACITY);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put("[VER:1.1h.OrionPlus:]\r\n", 23);
+    tx_put(text, length);
+}
+
+// Status reports
+//
+//  <State|MPos:x,y,z|WCO:x,y,z|Bf:blocks,bytes|FS:feed,rpm|Ln:line>
+//
+// WCO is the work coordinate offset (WPos = MPos - WCO). Bf gives the free planner blocks
+// and free RX bytes. A '?' query always gets every field. Automatic reports ($R<hz>) only
+// carry the fields that changed since the previous report, the state is always present.
+
+typedef struct STATUS_REPORT_SNAPSHOT
+{
+    const char* State;
+    int32_t     MachinePos[COORDINATE_LINEAR_AXES_COUNT];
+    int32_t     WorkOffset[COORDINATE_LINEAR_AXES_COUNT];
+    uint32_t    PlannerFree;
+    uint32_t    RxFree;
+    uint32_t    FeedRate;
+    uint32_t    SpindleRPM;
+    uint32_t    LineNumber;
+
+}STATUS_REPORT_SNAPSHOT;
+
+#define SERIAL_STATUS_MAX_RATE_HZ       50
+
+// Longest report: every field, the longest state ("Alarm", "Check"), 32 bit values at their
+// widest (-2147483.648 with 3 decimals, 4294967295)
+#define STATUS_STATE_MAX_LENGTH         5
+#define STATUS_FIXED3_MAX_LENGTH        12
+#define STATUS_DECIMAL_MAX_LENGTH       10
+#define STATUS_AXES_MAX_LENGTH          (6 + COORDINATE_LINEAR_AXES_COUNT * (STATUS_FIXED3_MAX_LENGTH + 1))
+#define STATUS_PAIR_MAX_LENGTH          (4 + 2 * STATUS_DECIMAL_MAX_LENGTH + 1)
+#define STATUS_REPORT_MAX_LENGTH        (1 + STATUS_STATE_MAX_LENGTH + 2 * STATUS_AXES_MAX_LENGTH + \
+                                         2 * STATUS_PAIR_MAX_LENGTH + 4 + STATUS_DECIMAL_MAX_LENGTH + 3)
+#define STATUS_REPORT_BUFFER_SIZE       192
+
+// Fails to compile if the longest report doesn't fit
+typedef char status_report_fits[(STATUS_REPORT_MAX_LENGTH <= STATUS_REPORT_BUFFER_SIZE) ? 1 : -1];
+
+static GLOBAL_STATUS_REPORT_DATA    status_data;
+static STATUS_REPORT_SNAPSHOT       status_last;
+static bool                         status_last_valid = false;
+
+static TickType_t                   status_period = 0;      // Automatic reports off
+static TickType_t                   status_last_tick;
+
+static void take_status_snapshot(STATUS_REPORT_SNAPSHOT& snapshot)
+{
+    uint32_t axis;
+    uint32_t planner_count;
+    
+    machine->GetGlobalStatusReport(status_data);
+    planner_count = machine->GetPlannerQueueCount();
+    
+    if (status_data.SystemHalted != false)
+        snapshot.State = "Alarm";
+    else if (machine->IsHomingNow() != false)
+        snapshot.State = "Home";
+    else if (status_data.FeedHoldActive != false)
+        snapshot.State = "Hold";
+    else if (status_data.CheckModeEnabled != false)
+        snapshot.State = "Check";
+    else if (status_data.SteppersEnabled != false || planner_count != 0)
+        snapshot.State = "Run";
+    else
+        snapshot.State = "Idle";
+    
+    for (axis = COORD_X; axis < COORDINATE_LINEAR_AXES_COUNT; axis++)
+    {
+        snapshot.MachinePos[axis] = to_fixed3(status_data.CurrentPositions[axis]);
+        snapshot.WorkOffset[axis] = to_fixed3(status_data.OriginCoordinates[axis] + status_data.OffsetCoordinates[axis]);
+    }
+    
+    snapshot.PlannerFree = (CONVEYOR_QUEUE_LENGTH - 1) - planner_count;
+    // A sender that does not count can fill the FIFO past the capacity
+    snapshot.RxFree = SERIAL_RX_CAPACITY - std::min(tud_cdc_n_available(0), (uint32_t)SERIAL_RX_CAPACITY);
+    
+    // Feed rate is kept in mm/s, reported in mm/min
+    snapshot.FeedRate = (uint32_t)(status_data.CurrentFeedRate * 60.0f + 0.5f);
+    snapshot.SpindleRPM = status_data.CurrentSpindleRPM;
+    snapshot.LineNumber = status_data.CurrentLineNumber;
+}
+
+static uint32_t append_axes(char* text, const char* label, const int32_t* values)
+{
+    uint32_t length = strlen(label);
+    uint32_t axis;
+    
+    memcpy(text, label, length);
+    
+    for (axis = COORD_X; axis < COORDINATE_LINEAR_AXES_COUNT; axis++)
+    {
+        if (axis != COORD_X)
+            text[length++] = ',';
         
-            if (ch_counter < (RX_BUFFER_SIZE + 1))
-            {
-                // We still have space available in the line buffer
-                if (ch == '\n')
-                {
-                    // End of line. Check for previous \r
-                    if (prev_ch == '\r')
-                        ch_counter--;
-                    
-                    line[ch_counter] = '\0';
-                    
-                    // Reset counter and call to process line 
-                    // Not allow the modification of line_buffer during processing
-                    ch_counter = 0;
-                    prev_ch = 0;    // ???
-                    
-                    allow_processing = true;                    
-                }
-                else if (ch == '\b')
-                {
-                    // Backspace support
-                    if (ch_counter > 0)
-                        ch_counter--;
-                }
-                else
-                {
-                    line[ch_counter++] = ch;
-                    prev_ch = ch;
-                }
-            }
-            else
-            {
-                // There is no more space available. Send the line 'as is'. 
-                line[RX_BUFFER_SIZE] = '\0';
-                allow_processing = true;
-            }
-        }
+        length += append_fixed3(&text[length], values[axis]);
+    }
+    
+    return length;
+}
 
-        if (allow_processing == true)
-        {
-            const char* msg = machine->GetGCodeErrorText(machine->ParseGCodeLine(line));
-            
-            // Send back response            
-            if (*line != '\0')
-            {
-                tud_cdc_n_write_str(0, line);
-                tud_cdc_n_write_str(0, " >> ");
-            }
+static uint32_t append_pair(char* text, const char* label, uint32_t first, uint32_t second)
+{
+    uint32_t length = strlen(label);
+    
+    memcpy(text, label, length);
+    length += append_decimal(&text[length], first);
+    text[length++] = ',';
+    length += append_decimal(&text[length], second);
+    
+    return length;
+}
+
+static void send_status_report(bool full)
+{
+    STATUS_REPORT_SNAPSHOT now;
+    char text[STATUS_REPORT_BUFFER_SIZE];
+    uint32_t length;
+    
+    take_status_snapshot(now);
+    
+    if (status_last_valid == false)
+        full = true;
+    
+    text[0] = '<';
+    length = 1;
+    
+    memcpy(&text[length], now.State, strlen(now.State));
+    length += strlen(now.State);
+    
+    if (full != false || memcmp(now.MachinePos, status_last.MachinePos, sizeof(now.MachinePos)) != 0)
+        length += append_axes(&text[length], "|MPos:", now.MachinePos);
+    
+    if (full != false || memcmp(now.WorkOffset, status_last.WorkOffset, sizeof(now.WorkOffset)) != 0)
+        length += append_axes(&text[length], "|WCO:", now.WorkOffset);
+    
+    if (full != false || now.PlannerFree != status_last.PlannerFree || now.RxFree != status_last.RxFree)
+        length += append_pair(&text[length], "|Bf:", now.PlannerFree, now.RxFree);
+    
+    if (full != false || now.FeedRate != status_last.FeedRate || now.SpindleRPM != status_last.SpindleRPM)
+        length += append_pair(&text[length], "|FS:", now.FeedRate, now.SpindleRPM);
+    
+    if (full != false || now.LineNumber != status_last.LineNumber)
+    {
+        memcpy(&text[length], "|Ln:", 4);
+        length += 4;
+        length += append_decimal(&text[length], now.LineNumber);
+    }
+    
+    text[length++] = '>';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+    
+    memcpy((void*)&status_last, (const void*)&now, sizeof(status_last));
+    status_last_valid = true;
+    status_last_tick = xTaskGetTickCount();
+}
+
+// $R<hz> sets the automatic report rate, $R0 (or $R) turns them off
+static void set_status_report_rate(const char* args)
+{
+    uint32_t rate = 0;
+    
+    while (*args >= '0' && *args <= '9')
+        rate = (rate * 10) + (uint32_t)(*args++ - '0');
+    
+    if (rate > SERIAL_STATUS_MAX_RATE_HZ)
+        rate = SERIAL_STATUS_MAX_RATE_HZ;
+    
+    status_period = (rate != 0) ? (configTICK_RATE_HZ / rate) : 0;
+    status_last_tick = xTaskGetTickCount();
+    
+    // Next report is a full one
+    status_last_valid = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SERIAL_REALTIME_STATUS_REPORT   '?'
+#define SERIAL_REALTIME_FEED_HOLD       '!'
+#define SERIAL_REALTIME_CYCLE_START     '~'
+#define SERIAL_REALTIME_RESET           0x18    // Ctrl-X
+
+#define SERIAL_REALTIME_POLL_TIME       pdMS_TO_TICKS(10)   // While blocked on the parser
+
+static volatile bool status_report_requested = false;
+
+static volatile bool binary_mode = false;
+static volatile bool upload_mode = false;
+
+static BinaryFraming    framing;
+static FileUpload       upload;
+
+// Returns false if the byte is not a real-time command
+static bool dispatch_realtime_command(uint8_t command)
+{
+    switch (command)
+    {
+        case SERIAL_REALTIME_STATUS_REPORT:
+            // Built and sent by the serial task (see service_realtime_requests)
+            status_report_requested = true;
             
-            tud_cdc_n_write_str(0, msg);
-            tud_cdc_n_write_str(0, "\r\n");
-            tud_cdc_n_write_flush(0);
+            if (serial_task_handle != NULL)
+                xTaskNotifyGive(serial_task_handle);
+            break;
+        
+        case SERIAL_REALTIME_FEED_HOLD:
+            machine->EnterFeedHold();
+            break;
+        
+        case SERIAL_REALTIME_CYCLE_START:
+            machine->ExitFeedHold();
+            break;
+        
+        case SERIAL_REALTIME_RESET:
+            machine->RequestReset();
+            DiskTask_StopJob();
+            break;
+        
+        default:
+            return false;
+    }
+    
+    return true;
+}
 
-            allow_processing = false;            
-        }
-        else if (avail == 0)
+// [Called from the USB task]
+uint32_t SerialTask_FilterRealtimeCommands(uint8_t* data, uint32_t count)
+{
+    uint32_t index;
+    uint32_t kept = 0;
+    
+    // Frames and uploaded files may hold any byte value. Frames carry real-time commands in
+    // REALTIME frames
+    if (binary_mode != false || upload_mode != false)
+        return count;
+    
+    for (index = 0; index < count; index++)
+    {
+        if (dispatch_realtime_command(data[index]) == false)
+            data[kept++] = data[index];
+    }
+    
+    return kept;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Motion telemetry ($T<hz>). Samples are sent in TELEMETRY frames in both protocols, the
+// SOF byte and CRC let the host pick them out of the text responses. A frame fits in tx_buffer,
+// so it goes out whole
+
+#define SERIAL_TELEMETRY_SAMPLES_PER_FRAME  ((TX_BUFFER_SIZE - FRAME_HEADER_SIZE - FRAME_CRC_SIZE) / sizeof(TELEMETRY_SAMPLE))
+#define SERIAL_TELEMETRY_POLL_TIME          pdMS_TO_TICKS(10)
+
+static TELEMETRY_SAMPLE telemetry_samples[SERIAL_TELEMETRY_SAMPLES_PER_FRAME];
+static uint16_t         telemetry_frame_seq;
+
+static void send_telemetry(void)
+{
+    uint32_t count;
+    
+    while ((count = MotionTelemetry::Read(telemetry_samples, SERIAL_TELEMETRY_SAMPLES_PER_FRAME)) != 0)
+    {
+        framing.SendFrame(FRAME_TYPE_TELEMETRY, telemetry_frame_seq++, (const uint8_t*)telemetry_samples, count * sizeof(TELEMETRY_SAMPLE));
+        
+        // Keep whole frames together
+        tx_flush();
+    }
+}
+
+// $T<hz> starts sampling the step ticker, $T0 (or $T) stops it
+static void set_telemetry_rate(const char* args)
+{
+    uint32_t rate = 0;
+    
+    while (*args >= '0' && *args <= '9')
+        rate = (rate * 10) + (uint32_t)(*args++ - '0');
+    
+    telemetry_frame_seq = 0;
+    MotionTelemetry::Start(rate, StepTicker::getInstance()->get_frequency());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Also called while waiting on the parser, so a report never waits for queued lines
+static void service_realtime_requests(void)
+{
+    if (MotionTelemetry::IsEnabled() != false)
+        send_telemetry();
+    
+
+    if (status_report_requested != false)
+    {
+        status_report_requested = false;
+        
+        send_status_report(true);
+        tx_flush();
+    }
+    else if (status_period != 0 && (xTaskGetTickCount() - status_last_tick) >= status_period)
+    {
+        send_status_report(false);
+        tx_flush();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SERIAL_RX_CHUNK_SIZE    64      // One full speed bulk packet
+
+static char     rx_chunk[SERIAL_RX_CHUNK_SIZE];
+static char*    line;
+static uint32_t ch_counter;
+static bool     line_overflow;
+
+// Lines handed to the parsing task, waiting for their result. Binary frames need the seq back
+static uint32_t pending_results;
+static uint32_t pending_first;
+static uint16_t pending_seqs[GCODE_RESULT_QUEUE_LENGTH];
+
+static void send_line_result(int32_t result)
+{
+    uint16_t seq = pending_seqs[pending_first];
+    
+    pending_first = (pending_first + 1) % GCODE_RESULT_QUEUE_LENGTH;
+    pending_results--;
+    
+    if (binary_mode != false)
+        framing.SendResult(seq, result);
+    else
+        send_response(result);
+}
+
+// Sends back the responses already available (in order). With wait set, blocks until at least one is sent
+static void send_pending_results(bool wait)
+{
+    int32_t result;
+    bool sent = false;
+    
+    // Do not keep the host waiting for responses while blocked
+    if (wait != false)
+        tx_flush();
+    
+    while (pending_results != 0)
+    {
+        if (GCodeParsingTask_GetResult(GCODE_SOURCE_SERIAL_CONSOLE, &result, (wait != false && sent == false) ? SERIAL_REALTIME_POLL_TIME : 0) == false)
         {
-            // If there is nothing to process nor data available take a rest
-            vTaskDelay(pdMS_TO_TICKS(50));
+            if (wait == false || sent != false)
+                break;
+            
+            service_realtime_requests();
+            continue;
         }
+        
+        send_line_result(result);
+        sent = true;
+    }
+}
+
+// Never have more lines in flight than the result queue can hold, otherwise the
+// parsing task could block on a full result queue while we block on a full line buffer.
+// With drain_all set, waits for every result (local responses are sent in order)
+static void wait_for_results(bool drain_all)
+{
+    while ((pending_results >= GCODE_RESULT_QUEUE_LENGTH) || 
+           (pending_results != 0 && drain_all != false))
+    {
+        send_pending_results(true);
+    }
+}
+
+static void submit_line(const char* text, uint32_t length, uint16_t seq)
+{
+    wait_for_results(false);
+    
+    // Hand over the line to the parsing task and keep receiving
+    while (GCodeParsingTask_SubmitLine(GCODE_SOURCE_SERIAL_CONSOLE, text, length, SERIAL_REALTIME_POLL_TIME) == false)
+        service_realtime_requests();
+    
+    pending_seqs[(pending_first + pending_results) % GCODE_RESULT_QUEUE_LENGTH] = seq;
+    pending_results++;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void framing_output(const uint8_t* data, uint32_t size, void* context)
+{
+    tx_put((const char*)data, size);
+}
+
+static void framing_deliver(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length, void* context)
+{
+    switch (type)
+    {
+        case FRAME_TYPE_DATA:
+            submit_line((const char*)payload, length, seq);
+            break;
+        
+        case FRAME_TYPE_REALTIME:
+            if (length != 0)
+                dispatch_realtime_command(payload[0]);
+            break;
+        
+        case FRAME_TYPE_EXIT:
+            wait_for_results(true);
+            
+            binary_mode = false;
+            send_response(GCODE_OK);
+            break;
+    }
+}
+
+// $B[window] switches to the binary framed transport
+static void enter_binary_mode(const char* args)
+{
+    char text[32];
+    uint32_t length;
+    uint32_t window = 0;
+    
+    while (*args >= '0' && *args <= '9')
+        window = (window * 10) + (uint32_t)(*args++ - '0');
+    
+    framing.Reset(window);
+    
+    // [BIN:<window>,<max payload>]
+    memcpy(text, "[BIN:", 5);
+    length = 5;
+    length += append_decimal(&text[length], framing.GetWindow());
+    text[length++] = ',';
+    length += append_decimal(&text[length], FRAME_MAX_PAYLOAD);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+    send_response(GCODE_OK);
+    tx_flush();
+    
+    binary_mode = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void process_rx_chunk(const char* data, uint32_t size);
+
+// $U<size>,<name> uploads a file to the SD card (see FileUpload.h)
+static void start_upload(const char* args)
+{
+    uint32_t size = 0;
+    int32_t result;
+    
+    while (*args >= '0' && *args <= '9')
+        size = (size * 10) + (uint32_t)(*args++ - '0');
+    
+    if (*args++ != ',')
+        result = GCODE_ERROR_INVALID_FILE_REQUEST;
+    else
+        result = upload.Begin(args, size);
+    
+    // The host sends the data once it gets the "ok", so nothing is filtered by mistake
+    if (result == GCODE_OK)
+        upload_mode = true;
+    
+    send_response(result);
+    tx_flush();
+}
+
+static void finish_upload(void)
+{
+    UPLOAD_STATS stats;
+    char text[48];
+    uint32_t length;
+    int32_t result;
+    
+    upload_mode = false;
+    result = upload.Finish(stats);
+    
+    // [UPL:<bytes>,<ms>,<KB/s>]
+    length = append_pair(text, "[UPL:", stats.Bytes, stats.Milliseconds);
+    text[length++] = ',';
+    length += append_decimal(&text[length], stats.KBytesPerSecond);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+    send_response(result);
+    tx_flush();
+}
+
+static void abort_upload(int32_t result)
+{
+    upload_mode = false;
+    upload.Abort();
+    
+    if (result != GCODE_OK)
+    {
+        send_response(result);
+        tx_flush();
+    }
+}
+
+static void feed_upload(const char* data, uint32_t size)
+{
+    uint32_t taken = upload.Feed((const uint8_t*)data, size);
+    
+    if (upload.IsComplete() != false)
+    {
+        finish_upload();
+        
+        // The host may not have waited for the result to send its next line
+        if (taken < size)
+            process_rx_chunk(&data[taken], size - taken);
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-extern "C" void USART1_IRQHandler(void)
+// Pipeline report
+//
+//  $P          [PIPE:<lines>,<lines/s>,<parser busy %>,<planner busy %>,<line buffer peak bytes>,
+//              <planner lines peak>,<planner blocks>] the parsing and planning stages
+//              (GCodeParsingTask_GetStats): rates, busy times and blocks of the last second,
+//              peaks since power up
+
+static void send_pipeline_report(void)
+{
+    GCODE_PIPELINE_STATS stats;
+    char text[96];
+    uint32_t length;
+    
+    GCodeParsingTask_GetStats(&stats);
+    
+    memcpy(text, "[PIPE:", 6);
+    length = 6;
+    length += append_decimal(&text[length], stats.LinesProcessed);
+    length += append_pair(&text[length], ",", stats.LinesPerSecond, stats.ParserBusyPercent);
+    length += append_pair(&text[length], ",", stats.PlannerBusyPercent, stats.LineBufferPeak);
+    length += append_pair(&text[length], ",", stats.PlannerLinesPeak, stats.PlannerQueueBlocks);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Memory report
+//
+//  $M          [MEM:<heap free>,<heap free minimum>,<heap size>] bytes of the FreeRTOS heap (the
+//              CCM, budget in FreeRTOSConfig.h), the minimum since power up. Then for each task of
+//              user_tasks.cpp [STK:<name>,<stack words never used>]
+
+static void send_memory_report(void)
+{
+    const TaskHandle_t tasks[] = { usb_task_handle, disk_task_handle, gcode_task_handle, gcode_plan_task_handle,
+                                   serial_task_handle, debug_log_task_handle, settings_task_handle };
+    const char* name;
+    char text[48];
+    uint32_t length;
+    uint32_t index;
+    
+    length = append_pair(text, "[MEM:", (uint32_t)xPortGetFreeHeapSize(), (uint32_t)xPortGetMinimumEverFreeHeapSize());
+    text[length++] = ',';
+    length += append_decimal(&text[length], configTOTAL_HEAP_SIZE);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+    
+    for (index = 0; index < sizeof(tasks) / sizeof(tasks[0]); index++)
+    {
+        if (tasks[index] == NULL)
+            continue;
+        
+        name = pcTaskGetName(tasks[index]);
+        length = std::min((uint32_t)strlen(name), (uint32_t)configMAX_TASK_NAME_LEN);
+        
+        memcpy(text, "[STK:", 5);
+        memcpy(&text[5], name, length);
+        length += 5;
+        text[length++] = ',';
+        length += append_decimal(&text[length], (uint32_t)uxTaskGetStackHighWaterMark(tasks[index]));
+        text[length++] = ']';
+        text[length++] = '\r';
+        text[length++] = '\n';
+        
+        tx_put(text, length);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Check mode
+//
+//  $C          Toggles the check mode: the lines are parsed and planned, nothing moves
+//              (MachineCore::SetCheckMode). Leaving it, the estimate follows the ok:
+//              [EST:<seconds>,<blocks>] planned time of the moves and dwells of the check
+
+static void send_check_report(void)
+{
+    uint64_t milliseconds = machine->GetCheckTime_ms();
+    uint32_t fraction = (uint32_t)(milliseconds % 1000);
+    char text[40];
+    uint32_t length;
+    
+    // Long jobs don't fit append_fixed3
+    memcpy(text, "[EST:", 5);
+    length = 5;
+    length += append_decimal(&text[length], (uint32_t)(milliseconds / 1000));
+    text[length++] = '.';
+    text[length++] = '0' + (char)(fraction / 100);
+    text[length++] = '0' + (char)((fraction / 10) % 10);
+    text[length++] = '0' + (char)(fraction % 10);
+    text[length++] = ',';
+    length += append_decimal(&text[length], machine->GetCheckBlocks());
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+}
+
+static void process_check_command(void)
+{
+    bool was_active = machine->IsCheckModeActive();
+    
+    // Toggled by the parsing task, in line with the lines of the other sources
+    submit_line(line, ch_counter, 0);
+    wait_for_results(true);
+    
+    if (was_active != false && machine->IsCheckModeActive() == false)
+        send_check_report();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// SD card jobs
+//
+//  $F=<name>   Runs the file (answered once it started)
+//  $FX         Stops the running file, the lines already sent to the parser still run
+//  $F          [JOB:<state>,<lines>,<lines/s>,<min margin bytes>,<underruns>]
+//  $FB         Raw read benchmark of the card, results on the debug log (disk_task.h)
+//  $FR         Resumes the job of the last checkpoint (power loss, stop or error)
+//  $FL<n>=<name>
+//              Runs the file from line n (1 based, blank lines count), the lines before it are
+//              scanned for the modal state and position (disk_task.h)
+//  $FC         [CKP:<name>,<line>,<offset>] last job checkpoint, [CKP:None] if nothing to resume
+
+static void send_job_report(void)
+{
+    static const char* const state_names[] = { "Idle", "Run", "Done", "Error", "Stopped" };
+    
+    DISK_JOB_STATS stats;
+    char text[80];
+    uint32_t length;
+    
+    DiskTask_GetJobStats(&stats);
+    
+    memcpy(text, "[JOB:", 5);
+    length = 5;
+    
+    memcpy(&text[length], state_names[stats.State], strlen(state_names[stats.State]));
+    length += strlen(state_names[stats.State]);
+    
+    if (stats.State == DISK_JOB_FAILED)
+    {
+        text[length++] = ':';
+        length += append_decimal(&text[length], (uint32_t)stats.Result);
+    }
+    
+    length += append_pair(&text[length], ",", stats.Lines, stats.LinesPerSecond);
+    length += append_pair(&text[length], ",", stats.MinMargin, stats.Underruns);
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+}
+
+static void send_checkpoint_report(void)
+{
+    JOB_CHECKPOINT checkpoint;
+    char text[JOB_CHECKPOINT_MAX_NAME + 40];
+    uint32_t length;
+    
+    memcpy(text, "[CKP:", 5);
+    length = 5;
+    
+    if (JobCheckpoint::GetLatest(&checkpoint) != false)
+    {
+        memcpy(&text[length], checkpoint.FileName, strlen(checkpoint.FileName));
+        length += strlen(checkpoint.FileName);
+        length += append_pair(&text[length], ",", checkpoint.LineNumber, checkpoint.LineOffset);
+    }
+    else
+    {
+        memcpy(&text[length], "None", 4);
+        length += 4;
+    }
+    
+    text[length++] = ']';
+    text[length++] = '\r';
+    text[length++] = '\n';
+    
+    tx_put(text, length);
+}
+
+static void process_restart_command(const char* args)
+{
+    uint32_t number = 0;
+    
+    while (*args >= '0' && *args <= '9')
+        number = (number * 10) + (uint32_t)(*args++ - '0');
+    
+    if (*args != '=')
+        send_response(GCODE_ERROR_INVALID_FILE_REQUEST);
+    else
+        send_response(DiskTask_RestartJob(&args[1], number));
+}
+
+static void process_job_command(const char* args)
 {
-    char ch;
+    if (args[0] == '=')
+    {
+        send_response(DiskTask_StartJob(&args[1]));
+    }
+    else if (args[0] == 'L' || args[0] == 'l')
+    {
+        process_restart_command(&args[1]);
+    }
+    else if ((args[0] == 'X' || args[0] == 'x') && args[1] == '\0')
+    {
+        DiskTask_StopJob();
+        send_response(GCODE_OK);
+    }
+    else if ((args[0] == 'B' || args[0] == 'b') && args[1] == '\0')
+    {
+        send_response(DiskTask_StartBenchmark());
+    }
+    else if ((args[0] == 'R' || args[0] == 'r') && args[1] == '\0')
+    {
+        send_response(DiskTask_ResumeJob());
+    }
+    else if ((args[0] == 'C' || args[0] == 'c') && args[1] == '\0')
+    {
+        send_checkpoint_report();
+        send_response(GCODE_OK);
+    }
+    else
+    {
+        send_job_report();
+        send_response(GCODE_OK);
+    }
+}
+
+// $S writes the settings still waiting in the settings task, answered once they are in flash
+// (controlled power off)
+#define SERIAL_SETTINGS_FLUSH_TIMEOUT   pdMS_TO_TICKS(2000)     // Sector erase worst case 400 ms
+
+static void process_line(void)
+{
+    char* src;
+    char* dst;
+    
+    // Backspace support (interactive terminals). Rare, so it is applied on the complete line
+    if (memchr(line, '\b', ch_counter) != NULL)
+    {
+        for (src = dst = line; src < &line[ch_counter]; src++)
+        {
+            if (*src != '\b')
+                *dst++ = *src;
+            else if (dst != line)
+                dst--;
+        }
+        
+        ch_counter = (uint32_t)(dst - line);
+    }
+    
+    // Drop a trailing \r
+    if (ch_counter > 0 && line[ch_counter - 1] == '\r')
+        ch_counter--;
+    
+    line[ch_counter] = '\0';
+    
+    if (line_overflow != false || line[0] == '$')
+        wait_for_results(true);
     
-    // Check if rx'd something
-    if (__HAL_UART_GET_FLAG(&debug_uart_handle, UART_FLAG_RXNE))
+    if (line_overflow != false)
     {
-        // Rx Interrupt
-        ch = (char)debug_uart_handle.Instance->DR;
+        send_response(GCODE_ERROR_LINE_TOO_LONG);
     }
+    else if (line[0] == '$' && (line[1] == 'I' || line[1] == 'i') && line[2] == '\0')
+    {
+        send_build_info();
+        send_response(GCODE_OK);
+    }
+    else if (line[0] == '$' && (line[1] == 'P' || line[1] == 'p') && line[2] == '\0')
+    {
+        send_pipeline_report();
+        send_response(GCODE_OK);
+    }
+    else if (line[0] == '$' && (line[1] == 'M' || line[1] == 'm') && line[2] == '\0')
+    {
+        send_memory_report();
+        send_response(GCODE_OK);
+    }
+    else if (line[0] == '$' && (line[1] == 'B' || line[1] == 'b'))
+    {
+        enter_binary_mode(&line[2]);
+    }
+    else if (line[0] == '$' && (line[1] == 'R' || line[1] == 'r'))
+    {
+        set_status_report_rate(&line[2]);
+        send_response(GCODE_OK);
+    }
+    else if (line[0] == '$' && (line[1] == 'T' || line[1] == 't'))
+    {
+        set_telemetry_rate(&line[2]);
+        send_response(GCODE_OK);
+    }
+    else if (line[0] == '$' && (line[1] == 'U' || line[1] == 'u'))
+    {
+        start_upload(&line[2]);
+    }
+    else if (line[0] == '$' && (line[1] == 'F' || line[1] == 'f'))
+    {
+        process_job_command(&line[2]);
+    }
+    else if (line[0] == '$' && (line[1] == 'C' || line[1] == 'c') && line[2] == '\0')
+    {
+        process_check_command();
+    }
+    else if (line[0] == '$' && (line[1] == 'S' || line[1] == 's') && line[2] == '\0')
+    {
+        // Before switching off: settings saved with M38 may still be waiting for the quiet time
+        send_response(SettingsTask_Flush(SERIAL_SETTINGS_FLUSH_TIMEOUT) ? GCODE_OK : GCODE_ERROR_SETTINGS_NOT_SAVED);
+    }
+    else
+    {
+        submit_line(line, ch_counter, 0);
+    }
+    
+    ch_counter = 0;
+    line_overflow = false;
+}
+
+// Splits a block of received bytes into lines
+static void process_rx_chunk(const char* data, uint32_t size)
+{
+    const char* end = data + size;
+    const char* eol;
+    uint32_t length;
     
-    if ( (__HAL_UART_GET_FLAG(&debug_uart_handle, UART_FLAG_TXE)) && 
-         ((debug_uart_handle.Instance->CR1 & USART_CR1_TXEIE) == USART_CR1_TXEIE))
+    while (data < end)
     {
-        // Tx Interrupt
-        /* The interrupt was caused by the THR becoming empty.  Are there any
-		more characters to transmit? */
-        // Disable if no more data
-        __HAL_UART_DISABLE_IT(&debug_uart_handle, UART_IT_TXE);
+        // memchr works a word at a time, much faster than testing each byte here
+        eol = (const char*)memchr(data, '\n', (size_t)(end - data));
+        length = (uint32_t)(((eol != NULL) ? eol : end) - data);
+        
+        if (length > (RX_BUFFER_SIZE - ch_counter))
+        {
+            // No more space available. Discard up to the end of the line, which is still
+            // answered with a single response so the sender's character count stays valid
+            length = RX_BUFFER_SIZE - ch_counter;
+            line_overflow = true;
+        }
+        
+        memcpy(&line[ch_counter], data, length);
+        ch_counter += length;
+        
+        if (eol == NULL)
+            break;
+        
+        process_line();
+        data = eol + 1;
+        
+        // The rest is file data
+        if (upload_mode != false)
+        {
+            feed_upload(data, (uint32_t)(end - data));
+            break;
+        }
+    }
+}
+
+void SerialTask_Entry(void * pvParam)
+{   
+    uint32_t received;
+    TickType_t wait;
+    bool connected = false;
+    
+    /* Reserve memory for line copy/processing */
+    line = new char[RX_BUFFER_SIZE + 1];
+    
+    ch_counter = 0;
+    line_overflow = false;
+    pending_results = 0;
+    pending_first = 0;
+    tx_count = 0;
+    
+    framing.AssociateOutput(framing_output, NULL);
+    framing.AssociateDelivery(framing_deliver, NULL);
+    
+    GCodeParsingTask_SetResultNotify(GCODE_SOURCE_SERIAL_CONSOLE, serial_task_handle);
+    
+    for ( ; ; )
+    {
+        // Greet the host each time a terminal opens the port
+        if (tud_cdc_n_connected(0) != connected)
+        {
+            connected = !connected;
+            
+            // A new session always starts with the text protocol and no automatic reports
+            binary_mode = false;
+            status_period = 0;
+            MotionTelemetry::Stop();
+            
+            if (upload_mode != false)
+                abort_upload(GCODE_OK);
+            
+            if (connected != false)
+            {
+                tx_put(hello_msg, strlen(hello_msg));
+                tx_flush();
+            }
+        }
+        
+        service_realtime_requests();
+        
+        // Drain the CDC FIFO in bulk
+        while ((received = tud_cdc_n_read(0, rx_chunk, sizeof(rx_chunk))) != 0)
+        {
+            if (upload_mode != false)
+                feed_upload(rx_chunk, received);
+            else if (binary_mode != false)
+            {
+                framing.Feed((const uint8_t*)rx_chunk, received);
+                
+                if (framing.IsAckPending() != false)
+                    framing.SendAck();
+            }
+            else
+                process_rx_chunk(rx_chunk, received);
+            
+            send_pending_results(false);
+            
+            // A sender that keeps the FIFO full would never let this loop end, and the parser
+            // may take each line before the submit wait runs out
+            service_realtime_requests();
+        }
+        
+        send_pending_results(false);
+        
+        if (upload_mode != false && upload.IsTimedOut() != false)
+            abort_upload(GCODE_ERROR_UPLOAD_TIMEOUT);
+        
+        // More responses on the way can share the packet, unless the batch is getting old
+        wait = portMAX_DELAY;
+        
+        if (status_period != 0)
+        {
+            TickType_t elapsed = xTaskGetTickCount() - status_last_tick;
+            
+            wait = (elapsed < status_period) ? (status_period - elapsed) : 0;
+        }
+        
+        // Nothing signals new samples, poll the ring often enough for it not to overflow
+        if (MotionTelemetry::IsEnabled() != false)
+            wait = std::min(wait, SERIAL_TELEMETRY_POLL_TIME);
+        
+        if (upload_mode != false)
+            wait = std::min(wait, UPLOAD_TIMEOUT);
+        
+        if (tx_count != 0)
+        {
+            TickType_t age = xTaskGetTickCount() - tx_first_tick;
+            
+            if (pending_results == 0 || age >= SERIAL_TX_FLUSH_DEADLINE)
+                tx_flush();
+            else
+                wait = std::min(wait, SERIAL_TX_FLUSH_DEADLINE - age);
+        }
+        
+        // Sleep until new data arrives (tud_cdc_rx_cb), a result is ready, the port state changes
+        // or the pending responses have to go out
+        ulTaskNotifyTake(pdTRUE, wait);
     }
 }
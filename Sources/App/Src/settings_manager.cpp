@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "FreeRTOS.h"
+#include "task.h"
 
 #include "spi_ports.h"
 #include "settings_manager.h"
@@ -17,6 +18,14 @@ void HAL_CRC_MspInit(CRC_HandleTypeDef *hcrc)
 
 // Define m_data as a static member of Settings_Manager class
 SETTINGS_DATA* Settings_Manager::m_data;
+SETTINGS_DATA* Settings_Manager::m_saved;
+
+uint32_t Settings_Manager::m_journal_sector = 0;
+uint32_t Settings_Manager::m_journal_sequence = 0;
+uint32_t Settings_Manager::m_journal_address = 0;
+
+// Journal record being written or replayed
+static uint32_t journal_record[SETTINGS_JOURNAL_MAX_RECORD_WORDS];
 
 void Settings_Manager::Initialize()
 {
@@ -37,15 +46,21 @@ int Settings_Manager::Load()
     SETTINGS_DATA * pData;
     uint32_t read_data_crc;    
     
+    if (Journal_Load() != false)
+        return 0;
+    
+    // No journal yet, the first save writes one
+    m_journal_address = 0;
+    
     pData = (SETTINGS_DATA*)pvPortMalloc(SETTINGS_DATA_SIZE_BYTES);
     
     if (pData != NULL)
     {
-        // Try to read data from flash memory
+        // Try to read data from flash memory (single copy format)
         W25QXX_Read((uint8_t*)pData, SETTINGS_DATA_START_ADDRESS, SETTINGS_DATA_SIZE_BYTES);
         
         // Calculate read data CRC and check against retrieved value
-        read_data_crc = HAL_CRC_Calculate(&CrcHandle, (uint32_t*)pData, SETTINGS_DATA_SIZE_WORDS_NO_CRC);
+        read_data_crc = CalculateCRC((const uint32_t*)pData, SETTINGS_DATA_SIZE_WORDS_NO_CRC);
         
         if ((read_data_crc != pData->settings_crc) ||
            (pData->settings_header != SETTINGS_HEADER_VALUE)) 
@@ -73,42 +88,331 @@ int Settings_Manager::Load()
     return 1;
 }
 
+// Called from the settings task only (and from Initialize, before the scheduler starts). It
+// is the one task writing to the flash, the job checkpoints included, so the W25QXX calls here
+// need no mutex
 void Settings_Manager::Save()
 {
-    const uint32_t FLASH_PAGE_SIZE = 256;
+    uint32_t payload_words = 0;
+    
+    m_data->settings_crc = CalculateCRC((const uint32_t*)m_data, SETTINGS_DATA_SIZE_WORDS_NO_CRC);
+    
+    // Saved from the settings task while the parser may be changing them. The record is built
+    // from a consistent copy, changes made after it go with the next save
+    vTaskSuspendAll();
+    
+    if (m_journal_address != 0)
+        payload_words = Journal_BuildChanges();
+    
+    memcpy((void*)m_saved, (const void*)m_data, SETTINGS_DATA_SIZE_BYTES);
+    xTaskResumeAll();
+    
+    if (m_journal_address == 0)
+    {
+        Journal_Compact();
+        return;
+    }
+    
+    // Only if something changed then update flash
+    if (payload_words == 0)
+        return;
+    
+    // Sector full, continue in the next one
+    if (Journal_Append(payload_words) == false)
+        Journal_Compact();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Replays the newest sector. An older one is used if that fails (it shouldn't, a sector header
+// is only written after its full copy)
+bool Settings_Manager::Journal_Load(void)
+{
+    uint32_t header[2];
+    uint32_t sequences[SETTINGS_JOURNAL_SECTORS];
+    bool valid[SETTINGS_JOURNAL_SECTORS];
+    uint32_t sector;
+    uint32_t newest;
     
-    uint32_t bytes_to_write;
-    uint32_t new_crc = HAL_CRC_Calculate(&CrcHandle, (uint32_t*)m_data, SETTINGS_DATA_SIZE_WORDS_NO_CRC);
-    uint32_t addr = SETTINGS_DATA_START_ADDRESS;
-    uint32_t total_len = SETTINGS_DATA_SIZE_BYTES;
-    uint8_t * data_ptr = (uint8_t*)(m_data);
+    m_journal_sector = 0;
+    m_journal_sequence = 0;
     
-    // Only if something changed then update flash    
-    if (new_crc != m_data->settings_crc)
+    for (sector = 0; sector < SETTINGS_JOURNAL_SECTORS; sector++)
     {
-        // Update settings CRC, erase sector (4K) and write settings to flash
-        m_data->settings_crc = new_crc;
-    
-        // Erase sector
-        W25QXX_Erase_Sector(SETTINGS_DATA_START_ADDRESS);
-        
-        while (total_len != 0)
-        {    
-            // Restrict data count to max page size
-            if (total_len > FLASH_PAGE_SIZE)
-                bytes_to_write = FLASH_PAGE_SIZE;
-            else
-                bytes_to_write = total_len;
+        W25QXX_Read((uint8_t*)header, SETTINGS_DATA_START_ADDRESS + sector * SETTINGS_JOURNAL_SECTOR_SIZE, sizeof(header));
+        
+        valid[sector] = (header[0] == SETTINGS_JOURNAL_SECTOR_MAGIC);
+        sequences[sector] = header[1];
+        
+        // New sectors must get a sequence above any sector still on the flash
+        if (valid[sector] != false && (int32_t)(header[1] - m_journal_sequence) > 0)
+            m_journal_sequence = header[1];
+    }
+    
+    for ( ; ; )
+    {
+        newest = SETTINGS_JOURNAL_SECTORS;
+        
+        for (sector = 0; sector < SETTINGS_JOURNAL_SECTORS; sector++)
+        {
+            if (valid[sector] != false && (newest == SETTINGS_JOURNAL_SECTORS || (int32_t)(sequences[sector] - sequences[newest]) > 0))
+                newest = sector;
+        }
+        
+        if (newest == SETTINGS_JOURNAL_SECTORS)
+            return false;
+        
+        m_journal_sector = newest;
+        
+        if (Journal_Replay(newest) != false)
+        {
+            // Fell back to an older sector, move on to a new one with the next save
+            if (sequences[newest] != m_journal_sequence)
+                m_journal_address = 0;
             
-            // Write data page (up to 256 bytes)
-            W25QXX_Write_Page(data_ptr, addr, bytes_to_write);
+            return true;
+        }
+        
+        valid[newest] = false;
+    }
+}
+
+bool Settings_Manager::Journal_Replay(uint32_t sector)
+{
+    const uint32_t base = SETTINGS_DATA_START_ADDRESS + sector * SETTINGS_JOURNAL_SECTOR_SIZE;
+    const uint32_t end = base + SETTINGS_JOURNAL_SECTOR_SIZE;
+    
+    uint32_t* words = (uint32_t*)m_data;
+    uint32_t address = base + SETTINGS_JOURNAL_HEADER_SIZE;
+    uint32_t payload_words;
+    uint32_t index;
+    uint32_t first;
+    uint32_t count;
+    
+    // Stays 0 (full copy on the next save) unless the end of the log is found
+    m_journal_address = 0;
+    
+    while ((end - address) >= 4)
+    {
+        W25QXX_Read((uint8_t*)journal_record, address, 4);
+        
+        if (journal_record[0] == 0xFFFFFFFF)
+        {
+            // A torn write may have left bits programmed further on, appends need erased flash
+            if (Journal_IsErased(address, end - address) != false)
+                m_journal_address = address;
+            
+            break;
+        }
+        
+        payload_words = journal_record[0] & 0xFFFF;
+        
+        // Anything else is a record torn by a power cut
+        if ((journal_record[0] >> 16) != SETTINGS_JOURNAL_RECORD_MAGIC ||
+            payload_words > (SETTINGS_JOURNAL_MAX_RECORD_WORDS - 2) ||
+            (end - address) < ((payload_words + 2) * 4))
+            break;
+        
+        W25QXX_Read((uint8_t*)&journal_record[1], address + 4, (payload_words + 1) * 4);
+        
+        if (CalculateCRC(journal_record, payload_words + 1) != journal_record[payload_words + 1])
+            break;
+        
+        // The runs must stay inside the settings, all checked before any is applied
+        for (index = 1; index <= payload_words; index += count + 1)
+        {
+            first = journal_record[index] >> 16;
+            count = journal_record[index] & 0xFFFF;
+            
+            if (count == 0 || (first + count) > SETTINGS_DATA_SIZE_WORDS_NO_CRC || (index + count) > payload_words)
+                break;
+        }
+        
+        if (index != (payload_words + 1))
+            break;
+        
+        // The first record is the full copy
+        if (address == (base + SETTINGS_JOURNAL_HEADER_SIZE) &&
+            (payload_words != (SETTINGS_DATA_SIZE_WORDS_NO_CRC + 1) || journal_record[1] != SETTINGS_DATA_SIZE_WORDS_NO_CRC))
+            return false;
+        
+        for (index = 1; index <= payload_words; index += count + 1)
+        {
+            first = journal_record[index] >> 16;
+            count = journal_record[index] & 0xFFFF;
+            
+            memcpy(&words[first], &journal_record[index + 1], count * 4);
+        }
+        
+        address += (payload_words + 2) * 4;
+    }
+    
+    if (address == (base + SETTINGS_JOURNAL_HEADER_SIZE) || m_data->settings_header != SETTINGS_HEADER_VALUE)
+        return false;
+    
+    m_data->settings_crc = CalculateCRC((const uint32_t*)m_data, SETTINGS_DATA_SIZE_WORDS_NO_CRC);
+    memcpy((void*)m_saved, (const void*)m_data, SETTINGS_DATA_SIZE_BYTES);
+    
+    return true;
+}
+
+// Writes the record (payload already in journal_record) at the end of the active sector.
+// Returns false if it doesn't fit or didn't program
+bool Settings_Manager::Journal_Append(uint32_t payload_words)
+{
+    const uint32_t end = SETTINGS_DATA_START_ADDRESS + (m_journal_sector + 1) * SETTINGS_JOURNAL_SECTOR_SIZE;
+    const uint32_t length = (payload_words + 2) * 4;
+    
+    if ((end - m_journal_address) < length)
+        return false;
+    
+    journal_record[0] = (SETTINGS_JOURNAL_RECORD_MAGIC << 16) | payload_words;
+    journal_record[payload_words + 1] = CalculateCRC(journal_record, payload_words + 1);
+    
+    Journal_Program(m_journal_address, journal_record, length);
+    
+    m_journal_address += length;
+    
+    // Read back, a failed program is replaced by a full copy in the next sector
+    W25QXX_Read((uint8_t*)journal_record, m_journal_address - length, length);
+    
+    return (journal_record[payload_words + 1] == CalculateCRC(journal_record, payload_words + 1));
+}
+
+bool Settings_Manager::Journal_IsErased(uint32_t address, uint32_t length)
+{
+    uint32_t count;
+    uint32_t index;
+    
+    while (length != 0)
+    {
+        count = (length < sizeof(journal_record)) ? length : sizeof(journal_record);
+        
+        W25QXX_Read((uint8_t*)journal_record, address, (uint16_t)count);
+        
+        for (index = 0; index < (count / 4); index++)
+        {
+            if (journal_record[index] != 0xFFFFFFFF)
+                return false;
+        }
+        
+        address += count;
+        length -= count;
+    }
+    
+    return true;
+}
+
+// Starts the next sector of the ring with a full copy of m_saved
+void Settings_Manager::Journal_Compact(void)
+{
+    uint32_t header[2];
+    uint32_t base;
+    uint32_t attempt;
+    
+    // A sector that fails to program is skipped
+    for (attempt = 0; attempt < (SETTINGS_JOURNAL_SECTORS - 1); attempt++)
+    {
+        m_journal_sector = (m_journal_sector + 1) % SETTINGS_JOURNAL_SECTORS;
+        m_journal_sequence++;
+        
+        base = SETTINGS_DATA_START_ADDRESS + m_journal_sector * SETTINGS_JOURNAL_SECTOR_SIZE;
+        
+        W25QXX_Erase_Sector(base / SETTINGS_JOURNAL_SECTOR_SIZE);
+        
+        m_journal_address = base + SETTINGS_JOURNAL_HEADER_SIZE;
+        
+        if (Journal_Append(Journal_BuildFullCopy(m_saved)) != false)
+        {
+            // The sector only counts once the full copy is in
+            header[0] = SETTINGS_JOURNAL_SECTOR_MAGIC;
+            header[1] = m_journal_sequence;
             
-            // Update address, data pointer & remaining length
-            total_len -= bytes_to_write;
-            addr += bytes_to_write;
-            data_ptr += bytes_to_write;
+            Journal_Program(base, header, sizeof(header));
+            return;
         }
     }
+    
+    m_journal_address = 0;
+}
+
+// Builds the runs of words changed since the last save, returns the payload size in words.
+// A full copy when that is smaller
+uint32_t Settings_Manager::Journal_BuildChanges(void)
+{
+    const uint32_t* words = (const uint32_t*)m_data;
+    const uint32_t* saved = (const uint32_t*)m_saved;
+    uint32_t length = 1;        // Next record word, after the header
+    uint32_t run = 0;           // Record word holding the current run, 0 = none
+    uint32_t index;
+    
+    for (index = 0; index < SETTINGS_DATA_SIZE_WORDS_NO_CRC; index++)
+    {
+        if (words[index] == saved[index])
+        {
+            run = 0;
+            continue;
+        }
+        
+        // Not smaller than a full copy anymore
+        if ((length + 2) > (SETTINGS_DATA_SIZE_WORDS_NO_CRC + 2))
+            return Journal_BuildFullCopy(m_data);
+        
+        if (run == 0)
+        {
+            run = length++;
+            journal_record[run] = index << 16;
+        }
+        
+        journal_record[run]++;
+        journal_record[length++] = words[index];
+    }
+    
+    return (length - 1);
+}
+
+uint32_t Settings_Manager::Journal_BuildFullCopy(const SETTINGS_DATA* source)
+{
+    // A single run: from word 0, all of them
+    journal_record[1] = SETTINGS_DATA_SIZE_WORDS_NO_CRC;
+    memcpy(&journal_record[2], (const void*)source, SETTINGS_DATA_SIZE_WORDS_NO_CRC * 4);
+    
+    return (SETTINGS_DATA_SIZE_WORDS_NO_CRC + 1);
+}
+
+// Page programs can't cross a page boundary
+void Settings_Manager::Journal_Program(uint32_t address, const void* data, uint32_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t count;
+    
+    while (length != 0)
+    {
+        count = SETTINGS_JOURNAL_PAGE_SIZE - (address % SETTINGS_JOURNAL_PAGE_SIZE);
+        
+        if (count > length)
+            count = length;
+        
+        W25QXX_Write_Page((uint8_t*)bytes, address, (uint16_t)count);
+        
+        address += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t Settings_Manager::CalculateCRC(const uint32_t* data, uint32_t word_count)
+{
+    uint32_t crc;
+    
+    // The CRC unit holds state between words, keep other tasks away while in use
+    vTaskSuspendAll();
+    crc = HAL_CRC_Calculate(&CrcHandle, (uint32_t*)data, word_count);
+    xTaskResumeAll();
+    
+    return crc;
 }
 
 void Settings_Manager::ResetToDefaults()
@@ -243,5 +547,11 @@ void Settings_Manager::Internal_AllocMemory(void)
         m_data = (SETTINGS_DATA*)pvPortMalloc(SETTINGS_DATA_SIZE_BYTES);
         memset(m_data, 0, SETTINGS_DATA_SIZE_BYTES);
     }
+    
+    if (NULL == m_saved)
+    {
+        m_saved = (SETTINGS_DATA*)pvPortMalloc(SETTINGS_DATA_SIZE_BYTES);
+        memset(m_saved, 0, SETTINGS_DATA_SIZE_BYTES);
+    }
 }
 
@@ -0,0 +1,97 @@
+#include <stm32f4xx_hal.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "task_settings.h"
+#include "settings_task.h"
+#include "settings_manager.h"
+#include "debug_log_task.h"
+#include "JobCheckpoint.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+TaskHandle_t settings_task_handle;
+
+static volatile uint32_t    save_requests = 0;      // Incremented by each request
+static volatile uint32_t    saved_requests = 0;     // Requests covered by the last save
+static volatile bool        flush_request = false;
+static volatile TickType_t  last_request_tick;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void SettingsTask_RequestSave(void)
+{
+    taskENTER_CRITICAL();
+    save_requests++;
+    last_request_tick = xTaskGetTickCount();
+    taskEXIT_CRITICAL();
+
+    xTaskNotifyGive(settings_task_handle);
+}
+
+bool SettingsTask_Flush(TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    flush_request = true;
+    xTaskNotifyGive(settings_task_handle);
+
+    while (saved_requests != save_requests)
+    {
+        if ((xTaskGetTickCount() - start) >= timeout)
+            return false;
+
+        vTaskDelay(SETTINGS_FLUSH_POLL_TIME);
+    }
+
+    return true;
+}
+
+void SettingsTask_Entry(void * pvParam)
+{
+    TickType_t wait = portMAX_DELAY;
+    TickType_t elapsed;
+    uint32_t requests;
+    uint32_t cycles;
+
+    // Job checkpoints share the flash (and this task)
+    JobCheckpoint::Initialize();
+
+    for ( ; ; )
+    {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        JobCheckpoint::Service();
+
+        requests = save_requests;
+
+        if (requests == saved_requests)
+        {
+            flush_request = false;
+            wait = portMAX_DELAY;
+            continue;
+        }
+
+        // Wait for the changes to settle, each new request restarts the wait
+        elapsed = xTaskGetTickCount() - last_request_tick;
+
+        if (flush_request == false && elapsed < SETTINGS_SAVE_QUIET_TIME)
+        {
+            wait = SETTINGS_SAVE_QUIET_TIME - elapsed;
+            continue;
+        }
+
+        flush_request = false;
+        wait = portMAX_DELAY;
+
+        cycles = DWT->CYCCNT;
+        Settings_Manager::Save();
+        cycles = DWT->CYCCNT - cycles;
+
+        DebugLog("Settings saved (%u requests) in %u us", requests - saved_requests, cycles / (SystemCoreClock / 1000000));
+
+        saved_requests = requests;
+    }
+}
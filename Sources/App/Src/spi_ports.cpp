@@ -1,11 +1,22 @@
 #include <stm32f4xx_hal.h>
 #include "pins.h"
 #include "spi_ports.h"
+#include "dma.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "ff_sddisk.h"
+
+#include <string.h>
 
 SPI_HandleTypeDef hspi1;
 SPI_HandleTypeDef hspi3;
 
-static void W25QXX_Wait_Busy(void);
+// Signaled by the SPI1 DMA completion (flash transfers)
+static SemaphoreHandle_t flash_dma_done = NULL;
+
+static void W25QXX_Wait_Busy(TickType_t sleep_time);
 
 /* SPI1 init function */
 void Init_Flash_SPI1(void)
@@ -17,13 +28,15 @@ void Init_Flash_SPI1(void)
     hspi1.Init.CLKPolarity = SPI_POLARITY_LOW;
     hspi1.Init.CLKPhase = SPI_PHASE_1EDGE;
     hspi1.Init.NSS = SPI_NSS_SOFT;
-    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_16; // ~5 MHz
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_4;  // 21 MHz (fast read, any W25Q16)
     hspi1.Init.FirstBit = SPI_FIRSTBIT_MSB;
     hspi1.Init.TIMode = SPI_TIMODE_DISABLE;
     hspi1.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
     hspi1.Init.CRCPolynomial = 10;
     
     HAL_SPI_Init(&hspi1);
+    
+    flash_dma_done = xSemaphoreCreateBinary();
 }
 
 /* SPI3 init function */
@@ -67,6 +80,45 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
         GPIO_InitStruct.Alternate = GPIO_AF5_SPI1;
         
         HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+        /* SPI1 DMA Init (flash reads and page programs). Bytes both sides, any buffer alignment */
+        /* SPI1_RX on DMA2_Stream2 */
+        hdma_spi1_rx.Instance = DMA2_Stream2;
+        hdma_spi1_rx.Init.Channel = DMA_CHANNEL_3;
+        hdma_spi1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+        hdma_spi1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_spi1_rx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_spi1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_spi1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+        hdma_spi1_rx.Init.Mode = DMA_NORMAL;
+        hdma_spi1_rx.Init.Priority = DMA_PRIORITY_MEDIUM;
+        hdma_spi1_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+        HAL_DMA_Init(&hdma_spi1_rx);
+
+        __HAL_LINKDMA(spiHandle, hdmarx, hdma_spi1_rx);
+
+        /* SPI1_TX on DMA2_Stream3 */
+        hdma_spi1_tx.Instance = DMA2_Stream3;
+        hdma_spi1_tx.Init.Channel = DMA_CHANNEL_3;
+        hdma_spi1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+        hdma_spi1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_spi1_tx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_spi1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_spi1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+        hdma_spi1_tx.Init.Mode = DMA_NORMAL;
+        hdma_spi1_tx.Init.Priority = DMA_PRIORITY_MEDIUM;
+        hdma_spi1_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+        HAL_DMA_Init(&hdma_spi1_tx);
+
+        __HAL_LINKDMA(spiHandle, hdmatx, hdma_spi1_tx);
+
+        HAL_NVIC_SetPriority(DMA2_Stream2_IRQn, 6, 0);
+        HAL_NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+
+        HAL_NVIC_SetPriority(DMA2_Stream3_IRQn, 6, 0);
+        HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
     }
     else if (spiHandle->Instance == SPI3)
     {
@@ -86,9 +138,108 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
         GPIO_InitStruct.Alternate = GPIO_AF6_SPI3;
 
         HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+        /* SPI3 DMA Init (sector transfers of the SD card) */
+        /* SPI3_RX on DMA1_Stream0 */
+        hdma_spi3_rx.Instance = DMA1_Stream0;
+        hdma_spi3_rx.Init.Channel = DMA_CHANNEL_0;
+        hdma_spi3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+        hdma_spi3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_spi3_rx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_spi3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_spi3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;     // Packed by the FIFO, buffers must be word aligned
+        hdma_spi3_rx.Init.Mode = DMA_NORMAL;
+        hdma_spi3_rx.Init.Priority = DMA_PRIORITY_HIGH;
+        hdma_spi3_rx.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+        hdma_spi3_rx.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+        hdma_spi3_rx.Init.MemBurst = DMA_MBURST_SINGLE;
+        hdma_spi3_rx.Init.PeriphBurst = DMA_PBURST_SINGLE;
+
+        HAL_DMA_Init(&hdma_spi3_rx);
+
+        __HAL_LINKDMA(spiHandle, hdmarx, hdma_spi3_rx);
+
+        /* SPI3_TX on DMA1_Stream5 */
+        hdma_spi3_tx.Instance = DMA1_Stream5;
+        hdma_spi3_tx.Init.Channel = DMA_CHANNEL_0;
+        hdma_spi3_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+        hdma_spi3_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_spi3_tx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_spi3_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_spi3_tx.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+        hdma_spi3_tx.Init.Mode = DMA_NORMAL;
+        hdma_spi3_tx.Init.Priority = DMA_PRIORITY_HIGH;
+        hdma_spi3_tx.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+        hdma_spi3_tx.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+        hdma_spi3_tx.Init.MemBurst = DMA_MBURST_SINGLE;
+        hdma_spi3_tx.Init.PeriphBurst = DMA_PBURST_SINGLE;
+
+        HAL_DMA_Init(&hdma_spi3_tx);
+
+        __HAL_LINKDMA(spiHandle, hdmatx, hdma_spi3_tx);
+
+        HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 6, 0);
+        HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
+
+        HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 6, 0);
+        HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// DMA transfers on SPI3 belong to the SD card driver, on SPI1 to the flash functions below.
+// Both wait for the completion
+static void spi_transfer_done(SPI_HandleTypeDef *hspi)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+
+    if (hspi->Instance == SPI3)
+        vSDCardTransferCompleteFromISR(&higher_priority_task_woken);
+    else if (hspi->Instance == SPI1)
+        xSemaphoreGiveFromISR(flash_dma_done, &higher_priority_task_woken);
+    else
+        return;
+
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    spi_transfer_done(hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    spi_transfer_done(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    // The driver checks HAL_SPI_GetError() once woken
+    spi_transfer_done(hspi);
+}
+
+extern "C" void DMA1_Stream0_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_spi3_rx);
+}
+
+extern "C" void DMA1_Stream5_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_spi3_tx);
+}
+
+extern "C" void DMA2_Stream2_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_spi1_rx);
+}
+
+extern "C" void DMA2_Stream3_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_spi1_tx);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 //                              W25Q16 Flash Memory Functions                                    //
@@ -96,6 +247,17 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
 
 #define FLASH_TIMEOUT_MAX       10000  // ms
 
+// Transfers from this size on go by DMA, once the scheduler runs (the settings are loaded before
+// it starts, with polled transfers). Dual output reads (0x3B) would need MOSI as a second input,
+// SPI1 can't do that
+#define FLASH_DMA_MIN_LENGTH    32
+#define FLASH_DMA_TIMEOUT       pdMS_TO_TICKS(100)
+
+// Status polling while the flash is busy. Page programs take below a millisecond, erases tens
+#define FLASH_PROGRAM_POLL_TIME 0                       // Just a yield
+#define FLASH_ERASE_POLL_TIME   pdMS_TO_TICKS(1)
+#define FLASH_CHIP_ERASE_POLL_TIME  pdMS_TO_TICKS(100)
+
 #define W25X_WriteEnable		0x06 
 #define W25X_WriteDisable		0x04 
 #define W25X_ReadStatusReg		0x05 
@@ -194,26 +356,77 @@ void W25QXX_Write_Disable(void)
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
 } 		
 
-void W25QXX_Read(uint8_t * pBuffer,uint32_t ReadAddr, uint16_t NumByteToRead)   
+// DMA only pays off for long transfers, and can only be waited for from a task. Buffers in
+// the heap (task stacks, the settings) are in the CCM, out of reach of the DMA
+static bool flash_use_dma(const uint8_t * buffer, uint32_t length)
 {
-    uint8_t buf[4];
+    return (length >= FLASH_DMA_MIN_LENGTH && configIN_HEAP_RAM(buffer) == 0 && xTaskGetSchedulerState() == taskSCHEDULER_RUNNING);
+}
+
+// False if the transfer failed, or was aborted after FLASH_DMA_TIMEOUT
+static bool flash_wait_dma(void)
+{
+    if (xSemaphoreTake(flash_dma_done, FLASH_DMA_TIMEOUT) != pdTRUE)
+    {
+        HAL_SPI_Abort(&hspi1);
+        return false;
+    }
+
+    return (HAL_SPI_GetError(&hspi1) == HAL_SPI_ERROR_NONE);
+}
+
+static bool flash_read(uint8_t * pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead, bool dma)
+{
+    uint8_t buf[5];
+    bool result;
 
-    buf[0] = W25X_ReadData;
+    // Fast read, a dummy byte after the address. Valid at any SPI clock, the plain read
+    // command is limited to 33-50 MHz depending on the part
+    buf[0] = W25X_FastReadData;
     buf[1] = (uint8_t)((ReadAddr)>>16);
     buf[2] = (uint8_t)((ReadAddr)>>8);
     buf[3] = (uint8_t)(ReadAddr);
+    buf[4] = 0xFF;
 
     // Select Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_RESET);
 
-    // Send command + address
-    HAL_SPI_Transmit(&hspi1, buf, 4, FLASH_TIMEOUT_MAX);
+    // Send command + address + dummy byte
+    result = (HAL_SPI_Transmit(&hspi1, buf, 5, FLASH_TIMEOUT_MAX) == HAL_OK);
     
-    // Then, receive all requested data
-    HAL_SPI_Receive(&hspi1, pBuffer, NumByteToRead, FLASH_TIMEOUT_MAX);
+    // Then, receive all requested data. The flash ignores what goes out meanwhile (the buffer)
+    if (result != false && dma != false)
+    {
+        // Drop a completion left over from a timed out transfer
+        xSemaphoreTake(flash_dma_done, 0);
+
+        result = (HAL_SPI_TransmitReceive_DMA(&hspi1, pBuffer, pBuffer, NumByteToRead) == HAL_OK && flash_wait_dma() != false);
+    }
+    else if (result != false)
+    {
+        result = (HAL_SPI_Receive(&hspi1, pBuffer, NumByteToRead, FLASH_TIMEOUT_MAX) == HAL_OK);
+    }
     
 	// Deselect Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
+
+    return result;
+}
+
+// A DMA read that failed or timed out has filled part of the buffer: the whole read is done
+// again polled. If that fails as well the buffer is cleared, so no caller goes on with a part
+HAL_StatusTypeDef W25QXX_Read(uint8_t * pBuffer,uint32_t ReadAddr, uint16_t NumByteToRead)   
+{
+    bool dma = flash_use_dma(pBuffer, NumByteToRead);
+
+    if (flash_read(pBuffer, ReadAddr, NumByteToRead, dma) != false)
+        return HAL_OK;
+
+    if (dma != false && flash_read(pBuffer, ReadAddr, NumByteToRead, false) != false)
+        return HAL_OK;
+
+    memset(pBuffer, 0, NumByteToRead);
+    return HAL_ERROR;
 }
 
 void W25QXX_Write_Page(uint8_t * pBuffer, uint32_t WriteAddr, uint16_t NumByteToWrite)
@@ -234,12 +447,23 @@ void W25QXX_Write_Page(uint8_t * pBuffer, uint32_t WriteAddr, uint16_t NumByteTo
     HAL_SPI_Transmit(&hspi1, buf, 4, FLASH_TIMEOUT_MAX);
     
     // Send data
-    HAL_SPI_Transmit(&hspi1, pBuffer, NumByteToWrite, FLASH_TIMEOUT_MAX);
+    if (flash_use_dma(pBuffer, NumByteToWrite))
+    {
+        xSemaphoreTake(flash_dma_done, 0);
+
+        // A failed transfer is found by the read back of the caller
+        if (HAL_SPI_Transmit_DMA(&hspi1, pBuffer, NumByteToWrite) == HAL_OK)
+            flash_wait_dma();
+    }
+    else
+    {
+        HAL_SPI_Transmit(&hspi1, pBuffer, NumByteToWrite, FLASH_TIMEOUT_MAX);
+    }
     
     // Deselect Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
     
-	W25QXX_Wait_Busy();
+	W25QXX_Wait_Busy(FLASH_PROGRAM_POLL_TIME);
 }
 
 void W25QXX_Erase_Chip(void)   
@@ -248,7 +472,7 @@ void W25QXX_Erase_Chip(void)
     
     
     W25QXX_Write_Enable();                  //Set WEL bit
-    W25QXX_Wait_Busy();
+    W25QXX_Wait_Busy(FLASH_PROGRAM_POLL_TIME);
     
   	// Select Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_RESET);
@@ -258,7 +482,7 @@ void W25QXX_Erase_Chip(void)
     // Deselect Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
     
-	W25QXX_Wait_Busy();
+	W25QXX_Wait_Busy(FLASH_CHIP_ERASE_POLL_TIME);
 }
 
 void W25QXX_Erase_Sector(uint32_t Dst_Addr)   
@@ -273,7 +497,7 @@ void W25QXX_Erase_Sector(uint32_t Dst_Addr)
     buf[3] = (uint8_t)Dst_Addr;
     
     W25QXX_Write_Enable();                  //Set WEL bit
-    W25QXX_Wait_Busy();   
+    W25QXX_Wait_Busy(FLASH_PROGRAM_POLL_TIME);
   	
     // Select Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_RESET);
@@ -284,13 +508,21 @@ void W25QXX_Erase_Sector(uint32_t Dst_Addr)
     // Deselect Flash Memory
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
     
-    W25QXX_Wait_Busy();
+    W25QXX_Wait_Busy(FLASH_ERASE_POLL_TIME);
 }
 
-static void W25QXX_Wait_Busy(void)   
+// Other tasks run while the flash is busy, once the scheduler is up
+static void W25QXX_Wait_Busy(TickType_t sleep_time)   
 {   
 	while((W25QXX_ReadSR() & 0x01) == 0x01)
     {
+        if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+            continue;
+
+        if (sleep_time == 0)
+            taskYIELD();
+        else
+            vTaskDelay(sleep_time);
     }
 }
 
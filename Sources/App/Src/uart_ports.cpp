@@ -1,6 +1,7 @@
 #include <stm32f4xx_hal.h>
 #include "pins.h"
 #include "uart_ports.h"
+#include "dma.h"
 
 UART_HandleTypeDef debug_uart_handle;
 UART_HandleTypeDef spindle_uart_handle;
@@ -57,6 +58,25 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     
         HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
         
+        /* USART1_TX DMA Init [Debug log] */
+        hdma_usart1_tx.Instance = DMA2_Stream7;
+        hdma_usart1_tx.Init.Channel = DMA_CHANNEL_4;
+        hdma_usart1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+        hdma_usart1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_usart1_tx.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_usart1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+        hdma_usart1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+        hdma_usart1_tx.Init.Mode = DMA_NORMAL;
+        hdma_usart1_tx.Init.Priority = DMA_PRIORITY_LOW;
+        hdma_usart1_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+        
+        HAL_DMA_Init(&hdma_usart1_tx);
+        
+        __HAL_LINKDMA(uartHandle, hdmatx, hdma_usart1_tx);
+        
+        HAL_NVIC_SetPriority(DMA2_Stream7_IRQn, 6, 0);
+        HAL_NVIC_EnableIRQ(DMA2_Stream7_IRQn);
+        
         HAL_NVIC_SetPriority(USART1_IRQn, 6, 0);
         HAL_NVIC_EnableIRQ(USART1_IRQn);
     }
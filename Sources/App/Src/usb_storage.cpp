@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "usb_storage.h"
+#include "disk_task.h"
+#include "debug_log_task.h"
+
+#include "tusb.h"
+
+#define SECTOR_SIZE     512
+
+// USB task only
+static bool                 ejected = false;
+static USB_STORAGE_STATS    storage_stats;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool take_card(void)
+{
+    if (storage_stats.HostOwner != false)
+        return true;
+
+    if (ejected != false || DiskTask_AcquireVolume(DISK_OWNER_USB_HOST) == false)
+        return false;
+
+    memset(&storage_stats, 0, sizeof(storage_stats));
+    storage_stats.HostOwner = true;
+
+    return true;
+}
+
+static void give_card_back(void)
+{
+    uint32_t kilobytes;
+
+    if (storage_stats.HostOwner == false)
+        return;
+
+    storage_stats.HostOwner = false;
+
+    kilobytes = (storage_stats.SectorsRead + storage_stats.SectorsWritten) / 2;
+
+    DebugLog("USB storage: %u KB read, %u KB written, %u KB/s card IO, %u errors", storage_stats.SectorsRead / 2,
+             storage_stats.SectorsWritten / 2, (storage_stats.Milliseconds != 0) ? (kilobytes * 1000 / storage_stats.Milliseconds) : 0,
+             storage_stats.Errors);
+
+    DiskTask_ReleaseVolume(DISK_OWNER_USB_HOST);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void UsbStorage_Connected(void)
+{
+    ejected = false;
+}
+
+void UsbStorage_Disconnected(void)
+{
+    give_card_back();
+}
+
+void UsbStorage_GetStats(USB_STORAGE_STATS* stats)
+{
+    *stats = storage_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+extern "C" void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+    memcpy(vendor_id, "OrionPl ", 8);
+    memcpy(product_id, "SD card         ", 16);
+    memcpy(product_rev, "1.0 ", 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Polled by the host every second or so, the card is taken here
+extern "C" bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+    if (take_card() == false)
+    {
+        // Medium not present: the host keeps polling and mounts the drive once the card is free
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+extern "C" void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size)
+{
+    // No card for the host: 0 is reported as not ready
+    *block_count = (storage_stats.HostOwner != false) ? DiskTask_GetSectorCount() : 0;
+    *block_size = SECTOR_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Eject from the PC
+extern "C" void tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+{
+    if (load_eject != false && start == false)
+    {
+        ejected = true;
+        give_card_back();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The class driver asks for whole transfer buffers, always sector aligned (offset 0)
+extern "C" int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+{
+    TickType_t start = xTaskGetTickCount();
+    bool result;
+
+    if (storage_stats.HostOwner == false || offset != 0 || (bufsize % SECTOR_SIZE) != 0)
+        return -1;
+
+    result = DiskTask_ReadSectors(lba, bufsize / SECTOR_SIZE, buffer);
+
+    storage_stats.Milliseconds += (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+
+    if (result == false)
+    {
+        storage_stats.Errors++;
+        return -1;
+    }
+
+    storage_stats.SectorsRead += bufsize / SECTOR_SIZE;
+    return (int32_t)bufsize;
+}
+
+extern "C" int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+{
+    TickType_t start = xTaskGetTickCount();
+    bool result;
+
+    if (storage_stats.HostOwner == false || offset != 0 || (bufsize % SECTOR_SIZE) != 0)
+        return -1;
+
+    result = DiskTask_WriteSectors(lba, bufsize / SECTOR_SIZE, buffer);
+
+    storage_stats.Milliseconds += (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+
+    if (result == false)
+    {
+        storage_stats.Errors++;
+        return -1;
+    }
+
+    storage_stats.SectorsWritten += bufsize / SECTOR_SIZE;
+    return (int32_t)bufsize;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The commands the class driver does not handle itself
+extern "C" int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize)
+{
+    switch (scsi_cmd[0])
+    {
+        case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+            // The card is never locked in, ejecting is how it goes back to the firmware
+            return 0;
+
+        default:
+            // Invalid command operation code
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+            return -1;
+    }
+}
@@ -11,6 +11,7 @@
 #include "usb_task.h"
 #include "serial_task.h"
 #include "settings_manager.h"
+#include "usb_storage.h"
 
 #include "tusb.h"
 #include "pins.h"
@@ -64,6 +65,7 @@ static void usb_low_level_init(void)
 // Invoked when device is mounted (configured)
 extern "C" void tud_mount_cb(void)
 {
+    UsbStorage_Connected();
     //xTaskGenericNotify(serial_task_handle, 0, USB_EVENT_CONNECTED, eSetBits, NULL);
 }
 
@@ -72,6 +74,7 @@ extern "C" void tud_mount_cb(void)
 // Invoked when device is unmounted
 extern "C" void tud_umount_cb(void)
 {
+    UsbStorage_Disconnected();
     //xTaskGenericNotify(serial_task_handle, 0, USB_EVENT_DISCONNECTED, eSetBits, NULL);
 }
 
@@ -81,6 +84,7 @@ extern "C" void tud_umount_cb(void)
 // Within 7ms, device must draw an average of current less than 2.5 mA from bus
 extern "C" void tud_suspend_cb(bool remote_wakeup_en)
 {
+    UsbStorage_Disconnected();
     //xTaskGenericNotify(serial_task_handle, 0, USB_EVENT_SUSPENDED, eSetBits, NULL);
 }
 
@@ -94,6 +98,32 @@ extern "C" void tud_resume_cb(void)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Invoked (from the USB task) with each received packet, before it is stored in the CDC RX FIFO
+extern "C" uint32_t tud_cdc_rx_filter_cb(uint8_t itf, uint8_t* buffer, uint32_t count)
+{
+    return SerialTask_FilterRealtimeCommands(buffer, count);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Invoked (from the USB task) when new data has been stored in the CDC RX FIFO
+extern "C" void tud_cdc_rx_cb(uint8_t itf)
+{
+    if (serial_task_handle != NULL)
+        xTaskNotifyGive(serial_task_handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Invoked when the host opens/closes the port (DTR) 
+extern "C" void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+{
+    if (serial_task_handle != NULL)
+        xTaskNotifyGive(serial_task_handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
 extern "C" void OTG_FS_IRQHandler(void)
 {
     tud_int_handler();
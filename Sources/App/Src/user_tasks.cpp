@@ -14,6 +14,8 @@
 #include "gcode_parsing_task.h"
 #include "disk_task.h"
 #include "serial_task.h"
+#include "debug_log_task.h"
+#include "settings_task.h"
 
 #include "pins.h"
 #include "gpio.h"
@@ -23,18 +25,40 @@
 // System Global Controller class
 MachineCore * machine;
 
+// Stacks and task control blocks come from the heap (budget in FreeRTOSConfig.h), a task that
+// doesn't fit stops here instead of leaving a NULL handle behind
+static void create_task(TaskFunction_t entry, const char * name, configSTACK_DEPTH_TYPE stack_size, void * parameters, UBaseType_t priority, TaskHandle_t * handle)
+{
+    if (pdPASS != xTaskCreate(entry, name, stack_size, parameters, priority, handle))
+    {
+        /* Notify failure and take action */
+        configASSERT(0);
+    }
+}
+
 void Init_UserTasks_and_Objects(void)
 {   
+    DebugLogTask_Initialize();
+    
     machine = new MachineCore();
     
     machine->Initialize();   
     
 //    xTaskCreate(UI_BootTask_Entry, "UIBOOT", UI_BOOT_TASK_STACK_SIZE, (void*)machine, UI_BOOT_TASK_PRIORITY, NULL);
-    xTaskCreate(USBTask_Entry, "USBTASK", USB_TASK_STACK_SIZE, NULL, USB_TASK_PRIORITY, &usb_task_handle);
-//  xTaskCreate(DiskTask_Entry, "DSKTASK", DISK_TASK_STACK_SIZE, NULL, DISK_TASK_PRIORITY, &disk_task_handle);
+    create_task(USBTask_Entry, "USBTASK", USB_TASK_STACK_SIZE, NULL, USB_TASK_PRIORITY, &usb_task_handle);
 
-//    xTaskCreate(GCodeParsingTask_Entry, "GCODE", GCODE_TASK_STACK_SIZE, (void*)machine, GCODE_TASK_PRIORITY, &gcode_task_handle);
-    xTaskCreate(SerialTask_Entry, "SERIAL", SERIAL_TASK_STACK_SIZE, (void*)machine, SERIAL_TASK_PRIORITY, &serial_task_handle);
+    DiskTask_Initialize();
+    create_task(DiskTask_Entry, "DSKTASK", DISK_TASK_STACK_SIZE, NULL, DISK_TASK_PRIORITY, &disk_task_handle);
+
+    GCodeParsingTask_Initialize();
+    create_task(GCodeParsingTask_Entry, "GCODE", GCODE_TASK_STACK_SIZE, (void*)machine, GCODE_TASK_PRIORITY, &gcode_task_handle);
+    create_task(GCodePlanningTask_Entry, "GPLAN", GCODE_PLAN_TASK_STACK_SIZE, (void*)machine, GCODE_PLAN_TASK_PRIORITY, &gcode_plan_task_handle);
+    create_task(SerialTask_Entry, "SERIAL", SERIAL_TASK_STACK_SIZE, (void*)machine, SERIAL_TASK_PRIORITY, &serial_task_handle);
+    create_task(DebugLogTask_Entry, "DBGLOG", DEBUG_LOG_TASK_STACK_SIZE, NULL, DEBUG_LOG_TASK_PRIORITY, &debug_log_task_handle);
+    create_task(SettingsTask_Entry, "SETTASK", SETTINGS_TASK_STACK_SIZE, NULL, SETTINGS_TASK_PRIORITY, &settings_task_handle);
     
     vTaskStartScheduler();
+
+    // Only back here when the heap can't take the idle and timer tasks
+    configASSERT(0);
 }
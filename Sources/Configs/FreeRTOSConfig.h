@@ -56,7 +56,7 @@
 #define configTICK_RATE_HZ				( ( TickType_t ) 1000 )
 #define configMAX_PRIORITIES			( 7 )
 #define configMINIMAL_STACK_SIZE		( ( unsigned short ) 128 )
-#define configTOTAL_HEAP_SIZE			( ( size_t ) ( 1024 * 32 ) )
+#define configTOTAL_HEAP_SIZE			( ( size_t ) ( 1024 * 64 ) )
 #define configMAX_TASK_NAME_LEN			( 8 )
 #define configUSE_TRACE_FACILITY		0
 #define configUSE_16_BIT_TICKS			0
@@ -70,7 +70,30 @@
 #define configUSE_COUNTING_SEMAPHORES	1
 #define configGENERATE_RUN_TIME_STATS	0
 
-#define configAPPLICATION_ALLOCATED_HEAP    0
+/* The heap fills the 64 KB CCM data RAM (ucHeap, memory_wrappers.cpp), the
+128 KB SRAM is left to static data. Budget of the Release and Debug targets,
+from the sources (the linker map has the static data, $M the heap in use):
+
+  SRAM   ~90 KB  static data: 48 KB before the SD card, upload and job
+                 files, then the upload 8.4 KB, job buffers 8 KB, SD card
+                 7.5 KB (sector cache, bounce buffer, read-ahead), job index
+                 4.5 KB, USB mass storage 4 KB, framing 2.7 KB, debug log
+                 2.5 KB, telemetry 2.3 KB, the rest 2 KB. Main stack 1 KB,
+                 C heap 256 bytes
+  CCM    ~41 KB  of the heap: task stacks and TCBs 15 KB, conveyor queue
+                 (32 blocks and their tick info) 14.5 KB, FreeRTOS+FAT 3 KB
+                 (I/O manager, files, working directories), line buffers and
+                 queues 3 KB, objects and timers 2 KB, settings 1.3 KB
+
+The DMA can't reach the CCM: buffers in the heap, task stacks included, go
+through the SD card bounce buffer (ff_sddisk.c) and polled flash transfers
+(spi_ports.cpp). */
+#define configAPPLICATION_ALLOCATED_HEAP    1
+#define configHEAP_ADDRESS                  0x10000000
+
+#ifndef configIN_HEAP_RAM
+	#define configIN_HEAP_RAM( pv )         ( ( ( uint32_t ) ( pv ) - configHEAP_ADDRESS ) < configTOTAL_HEAP_SIZE )
+#endif
 
 /* Co-routine definitions. */
 #define configUSE_CO_ROUTINES 		0
@@ -91,7 +114,7 @@ to exclude the API function. */
 #define INCLUDE_vTaskSuspend			1
 #define INCLUDE_vTaskDelayUntil			0
 #define INCLUDE_vTaskDelay				1
-#define INCLUDE_uxTaskGetStackHighWaterMark 0
+#define INCLUDE_uxTaskGetStackHighWaterMark 1
 #define INCLUDE_xTimerPendFunctionCall  1
 
 /* Cortex-M specific definitions. */
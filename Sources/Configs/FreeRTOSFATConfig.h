@@ -223,8 +223,10 @@ one time. */
 Use of HASH values can improve performance when working with large
 directories, or with files that have a similar name.
 
-Set to 0 not to calculate a HASH value. */
-#define	ffconfigHASH_CACHE	1
+Set to 0 not to calculate a HASH value.  Off: each table of the cache takes
+8 KB with CRC16 (2^16 bits), the 64 of them in FF_IOManager_t are more than
+the whole RAM and FF_CreateIOManager() failed. */
+#define	ffconfigHASH_CACHE	0
 
 /* Only used if ffconfigHASH_CACHE is set to 1
 
@@ -43,22 +43,57 @@
 /* ST HAL includes. */
 #include "stm32f4xx_hal.h"
 
+/* Board includes. */
+#include "pins.h"
+#include "spi_ports.h"
+
 /* Misc definitions. */
 #define sdSIGNATURE 			0x41404342UL
 #define sdHUNDRED_64_BIT		( 100ull )
 #define sdBYTES_PER_MB			( 1024ull * 1024ull )
 #define sdSECTORS_PER_MB		( sdBYTES_PER_MB / 512ull )
 #define sdIOMAN_MEM_SIZE		4096
-
-/* DMA constants. */
-#define SD_DMAx_Tx_CHANNEL					DMA_CHANNEL_4
-#define SD_DMAx_Rx_CHANNEL					DMA_CHANNEL_4
-#define SD_DMAx_Tx_STREAM					DMA2_Stream6
-#define SD_DMAx_Rx_STREAM					DMA2_Stream3
-#define SD_DMAx_Tx_IRQn						DMA2_Stream6_IRQn
-#define SD_DMAx_Rx_IRQn						DMA2_Stream3_IRQn
-#define __DMAx_TxRx_CLK_ENABLE				__DMA2_CLK_ENABLE
-#define configSDIO_DMA_INTERRUPT_PRIORITY	( configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY )
+#define sdBOUNCE_SECTORS		4			/* Sectors per transfer through the bounce buffer */
+#define sdREADAHEAD_SECTORS		2			/* Read-ahead ring: a sector read ahead and the next one in flight */
+
+/* Buffers the DMA can take directly: word aligned (the DMA packs the SPI bytes
+into words) and out of the CCM of the heap, which is not on the DMA bus.  Others
+go through the bounce buffer or the read-ahead slots. */
+#define sdDMA_BUFFER( pv )		( ( ( ( ( size_t )( pv ) ) & ( sizeof( size_t ) - 1 ) ) == 0 ) && ( configIN_HEAP_RAM( pv ) == 0 ) )
+
+/* The card is wired to SPI3 (SPI mode), not to the SDIO peripheral.  Sector
+data moves by DMA (SPI3 RX = DMA1 stream 0, TX = DMA1 stream 5), commands and
+tokens are exchanged by polling. */
+#define sdSPI_HANDLE			( &hspi3 )
+#define sdSPI_INIT_PRESCALER	SPI_BAUDRATEPRESCALER_128	/* 42 MHz / 128 = 328 KHz, identification must be <= 400 KHz */
+#define sdSPI_DATA_PRESCALER	SPI_BAUDRATEPRESCALER_2		/* 42 MHz / 2 = 21 MHz, the fastest SPI3 clock */
+#define sdSPI_POLL_TIMEOUT		100							/* HAL timeout for polled bytes, ms */
+
+/* SPI mode commands.  ACMDs have bit 7 set and are sent after CMD55. */
+#define sdCMD0					( 0 )		/* GO_IDLE_STATE */
+#define sdCMD8					( 8 )		/* SEND_IF_COND */
+#define sdCMD9					( 9 )		/* SEND_CSD */
+#define sdCMD12					( 12 )		/* STOP_TRANSMISSION */
+#define sdCMD16					( 16 )		/* SET_BLOCKLEN */
+#define sdCMD17					( 17 )		/* READ_SINGLE_BLOCK */
+#define sdCMD18					( 18 )		/* READ_MULTIPLE_BLOCK */
+#define sdCMD24					( 24 )		/* WRITE_BLOCK */
+#define sdCMD25					( 25 )		/* WRITE_MULTIPLE_BLOCK */
+#define sdCMD55					( 55 )		/* APP_CMD */
+#define sdCMD58					( 58 )		/* READ_OCR */
+#define sdACMD23				( 0x80 | 23 )	/* SET_WR_BLK_ERASE_COUNT */
+#define sdACMD41				( 0x80 | 41 )	/* SD_SEND_OP_COND */
+
+#define sdR1_IDLE				( 0x01 )
+#define sdTOKEN_START_BLOCK		( 0xFE )
+#define sdTOKEN_START_MULTI		( 0xFC )
+#define sdTOKEN_STOP_TRAN		( 0xFD )
+#define sdDATA_RESPONSE_MASK	( 0x1F )
+#define sdDATA_ACCEPTED			( 0x05 )
+
+#define sdINIT_TIMEOUT_TICKS	pdMS_TO_TICKS( 1000UL )
+#define sdREAD_TIMEOUT_TICKS	pdMS_TO_TICKS( 200UL )
+#define sdWRITE_TIMEOUT_TICKS	pdMS_TO_TICKS( 500UL )
 
 /* Define a time-out for all DMA transactions in msec. */
 #ifndef sdMAX_TIME_TICKS
@@ -90,11 +125,6 @@
  */
 static BaseType_t prvSDDetect( void );
 
-/*
- * Translate a numeric code like 'SD_TX_UNDERRUN' to a printable string.
- */
-static const char *prvSDCodePrintable( uint32_t ulCode );
-
 /*
  * The following 'hook' must be provided by the user of this module.  It will be
  * called from a GPIO ISR after every change.  Note that during the ISR, the
@@ -106,35 +136,48 @@ extern void vApplicationCardDetectChangeHookFromISR( BaseType_t *pxHigherPriorit
 /*
  * Hardware initialisation.
  */
-static void prvSDIO_SD_Init( void );
-static void vGPIO_SD_Init( /*SD_HandleTypeDef* xSDHandle */ void);
+static void prvSPI_SD_Init( void );
 
 /*
- * Check if the card is present, and if so, print out some info on the card.
+ * Check if the card is present, and if so, identify it and read its size.
  */
 static BaseType_t prvSDMMCInit( BaseType_t xDriveNumber );
 
-#if( SDIO_USES_DMA != 0 )
-	/*
-	 * Initialise the DMA for SDIO cards.
-	 */
-	static void prvSDIO_DMA_Init( void );
-#endif
+/*
+ * SPI mode transfers.  The card must be selected.
+ */
+static void prvSPISelect( void );
+static void prvSPIDeselect( void );
+static uint8_t prvSPIExchange( uint8_t ucByte );
+static BaseType_t prvSPIWaitReady( TickType_t xTimeout );
+static uint8_t prvSDCommand( uint8_t ucCommand, uint32_t ulArgument );
+static BaseType_t prvSDReceiveToken( void );
+static BaseType_t prvSDReceiveStart( uint8_t *pucBuffer );
+static BaseType_t prvSDReceiveEnd( void );
+static BaseType_t prvSDReceiveBlock( uint8_t *pucBuffer, uint32_t ulLength );
+static BaseType_t prvSDSendBlock( const uint8_t *pucBuffer, uint8_t ucToken );
+static BaseType_t prvSDWaitTransfer( void );
 
-#if( SDIO_USES_DMA != 0 )
-	/*
-	 * A function will be called at the start of a DMA action.
-	 */
-	static void prvEventSetupFunction( SD_HandleTypeDef * pxHandle );
-#endif
+/*
+ * Multi-block sector transfers.  Both need a buffer the DMA can take
+ * (sdDMA_BUFFER).
+ */
+static BaseType_t prvSDReadBlocks( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount );
+static BaseType_t prvSDWriteBlocks( const uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount );
 
-#if( SDIO_USES_DMA != 0 )
-	/*
-	 * This function is supposed to wait for an event: SDIO or DMA.
-	 * Return non-zero if a timeout has been reached.
-	 */
-	static uint32_t prvEventWaitFunction( SD_HandleTypeDef *pxHandle );
-#endif
+/*
+ * Sequential read-ahead (see ulSDReadAhead).  prvReadAheadFetch() copies the
+ * leading sectors of a request that were read ahead and returns their number,
+ * prvReadAheadStream() receives the rest from the multi-block read.
+ * prvReadAheadStart() starts the DMA transfer of the next sector,
+ * prvReadAheadComplete() ends it, prvReadAheadStop() ends the multi-block read.
+ */
+static uint32_t prvReadAheadFetch( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount );
+static BaseType_t prvReadAheadStream( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount );
+static void prvReadAheadStart( void );
+static void prvReadAheadComplete( BaseType_t xBlock );
+static void prvReadAheadStop( void );
+static void prvReadAheadInvalidate( uint32_t ulSectorNumber, uint32_t ulSectorCount );
 
 /*-----------------------------------------------------------*/
 
@@ -148,20 +191,9 @@ typedef struct
 		bStableSignal : 1;
 } CardDetect_t;
 
-/* Used to handle timeouts. */
-static TickType_t xDMARemainingTime;
-static TimeOut_t xDMATimeOut;
-
-/* Used to unblock the task that calls prvEventWaitFunction() after an event has
-occurred. */
+/* Used to unblock the task that waits for a DMA transfer to finish. */
 static SemaphoreHandle_t xSDCardSemaphore = NULL;
 
-/* Handle of the SD card being used. */
-//static SD_HandleTypeDef xSDHandle;
-
-/* Holds parameters for the detected SD card. */
-//static HAL_SD_CardInfoTypedef xSDCardInfo;
-
 /* Mutex for partition. */
 static SemaphoreHandle_t xPlusFATMutex = NULL;
 
@@ -171,6 +203,40 @@ static BaseType_t xSDCardStatus = pdFALSE;
 /* Maintains state for card detection. */
 static CardDetect_t xCardDetect;
 
+/* SDHC/SDXC cards take sector numbers, SDSC cards take byte addresses. */
+static BaseType_t xSDHighCapacity = pdFALSE;
+
+/* Card size, from the CSD register. */
+static uint32_t ulSDSectorCount = 0;
+
+/* Clocked out while a block is received, MOSI has to stay high. */
+static uint32_t ulSDFillBlock[ 512 / sizeof( uint32_t ) ];
+
+/* Sector cache of the I/O manager.  Static, so that it is in SRAM and the
+DMA takes its sectors directly (the heap is in the CCM). */
+static uint32_t ulSDCacheMemory[ sdIOMAN_MEM_SIZE / sizeof( uint32_t ) ];
+
+/* Word aligned copy of unaligned caller buffers, used under xPlusFATMutex.
+Whole runs of sectors go through it so the transfers stay multi-block. */
+static uint32_t ulSDBounceBuffer[ sdBOUNCE_SECTORS * 512 / sizeof( uint32_t ) ];
+
+/* Sequential read-ahead.  A read that continues the previous one (or the
+sectors already read ahead) leaves the card in a multi-block read (CMD18), and
+the DMA transfer of the sector after it is started before returning: the card
+sends it while the caller works on the data.  The next read takes it from RAM
+and only waits when the block it needs is still in flight.  The ring holds
+ulReadAheadCount sectors from ulReadAheadFirst, each in the slot of its number
+modulo sdREADAHEAD_SECTORS; the next block of the multi-block read (in flight
+or not yet started) is the sector after them.  Any other command ends the
+multi-block read first, writes drop the sectors they overlap, a card
+(re)initialisation drops everything. */
+static uint32_t ulSDReadAhead[ sdREADAHEAD_SECTORS * 512 / sizeof( uint32_t ) ];
+static uint32_t ulReadAheadFirst = 0;
+static uint32_t ulReadAheadCount = 0;
+static uint32_t ulNextSequential = 0;
+static BaseType_t xReadAheadStreaming = pdFALSE;	/* CMD18 open, the card selected */
+static BaseType_t xReadAheadInFlight = pdFALSE;	/* DMA transfer of the next block running */
+
 /*-----------------------------------------------------------*/
 
 static int32_t prvFFRead( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount, FF_Disk_t *pxDisk )
@@ -184,69 +250,75 @@ int32_t lReturnCode = FF_ERR_IOMAN_OUT_OF_BOUNDS_READ | FF_ERRFLAG;
 		( ulSectorNumber < pxDisk->ulNumberOfSectors ) &&
 		( ( pxDisk->ulNumberOfSectors - ulSectorNumber ) >= ulSectorCount ) )
 	{
-	uint64_t ullReadAddr;
-//	HAL_SD_ErrorTypedef sd_result;
+	BaseType_t xResult = pdPASS;
+	BaseType_t xSequential;
+	uint32_t ulCount;
 
-		ullReadAddr = 512ull * ( uint64_t ) ulSectorNumber;
+		xSequential = ( ( ulSectorNumber == ulNextSequential ) ||
+						( ( ( ulReadAheadCount != 0 ) || ( xReadAheadStreaming != pdFALSE ) ) &&
+						  ( ulSectorNumber == ( ulReadAheadFirst + ulReadAheadCount ) ) ) ) ? pdTRUE : pdFALSE;
+		ulNextSequential = ulSectorNumber + ulSectorCount;
 
-		#if( SDIO_USES_DMA == 0 )
+		ulCount = prvReadAheadFetch( pucBuffer, ulSectorNumber, ulSectorCount );
+
+		if( ulCount != 0 )
 		{
-			//sd_result = HAL_SD_ReadBlocks( &xSDHandle, (uint32_t *) pucBuffer, ullReadAddr, 512ul, ulSectorCount );
+			pucBuffer += 512ul * ulCount;
+			ulSectorNumber += ulCount;
+			ulSectorCount -= ulCount;
+			xSequential = pdTRUE;
 		}
-		#else
+
+		if( ulSectorCount == 0 )
 		{
-			if( ( ( ( size_t )pucBuffer ) & ( sizeof( size_t ) - 1 ) ) == 0 )
-			{
-				/* The buffer is word-aligned, call DMA read directly. */
-				sd_result = HAL_SD_ReadBlocks_DMA( &xSDHandle, (uint32_t *) pucBuffer, ullReadAddr, 512ul, ulSectorCount);
-				if( sd_result == SD_OK )
-				{
-					sd_result = HAL_SD_CheckReadOperation( &xSDHandle, sdMAX_TIME_TICKS );
-				}
-			}
-			else
-			{
-			uint32_t ulSector;
-			uint8_t *pucDMABuffer = ffconfigMALLOC( 512ul );
+			/* All from the read-ahead buffer. */
+		}
+		else if( xSequential != pdFALSE )
+		{
+			/* On with the multi-block read, whatever the size. */
+			xResult = prvReadAheadStream( pucBuffer, ulSectorNumber, ulSectorCount );
+		}
+		else if( sdDMA_BUFFER( pucBuffer ) )
+		{
+			/* The DMA can take the buffer, read into it directly. */
+			prvReadAheadStop();
+			xResult = prvSDReadBlocks( pucBuffer, ulSectorNumber, ulSectorCount );
+		}
+		else
+		{
+		uint32_t ulCount;
 
-				/* The buffer is NOT word-aligned, copy first to an aligned buffer. */
-				if( pucDMABuffer != NULL )
-				{
-					sd_result = SD_OK;
-					for( ulSector = 0; ulSector < ulSectorCount; ulSector++ )
-					{
-						ullReadAddr = 512ull * ( ( uint64_t ) ulSectorNumber + ( uint64_t ) ulSector );
-						sd_result = HAL_SD_ReadBlocks_DMA( &xSDHandle, ( uint32_t * )pucDMABuffer, ullReadAddr, 512ul, 1 );
+			/* The buffer is NOT word-aligned or is in the heap, read through
+			the bounce buffer. */
+			prvReadAheadStop();
 
-						if( sd_result == SD_OK )
-						{
-							sd_result = HAL_SD_CheckReadOperation( &xSDHandle, sdMAX_TIME_TICKS );
-							if( sd_result != SD_OK )
-							{
-								break;
-							}
-							memcpy( pucBuffer + 512ul * ulSector, pucDMABuffer, 512ul );
-						}
-					}
-					ffconfigFREE( pucDMABuffer );
-				}
-				else
+			while( ( xResult == pdPASS ) && ( ulSectorCount != 0 ) )
+			{
+				ulCount = ( ulSectorCount < sdBOUNCE_SECTORS ) ? ulSectorCount : sdBOUNCE_SECTORS;
+				xResult = prvSDReadBlocks( ( uint8_t * ) ulSDBounceBuffer, ulSectorNumber, ulCount );
+
+				if( xResult == pdPASS )
 				{
-					sd_result = SD_INVALID_PARAMETER;
+					memcpy( pucBuffer, ulSDBounceBuffer, 512ul * ulCount );
+					pucBuffer += 512ul * ulCount;
+					ulSectorNumber += ulCount;
+					ulSectorCount -= ulCount;
 				}
 			}
 		}
-		#endif	/* SDIO_USES_DMA */
 
-		//if( sd_result == SD_OK )
+		if( xResult == pdPASS )
 		{
+			/* The card sends the next sector while the caller works on these. */
+			prvReadAheadStart();
 			lReturnCode = 0L;
 		}
-		//else
-		//{
+		else
+		{
 			/* Some error occurred. */
-		//	FF_PRINTF( "prvFFRead: %lu: %u (%s)\n", ulSectorNumber, sd_result, prvSDCodePrintable( sd_result ) );
-		//}
+			FF_PRINTF( "prvFFRead: %lu + %lu failed\n", ulSectorNumber, ulSectorCount );
+			lReturnCode = FF_ERR_IOMAN_DRIVER_FATAL_ERROR | FF_ERRFLAG;
+		}
 	}
 	else
 	{
@@ -274,68 +346,49 @@ int32_t lReturnCode = FF_ERR_IOMAN_OUT_OF_BOUNDS_READ | FF_ERRFLAG;
 		( ulSectorNumber < pxDisk->ulNumberOfSectors ) &&
 		( ( pxDisk->ulNumberOfSectors - ulSectorNumber ) >= ulSectorCount ) )
 	{
-		//HAL_SD_ErrorTypedef sd_result;
-		uint64_t ullWriteAddr;
-		ullWriteAddr = 512ull * ulSectorNumber;
+	BaseType_t xResult;
+
+		/* The card takes no other command during a multi-block read. */
+		prvReadAheadStop();
+		prvReadAheadInvalidate( ulSectorNumber, ulSectorCount );
 
-		#if( SDIO_USES_DMA == 0 )
+		if( sdDMA_BUFFER( pucBuffer ) )
 		{
-			//sd_result = HAL_SD_WriteBlocks( &xSDHandle, ( uint32_t * )pucBuffer, ullWriteAddr, 512ul, ulSectorCount );
+			/* The DMA can take the buffer, write from it directly. */
+			xResult = prvSDWriteBlocks( pucBuffer, ulSectorNumber, ulSectorCount );
 		}
-		#else
+		else
 		{
-			if( ( ( ( size_t )pucBuffer ) & ( sizeof( size_t ) - 1 ) ) == 0 )
-			{
-				/* The buffer is word-aligned, call DMA reawrite directly. */
-				sd_result = HAL_SD_WriteBlocks_DMA( &xSDHandle, ( uint32_t * )pucBuffer, ullWriteAddr, 512ul, ulSectorCount );
-				if( sd_result == SD_OK )
-				{
-					sd_result = HAL_SD_CheckWriteOperation( &xSDHandle, sdMAX_TIME_TICKS );
-				}
-			}
-			else
+		uint32_t ulCount;
+
+			/* The buffer is NOT word-aligned or is in the heap, write through
+			the bounce buffer. */
+			xResult = pdPASS;
+			while( ( xResult == pdPASS ) && ( ulSectorCount != 0 ) )
 			{
-			uint32_t ulSector;
-			uint8_t *pucDMABuffer = ffconfigMALLOC( 512ul );
+				ulCount = ( ulSectorCount < sdBOUNCE_SECTORS ) ? ulSectorCount : sdBOUNCE_SECTORS;
+				memcpy( ulSDBounceBuffer, pucBuffer, 512ul * ulCount );
+				xResult = prvSDWriteBlocks( ( const uint8_t * ) ulSDBounceBuffer, ulSectorNumber, ulCount );
 
-				/* The buffer is NOT word-aligned, read to an aligned buffer and then
-				copy the data to the user provided buffer. */
-				if( pucDMABuffer != NULL )
+				if( xResult == pdPASS )
 				{
-					sd_result = SD_OK;
-					for( ulSector = 0; ulSector < ulSectorCount; ulSector++ )
-					{
-						memcpy( pucDMABuffer, pucBuffer + 512ul * ulSector, 512ul );
-						ullWriteAddr = 512ull * ( ulSectorNumber + ulSector );
-						sd_result = HAL_SD_WriteBlocks_DMA( &xSDHandle, ( uint32_t * )pucDMABuffer, ullWriteAddr, 512ul, 1 );
-						if( sd_result == SD_OK )
-						{
-							sd_result = HAL_SD_CheckWriteOperation( &xSDHandle, sdMAX_TIME_TICKS );
-							if( sd_result != SD_OK )
-							{
-								break;
-							}
-						}
-					}
-					ffconfigFREE( pucDMABuffer );
-				}
-				else
-				{
-					sd_result = SD_INVALID_PARAMETER;
+					pucBuffer += 512ul * ulCount;
+					ulSectorNumber += ulCount;
+					ulSectorCount -= ulCount;
 				}
 			}
 		}
-		#endif	/* SDIO_USES_DMA */
 
-		//if( sd_result == SD_OK )
+		if( xResult == pdPASS )
 		{
 			/* No errors. */
 			lReturnCode = 0L;
 		}
-		//else
-		//{
-		//	FF_PRINTF( "prvFFWrite: %lu: %u (%s)\n", ulSectorNumber, sd_result, prvSDCodePrintable( sd_result ) );
-		//}
+		else
+		{
+			FF_PRINTF( "prvFFWrite: %lu + %lu failed\n", ulSectorNumber, ulSectorCount );
+			lReturnCode = FF_ERR_IOMAN_DRIVER_FATAL_ERROR | FF_ERRFLAG;
+		}
 	}
 	else
 	{
@@ -349,6 +402,172 @@ int32_t lReturnCode = FF_ERR_IOMAN_OUT_OF_BOUNDS_READ | FF_ERRFLAG;
 }
 /*-----------------------------------------------------------*/
 
+static uint8_t *prvReadAheadSlot( uint32_t ulSectorNumber )
+{
+	return ( uint8_t * ) ulSDReadAhead + 512ul * ( ulSectorNumber % sdREADAHEAD_SECTORS );
+}
+/*-----------------------------------------------------------*/
+
+static uint32_t prvReadAheadFetch( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount )
+{
+uint32_t ulOffset = ulSectorNumber - ulReadAheadFirst;
+uint32_t ulCount = 0;
+uint32_t ulIndex;
+
+	/* The one wait for the read-ahead: the request needs the block in flight.
+	Also false for sectors below ulReadAheadFirst (the subtraction wraps). */
+	if( ( xReadAheadInFlight != pdFALSE ) && ( ulOffset <= ulReadAheadCount ) &&
+		( ( ulOffset + ulSectorCount ) > ulReadAheadCount ) )
+	{
+		prvReadAheadComplete( pdTRUE );
+	}
+
+	if( ulOffset < ulReadAheadCount )
+	{
+		ulCount = ulReadAheadCount - ulOffset;
+
+		if( ulCount > ulSectorCount )
+		{
+			ulCount = ulSectorCount;
+		}
+
+		for( ulIndex = 0; ulIndex < ulCount; ulIndex++ )
+		{
+			memcpy( pucBuffer + 512ul * ulIndex, prvReadAheadSlot( ulSectorNumber + ulIndex ), 512ul );
+		}
+
+		/* The sectors up to the last one copied are dropped, their slots
+		take the next ones. */
+		ulReadAheadFirst = ulSectorNumber + ulCount;
+		ulReadAheadCount -= ulOffset + ulCount;
+	}
+
+	return ulCount;
+}
+/*-----------------------------------------------------------*/
+
+/* The rest of a sequential read, after prvReadAheadFetch() took what was read
+ahead: on from the multi-block read if it is at the first sector, else from a
+new one.  Buffers the DMA can take get the blocks directly, others through the
+slot of the sector. */
+static BaseType_t prvReadAheadStream( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount )
+{
+BaseType_t xAligned = sdDMA_BUFFER( pucBuffer ) ? pdTRUE : pdFALSE;
+uint8_t *pucBlock;
+
+	if( ( xReadAheadStreaming == pdFALSE ) || ( ulSectorNumber != ( ulReadAheadFirst + ulReadAheadCount ) ) )
+	{
+		prvReadAheadStop();
+
+		if( prvSDCommand( sdCMD18, ( xSDHighCapacity != pdFALSE ) ? ulSectorNumber : ( ulSectorNumber * 512ul ) ) != 0 )
+		{
+			prvSPIDeselect();
+			return pdFAIL;
+		}
+
+		xReadAheadStreaming = pdTRUE;
+	}
+
+	ulReadAheadFirst = ulSectorNumber;
+	ulReadAheadCount = 0;
+
+	while( ulSectorCount != 0 )
+	{
+		pucBlock = ( xAligned != pdFALSE ) ? pucBuffer : prvReadAheadSlot( ulSectorNumber );
+
+		if( prvSDReceiveBlock( pucBlock, 512ul ) != pdPASS )
+		{
+			prvReadAheadStop();
+			return pdFAIL;
+		}
+
+		if( xAligned == pdFALSE )
+		{
+			memcpy( pucBuffer, pucBlock, 512ul );
+		}
+
+		pucBuffer += 512ul;
+		ulSectorNumber++;
+		ulSectorCount--;
+		ulReadAheadFirst = ulSectorNumber;
+	}
+
+	return pdPASS;
+}
+/*-----------------------------------------------------------*/
+
+/* Starts the DMA transfer of the next block of the multi-block read into its
+slot, once the one before is done and while the ring has room.  Never past the
+end of the card. */
+static void prvReadAheadStart( void )
+{
+uint32_t ulNext;
+
+	prvReadAheadComplete( pdFALSE );
+
+	ulNext = ulReadAheadFirst + ulReadAheadCount;
+
+	if( ( xReadAheadStreaming != pdFALSE ) && ( xReadAheadInFlight == pdFALSE ) &&
+		( ulReadAheadCount < sdREADAHEAD_SECTORS ) && ( ulNext < ulSDSectorCount ) )
+	{
+		if( prvSDReceiveStart( prvReadAheadSlot( ulNext ) ) == pdPASS )
+		{
+			xReadAheadInFlight = pdTRUE;
+		}
+		else
+		{
+			prvReadAheadStop();
+		}
+	}
+}
+/*-----------------------------------------------------------*/
+
+/* Ends the transfer started by prvReadAheadStart(), its sector joins the ring.
+Without xBlock only if the DMA is done already. */
+static void prvReadAheadComplete( BaseType_t xBlock )
+{
+	if( ( xReadAheadInFlight != pdFALSE ) &&
+		( ( xBlock != pdFALSE ) || ( uxSemaphoreGetCount( xSDCardSemaphore ) != 0 ) ) )
+	{
+		xReadAheadInFlight = pdFALSE;
+
+		if( prvSDReceiveEnd() == pdPASS )
+		{
+			ulReadAheadCount++;
+		}
+		else
+		{
+			prvReadAheadStop();
+		}
+	}
+}
+/*-----------------------------------------------------------*/
+
+/* Ends the multi-block read before any other command.  The sectors read
+ahead stay valid. */
+static void prvReadAheadStop( void )
+{
+	prvReadAheadComplete( pdTRUE );
+
+	if( xReadAheadStreaming != pdFALSE )
+	{
+		xReadAheadStreaming = pdFALSE;
+		prvSDCommand( sdCMD12, 0 );
+		prvSPIDeselect();
+	}
+}
+/*-----------------------------------------------------------*/
+
+static void prvReadAheadInvalidate( uint32_t ulSectorNumber, uint32_t ulSectorCount )
+{
+	if( ( ulSectorNumber < ( ulReadAheadFirst + ulReadAheadCount ) ) &&
+		( ( ulSectorNumber + ulSectorCount ) > ulReadAheadFirst ) )
+	{
+		ulReadAheadCount = 0;
+	}
+}
+/*-----------------------------------------------------------*/
+
 void FF_SDDiskFlush( FF_Disk_t *pxDisk )
 {
 	if( ( pxDisk != NULL ) &&
@@ -360,47 +579,387 @@ void FF_SDDiskFlush( FF_Disk_t *pxDisk )
 }
 /*-----------------------------------------------------------*/
 
-static void vGPIO_SD_Init(/*SD_HandleTypeDef* xSDHandle*/)
+/* Raw sector access for a USB host (mass storage) while the volume is
+unmounted.  The whole card is addressed, not only the partition FreeRTOS+FAT
+had mounted, and nothing goes through the IO manager's sector cache.  The
+transfers take xPlusFATMutex like the IO manager calls, so they stay
+multi-block DMA transfers of the size asked for. */
+int32_t FF_SDDiskReadSectors( FF_Disk_t *pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, uint8_t *pucBuffer )
 {
-//GPIO_InitTypeDef GPIO_InitStruct;
+int32_t lReturnCode = FF_ERR_NULL_POINTER | FF_ERRFLAG;
 
-//	if( xSDHandle->Instance == SDIO )
-//	{
-//		/* Peripheral clock enable */
-//		__SDIO_CLK_ENABLE();
-
-//		/**SDIO GPIO Configuration
-//		PC8     ------> SDIO_D0
-//		PC9     ------> SDIO_D1
-//		PC10    ------> SDIO_D2
-//		PC11    ------> SDIO_D3
-//		PC12    ------> SDIO_CK
-//		PD2     ------> SDIO_CMD
-//		*/
-//		__HAL_RCC_GPIOC_CLK_ENABLE();
-//		#if( BUS_4BITS != 0 )
-//		{
-//			GPIO_InitStruct.Pin = GPIO_PIN_8 | GPIO_PIN_9 | GPIO_PIN_10 | GPIO_PIN_11 | GPIO_PIN_12;
-//		}
-//		#else
-//		{
-//			GPIO_InitStruct.Pin = GPIO_PIN_8 | GPIO_PIN_9 | GPIO_PIN_12;
-//		}
-//		#endif
-//		GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
-//		GPIO_InitStruct.Pull = GPIO_NOPULL;
-//		GPIO_InitStruct.Speed = GPIO_SPEED_FAST;
-//		GPIO_InitStruct.Alternate = GPIO_AF12_SDIO;
-//		HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
-
-//		__HAL_RCC_GPIOD_CLK_ENABLE();
-//		GPIO_InitStruct.Pin = GPIO_PIN_2;
-//		GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
-//		GPIO_InitStruct.Pull = GPIO_NOPULL;
-//		GPIO_InitStruct.Speed = GPIO_SPEED_LOW;
-//		GPIO_InitStruct.Alternate = GPIO_AF12_SDIO;
-//		HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
-//	}
+	if( ( pxDisk != NULL ) && ( pxDisk->xStatus.bIsMounted == pdFALSE ) && ( xPlusFATMutex != NULL ) )
+	{
+		xSemaphoreTakeRecursive( xPlusFATMutex, portMAX_DELAY );
+		lReturnCode = prvFFRead( pucBuffer, ulSectorNumber, ulSectorCount, pxDisk );
+		xSemaphoreGiveRecursive( xPlusFATMutex );
+	}
+
+	return lReturnCode;
+}
+/*-----------------------------------------------------------*/
+
+int32_t FF_SDDiskWriteSectors( FF_Disk_t *pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, const uint8_t *pucBuffer )
+{
+int32_t lReturnCode = FF_ERR_NULL_POINTER | FF_ERRFLAG;
+
+	if( ( pxDisk != NULL ) && ( pxDisk->xStatus.bIsMounted == pdFALSE ) && ( xPlusFATMutex != NULL ) )
+	{
+		xSemaphoreTakeRecursive( xPlusFATMutex, portMAX_DELAY );
+		lReturnCode = prvFFWrite( ( uint8_t * ) pucBuffer, ulSectorNumber, ulSectorCount, pxDisk );
+		xSemaphoreGiveRecursive( xPlusFATMutex );
+	}
+
+	return lReturnCode;
+}
+/*-----------------------------------------------------------*/
+
+
+/* SPI3 is initialised with the other ports (Init_SDCard_SPI3()), only the
+clock rate changes here. */
+static void prvSPI_SD_Init( void )
+{
+	__HAL_SPI_DISABLE( sdSPI_HANDLE );
+	MODIFY_REG( sdSPI_HANDLE->Instance->CR1, SPI_CR1_BR, sdSPI_INIT_PRESCALER );
+	sdSPI_HANDLE->Init.BaudRatePrescaler = sdSPI_INIT_PRESCALER;
+
+	memset( ulSDFillBlock, 0xFF, sizeof( ulSDFillBlock ) );
+
+	HAL_GPIO_WritePin( SDCARD_CS_GPIO_Port, SDCARD_CS_Pin, GPIO_PIN_SET );
+}
+/*-----------------------------------------------------------*/
+
+static void prvSPISelect( void )
+{
+	HAL_GPIO_WritePin( SDCARD_CS_GPIO_Port, SDCARD_CS_Pin, GPIO_PIN_RESET );
+}
+/*-----------------------------------------------------------*/
+
+static void prvSPIDeselect( void )
+{
+	HAL_GPIO_WritePin( SDCARD_CS_GPIO_Port, SDCARD_CS_Pin, GPIO_PIN_SET );
+
+	/* The card releases MISO on the next clock. */
+	prvSPIExchange( 0xFF );
+}
+/*-----------------------------------------------------------*/
+
+static uint8_t prvSPIExchange( uint8_t ucByte )
+{
+uint8_t ucReceived = 0xFF;
+
+	HAL_SPI_TransmitReceive( sdSPI_HANDLE, &ucByte, &ucReceived, 1, sdSPI_POLL_TIMEOUT );
+	return ucReceived;
+}
+/*-----------------------------------------------------------*/
+
+/* The card holds MISO low while busy.  Spin for the rest of the current tick
+(block programming usually takes well under a millisecond), then sleep between
+polls. */
+static BaseType_t prvSPIWaitReady( TickType_t xTimeout )
+{
+TickType_t xStart = xTaskGetTickCount();
+TickType_t xElapsed;
+
+	while( prvSPIExchange( 0xFF ) != 0xFF )
+	{
+		xElapsed = xTaskGetTickCount() - xStart;
+
+		if( xElapsed >= xTimeout )
+		{
+			return pdFAIL;
+		}
+
+		if( xElapsed > 1 )
+		{
+			vTaskDelay( 1 );
+		}
+	}
+
+	return pdPASS;
+}
+/*-----------------------------------------------------------*/
+
+/* Sends a command and returns its R1 response (0xFF on time-out).  The card
+is left selected. */
+static uint8_t prvSDCommand( uint8_t ucCommand, uint32_t ulArgument )
+{
+uint8_t pucFrame[ 6 ];
+uint8_t ucResponse;
+BaseType_t xRetry;
+
+	if( ( ucCommand & 0x80 ) != 0 )
+	{
+		ucCommand &= 0x7F;
+		ucResponse = prvSDCommand( sdCMD55, 0 );
+
+		if( ucResponse > sdR1_IDLE )
+		{
+			return ucResponse;
+		}
+	}
+
+	/* Reselect the card, it must not be busy with a previous command. */
+	HAL_GPIO_WritePin( SDCARD_CS_GPIO_Port, SDCARD_CS_Pin, GPIO_PIN_SET );
+	prvSPIExchange( 0xFF );
+	prvSPISelect();
+
+	if( ( ucCommand != sdCMD0 ) && ( prvSPIWaitReady( sdWRITE_TIMEOUT_TICKS ) != pdPASS ) )
+	{
+		return 0xFF;
+	}
+
+	pucFrame[ 0 ] = 0x40 | ucCommand;
+	pucFrame[ 1 ] = ( uint8_t ) ( ulArgument >> 24 );
+	pucFrame[ 2 ] = ( uint8_t ) ( ulArgument >> 16 );
+	pucFrame[ 3 ] = ( uint8_t ) ( ulArgument >> 8 );
+	pucFrame[ 4 ] = ( uint8_t ) ( ulArgument );
+
+	/* Only CMD0 and CMD8 are checked in SPI mode, before CRC is turned off. */
+	if( ucCommand == sdCMD0 )
+	{
+		pucFrame[ 5 ] = 0x95;
+	}
+	else if( ucCommand == sdCMD8 )
+	{
+		pucFrame[ 5 ] = 0x87;
+	}
+	else
+	{
+		pucFrame[ 5 ] = 0x01;
+	}
+
+	HAL_SPI_Transmit( sdSPI_HANDLE, pucFrame, sizeof( pucFrame ), sdSPI_POLL_TIMEOUT );
+
+	if( ucCommand == sdCMD12 )
+	{
+		/* Skip the stuff byte. */
+		prvSPIExchange( 0xFF );
+	}
+
+	/* The response comes within 8 bytes. */
+	for( xRetry = 0; xRetry < 10; xRetry++ )
+	{
+		ucResponse = prvSPIExchange( 0xFF );
+
+		if( ( ucResponse & 0x80 ) == 0 )
+		{
+			break;
+		}
+	}
+
+	return ucResponse;
+}
+/*-----------------------------------------------------------*/
+
+/* Waits for the DMA transfer started on SPI3 (see vSDCardTransferCompleteFromISR()). */
+static BaseType_t prvSDWaitTransfer( void )
+{
+	if( xSemaphoreTake( xSDCardSemaphore, sdMAX_TIME_TICKS ) != pdTRUE )
+	{
+		HAL_SPI_Abort( sdSPI_HANDLE );
+		return pdFAIL;
+	}
+
+	return ( HAL_SPI_GetError( sdSPI_HANDLE ) == HAL_SPI_ERROR_NONE ) ? pdPASS : pdFAIL;
+}
+/*-----------------------------------------------------------*/
+
+/* Waits for the start token of a data block. */
+static BaseType_t prvSDReceiveToken( void )
+{
+TickType_t xStart = xTaskGetTickCount();
+uint8_t ucToken;
+
+	do
+	{
+		ucToken = prvSPIExchange( 0xFF );
+
+		if( ( xTaskGetTickCount() - xStart ) >= sdREAD_TIMEOUT_TICKS )
+		{
+			return pdFAIL;
+		}
+	} while( ucToken == 0xFF );
+
+	return ( ucToken == sdTOKEN_START_BLOCK ) ? pdPASS : pdFAIL;
+}
+/*-----------------------------------------------------------*/
+
+/* Starts the DMA transfer of a sector once its token came, prvSDReceiveEnd()
+waits for it. */
+static BaseType_t prvSDReceiveStart( uint8_t *pucBuffer )
+{
+	if( prvSDReceiveToken() != pdPASS )
+	{
+		return pdFAIL;
+	}
+
+	/* Drop a completion left over from a timed out transfer. */
+	xSemaphoreTake( xSDCardSemaphore, 0 );
+
+	return ( HAL_SPI_TransmitReceive_DMA( sdSPI_HANDLE, ( uint8_t * ) ulSDFillBlock, pucBuffer, 512 ) == HAL_OK ) ? pdPASS : pdFAIL;
+}
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvSDReceiveEnd( void )
+{
+	if( prvSDWaitTransfer() != pdPASS )
+	{
+		return pdFAIL;
+	}
+
+	/* CRC, not checked. */
+	prvSPIExchange( 0xFF );
+	prvSPIExchange( 0xFF );
+
+	return pdPASS;
+}
+/*-----------------------------------------------------------*/
+
+/* Receives one data block.  Sectors go by DMA, the short CSD by polling. */
+static BaseType_t prvSDReceiveBlock( uint8_t *pucBuffer, uint32_t ulLength )
+{
+	if( ulLength == 512ul )
+	{
+		return ( prvSDReceiveStart( pucBuffer ) == pdPASS ) ? prvSDReceiveEnd() : pdFAIL;
+	}
+
+	if( prvSDReceiveToken() != pdPASS )
+	{
+		return pdFAIL;
+	}
+
+	HAL_SPI_TransmitReceive( sdSPI_HANDLE, ( uint8_t * ) ulSDFillBlock, pucBuffer, ( uint16_t ) ulLength, sdSPI_POLL_TIMEOUT );
+
+	/* CRC, not checked. */
+	prvSPIExchange( 0xFF );
+	prvSPIExchange( 0xFF );
+
+	return pdPASS;
+}
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvSDSendBlock( const uint8_t *pucBuffer, uint8_t ucToken )
+{
+uint8_t ucResponse;
+
+	if( prvSPIWaitReady( sdWRITE_TIMEOUT_TICKS ) != pdPASS )
+	{
+		return pdFAIL;
+	}
+
+	prvSPIExchange( ucToken );
+
+	if( ucToken == sdTOKEN_STOP_TRAN )
+	{
+		return pdPASS;
+	}
+
+	xSemaphoreTake( xSDCardSemaphore, 0 );
+
+	if( HAL_SPI_Transmit_DMA( sdSPI_HANDLE, ( uint8_t * ) pucBuffer, 512 ) != HAL_OK )
+	{
+		return pdFAIL;
+	}
+
+	if( prvSDWaitTransfer() != pdPASS )
+	{
+		return pdFAIL;
+	}
+
+	/* Dummy CRC, then the data response token. */
+	prvSPIExchange( 0xFF );
+	prvSPIExchange( 0xFF );
+	ucResponse = prvSPIExchange( 0xFF );
+
+	return ( ( ucResponse & sdDATA_RESPONSE_MASK ) == sdDATA_ACCEPTED ) ? pdPASS : pdFAIL;
+}
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvSDReadBlocks( uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount )
+{
+uint32_t ulAddress = ( xSDHighCapacity != pdFALSE ) ? ulSectorNumber : ( ulSectorNumber * 512ul );
+BaseType_t xResult = pdFAIL;
+
+	if( ulSectorCount == 1 )
+	{
+		if( prvSDCommand( sdCMD17, ulAddress ) == 0 )
+		{
+			xResult = prvSDReceiveBlock( pucBuffer, 512ul );
+		}
+	}
+	else
+	{
+		/* One command for the whole run, the card streams the blocks back to back. */
+		if( prvSDCommand( sdCMD18, ulAddress ) == 0 )
+		{
+			do
+			{
+				xResult = prvSDReceiveBlock( pucBuffer, 512ul );
+				pucBuffer += 512ul;
+			} while( ( xResult == pdPASS ) && ( --ulSectorCount != 0 ) );
+
+			prvSDCommand( sdCMD12, 0 );
+		}
+	}
+
+	prvSPIDeselect();
+
+	return xResult;
+}
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvSDWriteBlocks( const uint8_t *pucBuffer, uint32_t ulSectorNumber, uint32_t ulSectorCount )
+{
+uint32_t ulAddress = ( xSDHighCapacity != pdFALSE ) ? ulSectorNumber : ( ulSectorNumber * 512ul );
+BaseType_t xResult = pdFAIL;
+
+	if( ulSectorCount == 1 )
+	{
+		if( prvSDCommand( sdCMD24, ulAddress ) == 0 )
+		{
+			xResult = prvSDSendBlock( pucBuffer, sdTOKEN_START_BLOCK );
+		}
+	}
+	else
+	{
+		/* Pre-erasing the run lets the card program it faster. */
+		prvSDCommand( sdACMD23, ulSectorCount );
+
+		if( prvSDCommand( sdCMD25, ulAddress ) == 0 )
+		{
+			do
+			{
+				xResult = prvSDSendBlock( pucBuffer, sdTOKEN_START_MULTI );
+				pucBuffer += 512ul;
+			} while( ( xResult == pdPASS ) && ( --ulSectorCount != 0 ) );
+
+			if( prvSDSendBlock( NULL, sdTOKEN_STOP_TRAN ) != pdPASS )
+			{
+				xResult = pdFAIL;
+			}
+		}
+	}
+
+	/* Wait until the card has programmed the data. */
+	if( ( xResult == pdPASS ) && ( prvSPIWaitReady( sdWRITE_TIMEOUT_TICKS ) != pdPASS ) )
+	{
+		xResult = pdFAIL;
+	}
+
+	prvSPIDeselect();
+
+	return xResult;
+}
+/*-----------------------------------------------------------*/
+
+/* Called from the SPI3 DMA completion callbacks (spi_ports.cpp). */
+void vSDCardTransferCompleteFromISR( BaseType_t *pxHigherPriorityTaskWoken )
+{
+	if( xSDCardSemaphore != NULL )
+	{
+		xSemaphoreGiveFromISR( xSDCardSemaphore, pxHigherPriorityTaskWoken );
+	}
 }
 /*-----------------------------------------------------------*/
 
@@ -430,7 +989,7 @@ FF_Disk_t *pxDisk;
 			/* Initialise the created disk structure. */
 			memset( pxDisk, '\0', sizeof( *pxDisk ) );
 
-			pxDisk->ulNumberOfSectors = (1024 * 2 * 2048); // (1024*1024*2048)/512; // xSDCardInfo.CardCapacity / 512;
+			pxDisk->ulNumberOfSectors = ulSDSectorCount;
 
 			if( xPlusFATMutex == NULL )
 			{
@@ -441,6 +1000,7 @@ FF_Disk_t *pxDisk;
 			if( xPlusFATMutex != NULL)
 			{
 				memset( &xParameters, '\0', sizeof( xParameters ) );
+				xParameters.pucCacheMemory = ( uint8_t * ) ulSDCacheMemory;
 				xParameters.ulMemorySize = sdIOMAN_MEM_SIZE;
 				xParameters.ulSectorSize = 512;
 				xParameters.fnWriteBlocks = prvFFWrite;
@@ -542,6 +1102,8 @@ BaseType_t xReturn = pdPASS;
 
 		if( FF_isERR( xFFError ) )
 		{
+			/* Still mounted, e.g. files open. */
+			pxDisk->xStatus.bIsMounted = pdTRUE;
 			FF_PRINTF( "FF_SDDiskUnmount: rc %08x\n", ( unsigned )xFFError );
 			xReturn = pdFAIL;
 		}
@@ -692,37 +1254,6 @@ BaseType_t xReturn = pdPASS;
 }
 /*-----------------------------------------------------------*/
 
-/* SDIO init function */
-static void prvSDIO_SD_Init( void )
-{
-//	xSDHandle.Instance = SDIO;
-//	xSDHandle.Init.ClockEdge = SDIO_CLOCK_EDGE_RISING;
-//	xSDHandle.Init.ClockBypass = SDIO_CLOCK_BYPASS_DISABLE;
-//	xSDHandle.Init.ClockPowerSave = SDIO_CLOCK_POWER_SAVE_DISABLE;
-
-//	/* Start as a 1-bit bus and switch to 4-bits later on. */
-//	xSDHandle.Init.BusWide = SDIO_BUS_WIDE_1B;
-
-//	xSDHandle.Init.HardwareFlowControl = SDIO_HARDWARE_FLOW_CONTROL_DISABLE;
-
-//	/* Use fastest CLOCK at 0. */
-//	xSDHandle.Init.ClockDiv = 32;
-
-//	#if( SDIO_USES_DMA != 0 )
-//	{
-//		xSDHandle.EventSetupFunction = prvEventSetupFunction;
-//		xSDHandle.EventWaitFunction = prvEventWaitFunction;
-//	}
-//	#else
-//	{
-//		xSDHandle.EventSetupFunction = NULL;
-//		xSDHandle.EventWaitFunction = NULL;
-//	}
-//	#endif
-//	__HAL_RCC_SDIO_CLK_ENABLE( );
-}
-/*-----------------------------------------------------------*/
-
 /* This routine returns true if the SD-card is inserted.  After insertion, it
 will wait for sdCARD_DETECT_DEBOUNCE_TIME_MS before returning pdTRUE. */
 BaseType_t FF_SDDiskDetect( FF_Disk_t *pxDisk )
@@ -788,6 +1319,12 @@ int iReturn;
 
 static BaseType_t prvSDMMCInit( BaseType_t xDriveNumber )
 {
+TickType_t xStart;
+uint8_t pucData[ 16 ];
+uint8_t ucResponse;
+BaseType_t xIndex;
+uint32_t ulSize;
+
 	/* 'xDriveNumber' not yet in use. */
 	( void )xDriveNumber;
 
@@ -795,17 +1332,19 @@ static BaseType_t prvSDMMCInit( BaseType_t xDriveNumber )
 	{
 		xSDCardSemaphore = xSemaphoreCreateBinary();
 	}
-	prvSDIO_SD_Init();
 
-	vGPIO_SD_Init(/* &xSDHandle */);
-
-	#if( SDIO_USES_DMA != 0 )
+	/* A multi-block read left open goes with the card state. */
+	if( xReadAheadInFlight != pdFALSE )
 	{
-		prvSDIO_DMA_Init( );
+		HAL_SPI_Abort( sdSPI_HANDLE );
+		xReadAheadInFlight = pdFALSE;
 	}
-	#endif
 
-	//int SD_state = SD_OK;
+	xReadAheadStreaming = pdFALSE;
+	ulReadAheadCount = 0;
+
+	prvSPI_SD_Init();
+
 	/* Check if the SD card is plugged in the slot */
 	if( prvSDDetect() == pdFALSE )
 	{
@@ -815,293 +1354,113 @@ static BaseType_t prvSDMMCInit( BaseType_t xDriveNumber )
 	/* When starting up, skip debouncing of the Card Detect signal. */
 	xCardDetect.bLastPresent = pdTRUE;
 	xCardDetect.bStableSignal = pdTRUE;
-	/* Initialise the SDIO device and read the card parameters. */
-	//SD_state = HAL_SD_Init( &xSDHandle, &xSDCardInfo );
-	#if( BUS_4BITS != 0 )
-    {
-		if( SD_state == SD_OK )
-		{
-			HAL_SD_ErrorTypedef rc;
-
-			xSDHandle.Init.BusWide = SDIO_BUS_WIDE_4B;
-			rc = HAL_SD_WideBusOperation_Config(&xSDHandle, SDIO_BUS_WIDE_4B);
-			if( rc != SD_OK )
-			{
-				FF_PRINTF( "HAL_SD_WideBus: %d: %s\n", rc, prvSDCodePrintable( ( uint32_t )rc ) );
-			}
-		}
-    }
-	#endif
-//    FF_PRINTF( "HAL_SD_Init: %d: %s type: %s Capacity: %lu MB\n",
-//        SD_state,
-//        prvSDCodePrintable( ( uint32_t )SD_state ),
-//        xSDHandle.CardType == HIGH_CAPACITY_SD_CARD ? "SDHC" : "SD",
-//        xSDCardInfo.CardCapacity / ( 1024 * 1024 ) );
-
-	return /*SD_state == SD_OK ? */ 1 /*: 0*/;
-}
-/*-----------------------------------------------------------*/
-
-struct xCODE_NAME
-{
-	uint32_t ulValue;
-	const char *pcName;
-};
-
-//const struct xCODE_NAME xSD_CODES[] =
-//{
-//	{ SD_CMD_CRC_FAIL,          "CMD_CRC_FAIL: Command response received (but CRC check failed)" },
-//	{ SD_DATA_CRC_FAIL,         "DATA_CRC_FAIL: Data block sent/received (CRC check failed)" },
-//	{ SD_CMD_RSP_TIMEOUT,       "CMD_RSP_TIMEOUT: Command response timeout" },
-//	{ SD_DATA_TIMEOUT,          "DATA_TIMEOUT: Data timeout" },
-//	{ SD_TX_UNDERRUN,           "TX_UNDERRUN: Transmit FIFO underrun" },
-//	{ SD_RX_OVERRUN,            "RX_OVERRUN: Receive FIFO overrun" },
-//	{ SD_START_BIT_ERR,         "START_BIT_ERR: Start bit not detected on all data signals in wide bus mode" },
-//	{ SD_CMD_OUT_OF_RANGE,      "CMD_OUT_OF_RANGE: Command's argument was out of range" },
-//	{ SD_ADDR_MISALIGNED,       "ADDR_MISALIGNED: Misaligned address" },
-//	{ SD_BLOCK_LEN_ERR,         "BLOCK_LEN_ERR: Transferred block length is not allowed for the card or the number of transferred bytes does not match the block length" },
-//	{ SD_ERASE_SEQ_ERR,         "ERASE_SEQ_ERR: An error in the sequence of erase command occurs." },
-//	{ SD_BAD_ERASE_PARAM,       "BAD_ERASE_PARAM: An invalid selection for erase groups" },
-//	{ SD_WRITE_PROT_VIOLATION,  "WRITE_PROT_VIOLATION: Attempt to program a write protect block" },
-//	{ SD_LOCK_UNLOCK_FAILED,    "LOCK_UNLOCK_FAILED: Sequence or password error has been detected in unlock command or if there was an attempt to access a locked card" },
-//	{ SD_COM_CRC_FAILED,        "COM_CRC_FAILED: CRC check of the previous command failed" },
-//	{ SD_ILLEGAL_CMD,           "ILLEGAL_CMD: Command is not legal for the card state" },
-//	{ SD_CARD_ECC_FAILED,       "CARD_ECC_FAILED: Card internal ECC was applied but failed to correct the data" },
-//	{ SD_CC_ERROR,              "CC_ERROR: Internal card controller error" },
-//	{ SD_GENERAL_UNKNOWN_ERROR, "GENERAL_UNKNOWN_ERROR: General or unknown error" },
-//	{ SD_STREAM_READ_UNDERRUN,  "STREAM_READ_UNDERRUN: The card could not sustain data transfer in stream read operation" },
-//	{ SD_STREAM_WRITE_OVERRUN,  "STREAM_WRITE_OVERRUN: The card could not sustain data programming in stream mode" },
-//	{ SD_CID_CSD_OVERWRITE,     "CID_CSD_OVERWRITE: CID/CSD overwrite error" },
-//	{ SD_WP_ERASE_SKIP,         "WP_ERASE_SKIP: Only partial address space was erased" },
-//	{ SD_CARD_ECC_DISABLED,     "CARD_ECC_DISABLED: Command has been executed without using internal ECC" },
-//	{ SD_ERASE_RESET,           "ERASE_RESET: Erase sequence was cleared before executing because an out of erase sequence command was received" },
-//	{ SD_AKE_SEQ_ERROR,         "AKE_SEQ_ERROR: Error in sequence of authentication" },
-//	{ SD_INVALID_VOLTRANGE,     "INVALID_VOLTRANGE" },
-//	{ SD_ADDR_OUT_OF_RANGE,     "ADDR_OUT_OF_RANGE" },
-//	{ SD_SWITCH_ERROR,          "SWITCH_ERROR" },
-//	{ SD_SDIO_DISABLED,         "SDIO_DISABLED" },
-//	{ SD_SDIO_FUNCTION_BUSY,    "SDIO_FUNCTION_BUSY" },
-//	{ SD_SDIO_FUNCTION_FAILED,  "SDIO_FUNCTION_FAILED" },
-//	{ SD_SDIO_UNKNOWN_FUNCTION, "SDIO_UNKNOWN_FUNCTION" },
-
-//	/**
-//	* @brief  Standard error defines
-//	*/
-//	{ SD_INTERNAL_ERROR,        "INTERNAL_ERROR" },
-//	{ SD_NOT_CONFIGURED,        "NOT_CONFIGURED" },
-//	{ SD_REQUEST_PENDING,       "REQUEST_PENDING" },
-//	{ SD_REQUEST_NOT_APPLICABLE,"REQUEST_NOT_APPLICABLE" },
-//	{ SD_INVALID_PARAMETER,     "INVALID_PARAMETER" },
-//	{ SD_UNSUPPORTED_FEATURE,   "UNSUPPORTED_FEATURE" },
-//	{ SD_UNSUPPORTED_HW,        "UNSUPPORTED_HW" },
-//	{ SD_ERROR,                 "ERROR" },
-//	{ SD_OK,                    "OK" },
-//};
-/*-----------------------------------------------------------*/
 
-static const char *prvSDCodePrintable( uint32_t ulCode )
-{
-//static char retString[32];
-//const struct xCODE_NAME *pxCode;
-
-//	for( pxCode = xSD_CODES; pxCode <= xSD_CODES + sdARRAY_SIZE( xSD_CODES ) - 1; pxCode++ )
-//	{
-//		if( pxCode->ulValue == ulCode )
-//		{
-//			return pxCode->pcName;
-//		}
-//	}
-//	snprintf( retString, sizeof( retString ), "SD code %lu\n", ulCode );
-//	return retString;
-    
-    return "";
-}
-/*-----------------------------------------------------------*/
-
-#if( SDIO_USES_DMA != 0 )
-
-	static void prvSDIO_DMA_Init( void )
+	/* At least 74 clocks with CS high before the first command. */
+	for( xIndex = 0; xIndex < 10; xIndex++ )
 	{
-	static DMA_HandleTypeDef xRxDMAHandle;
-	static DMA_HandleTypeDef xTxDMAHandle;
-
-		/* Enable DMA2 clocks */
-		__DMAx_TxRx_CLK_ENABLE();
-
-		/* NVIC configuration for SDIO interrupts */
-		HAL_NVIC_SetPriority(SDIO_IRQn, configSDIO_DMA_INTERRUPT_PRIORITY, 0);
-		HAL_NVIC_EnableIRQ(SDIO_IRQn);
-
-		/* Configure DMA Rx parameters */
-		xRxDMAHandle.Init.Channel             = SD_DMAx_Rx_CHANNEL;
-		xRxDMAHandle.Init.Direction           = DMA_PERIPH_TO_MEMORY;
-		/* Peripheral address is fixed (FIFO). */
-		xRxDMAHandle.Init.PeriphInc           = DMA_PINC_DISABLE;
-		/* Memory address increases. */
-		xRxDMAHandle.Init.MemInc              = DMA_MINC_ENABLE;
-		xRxDMAHandle.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
-		xRxDMAHandle.Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
-		/* The peripheral has flow-control. */
-		xRxDMAHandle.Init.Mode                = DMA_PFCTRL;
-		xRxDMAHandle.Init.Priority            = DMA_PRIORITY_VERY_HIGH;
-		xRxDMAHandle.Init.FIFOMode            = DMA_FIFOMODE_ENABLE;
-		xRxDMAHandle.Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
-		xRxDMAHandle.Init.MemBurst            = DMA_MBURST_INC4;
-		xRxDMAHandle.Init.PeriphBurst         = DMA_PBURST_INC4;
-
-		/* DMA2_Stream3. */
-		xRxDMAHandle.Instance = SD_DMAx_Rx_STREAM;
-
-		/* Associate the DMA handle */
-		__HAL_LINKDMA(&xSDHandle, hdmarx, xRxDMAHandle);
-
-		/* Deinitialize the stream for new transfer */
-		HAL_DMA_DeInit(&xRxDMAHandle);
-
-		/* Configure the DMA stream */
-		HAL_DMA_Init(&xRxDMAHandle);
-
-		/* Configure DMA Tx parameters */
-		xTxDMAHandle.Init.Channel             = SD_DMAx_Tx_CHANNEL;
-		xTxDMAHandle.Init.Direction           = DMA_MEMORY_TO_PERIPH;
-		xTxDMAHandle.Init.PeriphInc           = DMA_PINC_DISABLE;
-		xTxDMAHandle.Init.MemInc              = DMA_MINC_ENABLE;
-		xTxDMAHandle.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
-		xTxDMAHandle.Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
-		xTxDMAHandle.Init.Mode                = DMA_PFCTRL;
-		xTxDMAHandle.Init.Priority            = DMA_PRIORITY_VERY_HIGH;
-		xTxDMAHandle.Init.FIFOMode            = DMA_FIFOMODE_ENABLE;
-		xTxDMAHandle.Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
-		xTxDMAHandle.Init.MemBurst            = DMA_MBURST_SINGLE;
-		xTxDMAHandle.Init.PeriphBurst         = DMA_PBURST_INC4;
-
-		/* DMA2_Stream6. */
-		xTxDMAHandle.Instance = SD_DMAx_Tx_STREAM;
-
-		/* Associate the DMA handle */
-		__HAL_LINKDMA(&xSDHandle, hdmatx, xTxDMAHandle);
-
-		/* Deinitialize the stream for new transfer */
-		HAL_DMA_DeInit(&xTxDMAHandle);
-
-		/* Configure the DMA stream */
-		HAL_DMA_Init(&xTxDMAHandle);
-
-		/* NVIC configuration for DMA transfer complete interrupt */
-		HAL_NVIC_SetPriority(SD_DMAx_Rx_IRQn, configSDIO_DMA_INTERRUPT_PRIORITY + 2, 0);
-		HAL_NVIC_EnableIRQ(SD_DMAx_Rx_IRQn);
-
-		/* NVIC configuration for DMA transfer complete interrupt */
-		HAL_NVIC_SetPriority(SD_DMAx_Tx_IRQn, configSDIO_DMA_INTERRUPT_PRIORITY + 2, 0);
-		HAL_NVIC_EnableIRQ(SD_DMAx_Tx_IRQn);
+		prvSPIExchange( 0xFF );
 	}
-#endif	/* SDIO_USES_DMA */
-/*-----------------------------------------------------------*/
 
-#if( SDIO_USES_DMA != 0 )
-	void SDIO_IRQHandler(void)
-	{
-	BaseType_t xHigherPriorityTaskWoken = 0;
+	xSDHighCapacity = pdFALSE;
+	ulSDSectorCount = 0;
 
-		HAL_SD_IRQHandler( &xSDHandle );
-		if( xSDCardSemaphore != NULL )
-		{
-			xSemaphoreGiveFromISR( xSDCardSemaphore, &xHigherPriorityTaskWoken );
-		}
-		portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
+	if( prvSDCommand( sdCMD0, 0 ) != sdR1_IDLE )
+	{
+		prvSPIDeselect();
+		FF_PRINTF( "prvSDMMCInit: no response to CMD0\n" );
+		return 0;
 	}
 
-#endif	/* SDIO_USES_DMA */
-/*-----------------------------------------------------------*/
-
-#if( SDIO_USES_DMA != 0 )
+	xStart = xTaskGetTickCount();
 
-	void DMA2_Stream6_IRQHandler(void)
+	if( prvSDCommand( sdCMD8, 0x1AA ) == sdR1_IDLE )
 	{
-	BaseType_t xHigherPriorityTaskWoken = 0;
+		/* SD version 2 or later.  Check the echoed voltage and pattern. */
+		for( xIndex = 0; xIndex < 4; xIndex++ )
+		{
+			pucData[ xIndex ] = prvSPIExchange( 0xFF );
+		}
 
-		/* DMA SDIO-TX interrupt handler. */
-		HAL_DMA_IRQHandler (xSDHandle.hdmatx);
-		if( xSDCardSemaphore != NULL )
+		if( ( pucData[ 2 ] != 0x01 ) || ( pucData[ 3 ] != 0xAA ) )
 		{
-			xSemaphoreGiveFromISR( xSDCardSemaphore, &xHigherPriorityTaskWoken );
+			prvSPIDeselect();
+			return 0;
 		}
-		portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
-	}
 
-#endif	/* SDIO_USES_DMA */
-/*-----------------------------------------------------------*/
+		/* Leave the idle state, telling the card that high capacity is supported. */
+		do
+		{
+			ucResponse = prvSDCommand( sdACMD41, 1UL << 30 );
+		} while( ( ucResponse == sdR1_IDLE ) && ( ( xTaskGetTickCount() - xStart ) < sdINIT_TIMEOUT_TICKS ) );
 
-#if( SDIO_USES_DMA != 0 )
+		if( ( ucResponse == 0 ) && ( prvSDCommand( sdCMD58, 0 ) == 0 ) )
+		{
+			for( xIndex = 0; xIndex < 4; xIndex++ )
+			{
+				pucData[ xIndex ] = prvSPIExchange( 0xFF );
+			}
 
-	void DMA2_Stream3_IRQHandler(void)
+			/* CCS bit. */
+			xSDHighCapacity = ( ( pucData[ 0 ] & 0x40 ) != 0 ) ? pdTRUE : pdFALSE;
+		}
+	}
+	else
 	{
-	BaseType_t xHigherPriorityTaskWoken = 0;
+		/* SD version 1 (MMC is not supported). */
+		do
+		{
+			ucResponse = prvSDCommand( sdACMD41, 0 );
+		} while( ( ucResponse == sdR1_IDLE ) && ( ( xTaskGetTickCount() - xStart ) < sdINIT_TIMEOUT_TICKS ) );
 
-		/* DMA SDIO-RX interrupt handler. */
-		HAL_DMA_IRQHandler (xSDHandle.hdmarx);
-		if( xSDCardSemaphore != NULL )
+		if( ( ucResponse == 0 ) && ( prvSDCommand( sdCMD16, 512 ) != 0 ) )
 		{
-			xSemaphoreGiveFromISR( xSDCardSemaphore, &xHigherPriorityTaskWoken );
+			ucResponse = 0xFF;
 		}
-		portYIELD_FROM_ISR( xHigherPriorityTaskWoken );
 	}
 
-#endif	/* SDIO_USES_DMA */
-/*-----------------------------------------------------------*/
-
-#if( SDIO_USES_DMA != 0 )
-
-	static void prvEventSetupFunction( SD_HandleTypeDef * pxHandle )
+	if( ucResponse != 0 )
 	{
-		/* A DMA transfer to or from the SD-card is about to start.
-		Reset the timers that will be used in prvEventWaitFunction() */
-		xDMARemainingTime = sdMAX_TIME_TICKS;
-		vTaskSetTimeOutState( &xDMATimeOut );
+		prvSPIDeselect();
+		FF_PRINTF( "prvSDMMCInit: card did not leave the idle state\n" );
+		return 0;
 	}
 
-#endif	/* SDIO_USES_DMA != 0 */
-/*-----------------------------------------------------------*/
-
-#if( SDIO_USES_DMA != 0 )
-
-	static uint32_t prvEventWaitFunction( SD_HandleTypeDef *pxHandle )
+	/* Card size from the CSD register. */
+	if( ( prvSDCommand( sdCMD9, 0 ) == 0 ) && ( prvSDReceiveBlock( pucData, sizeof( pucData ) ) == pdPASS ) )
 	{
-	uint32_t ulReturn;
-
-		/*
-		 * It was measured how quickly a DMA interrupt was received. It varied
-		 * between 0 and 4 ms.
-		 * <= 1 ms : 8047
-		 * <= 2 ms : 1850
-		 * <= 3 ms :   99
-		 * <= 4 ms :   79
-		 * >= 5 ms :    0 times
-		 */
-
-		if( xTaskCheckForTimeOut( &xDMATimeOut, &xDMARemainingTime ) != pdFALSE )
+		if( ( pucData[ 0 ] >> 6 ) == 1 )
 		{
-			/* The timeout has been reached, no need to block. */
-			ulReturn = 1UL;
+			/* CSD version 2.0: ( C_SIZE + 1 ) * 512 KB */
+			ulSize = ( ( uint32_t ) ( pucData[ 7 ] & 0x3F ) << 16 ) | ( ( uint32_t ) pucData[ 8 ] << 8 ) | pucData[ 9 ];
+			ulSDSectorCount = ( ulSize + 1 ) * 1024ul;
 		}
 		else
 		{
-			/* The timeout has not been reached yet, block on the semaphore. */
-			xSemaphoreTake( xSDCardSemaphore, xDMARemainingTime );
-			if( xTaskCheckForTimeOut( &xDMATimeOut, &xDMARemainingTime ) != pdFALSE )
-			{
-				ulReturn = 1UL;
-			}
-			else
-			{
-				ulReturn = 0UL;
-			}
+			/* CSD version 1.0: ( C_SIZE + 1 ) * 2 ^ ( C_SIZE_MULT + 2 ) * 2 ^ READ_BL_LEN bytes */
+			ulSize = ( ( uint32_t ) ( pucData[ 6 ] & 0x03 ) << 10 ) | ( ( uint32_t ) pucData[ 7 ] << 2 ) | ( pucData[ 8 ] >> 6 );
+			ulSDSectorCount = ( ulSize + 1 ) << ( ( ( ( pucData[ 9 ] & 0x03 ) << 1 ) | ( pucData[ 10 ] >> 7 ) ) + 2 + ( pucData[ 5 ] & 0x0F ) - 9 );
 		}
+	}
+
+	prvSPIDeselect();
 
-		return ulReturn;
+	if( ulSDSectorCount == 0 )
+	{
+		FF_PRINTF( "prvSDMMCInit: CSD read failed\n" );
+		return 0;
 	}
 
-#endif	/* SDIO_USES_DMA != 0 */
+	/* Identification done, full speed from now on. */
+	__HAL_SPI_DISABLE( sdSPI_HANDLE );
+	MODIFY_REG( sdSPI_HANDLE->Instance->CR1, SPI_CR1_BR, sdSPI_DATA_PRESCALER );
+	sdSPI_HANDLE->Init.BaudRatePrescaler = sdSPI_DATA_PRESCALER;
+
+	FF_PRINTF( "prvSDMMCInit: type: %s Capacity: %lu MB\n",
+		xSDHighCapacity != pdFALSE ? "SDHC" : "SD",
+		ulSDSectorCount / sdSECTORS_PER_MB );
+
+	return 1;
+}
 /*-----------------------------------------------------------*/
 
 //void HAL_GPIO_EXTI_Callback( uint16_t GPIO_Pin )
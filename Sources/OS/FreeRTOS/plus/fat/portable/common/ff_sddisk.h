@@ -59,6 +59,11 @@ BaseType_t FF_SDDiskShowPartition( FF_Disk_t *pDisk );
 /* Flush changes from the driver's buf to disk */
 void FF_SDDiskFlush( FF_Disk_t *pDisk );
 
+/* Raw sector access while the volume is unmounted (USB mass storage), the
+whole card.  Return 0 or an FF_ERRFLAG error. */
+int32_t FF_SDDiskReadSectors( FF_Disk_t *pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, uint8_t *pucBuffer );
+int32_t FF_SDDiskWriteSectors( FF_Disk_t *pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, const uint8_t *pucBuffer );
+
 /* Format a given partition on an SD-card. */
 BaseType_t FF_SDDiskFormat( FF_Disk_t *pxDisk, BaseType_t aPart );
 
@@ -69,6 +74,9 @@ BaseType_t FF_SDDiskInserted( BaseType_t xDriveNr );
 manageer structure, just a handle to a disk. */
 FF_IOManager_t *sddisk_ioman( FF_Disk_t *pxDisk );
 
+/* To be called from the SPI DMA completion interrupt of the card. */
+void vSDCardTransferCompleteFromISR( BaseType_t *pxHigherPriorityTaskWoken );
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
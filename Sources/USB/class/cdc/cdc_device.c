@@ -428,6 +428,9 @@ bool cdcd_xfer_cb(uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
   // Received new data
   if ( ep_addr == p_cdc->ep_out )
   {
+    // Let the application pick out bytes that must not wait in the FIFO
+    if ( tud_cdc_rx_filter_cb ) xferred_bytes = tud_cdc_rx_filter_cb(itf, p_cdc->epout_buf, xferred_bytes);
+
     tu_fifo_write_n(&p_cdc->rx_ff, &p_cdc->epout_buf, xferred_bytes);
     
     // Check for wanted char and invoke callback if needed
@@ -133,6 +133,10 @@ static inline bool     tud_cdc_write_clear     (void);
 // Invoked when received new data
 TU_ATTR_WEAK void tud_cdc_rx_cb(uint8_t itf);
 
+// Invoked with each received packet before it is stored in the RX FIFO.
+// Returns the number of bytes left in the buffer (the application may remove some)
+TU_ATTR_WEAK uint32_t tud_cdc_rx_filter_cb(uint8_t itf, uint8_t* buffer, uint32_t count);
+
 // Invoked when received `wanted_char`
 TU_ATTR_WEAK void tud_cdc_rx_wanted_cb(uint8_t itf, char wanted_char);
 
@@ -99,14 +99,17 @@
 //------------- CLASS -------------//
 #define CFG_TUD_HID               0
 #define CFG_TUD_CDC               1
-#define CFG_TUD_MSC               0
+#define CFG_TUD_MSC               1
 #define CFG_TUD_MIDI              0
 #define CFG_TUD_VENDOR            0
 
 
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE   (512)
-#define CFG_TUD_CDC_TX_BUFSIZE   (64)
+#define CFG_TUD_CDC_TX_BUFSIZE   (256)
+
+// MSC buffer of the READ10/WRITE10 pieces: 8 sectors, one multi-block transfer of the card each
+#define CFG_TUD_MSC_EP_BUFSIZE   (4096)
 
 #ifdef __cplusplus
  }
@@ -44,9 +44,11 @@ tusb_desc_device_t const desc_device =
     .bLength            = sizeof(tusb_desc_device_t),
     .bDescriptorType    = TUSB_DESC_DEVICE,
     .bcdUSB             = 0x0200,
-    .bDeviceClass       = 0x00,
-    .bDeviceSubClass    = 0x00,
-    .bDeviceProtocol    = 0x00,
+    // Use Interface Association Descriptor (IAD) for CDC
+    // As required by USB Specs IAD's subclass must be common class (2) and protocol must be IAD (1)
+    .bDeviceClass       = TUSB_CLASS_MISC,
+    .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol    = MISC_PROTOCOL_IAD,
     .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
 
     .idVendor           = 0xCafe,
@@ -81,8 +83,13 @@ uint8_t const * tud_descriptor_device_cb(void)
 // Define endpoints for CDC //
 #define EPNUM_CDC_0_NOTIF   0x81
 #define EPNUM_CDC_0_DATA    0x02
-#define EPNUM_CDC_1_NOTIF   0x83
-#define EPNUM_CDC_1_DATA    0x04
+
+
+//----------- MSC CLASS SPECIFIC DATA --------//
+
+// Define endpoints for MSC (the SD card), OTG_FS has endpoints 0 to 3 //
+#define EPNUM_MSC_OUT       0x03
+#define EPNUM_MSC_IN        0x83
 
 
 //--------------------------------------------------------------------+
@@ -95,12 +102,13 @@ enum
 {
     ITF_NUM_CDC_0 = 0,
     ITF_NUM_CDC_0_DATA,
+    ITF_NUM_MSC,
     
     ITF_NUM_TOTAL
 };
 
-// Config Size (9) + 2 * CDC Size
-#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN)
+// Config Size (9) + CDC Size + MSC Size
+#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN + CFG_TUD_MSC * TUD_MSC_DESC_LEN)
 
 
 uint8_t const desc_configuration[] =
@@ -110,6 +118,9 @@ uint8_t const desc_configuration[] =
     
   // 1st CDC: Interface number, string index, EP notification address and size, EP data address (out, in) and size.
   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_0, 0, EPNUM_CDC_0_NOTIF, 8, EPNUM_CDC_0_DATA, 0x80 | EPNUM_CDC_0_DATA, 64),
+
+  // SD card: Interface number, string index, EP Out & EP In address, EP size
+  TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 4, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -132,6 +143,7 @@ char const* string_desc_arr [] =
   "Home Devices Inc.",                      // 1: Manufacturer
   "OrionPlus CNC Controller",               // 2: Product
   "0x325_YHSz",                             // 3: Serials, should use chip ID
+  "OrionPlus SD card",                      // 4: MSC Interface
 };
 
 static uint16_t _desc_str[32];
@@ -0,0 +1,555 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// gcheck - batch G-code verifier and job time estimator (host, POSIX)
+//
+// Runs G-code files through the firmware's own GCodeParser, Planner and
+// Conveyor in check mode ($C, MachineCore::SetCheckMode), built for the host
+// with the stand-ins of Tools/host (host.mk). Per file it reports the errors
+// with their lines, the moves outside the soft limits, the extents of the
+// planned path, the planned time and the peak feed, the same numbers a check
+// on the controller gives.
+//
+// The firmware code keeps its state in singletons (machine, Settings_Manager),
+// so each file is checked in a process of its own (fork), up to -j at a time.
+// That also starts every file from the same settings and modal state.
+//
+//  gcheck [options] file...
+//
+//      -j jobs     Files checked at the same time (default: one per core)
+//      -s steps    Steps per mm, one value or X,Y,Z
+//      -r rate     Max rate mm/min, one value or X,Y,Z
+//      -a accel    Acceleration mm/s^2, one value or X,Y,Z
+//      -t travel   Max travel mm (soft limits), one value or X,Y,Z
+//      -d dev      Junction deviation mm
+//      -e error    Max arc error mm
+//      -n          No soft limits
+//      -x line     Line run before each file, not counted (work offsets,
+//                  G10 L2 P1 X-250 Y-180 Z-60). Can be repeated
+//      -m count    Errors listed per file (default 10)
+//      -q          Only files with errors
+//
+// Settings not given are the defaults of Settings_Manager::ResetToDefaults
+// (2 mm/s^2, times come out long for most machines: give -a), the ones used
+// are printed first.
+// The axes count as homed, at machine zero. Exit status 0 if every file is
+// clean, 1 if any has errors or moves outside the soft limits, 2 if a file
+// can't be checked.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+
+#include "settings_manager.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define GCHECK_DEFAULT_ERRORS       10
+
+typedef struct HOST_OPTIONS
+{
+    uint32_t    Jobs;
+    uint32_t    MaxErrors;
+    bool        Quiet;
+    bool        NoSoftLimits;
+
+    bool        StepsSet;
+    bool        RateSet;
+    bool        AccelSet;
+    bool        TravelSet;
+    bool        DeviationSet;
+    bool        ArcErrorSet;
+
+    float       Steps[COORDINATE_LINEAR_AXES_COUNT];
+    float       Rate[COORDINATE_LINEAR_AXES_COUNT];         // mm/min
+    float       Accel[COORDINATE_LINEAR_AXES_COUNT];
+    float       Travel[COORDINATE_LINEAR_AXES_COUNT];
+    float       Deviation;
+    float       ArcError;
+
+    std::vector<const char*> SetupLines;
+
+}HOST_OPTIONS;
+
+// Sent by a worker after its report text
+typedef struct FILE_SUMMARY
+{
+    uint32_t    Lines;
+    uint32_t    Errors;             // All of them, soft limits included
+    uint32_t    LimitErrors;
+    uint32_t    Readable;
+    double      CpuSeconds;         // Parsing and planning only
+
+}FILE_SUMMARY;
+
+typedef struct WORKER
+{
+    pid_t       Pid;
+    int         Fd;
+    uint32_t    File;
+
+}WORKER;
+
+extern MachineCore* machine;
+
+static HOST_OPTIONS options;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static double cpu_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double wall_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One value for all the axes or X,Y,Z
+static bool parse_axes(const char* text, float* values)
+{
+    char* end;
+    uint32_t index;
+
+    for (index = 0; index < COORDINATE_LINEAR_AXES_COUNT; index++)
+    {
+        values[index] = strtof(text, &end);
+
+        if (end == text || values[index] <= 0.0f)
+            return false;
+
+        if (*end == '\0')
+            break;
+
+        if (*end != ',')
+            return false;
+
+        text = end + 1;
+    }
+
+    if (index == 0)
+    {
+        values[1] = values[0];
+        values[2] = values[0];
+        return true;
+    }
+
+    return (index == (COORDINATE_LINEAR_AXES_COUNT - 1) && *end == '\0');
+}
+
+static bool parse_value(const char* text, float* value)
+{
+    char* end;
+
+    *value = strtof(text, &end);
+
+    return (end != text && *end == '\0' && *value > 0.0f);
+}
+
+static void apply_settings(void)
+{
+    uint32_t axis;
+
+    for (axis = COORD_X; axis < COORDINATE_LINEAR_AXES_COUNT; axis++)
+    {
+        if (options.StepsSet != false)
+            Settings_Manager::SetStepsPer_mm_Axis(axis, options.Steps[axis]);
+
+        if (options.RateSet != false)
+            Settings_Manager::SetMaxSpeed_mm_sec_axis(axis, options.Rate[axis] / 60.0f);
+
+        if (options.AccelSet != false)
+            Settings_Manager::SetAcceleration_mm_sec2_axis(axis, options.Accel[axis]);
+
+        if (options.TravelSet != false)
+            Settings_Manager::SetMaxTravel_mm_Axis(axis, options.Travel[axis]);
+    }
+
+    if (options.DeviationSet != false)
+        Settings_Manager::SetJunctionDeviation_mm(options.Deviation);
+
+    if (options.ArcErrorSet != false)
+        Settings_Manager::SetMaxArcError_mm(options.ArcError);
+
+    if (options.NoSoftLimits != false)
+        Settings_Manager::DisableSoftLimits();
+}
+
+// The times depend on them, the firmware defaults are those of a slow machine
+static void print_settings(void)
+{
+    Settings_Manager::Initialize();
+    apply_settings();
+
+    printf("settings%s: steps/mm %.1f,%.1f,%.1f, rate mm/min %.0f,%.0f,%.0f, accel mm/s^2 %.1f,%.1f,%.1f, junction deviation %.3f mm\n",
+           (options.StepsSet || options.RateSet || options.AccelSet || options.DeviationSet) ? "" : " (firmware defaults)",
+           Settings_Manager::GetStepsPer_mm_Axis(COORD_X), Settings_Manager::GetStepsPer_mm_Axis(COORD_Y), Settings_Manager::GetStepsPer_mm_Axis(COORD_Z),
+           Settings_Manager::GetMaxSpeed_mm_sec_axis(COORD_X) * 60.0f, Settings_Manager::GetMaxSpeed_mm_sec_axis(COORD_Y) * 60.0f,
+           Settings_Manager::GetMaxSpeed_mm_sec_axis(COORD_Z) * 60.0f, Settings_Manager::GetAcceleration_mm_sec2_axis(COORD_X),
+           Settings_Manager::GetAcceleration_mm_sec2_axis(COORD_Y), Settings_Manager::GetAcceleration_mm_sec2_axis(COORD_Z),
+           Settings_Manager::GetJunctionDeviation_mm());
+}
+
+static void print_time(FILE* out, uint64_t milliseconds)
+{
+    uint64_t seconds = milliseconds / 1000;
+
+    fprintf(out, "%lu:%02u:%02u.%03u", (unsigned long)(seconds / 3600), (unsigned)((seconds / 60) % 60),
+            (unsigned)(seconds % 60), (unsigned)(milliseconds % 1000));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Worker side. Checks one file, writes the report to out
+static void check_file(const char* path, FILE* out, FILE_SUMMARY* summary)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 3];          // With CR LF
+    uint32_t length, index;
+    bool too_long = false;
+    int result;
+    double start;
+    float min_mm[TOTAL_AXES_COUNT], max_mm[TOTAL_AXES_COUNT];
+    FILE* file;
+
+    memset(summary, 0, sizeof(FILE_SUMMARY));
+
+    file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(out, "%s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    summary->Readable = true;
+
+    Settings_Manager::Initialize();
+    apply_settings();
+
+    machine = new MachineCore();
+    machine->Initialize();
+
+    for (index = 0; index < options.SetupLines.size(); index++)
+    {
+        result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, options.SetupLines[index]);
+
+        if (result != GCODE_OK && result != GCODE_INFO_BLOCK_DELETE)
+            fprintf(out, "    setup line %u: error %d (%s): %s\n", index + 1, result, machine->GetGCodeErrorText(result), options.SetupLines[index]);
+    }
+
+    machine->SetCheckMode(true);
+
+    start = cpu_seconds();
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        length = strlen(line);
+
+        // The rest of a line too long for the controller
+        if (too_long != false)
+        {
+            too_long = (length == 0 || line[length - 1] != '\n');
+            continue;
+        }
+
+        summary->Lines++;
+
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        else if (feof(file) == 0)
+            too_long = true;
+
+        if (length > 0 && line[length - 1] == '\r')
+            line[--length] = '\0';
+
+        if (too_long != false || length > GCODE_MAX_LINE_LENGTH)
+        {
+            result = GCODE_ERROR_LINE_TOO_LONG;
+            line[GCODE_MAX_LINE_LENGTH] = '\0';
+        }
+        else if (length == 0)
+        {
+            continue;
+        }
+        else
+        {
+            result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+
+        if (result == GCODE_OK || result == GCODE_INFO_BLOCK_DELETE)
+            continue;
+
+        if (result == GCODE_ERROR_TARGET_OUTSIDE_LIMIT_VALUES)
+            summary->LimitErrors++;
+
+        if (summary->Errors++ < options.MaxErrors)
+            fprintf(out, "    line %u: error %d (%s): %s\n", summary->Lines, result, machine->GetGCodeErrorText(result), line);
+    }
+
+    // Leaving retires the blocks still queued, their time counts
+    machine->SetCheckMode(false);
+
+    summary->CpuSeconds = cpu_seconds() - start;
+
+    if (ferror(file))
+        fprintf(out, "%s: %s\n", path, strerror(errno));
+
+    fclose(file);
+
+    if (summary->Errors > options.MaxErrors)
+        fprintf(out, "    ... %u more errors\n", summary->Errors - options.MaxErrors);
+
+    fprintf(out, "    time ");
+    print_time(out, machine->GetCheckTime_ms());
+    fprintf(out, ", %u blocks, peak feed %.0f mm/min\n", machine->GetCheckBlocks(), machine->GetCheckPeakSpeed() * 60.0f);
+
+    if (machine->GetCheckExtents(min_mm, max_mm) != false)
+    {
+        fprintf(out, "    X %.3f .. %.3f, Y %.3f .. %.3f, Z %.3f .. %.3f mm (machine)\n",
+                min_mm[COORD_X], max_mm[COORD_X], min_mm[COORD_Y], max_mm[COORD_Y], min_mm[COORD_Z], max_mm[COORD_Z]);
+    }
+}
+
+static void run_worker(const char* path, int fd)
+{
+    FILE* out = fdopen(fd, "w");
+    FILE_SUMMARY summary;
+
+    check_file(path, out, &summary);
+
+    fflush(out);
+    fwrite(&summary, sizeof(summary), 1, out);
+    fclose(out);
+
+    _exit(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Parent side. A worker that dies before its summary leaves the file unchecked
+static bool print_result(const char* path, const std::string& text, FILE_SUMMARY* summary)
+{
+    if (text.size() < sizeof(FILE_SUMMARY))
+    {
+        printf("%s: checker failed\n%s", path, text.c_str());
+        memset(summary, 0, sizeof(FILE_SUMMARY));
+        return false;
+    }
+
+    memcpy(summary, text.data() + text.size() - sizeof(FILE_SUMMARY), sizeof(FILE_SUMMARY));
+
+    if (summary->Readable == false)
+    {
+        printf("%.*s", (int)(text.size() - sizeof(FILE_SUMMARY)), text.data());
+        return false;
+    }
+
+    if (options.Quiet == false || summary->Errors != 0)
+    {
+        printf("%s: %u lines, %u errors (%u outside soft limits)\n", path, summary->Lines,
+               summary->Errors, summary->LimitErrors);
+        printf("%.*s", (int)(text.size() - sizeof(FILE_SUMMARY)), text.data());
+    }
+
+    return true;
+}
+
+static bool start_worker(WORKER* worker, const char* path, uint32_t file)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return false;
+
+    // Nothing buffered may reach the worker's copy of stdout
+    fflush(stdout);
+
+    worker->Pid = fork();
+
+    if (worker->Pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (worker->Pid == 0)
+    {
+        close(fds[0]);
+        run_worker(path, fds[1]);
+    }
+
+    close(fds[1]);
+
+    worker->Fd = fds[0];
+    worker->File = file;
+
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gcheck [-j jobs] [-s steps] [-r rate] [-a accel] [-t travel] [-d dev] [-e error]\n"
+                    "              [-n] [-x line]... [-m count] [-q] file...\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<WORKER> workers;
+    std::vector<std::string> results;
+    std::vector<bool> done;
+    std::vector<struct pollfd> fds;
+    FILE_SUMMARY summary;
+    uint32_t files, next = 0, printed = 0, index;
+    uint64_t total_lines = 0;
+    double total_cpu = 0.0, start;
+    bool failed = false, broken = false;
+    char buffer[16384];
+    ssize_t count;
+    long cores;
+    int option;
+
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    options.Jobs = (cores > 0) ? (uint32_t)cores : 1;
+    options.MaxErrors = GCHECK_DEFAULT_ERRORS;
+
+    while ((option = getopt(argc, argv, "j:s:r:a:t:d:e:nx:m:q")) != -1)
+    {
+        switch (option)
+        {
+            case 'j': options.Jobs = (uint32_t)atoi(optarg); if (options.Jobs == 0) usage(); break;
+            case 's': options.StepsSet = parse_axes(optarg, options.Steps); if (options.StepsSet == false) usage(); break;
+            case 'r': options.RateSet = parse_axes(optarg, options.Rate); if (options.RateSet == false) usage(); break;
+            case 'a': options.AccelSet = parse_axes(optarg, options.Accel); if (options.AccelSet == false) usage(); break;
+            case 't': options.TravelSet = parse_axes(optarg, options.Travel); if (options.TravelSet == false) usage(); break;
+            case 'd': options.DeviationSet = parse_value(optarg, &options.Deviation); if (options.DeviationSet == false) usage(); break;
+            case 'e': options.ArcErrorSet = parse_value(optarg, &options.ArcError); if (options.ArcErrorSet == false) usage(); break;
+            case 'n': options.NoSoftLimits = true; break;
+            case 'x': options.SetupLines.push_back(optarg); break;
+            case 'm': options.MaxErrors = (uint32_t)atoi(optarg); break;
+            case 'q': options.Quiet = true; break;
+            default: usage();
+        }
+    }
+
+    if (optind >= argc)
+        usage();
+
+    files = (uint32_t)(argc - optind);
+
+    if (options.Quiet == false)
+        print_settings();
+
+    results.resize(files);
+    done.resize(files, false);
+
+    start = wall_seconds();
+
+    while (printed < files)
+    {
+        while (workers.size() < options.Jobs && next < files)
+        {
+            WORKER worker;
+
+            if (start_worker(&worker, argv[optind + next], next) == false)
+            {
+                perror("gcheck");
+                return 2;
+            }
+
+            workers.push_back(worker);
+            next++;
+        }
+
+        fds.resize(workers.size());
+
+        for (index = 0; index < workers.size(); index++)
+        {
+            fds[index].fd = workers[index].Fd;
+            fds[index].events = POLLIN;
+            fds[index].revents = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR)
+        {
+            perror("gcheck");
+            return 2;
+        }
+
+        for (index = workers.size(); index != 0; index--)
+        {
+            WORKER& worker = workers[index - 1];
+
+            if (fds[index - 1].revents == 0)
+                continue;
+
+            count = read(worker.Fd, buffer, sizeof(buffer));
+
+            if (count > 0)
+            {
+                results[worker.File].append(buffer, count);
+                continue;
+            }
+
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            close(worker.Fd);
+            waitpid(worker.Pid, NULL, 0);
+
+            done[worker.File] = true;
+            workers.erase(workers.begin() + (index - 1));
+        }
+
+        // In the order given
+        while (printed < files && done[printed] != false)
+        {
+            if (print_result(argv[optind + printed], results[printed], &summary) == false)
+                broken = true;
+
+            if (summary.Errors != 0)
+                failed = true;
+
+            total_lines += summary.Lines;
+            total_cpu += summary.CpuSeconds;
+
+            results[printed].clear();
+            printed++;
+        }
+    }
+
+    printf("%u files, %llu lines in %.2f s with %u jobs", files, (unsigned long long)total_lines,
+           wall_seconds() - start, (options.Jobs < files) ? options.Jobs : files);
+
+    if (total_cpu > 0.0)
+        printf(", %.0f lines/s per core", total_lines / total_cpu);
+
+    printf("\n");
+
+    if (broken != false)
+        return 2;
+
+    return (failed != false) ? 1 : 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+###############################################################################
+#
+# Wall time of gcheck over the same files for -j 1, 2, 4, ... up to one job
+# per core, and the speedup over -j 1. Each file is one forked worker, so give
+# at least as many files as cores.
+#
+#   ./scaling.sh file...
+#
+###############################################################################
+
+if [ $# -eq 0 ]; then
+    echo "usage: scaling.sh file..." >&2
+    exit 2
+fi
+
+cores=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+echo "$cores cores, $# files"
+
+jobs=1
+base=""
+while :; do
+    start=$(date +%s.%N)
+    ./gcheck -q -j $jobs "$@" > /dev/null
+    end=$(date +%s.%N)
+
+    awk -v j=$jobs -v s=$start -v e=$end -v b="$base" 'BEGIN {
+        t = e - s;
+        if (b == "") b = t;
+        printf("-j %-3d %8.2f s  x%.2f\n", j, t, b / t);
+    }'
+
+    [ -z "$base" ] && base=$(awk -v s=$start -v e=$end 'BEGIN { print e - s }')
+    [ $jobs -ge $cores ] && break
+
+    jobs=$((jobs * 2))
+    [ $jobs -gt $cores ] && jobs=$cores
+done
@@ -0,0 +1,260 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// gcompile - G-code to precompiled toolpath compiler (host, POSIX)
+//
+// Compiles a G-code file into the binary toolpath format of BinaryToolpath.h
+// with the firmware's own GCodeParser, built for the host with the stand-ins
+// of Tools/host (host.mk). The controller runs the result from the card like
+// any job (DiskTask_StartJob), without parsing text.
+//
+// The records hold machine coordinates, so the work offsets the program uses
+// have to be given with -x the way they are set on the controller. Commands
+// that change the machine or its settings (G10, G28, G30, G28.1, G30.1, M0,
+// M32, M36, M38) can't be compiled, the first one stops the compiler. Arcs
+// are kept whole, the controller cuts them into lines with its own arc
+// settings when it runs them.
+//
+//  gcompile [options] file
+//
+//      -o output   Toolpath file (default: file with the .optp extension)
+//      -x line     Line run before the file, not compiled (work offsets,
+//                  G10 L2 P1 X-250 Y-180 Z-60). Can be repeated
+//      -q          No summary
+//
+// Exit status 0 if the file compiled, 1 if it has errors, 2 if it can't be
+// read or written.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "settings_manager.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+#include "BinaryToolpath.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct COMPILER_OUTPUT
+{
+    FILE*       File;
+    uint64_t    Bytes;
+    uint32_t    Records;
+    bool        Failed;
+
+}COMPILER_OUTPUT;
+
+extern MachineCore* machine;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static double cpu_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void write_record(const uint8_t* data, uint32_t size, void* context)
+{
+    COMPILER_OUTPUT* output = (COMPILER_OUTPUT*)context;
+
+    if (fwrite(data, 1, size, output->File) != size)
+        output->Failed = true;
+
+    output->Bytes += size;
+    output->Records++;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gcompile [-o output] [-x line]... [-q] file\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 3];          // With CR LF
+    std::vector<const char*> setup_lines;
+    std::string output_path;
+    COMPILER_OUTPUT output;
+    BinaryToolpath writer;
+    uint64_t input_bytes = 0;
+    uint32_t lines = 0;
+    uint32_t length, index;
+    bool quiet = false;
+    bool too_long = false;
+    double start;
+    size_t dot;
+    int result = GCODE_OK;
+    int option;
+    FILE* file;
+
+    while ((option = getopt(argc, argv, "o:x:q")) != -1)
+    {
+        switch (option)
+        {
+            case 'o':   output_path = optarg; break;
+            case 'x':   setup_lines.push_back(optarg); break;
+            case 'q':   quiet = true; break;
+
+            default:
+                usage();
+        }
+    }
+
+    if (optind != (argc - 1))
+        usage();
+
+    if (output_path.empty() != false)
+    {
+        output_path = argv[optind];
+        dot = output_path.find_last_of("./");
+
+        if (dot != std::string::npos && output_path[dot] == '.')
+            output_path.erase(dot);
+
+        output_path += ".optp";
+    }
+
+    file = fopen(argv[optind], "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+
+    Settings_Manager::Initialize();
+
+    machine = new MachineCore();
+    machine->Initialize();
+
+    // Setup lines only set up the parser. Check mode is off for the compile itself (it would
+    // leave spindle and coolant out), with the writer attached nothing reaches the machine
+    machine->SetCheckMode(true);
+
+    for (index = 0; index < setup_lines.size(); index++)
+    {
+        result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, setup_lines[index]);
+
+        if (result != GCODE_OK && result != GCODE_INFO_BLOCK_DELETE)
+        {
+            fprintf(stderr, "setup line %u: error %d (%s): %s\n", index + 1, result, machine->GetGCodeErrorText(result), setup_lines[index]);
+            return 1;
+        }
+    }
+
+    machine->SetCheckMode(false);
+
+    memset(&output, 0, sizeof(output));
+    output.File = fopen(output_path.c_str(), "wb");
+
+    if (output.File == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", output_path.c_str(), strerror(errno));
+        fclose(file);
+        return 2;
+    }
+
+    writer.AssociateOutput(write_record, &output);
+    writer.WriteHeader();
+    output.Records = 0;
+
+    machine->AssociateToolpathWriter(&writer);
+
+    result = GCODE_OK;
+    start = cpu_seconds();
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        length = strlen(line);
+        input_bytes += length;
+
+        // The rest of a line too long for the controller
+        if (too_long != false)
+        {
+            too_long = (length == 0 || line[length - 1] != '\n');
+            continue;
+        }
+
+        lines++;
+
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        else if (feof(file) == 0)
+            too_long = true;
+
+        if (length > 0 && line[length - 1] == '\r')
+            line[--length] = '\0';
+
+        if (too_long != false || length > GCODE_MAX_LINE_LENGTH)
+        {
+            result = GCODE_ERROR_LINE_TOO_LONG;
+            line[GCODE_MAX_LINE_LENGTH] = '\0';
+        }
+        else if (length == 0)
+        {
+            continue;
+        }
+        else
+        {
+            result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+
+        if (result == GCODE_INFO_BLOCK_DELETE)
+            result = GCODE_OK;
+
+        if (result != GCODE_OK)
+        {
+            fprintf(stderr, "%s: line %u: error %d (%s): %s\n", argv[optind], lines, result, machine->GetGCodeErrorText(result), line);
+            break;
+        }
+    }
+
+    machine->AssociateToolpathWriter(NULL);
+    writer.WriteEnd();
+
+    start = cpu_seconds() - start;
+
+    if (ferror(file))
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        result = GCODE_ERROR_DISK_ACCESS;
+    }
+
+    fclose(file);
+
+    if (fclose(output.File) != 0 || output.Failed != false)
+    {
+        fprintf(stderr, "%s: %s\n", output_path.c_str(), strerror(errno));
+        result = GCODE_ERROR_DISK_ACCESS;
+    }
+
+    // Never leave half a toolpath behind
+    if (result != GCODE_OK)
+    {
+        unlink(output_path.c_str());
+        return (result == GCODE_ERROR_DISK_ACCESS) ? 2 : 1;
+    }
+
+    if (quiet == false)
+    {
+        printf("%s: %u lines, %llu bytes -> %s: %u records, %llu bytes (%.0f%%), %.0f lines/s\n",
+               argv[optind], lines, (unsigned long long)input_bytes, output_path.c_str(), output.Records,
+               (unsigned long long)output.Bytes, (input_bytes != 0) ? (100.0 * output.Bytes / input_bytes) : 0.0,
+               (start > 0) ? (lines / start) : 0.0);
+    }
+
+    return 0;
+}
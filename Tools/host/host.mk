@@ -0,0 +1,58 @@
+###############################################################################
+#
+# Host build of the firmware sources, shared by the Makefiles of Tools/
+#
+# The stand-ins of this directory replace what the firmware gets from the
+# board: the HAL types, the FreeRTOS port, the CRC unit, the W25Q16
+# (host_platform.cpp) and the MachineCore members that touch hardware
+# (host_machine.cpp). The FreeRTOS calls come from HOST_KERNEL: host_kernel.cpp
+# for the single thread tools, host_rtos.cpp (tasks on threads) for the tests
+# that run firmware tasks, with the USB CDC port (host_usb.cpp) and the SD card
+# (host_sddisk.cpp). Needs a POSIX system and g++ or clang++.
+#
+# The including Makefile lists its firmware sources in FIRMWARE and its own
+# sources in LOCAL, then builds $(OBJECTS). The FreeRTOS+FAT sources build to
+# $(BUILD_DIR) as well.
+#
+###############################################################################
+
+HOST_DIR    := $(patsubst %/,%,$(dir $(lastword $(MAKEFILE_LIST))))
+SOURCES_DIR := $(HOST_DIR)/../../Sources
+APP_DIR     := $(SOURCES_DIR)/App
+
+FAT_DIR     := $(SOURCES_DIR)/OS/FreeRTOS/plus/fat
+
+CXX         ?= g++
+CC          ?= gcc
+CXXFLAGS    ?= -O2
+CXXFLAGS    += -std=gnu++98 -Wall -Wno-unknown-pragmas
+CFLAGS      ?= -O2
+# The only C sources are FreeRTOS+FAT as it comes. On a 64 bit host only, ff_fat.c puts ~0UL in a
+# uint32_t and ff_stdio.h keeps errno in a thread local pointer (casts between int and void*)
+CFLAGS      += -std=gnu99 -Wno-overflow -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast
+# The port header goes first: FreeRTOS takes portmacro.h from its own directory otherwise
+CPPFLAGS    += -include $(HOST_DIR)/portmacro.h -I$(HOST_DIR) -I$(SOURCES_DIR)/Configs -I$(SOURCES_DIR)/OS/FreeRTOS/Inc -I$(APP_DIR)/Inc
+CPPFLAGS    += -I$(SOURCES_DIR)/USB -I$(SOURCES_DIR)/USB/class/cdc -I$(FAT_DIR)/include -I$(FAT_DIR)/portable/common
+
+BUILD_DIR   ?= build
+
+# Host stand-ins every tool links
+HOST_KERNEL ?= host_kernel.cpp
+HOST        = host_machine.cpp host_platform.cpp $(HOST_KERNEL)
+
+OBJECTS     = $(addprefix $(BUILD_DIR)/, $(FIRMWARE:.cpp=.o) $(HOST:.cpp=.o) $(LOCAL:.cpp=.o))
+
+$(BUILD_DIR)/%.o: $(APP_DIR)/Src/%.cpp | $(BUILD_DIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -MMD -c -o $@ $<
+
+$(BUILD_DIR)/%.o: $(FAT_DIR)/%.c | $(BUILD_DIR)
+	$(CC) $(CPPFLAGS) $(CFLAGS) -MMD -c -o $@ $<
+
+$(BUILD_DIR)/%.o: $(HOST_DIR)/%.cpp | $(BUILD_DIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -MMD -c -o $@ $<
+
+$(BUILD_DIR)/%.o: %.cpp | $(BUILD_DIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -MMD -c -o $@ $<
+
+$(BUILD_DIR):
+	mkdir -p $(BUILD_DIR)
@@ -0,0 +1,67 @@
+#ifndef HOST_FLASH_H
+#define HOST_FLASH_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// W25Q16 of the host build (host_platform.cpp): the flash in RAM behind the
+// W25QXX calls of spi_ports.h, with power cuts and wear counters
+//
+// Reads are timed on the SPI bus of spi_ports.cpp: fast read (command,
+// address and a dummy byte before the data) at HOST_FLASH_SPI_HZ. Those below
+// HOST_FLASH_DMA_MIN_LENGTH are polled, the CPU waits for them, longer ones
+// go by DMA (the setup of a transfer is not counted). For comparison the same
+// reads are also timed the way they were done before, plain reads at
+// HOST_FLASH_OLD_SPI_HZ, all polled.
+//
+// Programming only clears bits and an erase sets a whole sector, like the
+// real part. A power cut tears one program or erase: it has done some of the
+// bits of every byte, in no order. Nothing is programmed or erased after that
+// until host_flash_power_on(), reads still work (the firmware runs on until
+// it notices, as on its capacitors).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_FLASH_SIZE             (2 * 1024 * 1024)
+#define HOST_FLASH_SECTOR_SIZE      4096
+#define HOST_FLASH_SECTORS          (HOST_FLASH_SIZE / HOST_FLASH_SECTOR_SIZE)
+
+#define HOST_FLASH_SPI_HZ           21000000    // SPI1, APB2 84 MHz / 4
+#define HOST_FLASH_DMA_MIN_LENGTH   32          // FLASH_DMA_MIN_LENGTH of spi_ports.cpp
+#define HOST_FLASH_OLD_SPI_HZ       5250000     // Prescaler 16, plain read (0x03)
+
+typedef struct HOST_FLASH_STATS
+{
+    uint32_t    Programs;               // Page programs
+    uint32_t    ProgrammedBytes;
+    uint32_t    Erases;                 // Sector erases
+    uint64_t    BusyMicroseconds;       // Typical W25Q16 times of those
+
+    uint32_t    Reads;
+    uint32_t    ReadBytes;
+    double      ReadMicroseconds;       // On the bus
+    double      PolledReadMicroseconds; // Of those, the CPU waits for
+    double      OldReadMicroseconds;    // Polled plain reads at HOST_FLASH_OLD_SPI_HZ
+
+}HOST_FLASH_STATS;
+
+// Everything erased, counters and statistics cleared, power on
+void host_flash_reset(void);
+
+// The operation-th program or erase from now (1 = the next one) is torn, with
+// random bits from seed
+void host_flash_power_cut(uint32_t operation, uint32_t seed);
+
+// True once the armed cut happened
+bool host_flash_is_cut(void);
+
+// Back on: no cut armed, programs and erases work again
+void host_flash_power_on(void);
+
+void host_flash_get_stats(HOST_FLASH_STATS* stats);
+
+// Erases of the sector since host_flash_reset()
+uint32_t host_flash_sector_erases(uint32_t sector);
+
+#endif
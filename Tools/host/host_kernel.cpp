@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "JobCheckpoint.h"
+#include "settings_task.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FreeRTOS for the single thread tools (gcheck, gcompile, the parser tests):
+// the calls of the firmware sources they build, with no scheduler behind them.
+// The firmware tasks are not part of these tools, the calls the parser makes
+// into them do nothing. The tests that run firmware tasks link host_rtos.cpp
+// instead
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" void vTaskDelay(const TickType_t xTicksToDelay)
+{
+}
+
+extern "C" TickType_t xTaskGetTickCount(void)
+{
+    return 0;
+}
+
+extern "C" void vTaskSuspendAll(void)
+{
+}
+
+extern "C" BaseType_t xTaskResumeAll(void)
+{
+    return pdFALSE;
+}
+
+extern "C" void vPortEnterCritical(void)
+{
+}
+
+extern "C" void vPortExitCritical(void)
+{
+}
+
+extern "C" void* pvPortMalloc(size_t xSize)
+{
+    return malloc(xSize);
+}
+
+extern "C" void vPortFree(void* pv)
+{
+    free(pv);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void JobCheckpoint::OnBlockStarted(uint8_t tag)
+{
+}
+
+void SettingsTask_RequestSave(void)
+{
+}
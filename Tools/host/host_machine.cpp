@@ -0,0 +1,239 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "MachineCore.h"
+#include "GCodeParser.h"
+#include "Planner.h"
+#include "Conveyor.h"
+#include "StepTicker.h"
+#include "BinaryToolpath.h"
+
+#include "host_machine.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host side of the machine for the verifier: the members of MachineCore,
+// StepTicker and friends the parser, planner and conveyor call, and the ones
+// the serial task calls in the tests that run it. Lines only run in check mode,
+// so only the check mode paths of MachineCore.cpp are here (keep them in step
+// with it). Nothing moves, nothing is written
+//
+///////////////////////////////////////////////////////////////////////////////
+
+MachineCore* machine = NULL;
+
+StepTicker* StepTicker::instance = NULL;
+
+static volatile uint32_t line_time_us = 0;
+
+void host_machine_set_line_time(uint32_t microseconds)
+{
+    line_time_us = microseconds;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MachineCore::MachineCore(void)
+{
+    m_startup_finished = true;
+    m_system_halted = false;
+    m_feed_hold = false;
+    m_dwell_active = false;
+    
+    m_gcode_source = GCODE_SOURCE_SD_STORAGE;
+    
+    memset((void*)this->m_current_stepper_pos, 0, sizeof(this->m_current_stepper_pos));
+    
+    m_homing_state = HOMING_IDLE;
+    m_axes_homing_now = 0;
+    m_axes_already_homed = 0;
+    
+    m_probe_state = PROBING_IDLE;
+    memset((void*)this->m_probe_position, 0, sizeof(this->m_probe_position));
+    
+    m_gcode_parser = new GCodeParser();
+    m_planner = new Planner();
+    m_conveyor = new Conveyor();
+    m_step_ticker = new StepTicker();
+    m_coolant = NULL;
+    m_spindle = NULL;
+    
+    m_step_ticker->Associate_Conveyor(m_conveyor);
+    m_planner->AssociateConveyor(m_conveyor);
+    m_gcode_parser->AssociatePlanner(m_planner);
+    
+    m_stepper_idle_timer = NULL;
+    m_user_btn_read_timer = NULL;
+    m_input_events_group = NULL;
+    m_fault_event_conditions = 0;
+    m_safety_task_handle = NULL;
+}
+
+MachineCore::~MachineCore(void)
+{
+}
+
+// The program is checked on a homed machine (soft limits as the settings say)
+bool MachineCore::Initialize()
+{
+    m_conveyor->start();
+    
+    m_axes_already_homed = (1 << COORDINATE_LINEAR_AXES_COUNT) - 1;
+    
+    return true;
+}
+
+void MachineCore::Halt()
+{
+    m_system_halted = true;
+    
+    m_planner->FlushQueuedLines();
+    m_conveyor->flush_queue();
+}
+
+// No safety task, the reset halts right away
+void MachineCore::RequestReset()
+{
+    Halt();
+}
+
+bool MachineCore::StartStepperIdleTimer()
+{
+    return false;
+}
+
+void MachineCore::StopStepperIdleTimer()
+{
+}
+
+int MachineCore::ParseGCodeLine(GCODE_SOURCE_OPTIONS source, const char* line)
+{
+    m_gcode_source = source;
+    m_planner->SetSource((uint8_t)source);
+
+    if (line_time_us != 0)
+        usleep(line_time_us);
+
+    return m_gcode_parser->ParseLine(line);
+}
+
+int MachineCore::ExecuteToolpathRecord(GCODE_SOURCE_OPTIONS source, const TOOLPATH_RECORD& record)
+{
+    // Blocks planned from this record are tagged with its source
+    m_gcode_source = source;
+    m_planner->SetSource((uint8_t)source);
+
+    return m_gcode_parser->ExecuteToolpathRecord(record);
+}
+
+int MachineCore::SetCheckMode(bool enable)
+{
+    if (enable == m_gcode_parser->IsCheckModeActive())
+        return GCODE_OK;
+    
+    m_planner->WaitForQueuedLines();
+    m_conveyor->wait_for_idle();
+    
+    m_planner->SetCheckMode(enable);
+    m_gcode_parser->SetCheckMode(enable);
+    m_conveyor->set_check_mode(enable);
+    
+    return GCODE_OK;
+}
+
+int MachineCore::GoHome(float* target, uint32_t spec_value_mask, bool isG28)
+{
+    int status = GCODE_OK;
+    
+    m_planner->ResetPosition();
+    m_gcode_parser->ResetParser();
+    
+    if ((spec_value_mask & VALUE_SET_ANY_AXES_BITS) != 0)
+        status = m_planner->AppendLine(target, 0.0f, SOME_LARGE_VALUE);
+    
+    return status;
+}
+
+int MachineCore::SendSpindleCommand(GCODE_MODAL_SPINDLE_MODES mode, float spindle_rpm)
+{
+    return 0;
+}
+
+int MachineCore::SendCoolantCommand(GCODE_MODAL_COOLANT_MODES mode)
+{
+    return 0;
+}
+
+int MachineCore::Dwell(float p_time_secs)
+{
+    m_conveyor->add_check_time(p_time_secs);
+    return 0;
+}
+
+int MachineCore::WaitForIdleCondition()
+{
+    m_planner->WaitForQueuedLines();
+    m_conveyor->wait_for_idle();
+    return 0;
+}
+
+// As MachineCore.cpp, without a spindle
+void MachineCore::GetGlobalStatusReport(GLOBAL_STATUS_REPORT_DATA & outData)
+{
+    outData.SystemHalted = this->m_system_halted;
+    outData.FaultConditions = this->m_fault_event_conditions;
+    outData.FeedHoldActive = this->m_feed_hold;
+    outData.SteppersEnabled = this->m_step_ticker->AreMotorsRunning();
+    outData.CheckModeEnabled = this->m_gcode_parser->IsCheckModeActive();
+    
+    outData.OriginCoordinates = this->m_gcode_parser->ReadOriginCoords();
+    outData.OffsetCoordinates = this->m_gcode_parser->ReadOffsetCoords();
+    
+    outData.CurrentPositions = this->m_current_stepper_pos;
+    outData.TargetPositions = this->m_gcode_parser->ReadTargetCoords();
+    
+    outData.ProbingPositions = this->m_probe_position;
+    outData.HomingState = this->m_homing_state;
+    outData.ProbingState = this->m_probe_state;
+    
+    this->m_gcode_parser->ReadParserModalState(&outData.ModalState);
+    
+    outData.CurrentFeedRate = this->m_conveyor->get_current_feedrate();
+    outData.CurrentLineNumber = this->m_conveyor->get_current_line_number();
+    outData.CurrentSpindleRPM = 0;
+    outData.CurrentSpindleTool = 0;
+    
+    outData.FileParsingPercent = 0;
+    outData.CurrentFileName = NULL;
+    outData.GCodeSource = (GCODE_SOURCE_OPTIONS)this->m_conveyor->get_current_source();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+StepTicker::StepTicker()
+{
+    instance = this;
+    
+    this->frequency = STEP_TICKER_FREQUENCY;
+    this->period = 0;
+    this->inversion_mask_bits_steps = 0;
+    this->inversion_mask_bits_dirs = 0;
+    this->unstep_bits = 0;
+    this->motor_enable_bits = 0;
+    this->current_block = NULL;
+    this->current_tick = 0;
+    this->block_counter = 0;
+    this->primary_axis = 0;
+    this->m_conveyor = NULL;
+    this->running = false;
+    
+    memset((void*)this->m_stepper_positions, 0, sizeof(this->m_stepper_positions));
+}
+
+StepTicker::~StepTicker()
+{
+}
+
+void StepTicker::EnableStepperDrivers(bool enable)
+{
+}
@@ -0,0 +1,17 @@
+#ifndef HOST_MACHINE_H
+#define HOST_MACHINE_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Knobs of the host machine (host_machine.cpp) for the tests that run the
+// firmware tasks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Time each G-code line takes in ParseGCodeLine on top of the parse, the way a
+// full planner holds the parser back while the machine moves (0 = none)
+void host_machine_set_line_time(uint32_t microseconds);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <algorithm>
+
+#include <stm32f4xx_hal.h>
+
+#include "spi_ports.h"
+#include "debug_log_task.h"
+#include "host_flash.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host side of the platform: the CRC unit, the W25Q16 in RAM (host_flash.h)
+// and the debug log. Settings_Manager runs unchanged on them, so the defaults
+// are the ones a fresh controller starts with. The FreeRTOS calls are in
+// host_kernel.cpp or host_rtos.cpp
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Typical W25Q16 times: first byte of a page program, each byte after it, whole page, sector erase
+#define HOST_FLASH_BYTE_FIRST_US    30
+#define HOST_FLASH_BYTE_NEXT_US     2.5
+#define HOST_FLASH_PAGE_US          700
+#define HOST_FLASH_ERASE_US         30000
+
+uint32_t SystemCoreClock = 168000000;
+
+CRC_TypeDef host_crc_unit;
+DWT_Type host_dwt_unit;          // The cycle counter stands still
+
+static uint8_t host_flash[HOST_FLASH_SIZE];
+static bool host_flash_ready = false;
+
+// The settings task writes while a test thread arms cuts
+static pthread_mutex_t host_flash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t host_flash_cut_countdown = 0;      // 0 = no cut armed
+static uint32_t host_flash_cut_seed;
+static bool host_flash_cut = false;
+static HOST_FLASH_STATS host_flash_stats;
+static uint32_t host_flash_erases[HOST_FLASH_SECTORS];
+
+// Erased until something is written
+static void host_flash_init(void)
+{
+    if (host_flash_ready == false)
+    {
+        memset(host_flash, 0xFF, sizeof(host_flash));
+        host_flash_ready = true;
+    }
+}
+
+// xorshift32, the tools don't link host_test.cpp
+static uint32_t host_flash_random(void)
+{
+    host_flash_cut_seed ^= host_flash_cut_seed << 13;
+    host_flash_cut_seed ^= host_flash_cut_seed >> 17;
+    host_flash_cut_seed ^= host_flash_cut_seed << 5;
+    
+    return host_flash_cut_seed;
+}
+
+// True if the operation may go on, false once the power is gone. True for the torn operation
+// as well, with how far it got in *progress (0..255, 256 = done)
+static bool host_flash_power(uint32_t* progress)
+{
+    *progress = 256;
+    
+    if (host_flash_cut != false)
+        return false;
+    
+    if (host_flash_cut_countdown == 0 || --host_flash_cut_countdown != 0)
+        return true;
+    
+    host_flash_cut = true;
+    *progress = host_flash_random() % 256;
+    
+    return true;
+}
+
+// The bits of a byte an operation has done: all of them, or for a torn one each with a chance
+// of progress / 256 (late cuts leave a few bits out of a whole page)
+static uint8_t host_flash_torn_bits(uint32_t progress)
+{
+    uint8_t bits = 0;
+    uint32_t bit;
+    
+    if (progress >= 256)
+        return 0xFF;
+    
+    for (bit = 0; bit < 8; bit++)
+    {
+        if ((host_flash_random() % 256) < progress)
+            bits |= (uint8_t)(1 << bit);
+    }
+    
+    return bits;
+}
+
+void host_flash_reset(void)
+{
+    pthread_mutex_lock(&host_flash_mutex);
+    
+    memset(host_flash, 0xFF, sizeof(host_flash));
+    host_flash_ready = true;
+    
+    host_flash_cut_countdown = 0;
+    host_flash_cut = false;
+    memset(&host_flash_stats, 0, sizeof(host_flash_stats));
+    memset(host_flash_erases, 0, sizeof(host_flash_erases));
+    
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+void host_flash_power_cut(uint32_t operation, uint32_t seed)
+{
+    pthread_mutex_lock(&host_flash_mutex);
+    host_flash_cut_countdown = operation;
+    host_flash_cut_seed = (seed != 0) ? seed : 1;
+    host_flash_cut = false;
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+bool host_flash_is_cut(void)
+{
+    return host_flash_cut;
+}
+
+void host_flash_power_on(void)
+{
+    pthread_mutex_lock(&host_flash_mutex);
+    host_flash_cut_countdown = 0;
+    host_flash_cut = false;
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+void host_flash_get_stats(HOST_FLASH_STATS* stats)
+{
+    pthread_mutex_lock(&host_flash_mutex);
+    *stats = host_flash_stats;
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+uint32_t host_flash_sector_erases(uint32_t sector)
+{
+    return host_flash_erases[sector % HOST_FLASH_SECTORS];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+HAL_StatusTypeDef HAL_CRC_Init(CRC_HandleTypeDef* hcrc)
+{
+    return HAL_OK;
+}
+
+// Same as the STM32F4 unit: CRC-32 polynomial 0x04C11DB7 over whole words, MSB first,
+// starting at 0xFFFFFFFF with no final XOR (HAL_CRC_Calculate resets it)
+uint32_t HAL_CRC_Calculate(CRC_HandleTypeDef* hcrc, uint32_t* buffer, uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t index, bit;
+    
+    for (index = 0; index < length; index++)
+    {
+        crc ^= buffer[index];
+        
+        for (bit = 0; bit < 32; bit++)
+            crc = ((crc & 0x80000000) != 0) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+    }
+    
+    return crc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Bus time of a read: fast read sends 5 bytes before the data, plain read 4
+HAL_StatusTypeDef W25QXX_Read(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead)
+{
+    double bus = (5.0 + NumByteToRead) * 8e6 / HOST_FLASH_SPI_HZ;
+    
+    pthread_mutex_lock(&host_flash_mutex);
+    host_flash_init();
+    memcpy(pBuffer, &host_flash[ReadAddr % HOST_FLASH_SIZE], NumByteToRead);
+    
+    host_flash_stats.Reads++;
+    host_flash_stats.ReadBytes += NumByteToRead;
+    host_flash_stats.ReadMicroseconds += bus;
+    host_flash_stats.OldReadMicroseconds += (4.0 + NumByteToRead) * 8e6 / HOST_FLASH_OLD_SPI_HZ;
+    
+    if (NumByteToRead < HOST_FLASH_DMA_MIN_LENGTH)
+        host_flash_stats.PolledReadMicroseconds += bus;
+    
+    pthread_mutex_unlock(&host_flash_mutex);
+    
+    return HAL_OK;
+}
+
+// Programming only clears bits, like the real part. A torn program has cleared some of the bits
+// of every byte, more of them the further it got
+void W25QXX_Write_Page(uint8_t* pBuffer, uint32_t WriteAddr, uint16_t NumByteToWrite)
+{
+    uint32_t progress;
+    uint32_t index;
+    
+    pthread_mutex_lock(&host_flash_mutex);
+    host_flash_init();
+    
+    if (host_flash_power(&progress) != false)
+    {
+        for (index = 0; index < NumByteToWrite; index++)
+            host_flash[(WriteAddr + index) % HOST_FLASH_SIZE] &= (pBuffer[index] | (uint8_t)~host_flash_torn_bits(progress));
+        
+        host_flash_stats.Programs++;
+        host_flash_stats.ProgrammedBytes += NumByteToWrite;
+        host_flash_stats.BusyMicroseconds += (uint64_t)std::min(HOST_FLASH_BYTE_FIRST_US + HOST_FLASH_BYTE_NEXT_US * (NumByteToWrite - 1), (double)HOST_FLASH_PAGE_US);
+    }
+    
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+// An erase works on all the cells of the sector at once: a torn one leaves every byte with
+// some of its bits set, more of them the further it got
+void W25QXX_Erase_Sector(uint32_t Dst_Addr)
+{
+    uint8_t* sector = &host_flash[(Dst_Addr % HOST_FLASH_SECTORS) * HOST_FLASH_SECTOR_SIZE];
+    uint32_t progress;
+    uint32_t index;
+    
+    pthread_mutex_lock(&host_flash_mutex);
+    host_flash_init();
+    
+    if (host_flash_power(&progress) != false)
+    {
+        for (index = 0; index < HOST_FLASH_SECTOR_SIZE; index++)
+            sector[index] |= host_flash_torn_bits(progress);
+        
+        host_flash_erases[Dst_Addr % HOST_FLASH_SECTORS]++;
+        host_flash_stats.Erases++;
+        host_flash_stats.BusyMicroseconds += HOST_FLASH_ERASE_US;
+    }
+    
+    pthread_mutex_unlock(&host_flash_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// No log task, the USART1 log goes to stderr when HOST_DEBUG_LOG is set in the environment
+TaskHandle_t debug_log_task_handle = NULL;
+
+void DebugLog(const char* format, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    static int enabled = -1;
+
+    if (enabled < 0)
+        enabled = (getenv("HOST_DEBUG_LOG") != NULL) ? 1 : 0;
+
+    if (enabled != 0)
+    {
+        fprintf(stderr, format, arg0, arg1, arg2, arg3);
+        fputs("\r\n", stderr);
+    }
+}
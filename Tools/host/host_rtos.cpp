@@ -0,0 +1,1061 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+#include "stream_buffer.h"
+#include "event_groups.h"
+
+#include "host_rtos.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FreeRTOS for the tests that run firmware tasks (serial, parsing and disk
+// task): each task is a POSIX thread, the tick is the millisecond of the
+// monotonic clock. The objects the firmware uses (notifications, queues,
+// semaphores and mutexes, stream and message buffers, event groups) are kept
+// under one kernel lock, a blocked task waits on the kernel condition until
+// anything changes or its time is up.
+//
+// Unlike the single core target the tasks really run at the same time and
+// priorities are not kept, a task gives up nothing by being higher. Critical
+// sections and a suspended scheduler exclude the other tasks (one recursive
+// lock), so the code between them still runs alone. Message buffers keep a
+// 32 bit length before each message as on the target, so their capacity in
+// messages is the same.
+//
+// The heap is malloc(), its free size counts down from configTOTAL_HEAP_SIZE
+// by the bytes pvPortMalloc handed out (FreeRTOS+FAT, in host sizes): the
+// objects of this kernel and new of the host don't come from it, so it says
+// nothing of the budget of the target.
+// Host task stacks are not measured: the high water mark of a task is the
+// depth it was created with.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_TASK_MAX_NAME      16
+
+struct tskTaskControlBlock
+{
+    pthread_t       Thread;
+    TaskFunction_t  Entry;
+    void*           Parameter;
+    char            Name[HOST_TASK_MAX_NAME];
+    configSTACK_DEPTH_TYPE StackDepth;
+
+    uint32_t        NotifyValue[configTASK_NOTIFICATION_ARRAY_ENTRIES];
+    bool            NotifyPending[configTASK_NOTIFICATION_ARRAY_ENTRIES];
+    void*           LocalStorage[configNUM_THREAD_LOCAL_STORAGE_POINTERS];
+};
+
+// Queues, semaphores and mutexes. A semaphore is a queue of items without data
+struct QueueDefinition
+{
+    uint8_t         Type;
+    UBaseType_t     Length;
+    UBaseType_t     ItemSize;
+    uint8_t*        Items;
+    UBaseType_t     First;
+    UBaseType_t     Count;
+
+    TaskHandle_t    Holder;             // Mutexes
+    UBaseType_t     Recursion;
+};
+
+struct StreamBufferDef_t
+{
+    uint8_t*        Data;
+    size_t          Size;
+    size_t          First;
+    size_t          Count;
+    size_t          TriggerLevel;
+    bool            Messages;
+};
+
+struct EventGroupDef_t
+{
+    EventBits_t     Bits;
+};
+
+// Length before each message, configMESSAGE_BUFFER_LENGTH_TYPE (size_t) of the target
+typedef uint32_t HOST_MESSAGE_LENGTH;
+
+static pthread_mutex_t  kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   kernel_changed;
+static pthread_mutex_t  critical_lock;
+static pthread_once_t   kernel_once = PTHREAD_ONCE_INIT;
+
+static struct timespec  kernel_start;
+
+static __thread TaskHandle_t current_task = NULL;
+
+static pthread_mutex_t  heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t           heap_used = 0;
+static size_t           heap_peak = 0;
+
+static void kernel_init(void)
+{
+    pthread_condattr_t condition;
+    pthread_mutexattr_t mutex;
+
+    pthread_condattr_init(&condition);
+    pthread_condattr_setclock(&condition, CLOCK_MONOTONIC);
+    pthread_cond_init(&kernel_changed, &condition);
+
+    pthread_mutexattr_init(&mutex);
+    pthread_mutexattr_settype(&mutex, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&critical_lock, &mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &kernel_start);
+}
+
+static void kernel_enter(void)
+{
+    pthread_once(&kernel_once, kernel_init);
+    pthread_mutex_lock(&kernel_lock);
+}
+
+static void kernel_exit(void)
+{
+    pthread_mutex_unlock(&kernel_lock);
+}
+
+// Something a blocked task may wait for changed (kernel lock held)
+static void kernel_signal(void)
+{
+    pthread_cond_broadcast(&kernel_changed);
+}
+
+static void deadline_after(TickType_t ticks, struct timespec & deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    deadline.tv_sec += ticks / configTICK_RATE_HZ;
+    deadline.tv_nsec += (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ);
+
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+// Waits for a change (kernel lock held). Returns false once the deadline passed
+static bool kernel_wait(TickType_t ticks, const struct timespec & deadline)
+{
+    if (ticks == 0)
+        return false;
+
+    if (ticks == portMAX_DELAY)
+    {
+        pthread_cond_wait(&kernel_changed, &kernel_lock);
+        return true;
+    }
+
+    return (pthread_cond_timedwait(&kernel_changed, &kernel_lock, &deadline) == 0);
+}
+
+// Threads not created by xTaskCreate (the test itself, the stand-ins of the USB and step
+// ticker interrupts) get a task when they first need one
+static TaskHandle_t get_current_task(void)
+{
+    if (current_task == NULL)
+    {
+        current_task = (TaskHandle_t)calloc(1, sizeof(struct tskTaskControlBlock));
+        current_task->Thread = pthread_self();
+        strcpy(current_task->Name, "host");
+    }
+
+    return current_task;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void* task_thread(void* parameter)
+{
+    TaskHandle_t task = (TaskHandle_t)parameter;
+
+    current_task = task;
+
+    // The creator stores the handle first, as the target does before the task can run
+    kernel_enter();
+    kernel_exit();
+
+    task->Entry(task->Parameter);
+
+    // A task function must not return
+    abort();
+    return NULL;
+}
+
+extern "C" BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char * const pcName, const configSTACK_DEPTH_TYPE usStackDepth,
+                                  void * const pvParameters, UBaseType_t uxPriority, TaskHandle_t * const pxCreatedTask)
+{
+    TaskHandle_t task = (TaskHandle_t)calloc(1, sizeof(struct tskTaskControlBlock));
+    pthread_attr_t attributes;
+    int result;
+
+    task->Entry = pxTaskCode;
+    task->Parameter = pvParameters;
+    strncpy(task->Name, (pcName != NULL) ? pcName : "", HOST_TASK_MAX_NAME - 1);
+    task->StackDepth = usStackDepth;
+
+    // The stack depth of the target is far too small for host code, the default is used
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    kernel_enter();
+
+    result = pthread_create(&task->Thread, &attributes, task_thread, task);
+
+    if (result == 0 && pxCreatedTask != NULL)
+        *pxCreatedTask = task;
+
+    kernel_exit();
+
+    pthread_attr_destroy(&attributes);
+
+    if (result != 0)
+    {
+        free(task);
+        return errCOULD_NOT_ALLOCATE_REQUIRED_MEMORY;
+    }
+
+    return pdPASS;
+}
+
+double host_rtos_cpu_seconds(TaskHandle_t task)
+{
+    struct timespec time;
+    clockid_t clock;
+
+    if (task == NULL || pthread_getcpuclockid(task->Thread, &clock) != 0 || clock_gettime(clock, &time) != 0)
+        return 0;
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+extern "C" TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return get_current_task();
+}
+
+extern "C" TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+
+    pthread_once(&kernel_once, kernel_init);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (TickType_t)((now.tv_sec - kernel_start.tv_sec) * configTICK_RATE_HZ +
+                        (now.tv_nsec - kernel_start.tv_nsec) / (1000000000L / configTICK_RATE_HZ));
+}
+
+extern "C" TickType_t xTaskGetTickCountFromISR(void)
+{
+    return xTaskGetTickCount();
+}
+
+extern "C" void vTaskDelay(const TickType_t xTicksToDelay)
+{
+    struct timespec delay;
+
+    if (xTicksToDelay == 0)
+    {
+        sched_yield();
+        return;
+    }
+
+    delay.tv_sec = xTicksToDelay / configTICK_RATE_HZ;
+    delay.tv_nsec = (long)(xTicksToDelay % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ);
+
+    nanosleep(&delay, NULL);
+}
+
+extern "C" void vTaskSetTimeOutState(TimeOut_t* const pxTimeOut)
+{
+    pxTimeOut->xOverflowCount = 0;
+    pxTimeOut->xTimeOnEntering = xTaskGetTickCount();
+}
+
+// The ticks left are counted down from the last call, as the kernel does
+extern "C" BaseType_t xTaskCheckForTimeOut(TimeOut_t* const pxTimeOut, TickType_t* const pxTicksToWait)
+{
+    TickType_t elapsed = xTaskGetTickCount() - pxTimeOut->xTimeOnEntering;
+
+    if (*pxTicksToWait == portMAX_DELAY)
+        return pdFALSE;
+
+    if (elapsed >= *pxTicksToWait)
+    {
+        *pxTicksToWait = 0;
+        return pdTRUE;
+    }
+
+    *pxTicksToWait -= elapsed;
+    vTaskSetTimeOutState(pxTimeOut);
+
+    return pdFALSE;
+}
+
+extern "C" BaseType_t xTaskGetSchedulerState(void)
+{
+    return taskSCHEDULER_RUNNING;
+}
+
+extern "C" void vTaskSuspendAll(void)
+{
+    pthread_once(&kernel_once, kernel_init);
+    pthread_mutex_lock(&critical_lock);
+}
+
+extern "C" BaseType_t xTaskResumeAll(void)
+{
+    pthread_mutex_unlock(&critical_lock);
+    return pdFALSE;
+}
+
+extern "C" void vPortEnterCritical(void)
+{
+    pthread_once(&kernel_once, kernel_init);
+    pthread_mutex_lock(&critical_lock);
+}
+
+extern "C" void vPortExitCritical(void)
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+extern "C" void* pvPortMalloc(size_t xSize)
+{
+    void* pv = malloc(xSize);
+
+    if (pv != NULL)
+    {
+        pthread_mutex_lock(&heap_lock);
+        heap_used += malloc_usable_size(pv);
+        heap_peak = (heap_used > heap_peak) ? heap_used : heap_peak;
+        pthread_mutex_unlock(&heap_lock);
+    }
+
+    return pv;
+}
+
+extern "C" void vPortFree(void* pv)
+{
+    if (pv != NULL)
+    {
+        pthread_mutex_lock(&heap_lock);
+        heap_used -= malloc_usable_size(pv);
+        pthread_mutex_unlock(&heap_lock);
+    }
+
+    free(pv);
+}
+
+// 0 once the host sizes have taken more than the heap of the target
+extern "C" size_t xPortGetFreeHeapSize(void)
+{
+    size_t used;
+
+    pthread_mutex_lock(&heap_lock);
+    used = heap_used;
+    pthread_mutex_unlock(&heap_lock);
+
+    return (used < configTOTAL_HEAP_SIZE) ? configTOTAL_HEAP_SIZE - used : 0;
+}
+
+extern "C" size_t xPortGetMinimumEverFreeHeapSize(void)
+{
+    size_t peak;
+
+    pthread_mutex_lock(&heap_lock);
+    peak = heap_peak;
+    pthread_mutex_unlock(&heap_lock);
+
+    return (peak < configTOTAL_HEAP_SIZE) ? configTOTAL_HEAP_SIZE - peak : 0;
+}
+
+extern "C" UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t xTask)
+{
+    TaskHandle_t task = (xTask != NULL) ? xTask : get_current_task();
+
+    return (task != NULL) ? task->StackDepth : 0;
+}
+
+extern "C" char* pcTaskGetName(TaskHandle_t xTaskToQuery)
+{
+    TaskHandle_t task = (xTaskToQuery != NULL) ? xTaskToQuery : get_current_task();
+
+    return (task != NULL) ? task->Name : NULL;
+}
+
+extern "C" void vTaskSetThreadLocalStoragePointer(TaskHandle_t xTaskToSet, BaseType_t xIndex, void* pvValue)
+{
+    TaskHandle_t task = (xTaskToSet != NULL) ? xTaskToSet : get_current_task();
+
+    task->LocalStorage[xIndex] = pvValue;
+}
+
+extern "C" void* pvTaskGetThreadLocalStoragePointer(TaskHandle_t xTaskToQuery, BaseType_t xIndex)
+{
+    TaskHandle_t task = (xTaskToQuery != NULL) ? xTaskToQuery : get_current_task();
+
+    return task->LocalStorage[xIndex];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Task notifications
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" BaseType_t xTaskGenericNotify(TaskHandle_t xTaskToNotify, UBaseType_t uxIndexToNotify, uint32_t ulValue,
+                                         eNotifyAction eAction, uint32_t* pulPreviousNotificationValue)
+{
+    BaseType_t result = pdPASS;
+    uint32_t* value = &xTaskToNotify->NotifyValue[uxIndexToNotify];
+
+    kernel_enter();
+
+    if (pulPreviousNotificationValue != NULL)
+        *pulPreviousNotificationValue = *value;
+
+    switch (eAction)
+    {
+        case eSetBits:                  *value |= ulValue; break;
+        case eIncrement:                (*value)++; break;
+        case eSetValueWithOverwrite:    *value = ulValue; break;
+
+        case eSetValueWithoutOverwrite:
+            if (xTaskToNotify->NotifyPending[uxIndexToNotify] != false)
+                result = pdFAIL;
+            else
+                *value = ulValue;
+            break;
+
+        case eNoAction:
+            break;
+    }
+
+    xTaskToNotify->NotifyPending[uxIndexToNotify] = true;
+
+    kernel_signal();
+    kernel_exit();
+
+    return result;
+}
+
+extern "C" BaseType_t xTaskGenericNotifyFromISR(TaskHandle_t xTaskToNotify, UBaseType_t uxIndexToNotify, uint32_t ulValue,
+                                                eNotifyAction eAction, uint32_t* pulPreviousNotificationValue,
+                                                BaseType_t* pxHigherPriorityTaskWoken)
+{
+    if (pxHigherPriorityTaskWoken != NULL)
+        *pxHigherPriorityTaskWoken = pdFALSE;
+
+    return xTaskGenericNotify(xTaskToNotify, uxIndexToNotify, ulValue, eAction, pulPreviousNotificationValue);
+}
+
+extern "C" void vTaskGenericNotifyGiveFromISR(TaskHandle_t xTaskToNotify, UBaseType_t uxIndexToNotify, BaseType_t* pxHigherPriorityTaskWoken)
+{
+    xTaskGenericNotifyFromISR(xTaskToNotify, uxIndexToNotify, 0, eIncrement, NULL, pxHigherPriorityTaskWoken);
+}
+
+extern "C" uint32_t ulTaskGenericNotifyTake(UBaseType_t uxIndexToWaitOn, BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    TaskHandle_t task = get_current_task();
+    struct timespec deadline;
+    uint32_t value;
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    while (task->NotifyValue[uxIndexToWaitOn] == 0 && kernel_wait(xTicksToWait, deadline) != false)
+        ;
+
+    value = task->NotifyValue[uxIndexToWaitOn];
+
+    if (value != 0)
+        task->NotifyValue[uxIndexToWaitOn] = (xClearCountOnExit != pdFALSE) ? 0 : (value - 1);
+
+    task->NotifyPending[uxIndexToWaitOn] = false;
+
+    kernel_exit();
+
+    return value;
+}
+
+extern "C" BaseType_t xTaskGenericNotifyWait(UBaseType_t uxIndexToWaitOn, uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit,
+                                             uint32_t* pulNotificationValue, TickType_t xTicksToWait)
+{
+    TaskHandle_t task = get_current_task();
+    struct timespec deadline;
+    BaseType_t received;
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    if (task->NotifyPending[uxIndexToWaitOn] == false)
+        task->NotifyValue[uxIndexToWaitOn] &= ~ulBitsToClearOnEntry;
+
+    while (task->NotifyPending[uxIndexToWaitOn] == false && kernel_wait(xTicksToWait, deadline) != false)
+        ;
+
+    if (pulNotificationValue != NULL)
+        *pulNotificationValue = task->NotifyValue[uxIndexToWaitOn];
+
+    received = (task->NotifyPending[uxIndexToWaitOn] != false) ? pdTRUE : pdFALSE;
+
+    if (received != pdFALSE)
+        task->NotifyValue[uxIndexToWaitOn] &= ~ulBitsToClearOnExit;
+
+    task->NotifyPending[uxIndexToWaitOn] = false;
+
+    kernel_exit();
+
+    return received;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Queues, semaphores and mutexes
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" QueueHandle_t xQueueGenericCreate(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize, const uint8_t ucQueueType)
+{
+    QueueHandle_t queue = (QueueHandle_t)calloc(1, sizeof(struct QueueDefinition));
+
+    queue->Type = ucQueueType;
+    queue->Length = uxQueueLength;
+    queue->ItemSize = uxItemSize;
+    queue->Items = (uxItemSize != 0) ? (uint8_t*)calloc(uxQueueLength, uxItemSize) : NULL;
+
+    return queue;
+}
+
+extern "C" QueueHandle_t xQueueCreateMutex(const uint8_t ucQueueType)
+{
+    QueueHandle_t mutex = xQueueGenericCreate(1, 0, ucQueueType);
+
+    // Free to take
+    mutex->Count = 1;
+
+    return mutex;
+}
+
+extern "C" QueueHandle_t xQueueCreateCountingSemaphore(const UBaseType_t uxMaxCount, const UBaseType_t uxInitialCount)
+{
+    QueueHandle_t semaphore = xQueueGenericCreate(uxMaxCount, 0, queueQUEUE_TYPE_COUNTING_SEMAPHORE);
+
+    semaphore->Count = uxInitialCount;
+
+    return semaphore;
+}
+
+extern "C" void vQueueDelete(QueueHandle_t xQueue)
+{
+    free(xQueue->Items);
+    free(xQueue);
+}
+
+extern "C" BaseType_t xQueueGenericSend(QueueHandle_t xQueue, const void * const pvItemToQueue, TickType_t xTicksToWait, const BaseType_t xCopyPosition)
+{
+    struct timespec deadline;
+    UBaseType_t slot;
+    BaseType_t sent = pdFALSE;
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    // Only the holder gives a mutex back
+    if (xQueue->Type == queueQUEUE_TYPE_MUTEX || xQueue->Type == queueQUEUE_TYPE_RECURSIVE_MUTEX)
+    {
+        if (xQueue->Holder == get_current_task() && xQueue->Count == 0)
+        {
+            xQueue->Holder = NULL;
+            xQueue->Count = 1;
+            sent = pdTRUE;
+        }
+    }
+    else
+    {
+        while (xQueue->Count == xQueue->Length && xCopyPosition != queueOVERWRITE && kernel_wait(xTicksToWait, deadline) != false)
+            ;
+
+        if (xCopyPosition == queueOVERWRITE && xQueue->Count != 0)
+        {
+            // Queue of one item
+            memcpy(&xQueue->Items[xQueue->First * xQueue->ItemSize], pvItemToQueue, xQueue->ItemSize);
+            sent = pdTRUE;
+        }
+        else if (xQueue->Count < xQueue->Length)
+        {
+            if (xCopyPosition == queueSEND_TO_FRONT)
+                slot = xQueue->First = (xQueue->First + xQueue->Length - 1) % xQueue->Length;
+            else
+                slot = (xQueue->First + xQueue->Count) % xQueue->Length;
+
+            if (xQueue->ItemSize != 0)
+                memcpy(&xQueue->Items[slot * xQueue->ItemSize], pvItemToQueue, xQueue->ItemSize);
+
+            xQueue->Count++;
+            sent = pdTRUE;
+        }
+    }
+
+    if (sent != pdFALSE)
+        kernel_signal();
+
+    kernel_exit();
+
+    return (sent != pdFALSE) ? pdPASS : errQUEUE_FULL;
+}
+
+extern "C" BaseType_t xQueueGenericSendFromISR(QueueHandle_t xQueue, const void * const pvItemToQueue, BaseType_t * const pxHigherPriorityTaskWoken,
+                                               const BaseType_t xCopyPosition)
+{
+    if (pxHigherPriorityTaskWoken != NULL)
+        *pxHigherPriorityTaskWoken = pdFALSE;
+
+    return xQueueGenericSend(xQueue, pvItemToQueue, 0, xCopyPosition);
+}
+
+extern "C" BaseType_t xQueueGiveFromISR(QueueHandle_t xQueue, BaseType_t * const pxHigherPriorityTaskWoken)
+{
+    return xQueueGenericSendFromISR(xQueue, NULL, pxHigherPriorityTaskWoken, queueSEND_TO_BACK);
+}
+
+// Takes the first item, with peek set leaves it in the queue
+static BaseType_t queue_receive(QueueHandle_t queue, void* buffer, TickType_t ticks, bool peek)
+{
+    struct timespec deadline;
+    BaseType_t received = pdFALSE;
+
+    deadline_after(ticks, deadline);
+    kernel_enter();
+
+    while (queue->Count == 0 && kernel_wait(ticks, deadline) != false)
+        ;
+
+    if (queue->Count != 0)
+    {
+        if (queue->ItemSize != 0)
+            memcpy(buffer, &queue->Items[queue->First * queue->ItemSize], queue->ItemSize);
+
+        if (peek == false)
+        {
+            queue->First = (queue->First + 1) % queue->Length;
+            queue->Count--;
+
+            if (queue->Type == queueQUEUE_TYPE_MUTEX || queue->Type == queueQUEUE_TYPE_RECURSIVE_MUTEX)
+                queue->Holder = get_current_task();
+
+            kernel_signal();
+        }
+
+        received = pdTRUE;
+    }
+
+    kernel_exit();
+
+    return received;
+}
+
+extern "C" BaseType_t xQueueReceive(QueueHandle_t xQueue, void * const pvBuffer, TickType_t xTicksToWait)
+{
+    return queue_receive(xQueue, pvBuffer, xTicksToWait, false);
+}
+
+extern "C" BaseType_t xQueuePeek(QueueHandle_t xQueue, void * const pvBuffer, TickType_t xTicksToWait)
+{
+    return queue_receive(xQueue, pvBuffer, xTicksToWait, true);
+}
+
+extern "C" BaseType_t xQueueReceiveFromISR(QueueHandle_t xQueue, void * const pvBuffer, BaseType_t * const pxHigherPriorityTaskWoken)
+{
+    if (pxHigherPriorityTaskWoken != NULL)
+        *pxHigherPriorityTaskWoken = pdFALSE;
+
+    return queue_receive(xQueue, pvBuffer, 0, false);
+}
+
+extern "C" BaseType_t xQueueSemaphoreTake(QueueHandle_t xQueue, TickType_t xTicksToWait)
+{
+    return queue_receive(xQueue, NULL, xTicksToWait, false);
+}
+
+extern "C" BaseType_t xQueueTakeMutexRecursive(QueueHandle_t xMutex, TickType_t xTicksToWait)
+{
+    BaseType_t taken = pdTRUE;
+
+    // The holder is only ever set by its own task, no lock needed to compare it
+    if (xMutex->Holder != get_current_task())
+        taken = queue_receive(xMutex, NULL, xTicksToWait, false);
+
+    if (taken != pdFALSE)
+        xMutex->Recursion++;
+
+    return taken;
+}
+
+extern "C" BaseType_t xQueueGiveMutexRecursive(QueueHandle_t xMutex)
+{
+    if (xMutex->Holder != get_current_task())
+        return pdFAIL;
+
+    if (--xMutex->Recursion == 0)
+        xQueueGenericSend(xMutex, NULL, 0, queueSEND_TO_BACK);
+
+    return pdPASS;
+}
+
+extern "C" TaskHandle_t xQueueGetMutexHolder(QueueHandle_t xSemaphore)
+{
+    TaskHandle_t holder;
+
+    kernel_enter();
+    holder = xSemaphore->Holder;
+    kernel_exit();
+
+    return holder;
+}
+
+extern "C" UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t xQueue)
+{
+    UBaseType_t count;
+
+    kernel_enter();
+    count = xQueue->Count;
+    kernel_exit();
+
+    return count;
+}
+
+extern "C" UBaseType_t uxQueueSpacesAvailable(const QueueHandle_t xQueue)
+{
+    UBaseType_t spaces;
+
+    kernel_enter();
+    spaces = xQueue->Length - xQueue->Count;
+    kernel_exit();
+
+    return spaces;
+}
+
+extern "C" BaseType_t xQueueGenericReset(QueueHandle_t xQueue, BaseType_t xNewQueue)
+{
+    kernel_enter();
+
+    xQueue->First = 0;
+    xQueue->Count = 0;
+
+    kernel_signal();
+    kernel_exit();
+
+    return pdPASS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Stream and message buffers
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" StreamBufferHandle_t xStreamBufferGenericCreate(size_t xBufferSizeBytes, size_t xTriggerLevelBytes, BaseType_t xIsMessageBuffer)
+{
+    StreamBufferHandle_t buffer = (StreamBufferHandle_t)calloc(1, sizeof(struct StreamBufferDef_t));
+
+    buffer->Data = (uint8_t*)malloc(xBufferSizeBytes);
+    buffer->Size = xBufferSizeBytes;
+    buffer->TriggerLevel = (xTriggerLevelBytes != 0) ? xTriggerLevelBytes : 1;
+    buffer->Messages = (xIsMessageBuffer != pdFALSE);
+
+    return buffer;
+}
+
+extern "C" void vStreamBufferDelete(StreamBufferHandle_t xStreamBuffer)
+{
+    free(xStreamBuffer->Data);
+    free(xStreamBuffer);
+}
+
+static void stream_put(StreamBufferHandle_t buffer, const void* data, size_t length)
+{
+    size_t position = (buffer->First + buffer->Count) % buffer->Size;
+    size_t part = buffer->Size - position;
+
+    if (part > length)
+        part = length;
+
+    memcpy(&buffer->Data[position], data, part);
+    memcpy(buffer->Data, (const uint8_t*)data + part, length - part);
+
+    buffer->Count += length;
+}
+
+// With take clear, only copies
+static void stream_get(StreamBufferHandle_t buffer, void* data, size_t length, bool take)
+{
+    size_t part = buffer->Size - buffer->First;
+
+    if (part > length)
+        part = length;
+
+    memcpy(data, &buffer->Data[buffer->First], part);
+    memcpy((uint8_t*)data + part, buffer->Data, length - part);
+
+    if (take != false)
+    {
+        buffer->First = (buffer->First + length) % buffer->Size;
+        buffer->Count -= length;
+    }
+}
+
+extern "C" size_t xStreamBufferSend(StreamBufferHandle_t xStreamBuffer, const void* pvTxData, size_t xDataLengthBytes, TickType_t xTicksToWait)
+{
+    HOST_MESSAGE_LENGTH header = (HOST_MESSAGE_LENGTH)xDataLengthBytes;
+    size_t needed = xDataLengthBytes;
+    struct timespec deadline;
+    size_t sent = 0;
+
+    if (xStreamBuffer->Messages != false)
+    {
+        needed += sizeof(header);
+
+        // Never fits
+        if (needed > xStreamBuffer->Size)
+            return 0;
+    }
+    else if (needed > xStreamBuffer->Size)
+    {
+        needed = xStreamBuffer->Size;
+    }
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    while ((xStreamBuffer->Size - xStreamBuffer->Count) < needed && kernel_wait(xTicksToWait, deadline) != false)
+        ;
+
+    if (xStreamBuffer->Messages != false)
+    {
+        if ((xStreamBuffer->Size - xStreamBuffer->Count) >= needed)
+        {
+            stream_put(xStreamBuffer, &header, sizeof(header));
+            stream_put(xStreamBuffer, pvTxData, xDataLengthBytes);
+            sent = xDataLengthBytes;
+        }
+    }
+    else
+    {
+        // As much as there is room for
+        sent = xStreamBuffer->Size - xStreamBuffer->Count;
+
+        if (sent > xDataLengthBytes)
+            sent = xDataLengthBytes;
+
+        stream_put(xStreamBuffer, pvTxData, sent);
+    }
+
+    if (sent != 0)
+        kernel_signal();
+
+    kernel_exit();
+
+    return sent;
+}
+
+extern "C" size_t xStreamBufferSendFromISR(StreamBufferHandle_t xStreamBuffer, const void* pvTxData, size_t xDataLengthBytes,
+                                           BaseType_t * const pxHigherPriorityTaskWoken)
+{
+    if (pxHigherPriorityTaskWoken != NULL)
+        *pxHigherPriorityTaskWoken = pdFALSE;
+
+    return xStreamBufferSend(xStreamBuffer, pvTxData, xDataLengthBytes, 0);
+}
+
+extern "C" size_t xStreamBufferReceive(StreamBufferHandle_t xStreamBuffer, void* pvRxData, size_t xBufferLengthBytes, TickType_t xTicksToWait)
+{
+    HOST_MESSAGE_LENGTH header;
+    struct timespec deadline;
+    size_t wanted;
+    size_t received = 0;
+
+    wanted = (xStreamBuffer->Messages != false) ? sizeof(header) : xStreamBuffer->TriggerLevel;
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    while (xStreamBuffer->Count < wanted && kernel_wait(xTicksToWait, deadline) != false)
+        ;
+
+    if (xStreamBuffer->Messages != false)
+    {
+        if (xStreamBuffer->Count >= sizeof(header))
+        {
+            stream_get(xStreamBuffer, &header, sizeof(header), false);
+
+            // A message too long for the buffer stays where it is
+            if (header <= xBufferLengthBytes)
+            {
+                stream_get(xStreamBuffer, &header, sizeof(header), true);
+                stream_get(xStreamBuffer, pvRxData, header, true);
+                received = header;
+            }
+        }
+    }
+    else if (xStreamBuffer->Count != 0)
+    {
+        received = (xStreamBuffer->Count < xBufferLengthBytes) ? xStreamBuffer->Count : xBufferLengthBytes;
+        stream_get(xStreamBuffer, pvRxData, received, true);
+    }
+
+    if (received != 0)
+        kernel_signal();
+
+    kernel_exit();
+
+    return received;
+}
+
+extern "C" size_t xStreamBufferReceiveFromISR(StreamBufferHandle_t xStreamBuffer, void* pvRxData, size_t xBufferLengthBytes,
+                                              BaseType_t * const pxHigherPriorityTaskWoken)
+{
+    if (pxHigherPriorityTaskWoken != NULL)
+        *pxHigherPriorityTaskWoken = pdFALSE;
+
+    return xStreamBufferReceive(xStreamBuffer, pvRxData, xBufferLengthBytes, 0);
+}
+
+extern "C" size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t xStreamBuffer)
+{
+    size_t spaces;
+
+    kernel_enter();
+    spaces = xStreamBuffer->Size - xStreamBuffer->Count;
+    kernel_exit();
+
+    return spaces;
+}
+
+extern "C" size_t xStreamBufferBytesAvailable(StreamBufferHandle_t xStreamBuffer)
+{
+    size_t count;
+
+    kernel_enter();
+    count = xStreamBuffer->Count;
+    kernel_exit();
+
+    return count;
+}
+
+extern "C" BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t xStreamBuffer)
+{
+    return (xStreamBufferBytesAvailable(xStreamBuffer) == 0) ? pdTRUE : pdFALSE;
+}
+
+extern "C" BaseType_t xStreamBufferIsFull(StreamBufferHandle_t xStreamBuffer)
+{
+    return (xStreamBufferSpacesAvailable(xStreamBuffer) == 0) ? pdTRUE : pdFALSE;
+}
+
+extern "C" BaseType_t xStreamBufferReset(StreamBufferHandle_t xStreamBuffer)
+{
+    kernel_enter();
+
+    xStreamBuffer->First = 0;
+    xStreamBuffer->Count = 0;
+
+    kernel_signal();
+    kernel_exit();
+
+    return pdPASS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Event groups
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" EventGroupHandle_t xEventGroupCreate(void)
+{
+    return (EventGroupHandle_t)calloc(1, sizeof(struct EventGroupDef_t));
+}
+
+extern "C" void vEventGroupDelete(EventGroupHandle_t xEventGroup)
+{
+    free(xEventGroup);
+}
+
+extern "C" EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit,
+                                           const BaseType_t xWaitForAllBits, TickType_t xTicksToWait)
+{
+    struct timespec deadline;
+    EventBits_t bits;
+    bool done;
+
+    deadline_after(xTicksToWait, deadline);
+    kernel_enter();
+
+    for ( ; ; )
+    {
+        bits = xEventGroup->Bits;
+
+        if (xWaitForAllBits != pdFALSE)
+            done = ((bits & uxBitsToWaitFor) == uxBitsToWaitFor);
+        else
+            done = ((bits & uxBitsToWaitFor) != 0);
+
+        if (done != false || kernel_wait(xTicksToWait, deadline) == false)
+            break;
+    }
+
+    if (done != false && xClearOnExit != pdFALSE)
+        xEventGroup->Bits &= ~uxBitsToWaitFor;
+
+    kernel_exit();
+
+    return bits;
+}
+
+extern "C" EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet)
+{
+    EventBits_t bits;
+
+    kernel_enter();
+
+    bits = (xEventGroup->Bits |= uxBitsToSet);
+
+    kernel_signal();
+    kernel_exit();
+
+    return bits;
+}
+
+// Returns the bits before they were cleared
+extern "C" EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear)
+{
+    EventBits_t bits;
+
+    kernel_enter();
+
+    bits = xEventGroup->Bits;
+    xEventGroup->Bits &= ~uxBitsToClear;
+
+    kernel_exit();
+
+    return bits;
+}
+
+extern "C" EventBits_t xEventGroupGetBitsFromISR(EventGroupHandle_t xEventGroup)
+{
+    return xEventGroupClearBits(xEventGroup, 0);
+}
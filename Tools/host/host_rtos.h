@@ -0,0 +1,17 @@
+#ifndef HOST_RTOS_H
+#define HOST_RTOS_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// What host_rtos.cpp adds to FreeRTOS for the tests: the CPU time of a task,
+// the time its thread ran (on the host CPU, not the one of the controller)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Seconds, 0 for an unknown task
+double host_rtos_cpu_seconds(TaskHandle_t task);
+
+#endif
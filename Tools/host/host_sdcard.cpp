@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <deque>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "ff_sddisk.h"
+#include "spi_ports.h"
+#include "pins.h"
+
+#include "host_sdcard.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SD card on SPI3 (host_sdcard.h). The card sees one byte at a time, what it
+// sends back comes from a queue (responses, data blocks, busy bytes) and
+// while a multi-block read is open the next block joins the queue each time
+// it runs dry, behind one byte of access time. The controller clocks the
+// card only with the chip select low
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define CARD_R1_IDLE            0x01
+#define CARD_R1_ILLEGAL         0x04
+#define CARD_R1_PARAMETER       0x40
+#define CARD_TOKEN_BLOCK        0xFE
+#define CARD_TOKEN_MULTI        0xFC
+#define CARD_TOKEN_STOP         0xFD
+#define CARD_TOKEN_RANGE        0x08        // Data error token, out of range
+#define CARD_DATA_ACCEPTED      0x05
+#define CARD_BUSY_BYTES         8           // After a block is programmed
+#define CARD_INIT_POLLS         3           // ACMD41 until the card is ready
+
+typedef enum CARD_WRITE
+{
+    CARD_WRITE_NONE = 0,
+    CARD_WRITE_SINGLE,
+    CARD_WRITE_MULTI
+
+}CARD_WRITE;
+
+typedef struct HOST_SDCARD_DMA
+{
+    uint8_t*    Tx;
+    uint8_t*    Rx;
+    uint32_t    Length;
+    bool        Busy;
+    uint32_t    Generation;             // Of the transfer, an abort moves on
+
+}HOST_SDCARD_DMA;
+
+GPIO_TypeDef            host_gpio_a;
+uint8_t                 host_ccm_ram[HOST_CCM_RAM_SIZE];
+
+static SPI_TypeDef      spi3;
+SPI_HandleTypeDef       hspi3 = { &spi3, { SPI_BAUDRATEPRESCALER_32 } };
+
+static pthread_mutex_t  card_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   dma_start = PTHREAD_COND_INITIALIZER;
+static pthread_once_t   dma_once = PTHREAD_ONCE_INIT;
+
+static uint8_t*         card_image = NULL;
+static uint32_t         card_sectors = 0;
+static HOST_SDCARD_STATS card_stats;
+static volatile uint32_t block_time_us = 0;
+
+static bool             card_selected = false;
+static bool             card_idle = true;
+static bool             app_command = false;
+static uint32_t         init_polls = 0;
+static uint8_t          frame[6];
+static uint32_t         frame_length = 0;
+static std::deque<uint8_t> card_out;
+
+static bool             streaming = false;     // CMD18
+static uint32_t         stream_sector = 0;
+
+static CARD_WRITE       write_mode = CARD_WRITE_NONE;
+static uint32_t         write_sector = 0;
+static int32_t          write_length = -1;      // Bytes of the block received, -1 before its token
+static uint8_t          write_block[HOST_SDCARD_SECTOR_SIZE + 2];
+
+static HOST_SDCARD_DMA  dma;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void queue_bytes(uint8_t value, uint32_t count)
+{
+    while (count-- != 0)
+        card_out.push_back(value);
+}
+
+// Access time, start token, data and CRC
+static void queue_block(const uint8_t* data, uint32_t length)
+{
+    queue_bytes(0xFF, 1);
+    card_out.push_back(CARD_TOKEN_BLOCK);
+    card_out.insert(card_out.end(), data, data + length);
+    queue_bytes(0xFF, 2);
+}
+
+static void queue_sector(uint32_t sector)
+{
+    queue_block(&card_image[sector * HOST_SDCARD_SECTOR_SIZE], HOST_SDCARD_SECTOR_SIZE);
+    card_stats.BlocksRead++;
+}
+
+// R1 after one byte of response time, the R1 of CMD8 and CMD58 has 4 bytes after it
+static void respond(uint8_t r1)
+{
+    queue_bytes(0xFF, 1);
+    card_out.push_back(r1);
+}
+
+static bool in_card(uint32_t sector)
+{
+    if (sector < card_sectors)
+        return true;
+
+    card_stats.Errors++;
+    respond(CARD_R1_PARAMETER);
+
+    return false;
+}
+
+static void run_command(void)
+{
+    uint8_t command = frame[0] & 0x3F;
+    uint32_t argument = ((uint32_t)frame[1] << 24) | ((uint32_t)frame[2] << 16) | ((uint32_t)frame[3] << 8) | frame[4];
+    uint32_t size;
+    uint8_t csd[16];
+    uint8_t r1;
+
+    card_stats.Commands++;
+
+    // Checked in SPI mode until CRC is turned off, the card starts with it off otherwise
+    if ((command == 0 && frame[5] != 0x95) || (command == 8 && frame[5] != 0x87))
+        card_stats.Errors++;
+
+    if (app_command != false)
+    {
+        app_command = false;
+
+        if (command == 41)
+        {
+            card_idle = (++init_polls < CARD_INIT_POLLS);
+            respond(card_idle ? CARD_R1_IDLE : 0);
+            return;
+        }
+
+        if (command == 23)
+        {
+            respond(0);
+            return;
+        }
+    }
+
+    r1 = card_idle ? CARD_R1_IDLE : 0;
+
+    // Only identification before the card is ready
+    if (card_idle != false && command != 0 && command != 8 && command != 55 && command != 58)
+    {
+        card_stats.Errors++;
+        respond(CARD_R1_IDLE | CARD_R1_ILLEGAL);
+        return;
+    }
+
+    switch (command)
+    {
+    case 0:
+        card_idle = true;
+        init_polls = 0;
+        streaming = false;
+        write_mode = CARD_WRITE_NONE;
+        respond(CARD_R1_IDLE);
+        break;
+
+    case 8:
+        respond(r1);
+        queue_bytes(0x00, 2);
+        card_out.push_back((uint8_t)((argument >> 8) & 0x0F));
+        card_out.push_back((uint8_t)argument);
+        break;
+
+    case 9:
+        // CSD version 2.0, C_SIZE in units of 512 KB
+        size = card_sectors / HOST_SDCARD_CSD_SECTORS - 1;
+
+        memset(csd, 0, sizeof(csd));
+        csd[0] = 0x40;
+        csd[5] = 0x09;
+        csd[7] = (uint8_t)((size >> 16) & 0x3F);
+        csd[8] = (uint8_t)(size >> 8);
+        csd[9] = (uint8_t)size;
+
+        respond(r1);
+        queue_block(csd, sizeof(csd));
+        break;
+
+    case 12:
+        // The block being sent is cut, the stuff byte comes before the response
+        streaming = false;
+        card_out.clear();
+        queue_bytes(0xFF, 1);
+        respond(r1);
+        break;
+
+    case 16:
+        respond(r1);
+        break;
+
+    case 17:
+        card_stats.ReadCommands++;
+
+        if (in_card(argument) != false)
+        {
+            respond(r1);
+            queue_sector(argument);
+        }
+        break;
+
+    case 18:
+        card_stats.ReadCommands++;
+
+        if (in_card(argument) != false)
+        {
+            respond(r1);
+            streaming = true;
+            stream_sector = argument;
+        }
+        break;
+
+    case 24:
+    case 25:
+        card_stats.WriteCommands++;
+
+        if (in_card(argument) != false)
+        {
+            respond(r1);
+            write_mode = (command == 24) ? CARD_WRITE_SINGLE : CARD_WRITE_MULTI;
+            write_sector = argument;
+            write_length = -1;
+        }
+        break;
+
+    case 55:
+        app_command = true;
+        respond(r1);
+        break;
+
+    case 58:
+        // OCR: powered up, high capacity
+        respond(r1);
+        card_out.push_back(0xC0);
+        card_out.push_back(0xFF);
+        card_out.push_back(0x80);
+        card_out.push_back(0x00);
+        break;
+
+    default:
+        card_stats.Errors++;
+        respond(r1 | CARD_R1_ILLEGAL);
+        break;
+    }
+}
+
+// A byte of a data block the controller writes, or the token before it
+static void receive_data(uint8_t value)
+{
+    if (write_length < 0)
+    {
+        if (value == 0xFF)
+            return;
+
+        if ((write_mode == CARD_WRITE_SINGLE && value == CARD_TOKEN_BLOCK) || (write_mode == CARD_WRITE_MULTI && value == CARD_TOKEN_MULTI))
+        {
+            write_length = 0;
+        }
+        else if (write_mode == CARD_WRITE_MULTI && value == CARD_TOKEN_STOP)
+        {
+            write_mode = CARD_WRITE_NONE;
+            queue_bytes(0xFF, 1);
+            queue_bytes(0x00, CARD_BUSY_BYTES);
+        }
+        else
+        {
+            card_stats.Errors++;
+        }
+
+        return;
+    }
+
+    write_block[write_length++] = value;
+
+    if (write_length < (int32_t)sizeof(write_block))
+        return;
+
+    // Data response right after the CRC, then busy while it programs
+    if (write_sector < card_sectors)
+    {
+        memcpy(&card_image[write_sector * HOST_SDCARD_SECTOR_SIZE], write_block, HOST_SDCARD_SECTOR_SIZE);
+        card_stats.BlocksWritten++;
+        card_out.push_back(CARD_DATA_ACCEPTED);
+        queue_bytes(0x00, CARD_BUSY_BYTES);
+    }
+    else
+    {
+        card_stats.Errors++;
+        card_out.push_back(0x0D);
+    }
+
+    write_sector++;
+    write_length = -1;
+
+    if (write_mode == CARD_WRITE_SINGLE)
+        write_mode = CARD_WRITE_NONE;
+}
+
+static void receive_command(uint8_t value)
+{
+    // Frames start with 01, the controller sends 0xFF in between
+    if (frame_length == 0 && (value & 0xC0) != 0x40)
+        return;
+
+    frame[frame_length++] = value;
+
+    if (frame_length == sizeof(frame))
+    {
+        frame_length = 0;
+        run_command();
+    }
+}
+
+// One byte each way (card_lock held)
+static uint8_t exchange(uint8_t value)
+{
+    uint8_t sent;
+
+    if (card_selected == false || card_image == NULL)
+        return 0xFF;
+
+    if (card_out.empty() != false && streaming != false)
+    {
+        if (stream_sector < card_sectors)
+        {
+            queue_sector(stream_sector++);
+        }
+        else
+        {
+            queue_bytes(0xFF, 1);
+            card_out.push_back(CARD_TOKEN_RANGE);
+            streaming = false;
+        }
+    }
+
+    if (card_out.empty() != false)
+    {
+        sent = 0xFF;
+    }
+    else
+    {
+        sent = card_out.front();
+        card_out.pop_front();
+    }
+
+    if (write_mode != CARD_WRITE_NONE)
+        receive_data(value);
+    else
+        receive_command(value);
+
+    return sent;
+}
+
+// The controller must not touch SPI3 while its DMA runs (card_lock held)
+static bool check_idle(void)
+{
+    if (dma.Busy == false)
+        return true;
+
+    card_stats.Errors++;
+    return false;
+}
+
+static void* dma_thread(void* parameter)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    struct timespec delay;
+    uint32_t generation;
+    uint32_t index;
+    uint8_t value;
+
+    pthread_mutex_lock(&card_lock);
+
+    for ( ; ; )
+    {
+        while (dma.Busy == false)
+            pthread_cond_wait(&dma_start, &card_lock);
+
+        generation = dma.Generation;
+
+        pthread_mutex_unlock(&card_lock);
+
+        delay.tv_sec = block_time_us / 1000000;
+        delay.tv_nsec = (long)(block_time_us % 1000000) * 1000L;
+
+        if (block_time_us != 0)
+            nanosleep(&delay, NULL);
+
+        pthread_mutex_lock(&card_lock);
+
+        // Aborted while it ran
+        if (dma.Busy == false || dma.Generation != generation)
+            continue;
+
+        for (index = 0; index < dma.Length; index++)
+        {
+            value = exchange((dma.Tx != NULL) ? dma.Tx[index] : 0xFF);
+
+            if (dma.Rx != NULL)
+                dma.Rx[index] = value;
+        }
+
+        dma.Busy = false;
+
+        pthread_mutex_unlock(&card_lock);
+        vSDCardTransferCompleteFromISR(&higher_priority_task_woken);
+        pthread_mutex_lock(&card_lock);
+    }
+
+    return NULL;
+}
+
+static void start_dma_thread(void)
+{
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, dma_thread, NULL);
+    pthread_detach(thread);
+}
+
+// The DMA can't reach the CCM, the transfer would end in a bus error
+static HAL_StatusTypeDef start_dma(uint8_t* tx, uint8_t* rx, uint16_t size)
+{
+    HAL_StatusTypeDef status = HAL_BUSY;
+
+    pthread_once(&dma_once, start_dma_thread);
+    pthread_mutex_lock(&card_lock);
+
+    if (configIN_HEAP_RAM(tx) != 0 || configIN_HEAP_RAM(rx) != 0)
+    {
+        card_stats.Errors++;
+        status = HAL_ERROR;
+    }
+    else if (check_idle() != false)
+    {
+        dma.Tx = tx;
+        dma.Rx = rx;
+        dma.Length = size;
+        dma.Busy = true;
+        dma.Generation++;
+
+        pthread_cond_signal(&dma_start);
+        status = HAL_OK;
+    }
+
+    pthread_mutex_unlock(&card_lock);
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void host_sdcard_create(uint32_t sectors)
+{
+    pthread_mutex_lock(&card_lock);
+
+    free(card_image);
+
+    card_image = (uint8_t*)calloc(sectors, HOST_SDCARD_SECTOR_SIZE);
+    card_sectors = sectors;
+
+    memset(&card_stats, 0, sizeof(card_stats));
+    card_idle = true;
+    app_command = false;
+    init_polls = 0;
+    frame_length = 0;
+    card_out.clear();
+    streaming = false;
+    write_mode = CARD_WRITE_NONE;
+
+    pthread_mutex_unlock(&card_lock);
+}
+
+void host_sdcard_set_block_time(uint32_t microseconds)
+{
+    block_time_us = microseconds;
+}
+
+uint32_t host_sdcard_image(uint8_t** data)
+{
+    *data = card_image;
+    return card_sectors;
+}
+
+void host_sdcard_get_stats(HOST_SDCARD_STATS* stats)
+{
+    pthread_mutex_lock(&card_lock);
+    *stats = card_stats;
+    pthread_mutex_unlock(&card_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    if (GPIOx != SDCARD_CS_GPIO_Port || GPIO_Pin != SDCARD_CS_Pin)
+        return;
+
+    pthread_mutex_lock(&card_lock);
+
+    if (check_idle() != false)
+        card_selected = (PinState == GPIO_PIN_RESET);
+
+    pthread_mutex_unlock(&card_lock);
+}
+
+extern "C" HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi, uint8_t* pTxData, uint8_t* pRxData, uint16_t Size, uint32_t Timeout)
+{
+    HAL_StatusTypeDef status = HAL_BUSY;
+    uint32_t index;
+
+    pthread_mutex_lock(&card_lock);
+
+    if (check_idle() != false)
+    {
+        for (index = 0; index < Size; index++)
+            pRxData[index] = exchange(pTxData[index]);
+
+        status = HAL_OK;
+    }
+
+    pthread_mutex_unlock(&card_lock);
+
+    return status;
+}
+
+extern "C" HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout)
+{
+    HAL_StatusTypeDef status = HAL_BUSY;
+    uint32_t index;
+
+    pthread_mutex_lock(&card_lock);
+
+    if (check_idle() != false)
+    {
+        for (index = 0; index < Size; index++)
+            exchange(pData[index]);
+
+        status = HAL_OK;
+    }
+
+    pthread_mutex_unlock(&card_lock);
+
+    return status;
+}
+
+extern "C" HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size)
+{
+    return start_dma(pData, NULL, Size);
+}
+
+extern "C" HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* hspi, uint8_t* pTxData, uint8_t* pRxData, uint16_t Size)
+{
+    return start_dma(pTxData, pRxData, Size);
+}
+
+extern "C" HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef* hspi)
+{
+    pthread_mutex_lock(&card_lock);
+    dma.Busy = false;
+    pthread_mutex_unlock(&card_lock);
+
+    return HAL_OK;
+}
+
+extern "C" uint32_t HAL_SPI_GetError(SPI_HandleTypeDef* hspi)
+{
+    return HAL_SPI_ERROR_NONE;
+}
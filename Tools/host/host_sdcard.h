@@ -0,0 +1,50 @@
+#ifndef HOST_SDCARD_H
+#define HOST_SDCARD_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SD card in SPI mode on SPI3 (host_sdcard.cpp), for host builds of the
+// STM32F4xx driver itself (portable/STM32F4xx/ff_sddisk.c) in place of
+// host_sddisk.cpp: an SDHC card in RAM behind the HAL SPI and chip select
+// calls of the driver. Identification (CMD0, CMD8, ACMD41, CMD58, the CSD),
+// single and multi-block reads and writes, CMD12 during a multi-block read.
+//
+// DMA transfers run on a thread of their own and end after the block time:
+// the bytes go through the card then and land in the buffer at the end, as
+// the DMA leaves them, before the completion comes as from the interrupt
+// (vSDCardTransferCompleteFromISR). Any other SPI3 or chip select call while
+// a transfer runs, a command the card does not know, one out of the card or
+// a DMA transfer from or into the CCM stand-in (host_ccm_ram, portmacro.h)
+// counts as a protocol error.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_SDCARD_SECTOR_SIZE     512
+#define HOST_SDCARD_CSD_SECTORS     1024        // Size unit of a CSD version 2.0
+
+typedef struct HOST_SDCARD_STATS
+{
+    uint32_t    Commands;
+    uint32_t    ReadCommands;           // CMD17 and CMD18
+    uint32_t    WriteCommands;          // CMD24 and CMD25
+    uint32_t    BlocksRead;             // Data blocks sent, also those cut by CMD12
+    uint32_t    BlocksWritten;
+    uint32_t    Errors;                 // Protocol errors
+
+}HOST_SDCARD_STATS;
+
+// New blank card of sectors (a multiple of HOST_SDCARD_CSD_SECTORS), in the
+// idle state, statistics cleared
+void host_sdcard_create(uint32_t sectors);
+
+// Time each DMA transfer takes, 0 to end it as soon as its thread runs
+void host_sdcard_set_block_time(uint32_t microseconds);
+
+// The image, sector 0 first. Returns the sector count
+uint32_t host_sdcard_image(uint8_t** data);
+
+void host_sdcard_get_stats(HOST_SDCARD_STATS* stats);
+
+#endif
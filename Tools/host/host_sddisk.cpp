@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "ff_headers.h"
+#include "ff_sys.h"
+#include "ff_sddisk.h"
+
+#include "host_sddisk.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host side of the SD card driver (portable/STM32F4xx/ff_sddisk.c): the same
+// calls and IO manager set up, on an image in RAM. The card is always there,
+// FF_SDDiskInit mounts it the first time
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_SDDISK_SIGNATURE       0x41404342UL
+#define HOST_SDDISK_IOMAN_MEM_SIZE  4096        // As the target driver
+#define HOST_SDDISK_HIDDEN_SECTORS  8
+
+static uint8_t*             sd_image = NULL;
+static uint32_t             sd_sectors = 0;
+static volatile uint32_t    sd_latency_us = 0;
+
+static SemaphoreHandle_t    plus_fat_mutex = NULL;
+
+static int32_t read_blocks(uint8_t* buffer, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    if (disk == NULL || disk->ulSignature != HOST_SDDISK_SIGNATURE || sector >= sd_sectors || (sd_sectors - sector) < count)
+        return FF_ERR_IOMAN_OUT_OF_BOUNDS_READ | FF_ERRFLAG;
+
+    if (sd_latency_us != 0)
+        usleep(sd_latency_us);
+
+    memcpy(buffer, &sd_image[sector * HOST_SDDISK_SECTOR_SIZE], count * HOST_SDDISK_SECTOR_SIZE);
+
+    return count;
+}
+
+static int32_t write_blocks(uint8_t* buffer, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    if (disk == NULL || disk->ulSignature != HOST_SDDISK_SIGNATURE || sector >= sd_sectors || (sd_sectors - sector) < count)
+        return FF_ERR_IOMAN_OUT_OF_BOUNDS_WRITE | FF_ERRFLAG;
+
+    if (sd_latency_us != 0)
+        usleep(sd_latency_us);
+
+    memcpy(&sd_image[sector * HOST_SDDISK_SECTOR_SIZE], buffer, count * HOST_SDDISK_SECTOR_SIZE);
+
+    return count;
+}
+
+static FF_Disk_t* create_disk(void)
+{
+    FF_CreationParameters_t parameters;
+    FF_Error_t error;
+    FF_Disk_t* disk;
+
+    disk = (FF_Disk_t*)ffconfigMALLOC(sizeof(*disk));
+    memset(disk, 0, sizeof(*disk));
+
+    disk->ulNumberOfSectors = sd_sectors;
+    disk->ulSignature = HOST_SDDISK_SIGNATURE;
+
+    if (plus_fat_mutex == NULL)
+        plus_fat_mutex = xSemaphoreCreateRecursiveMutex();
+
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.ulMemorySize = HOST_SDDISK_IOMAN_MEM_SIZE;
+    parameters.ulSectorSize = HOST_SDDISK_SECTOR_SIZE;
+    parameters.fnWriteBlocks = write_blocks;
+    parameters.fnReadBlocks = read_blocks;
+    parameters.pxDisk = disk;
+    parameters.xBlockDeviceIsReentrant = pdFALSE;
+    parameters.pvSemaphore = (void*)plus_fat_mutex;
+
+    disk->pxIOManager = FF_CreateIOManger(&parameters, &error);
+
+    if (disk->pxIOManager == NULL)
+    {
+        vPortFree(disk);
+        return NULL;
+    }
+
+    disk->xStatus.bIsInitialised = pdTRUE;
+    disk->xStatus.bPartitionNumber = 0;
+
+    return disk;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void host_sddisk_create(uint32_t sectors)
+{
+    FF_PartitionParameters_t partition;
+    FF_Disk_t* disk;
+
+    free(sd_image);
+
+    sd_image = (uint8_t*)calloc(sectors, HOST_SDDISK_SECTOR_SIZE);
+    sd_sectors = sectors;
+
+    // One partition over the whole card, as cards come
+    disk = create_disk();
+
+    memset(&partition, 0, sizeof(partition));
+    partition.ulSectorCount = sectors;
+    partition.ulHiddenSectors = HOST_SDDISK_HIDDEN_SECTORS;
+    partition.xPrimaryCount = 1;
+    partition.eSizeType = eSizeIsQuota;
+
+    FF_Partition(disk, &partition);
+
+    // Large clusters, as cards come formatted. With one sector clusters every sector written
+    // also writes both FATs (write through)
+    FF_Format(disk, 0, pdTRUE, pdFALSE);
+
+    FF_SDDiskDelete(disk);
+}
+
+void host_sddisk_set_latency(uint32_t microseconds)
+{
+    sd_latency_us = microseconds;
+}
+
+uint32_t host_sddisk_image(uint8_t** data)
+{
+    *data = sd_image;
+    return sd_sectors;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" BaseType_t FF_SDDiskDetect(FF_Disk_t* pxDisk)
+{
+    return (sd_image != NULL) ? pdTRUE : pdFALSE;
+}
+
+extern "C" FF_Disk_t* FF_SDDiskInit(const char* pcName)
+{
+    FF_Disk_t* disk;
+
+    if (sd_image == NULL)
+        return NULL;
+
+    disk = create_disk();
+
+    if (disk == NULL)
+        return NULL;
+
+    if (FF_SDDiskMount(disk) == pdFAIL)
+    {
+        FF_SDDiskDelete(disk);
+        return NULL;
+    }
+
+    FF_FS_Add((pcName != NULL) ? pcName : "/", disk);
+
+    return disk;
+}
+
+extern "C" BaseType_t FF_SDDiskReinit(FF_Disk_t* pxDisk)
+{
+    return pdPASS;
+}
+
+extern "C" BaseType_t FF_SDDiskMount(FF_Disk_t* pxDisk)
+{
+    if (FF_isERR(FF_Mount(pxDisk, pxDisk->xStatus.bPartitionNumber)) != pdFALSE)
+        return pdFAIL;
+
+    pxDisk->xStatus.bIsMounted = pdTRUE;
+    return pdPASS;
+}
+
+extern "C" BaseType_t FF_SDDiskUnmount(FF_Disk_t* pxDisk)
+{
+    if (pxDisk != NULL && pxDisk->xStatus.bIsMounted != pdFALSE)
+    {
+        pxDisk->xStatus.bIsMounted = pdFALSE;
+
+        if (FF_isERR(FF_Unmount(pxDisk)) != pdFALSE)
+        {
+            pxDisk->xStatus.bIsMounted = pdTRUE;
+            return pdFAIL;
+        }
+    }
+
+    return pdPASS;
+}
+
+extern "C" void FF_SDDiskFlush(FF_Disk_t* pxDisk)
+{
+    if (pxDisk != NULL && pxDisk->xStatus.bIsInitialised != pdFALSE && pxDisk->pxIOManager != NULL)
+        FF_FlushCache(pxDisk->pxIOManager);
+}
+
+extern "C" int32_t FF_SDDiskReadSectors(FF_Disk_t* pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, uint8_t* pucBuffer)
+{
+    int32_t result;
+
+    if (pxDisk == NULL || pxDisk->xStatus.bIsMounted != pdFALSE)
+        return FF_ERR_NULL_POINTER | FF_ERRFLAG;
+
+    xSemaphoreTakeRecursive(plus_fat_mutex, portMAX_DELAY);
+    result = read_blocks(pucBuffer, ulSectorNumber, ulSectorCount, pxDisk);
+    xSemaphoreGiveRecursive(plus_fat_mutex);
+
+    return (FF_isERR(result) != pdFALSE) ? result : 0;
+}
+
+extern "C" int32_t FF_SDDiskWriteSectors(FF_Disk_t* pxDisk, uint32_t ulSectorNumber, uint32_t ulSectorCount, const uint8_t* pucBuffer)
+{
+    int32_t result;
+
+    if (pxDisk == NULL || pxDisk->xStatus.bIsMounted != pdFALSE)
+        return FF_ERR_NULL_POINTER | FF_ERRFLAG;
+
+    xSemaphoreTakeRecursive(plus_fat_mutex, portMAX_DELAY);
+    result = write_blocks((uint8_t*)pucBuffer, ulSectorNumber, ulSectorCount, pxDisk);
+    xSemaphoreGiveRecursive(plus_fat_mutex);
+
+    return (FF_isERR(result) != pdFALSE) ? result : 0;
+}
+
+extern "C" BaseType_t FF_SDDiskDelete(FF_Disk_t* pxDisk)
+{
+    if (pxDisk != NULL)
+    {
+        pxDisk->ulSignature = 0;
+        pxDisk->xStatus.bIsInitialised = 0;
+
+        if (pxDisk->pxIOManager != NULL)
+        {
+            if (FF_Mounted(pxDisk->pxIOManager) != pdFALSE)
+                FF_Unmount(pxDisk);
+
+            FF_DeleteIOManager(pxDisk->pxIOManager);
+        }
+
+        vPortFree(pxDisk);
+    }
+
+    return 1;
+}
+
+extern "C" BaseType_t FF_SDDiskShowPartition(FF_Disk_t* pxDisk)
+{
+    return pdPASS;
+}
+
+extern "C" BaseType_t FF_SDDiskInserted(BaseType_t xDriveNr)
+{
+    return (sd_image != NULL) ? pdTRUE : pdFALSE;
+}
@@ -0,0 +1,24 @@
+#ifndef HOST_SDDISK_H
+#define HOST_SDDISK_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SD card of the tests that run the disk task (host_sddisk.cpp): a FAT image
+// in RAM behind the ff_sddisk.h calls of the STM32F4xx driver
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_SDDISK_SECTOR_SIZE     512
+
+// New card of sectors, partitioned and formatted. Before the disk task starts
+void host_sddisk_create(uint32_t sectors);
+
+// Time each read and write call takes on top of the copy, as a slow card would
+void host_sddisk_set_latency(uint32_t microseconds);
+
+// The image, sector 0 first. Returns the sector count
+uint32_t host_sddisk_image(uint8_t** data);
+
+#endif
@@ -0,0 +1,330 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "serial_task.h"
+#include "usb_task.h"
+#include "tusb.h"
+#include "cdc_device.h"
+
+#include "host_usb.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host side of the CDC interface (cdc_device.c) and of the USB task callbacks
+// (usb_task.cpp, keep them in step). The FIFOs have the sizes of tusb_config.h
+//
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct HOST_USB_FIFO
+{
+    uint8_t     Data[CFG_TUD_CDC_RX_BUFSIZE];
+    uint32_t    Size;
+    uint32_t    First;
+    uint32_t    Count;
+
+}HOST_USB_FIFO;
+
+static pthread_mutex_t  usb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   usb_changed = PTHREAD_COND_INITIALIZER;
+
+static HOST_USB_FIFO    rx_fifo = { { 0 }, CFG_TUD_CDC_RX_BUFSIZE, 0, 0 };
+static HOST_USB_FIFO    tx_fifo = { { 0 }, CFG_TUD_CDC_TX_BUFSIZE, 0, 0 };
+static volatile bool    dtr = false;
+
+// IN packets as cdc_device.c makes them: a full one as soon as the TX FIFO has it, a short one
+// for the rest on a flush
+static uint32_t         tx_unsent = 0;
+static uint32_t         tx_packets = 0;
+
+static uint32_t fifo_write(HOST_USB_FIFO & fifo, const uint8_t* data, uint32_t size)
+{
+    uint32_t index;
+
+    if (size > (fifo.Size - fifo.Count))
+        size = fifo.Size - fifo.Count;
+
+    for (index = 0; index < size; index++)
+        fifo.Data[(fifo.First + fifo.Count + index) % fifo.Size] = data[index];
+
+    fifo.Count += size;
+
+    return size;
+}
+
+static uint32_t fifo_read(HOST_USB_FIFO & fifo, uint8_t* data, uint32_t size)
+{
+    uint32_t index;
+
+    if (size > fifo.Count)
+        size = fifo.Count;
+
+    for (index = 0; index < size; index++)
+        data[index] = fifo.Data[(fifo.First + index) % fifo.Size];
+
+    fifo.First = (fifo.First + size) % fifo.Size;
+    fifo.Count -= size;
+
+    return size;
+}
+
+// Waits for a change (usb_lock held), false once the deadline passed
+static bool usb_wait(const struct timespec & deadline)
+{
+    return (pthread_cond_timedwait(&usb_changed, &usb_lock, &deadline) == 0);
+}
+
+static void deadline_after(TickType_t ticks, struct timespec & deadline)
+{
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec += ticks / configTICK_RATE_HZ;
+    deadline.tv_nsec += (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ);
+
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// USB task callbacks, as usb_task.cpp
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// No USB task, the test is the host
+TaskHandle_t usb_task_handle = NULL;
+
+extern "C" uint32_t tud_cdc_rx_filter_cb(uint8_t itf, uint8_t* buffer, uint32_t count)
+{
+    return SerialTask_FilterRealtimeCommands(buffer, count);
+}
+
+extern "C" void tud_cdc_rx_cb(uint8_t itf)
+{
+    if (serial_task_handle != NULL)
+        xTaskNotifyGive(serial_task_handle);
+}
+
+extern "C" void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+{
+    if (serial_task_handle != NULL)
+        xTaskNotifyGive(serial_task_handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host end
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void host_usb_connect(bool connected)
+{
+    pthread_mutex_lock(&usb_lock);
+    dtr = connected;
+    pthread_mutex_unlock(&usb_lock);
+
+    tud_cdc_line_state_cb(0, connected, false);
+}
+
+uint32_t host_usb_send(const void* data, uint32_t size, TickType_t wait)
+{
+    uint8_t packet[HOST_USB_PACKET_SIZE];
+    const uint8_t* bytes = (const uint8_t*)data;
+    struct timespec deadline;
+    uint32_t length, kept;
+    uint32_t sent = 0;
+
+    deadline_after(wait, deadline);
+
+    while (sent < size)
+    {
+        length = size - sent;
+
+        if (length > HOST_USB_PACKET_SIZE)
+            length = HOST_USB_PACKET_SIZE;
+
+        // NAK until a whole packet fits
+        pthread_mutex_lock(&usb_lock);
+
+        while ((rx_fifo.Size - rx_fifo.Count) < HOST_USB_PACKET_SIZE)
+        {
+            if (usb_wait(deadline) == false && (rx_fifo.Size - rx_fifo.Count) < HOST_USB_PACKET_SIZE)
+            {
+                pthread_mutex_unlock(&usb_lock);
+                return sent;
+            }
+        }
+
+        pthread_mutex_unlock(&usb_lock);
+
+        // The filter works on the packet before it goes into the FIFO, as in cdc_device.c
+        memcpy(packet, &bytes[sent], length);
+        kept = tud_cdc_rx_filter_cb(0, packet, length);
+
+        pthread_mutex_lock(&usb_lock);
+        fifo_write(rx_fifo, packet, kept);
+        kept = rx_fifo.Count;
+        pthread_mutex_unlock(&usb_lock);
+
+        if (kept != 0)
+            tud_cdc_rx_cb(0);
+
+        sent += length;
+    }
+
+    return sent;
+}
+
+uint32_t host_usb_in_packets(void)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+    count = tx_packets;
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+uint32_t host_usb_receive(void* data, uint32_t size, TickType_t wait)
+{
+    struct timespec deadline;
+    uint32_t received;
+
+    deadline_after(wait, deadline);
+
+    pthread_mutex_lock(&usb_lock);
+
+    while (tx_fifo.Count == 0 && wait != 0 && usb_wait(deadline) != false)
+        ;
+
+    received = fifo_read(tx_fifo, (uint8_t*)data, size);
+
+    pthread_cond_broadcast(&usb_changed);
+    pthread_mutex_unlock(&usb_lock);
+
+    return received;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Device end (cdc_device.h)
+//
+///////////////////////////////////////////////////////////////////////////////
+
+extern "C" bool tud_cdc_n_connected(uint8_t itf)
+{
+    return dtr;
+}
+
+extern "C" uint32_t tud_cdc_n_available(uint8_t itf)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+    count = rx_fifo.Count;
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+extern "C" uint32_t tud_cdc_n_read(uint8_t itf, void* buffer, uint32_t bufsize)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+
+    count = fifo_read(rx_fifo, (uint8_t*)buffer, bufsize);
+
+    // Room for the next OUT packet
+    if (count != 0)
+        pthread_cond_broadcast(&usb_changed);
+
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+extern "C" uint32_t tud_cdc_n_write(uint8_t itf, void const* buffer, uint32_t bufsize)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+
+    count = fifo_write(tx_fifo, (const uint8_t*)buffer, bufsize);
+
+    tx_unsent += count;
+    tx_packets += tx_unsent / HOST_USB_PACKET_SIZE;
+    tx_unsent %= HOST_USB_PACKET_SIZE;
+
+    if (count != 0)
+        pthread_cond_broadcast(&usb_changed);
+
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+// The host takes the IN data whenever there is some, only the packets are counted
+extern "C" uint32_t tud_cdc_n_write_flush(uint8_t itf)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+
+    count = tx_unsent;
+
+    if (tx_unsent != 0)
+        tx_packets++;
+
+    tx_unsent = 0;
+
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+extern "C" uint32_t tud_cdc_n_write_available(uint8_t itf)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&usb_lock);
+    count = tx_fifo.Size - tx_fifo.Count;
+    pthread_mutex_unlock(&usb_lock);
+
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Device end of the mass storage interface (msc_device.h). The test calls
+// the class callbacks of usb_storage.cpp itself, as the driver would
+//
+///////////////////////////////////////////////////////////////////////////////
+
+static uint8_t  msc_sense_key = 0;
+static uint8_t  msc_sense_code = 0;
+
+extern "C" bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+{
+    msc_sense_key = sense_key;
+    msc_sense_code = add_sense_code;
+
+    return true;
+}
+
+uint32_t host_usb_msc_sense(void)
+{
+    uint32_t sense = ((uint32_t)msc_sense_key << 8) | msc_sense_code;
+
+    msc_sense_key = 0;
+    msc_sense_code = 0;
+
+    return sense;
+}
@@ -0,0 +1,38 @@
+#ifndef HOST_USB_H
+#define HOST_USB_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// USB CDC port of the tests that run the serial task (host_usb.cpp). The test
+// is the USB host: it opens the port, sends OUT packets into the RX FIFO of
+// the device and takes the IN data the serial task writes to its TX FIFO. The
+// callbacks of usb_task.cpp run in the sending thread, which stands for the
+// USB task
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define HOST_USB_PACKET_SIZE    64      // Full speed bulk
+
+// Sets DTR (port open or closed)
+void host_usb_connect(bool connected);
+
+// Sends packets of up to HOST_USB_PACKET_SIZE bytes. Like the device NAKs, a packet only goes
+// once the RX FIFO has room for a full one. Returns the bytes sent before the wait ran out
+uint32_t host_usb_send(const void* data, uint32_t size, TickType_t wait);
+
+// Takes what the device wrote, waits up to wait ticks for the first byte. Returns the bytes read
+uint32_t host_usb_receive(void* data, uint32_t size, TickType_t wait);
+
+// IN packets the device sent so far: full ones as the TX FIFO fills, a short one for the rest
+// on each tud_cdc_n_write_flush
+uint32_t host_usb_in_packets(void);
+
+// Sense key << 8 | additional sense code of the last failed mass storage command (0 if none),
+// then clears it, as REQUEST SENSE does
+uint32_t host_usb_msc_sense(void);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PORTMACRO_H
+#define PORTMACRO_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host stand-in for the Cortex-M4 port (Sources/OS/FreeRTOS/Inc/portmacro.h).
+// Critical sections go to the kernel stand-in: nothing for the single thread
+// tools (host_kernel.cpp), a lock shared by the task threads of the tests that
+// run firmware tasks (host_rtos.cpp). Interrupt masking has nothing to do
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#define portCHAR            char
+#define portFLOAT           float
+#define portDOUBLE          double
+#define portLONG            long
+#define portSHORT           short
+#define portSTACK_TYPE      uint32_t
+#define portBASE_TYPE       long
+
+typedef portSTACK_TYPE      StackType_t;
+typedef long                BaseType_t;
+typedef unsigned long       UBaseType_t;
+typedef uint32_t            TickType_t;
+
+#define portMAX_DELAY               ( TickType_t ) 0xffffffffUL
+#define portTICK_TYPE_IS_ATOMIC     1
+
+#define portSTACK_GROWTH            ( -1 )
+#define portTICK_PERIOD_MS          ( ( TickType_t ) 1000 / configTICK_RATE_HZ )
+#define portBYTE_ALIGNMENT          8
+
+#define portYIELD()
+#define portYIELD_FROM_ISR( x )                 ( void ) ( x )
+#define portEND_SWITCHING_ISR( x )              ( void ) ( x )
+#define portDISABLE_INTERRUPTS()
+#define portENABLE_INTERRUPTS()
+#define portENTER_CRITICAL()                    vPortEnterCritical()
+#define portEXIT_CRITICAL()                     vPortExitCritical()
+#define portSET_INTERRUPT_MASK_FROM_ISR()       ( vPortEnterCritical(), 0 )
+#define portCLEAR_INTERRUPT_MASK_FROM_ISR( x )  ( ( void ) ( x ), vPortExitCritical() )
+
+#define portTASK_FUNCTION_PROTO( vFunction, pvParameters )  void vFunction( void * pvParameters )
+#define portTASK_FUNCTION( vFunction, pvParameters )        void vFunction( void * pvParameters )
+
+void vPortEnterCritical( void );
+void vPortExitCritical( void );
+
+// The CCM data RAM of the heap, out of reach of the DMA (configIN_HEAP_RAM of
+// FreeRTOSConfig.h): a block of the SD card model (host_sdcard.cpp), which
+// counts a DMA transfer from or into it as a protocol error. The heap itself
+// stays malloc()
+#define HOST_CCM_RAM_SIZE   8192
+
+extern uint8_t host_ccm_ram[HOST_CCM_RAM_SIZE];
+
+#define configIN_HEAP_RAM( pv )     ( ( ( uintptr_t ) ( pv ) - ( uintptr_t ) host_ccm_ram ) < HOST_CCM_RAM_SIZE )
+
+#define portNOP()
+#define portINLINE          inline
+#define portFORCE_INLINE    inline
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
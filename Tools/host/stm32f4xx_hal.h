@@ -0,0 +1,111 @@
+#ifndef STM32F4XX_HAL_H
+#define STM32F4XX_HAL_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Host stand-in for the parts of the HAL the host builds of the firmware
+// sources use (types in headers, the CRC unit of Settings_Manager, the cycle
+// counter and barrier of the tasks, SPI3 and the chip select of the SD card
+// driver). Nothing here touches hardware, host_platform.cpp has the functions,
+// host_sdcard.cpp the ones of SPI3 and the GPIO
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    HAL_OK = 0,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+
+}HAL_StatusTypeDef;
+
+typedef struct { volatile uint32_t IDR; volatile uint32_t ODR; } GPIO_TypeDef;
+typedef struct { uint32_t CR1; } SPI_TypeDef;
+typedef struct { uint32_t CR1; } TIM_TypeDef;
+typedef struct { uint32_t DR; } CRC_TypeDef;
+typedef struct { uint32_t SR; } USART_TypeDef;
+typedef struct { volatile uint32_t CYCCNT; } DWT_Type;
+
+typedef enum
+{
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+
+}GPIO_PinState;
+
+typedef struct { uint32_t BaudRatePrescaler; } SPI_InitTypeDef;
+
+typedef struct { SPI_TypeDef* Instance; SPI_InitTypeDef Init; } SPI_HandleTypeDef;
+typedef struct { TIM_TypeDef* Instance; } TIM_HandleTypeDef;
+typedef struct { CRC_TypeDef* Instance; } CRC_HandleTypeDef;
+typedef struct { USART_TypeDef* Instance; } UART_HandleTypeDef;
+
+extern uint32_t SystemCoreClock;
+extern CRC_TypeDef host_crc_unit;
+extern DWT_Type host_dwt_unit;
+extern GPIO_TypeDef host_gpio_a;
+
+#define CRC                                 (&host_crc_unit)
+#define DWT                                 (&host_dwt_unit)
+#define GPIOA                               (&host_gpio_a)
+
+#define GPIO_PIN_0                          ((uint16_t)0x0001)
+#define GPIO_PIN_1                          ((uint16_t)0x0002)
+#define GPIO_PIN_2                          ((uint16_t)0x0004)
+#define GPIO_PIN_3                          ((uint16_t)0x0008)
+#define GPIO_PIN_4                          ((uint16_t)0x0010)
+#define GPIO_PIN_5                          ((uint16_t)0x0020)
+#define GPIO_PIN_6                          ((uint16_t)0x0040)
+#define GPIO_PIN_7                          ((uint16_t)0x0080)
+#define GPIO_PIN_8                          ((uint16_t)0x0100)
+#define GPIO_PIN_9                          ((uint16_t)0x0200)
+#define GPIO_PIN_10                         ((uint16_t)0x0400)
+#define GPIO_PIN_11                         ((uint16_t)0x0800)
+#define GPIO_PIN_12                         ((uint16_t)0x1000)
+#define GPIO_PIN_13                         ((uint16_t)0x2000)
+#define GPIO_PIN_14                         ((uint16_t)0x4000)
+#define GPIO_PIN_15                         ((uint16_t)0x8000)
+
+#define SPI_CR1_BR                          (0x7UL << 3)
+#define SPI_BAUDRATEPRESCALER_2             (0x00000000UL)
+#define SPI_BAUDRATEPRESCALER_4             (0x00000008UL)
+#define SPI_BAUDRATEPRESCALER_8             (0x00000010UL)
+#define SPI_BAUDRATEPRESCALER_16            (0x00000018UL)
+#define SPI_BAUDRATEPRESCALER_32            (0x00000020UL)
+#define SPI_BAUDRATEPRESCALER_64            (0x00000028UL)
+#define SPI_BAUDRATEPRESCALER_128           (0x00000030UL)
+#define SPI_BAUDRATEPRESCALER_256           (0x00000038UL)
+#define HAL_SPI_ERROR_NONE                  (0x00000000UL)
+
+#define MODIFY_REG( reg, clear, set )       ( ( reg ) = ( ( ( reg ) & ~( clear ) ) | ( set ) ) )
+
+#define __DMB()                             __sync_synchronize()
+
+#define __HAL_RCC_CRC_CLK_ENABLE()
+#define __HAL_TIM_ENABLE( h )               ( ( void ) ( h ) )
+#define __HAL_SPI_DISABLE( h )              ( ( void ) ( h ) )
+
+HAL_StatusTypeDef HAL_CRC_Init(CRC_HandleTypeDef* hcrc);
+uint32_t HAL_CRC_Calculate(CRC_HandleTypeDef* hcrc, uint32_t* buffer, uint32_t length);
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi, uint8_t* pTxData, uint8_t* pRxData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* hspi, uint8_t* pTxData, uint8_t* pRxData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef* hspi);
+uint32_t HAL_SPI_GetError(SPI_HandleTypeDef* hspi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// tdecode - motion telemetry decoder (host, POSIX)
+//
+// Takes what the controller sent on the serial port while $T<hz> was on (a
+// capture of the port, text responses and all) and writes the samples of the
+// TELEMETRY frames (MotionTelemetry.h) as CSV, one line per sample. Frames
+// are picked out and checked with the firmware's own BinaryFraming, built for
+// the host with the stand-ins of Tools/host (host.mk).
+//
+//  tdecode [options] [capture]
+//
+//      -o output   CSV file (default: standard output)
+//      -f hz       Step ticker frequency, for steps/s (default 100000)
+//      -r hz       Rate given to $T, adds the time of each sample
+//      -q          No summary
+//
+// Columns: [time,] seq, block, phase, axis (primary), steps/s of the primary
+// axis, then the step counters X Y Z A B C. Samples lost in the ring of the
+// controller show as gaps in seq and are counted in the summary. To plot the
+// velocity of a move with gnuplot:
+//
+//  tdecode -r 1000 run.cap > run.csv
+//  gnuplot -p -e "set datafile separator ','; plot 'run.csv' every ::1 using 1:6 with lines"
+//
+// Exit status 0 if the capture decoded, 1 if it has bad frames, 2 if it can't
+// be read or written.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "BinaryFraming.h"
+#include "MotionTelemetry.h"
+#include "Block.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct DECODER_OUTPUT
+{
+    FILE*       File;
+    double      StepFrequency;
+    double      SampleRate;         // 0 without -r
+    uint32_t    Frames;
+    uint32_t    Samples;
+    uint32_t    Lost;               // Gaps in seq
+    uint32_t    BadFrames;          // Not TELEMETRY, or not whole samples
+    uint64_t    SampleIndex;        // seq without the wrap, from the first sample
+    uint16_t    LastSeq;
+
+}DECODER_OUTPUT;
+
+static const char* phase_names[] = { "idle", "accel", "cruise", "decel" };
+static const char* axis_names[] = { "X", "Y", "Z", "A", "B", "C" };
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void write_sample(DECODER_OUTPUT* output, const TELEMETRY_SAMPLE & sample)
+{
+    uint32_t axis;
+
+    if (output->Samples != 0)
+    {
+        output->Lost += (uint16_t)(sample.seq - output->LastSeq - 1);
+        output->SampleIndex += (uint16_t)(sample.seq - output->LastSeq);
+    }
+
+    output->LastSeq = sample.seq;
+    output->Samples++;
+
+    if (output->SampleRate > 0)
+        fprintf(output->File, "%.6f,", output->SampleIndex / output->SampleRate);
+
+    fprintf(output->File, "%u,%u,%s,%s,%.1f", sample.seq, sample.block,
+            (sample.phase < 4) ? phase_names[sample.phase] : "?",
+            (sample.primary_axis < TOTAL_AXES_COUNT) ? axis_names[sample.primary_axis] : "?",
+            sample.rate * output->StepFrequency / 1073741824.0);
+
+    for (axis = 0; axis < TOTAL_AXES_COUNT; axis++)
+        fprintf(output->File, ",%d", sample.steps[axis]);
+
+    fprintf(output->File, "\n");
+}
+
+static void deliver_frame(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length, void* context)
+{
+    DECODER_OUTPUT* output = (DECODER_OUTPUT*)context;
+    TELEMETRY_SAMPLE sample;
+    uint32_t offset;
+
+    if (type != FRAME_TYPE_TELEMETRY || (length % sizeof(TELEMETRY_SAMPLE)) != 0)
+    {
+        output->BadFrames++;
+        return;
+    }
+
+    output->Frames++;
+
+    for (offset = 0; offset < length; offset += sizeof(TELEMETRY_SAMPLE))
+    {
+        memcpy(&sample, &payload[offset], sizeof(sample));
+        write_sample(output, sample);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: tdecode [-o output] [-f hz] [-r hz] [-q] [capture]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t data[4096];
+    const char* input_path = "-";
+    const char* output_path = NULL;
+    DECODER_OUTPUT output;
+    BinaryFraming framing;
+    size_t count;
+    bool quiet = false;
+    int option;
+    uint32_t axis;
+    FILE* file;
+
+    memset(&output, 0, sizeof(output));
+    output.StepFrequency = STEP_TICKER_FREQUENCY;
+
+    while ((option = getopt(argc, argv, "o:f:r:q")) != -1)
+    {
+        switch (option)
+        {
+            case 'o':   output_path = optarg; break;
+            case 'q':   quiet = true; break;
+
+            case 'f':
+                output.StepFrequency = strtod(optarg, NULL);
+
+                if (output.StepFrequency <= 0)
+                    usage();
+                break;
+
+            case 'r':
+                output.SampleRate = strtod(optarg, NULL);
+
+                if (output.SampleRate <= 0)
+                    usage();
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    if (optind < (argc - 1))
+        usage();
+
+    if (optind == (argc - 1))
+        input_path = argv[optind];
+
+    file = (strcmp(input_path, "-") == 0) ? stdin : fopen(input_path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", input_path, strerror(errno));
+        return 2;
+    }
+
+    output.File = (output_path == NULL) ? stdout : fopen(output_path, "w");
+
+    if (output.File == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", output_path, strerror(errno));
+        return 2;
+    }
+
+    if (output.SampleRate > 0)
+        fprintf(output.File, "time,");
+
+    fprintf(output.File, "seq,block,phase,axis,steps/s");
+
+    for (axis = 0; axis < TOTAL_AXES_COUNT; axis++)
+        fprintf(output.File, ",%s", axis_names[axis]);
+
+    fprintf(output.File, "\n");
+
+    // Text responses between the frames are skipped by the receiver
+    framing.AssociateDelivery(deliver_frame, &output);
+
+    while ((count = fread(data, 1, sizeof(data), file)) != 0)
+        framing.Feed(data, (uint32_t)count);
+
+    if (ferror(file))
+    {
+        fprintf(stderr, "%s: %s\n", input_path, strerror(errno));
+        return 2;
+    }
+
+    if (file != stdin)
+        fclose(file);
+
+    if (fflush(output.File) != 0 || (output.File != stdout && fclose(output.File) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", (output_path != NULL) ? output_path : "stdout", strerror(errno));
+        return 2;
+    }
+
+    if (quiet == false)
+    {
+        fprintf(stderr, "%u samples in %u frames, %u lost in the controller, %u bad frames\n",
+                output.Samples, output.Frames, output.Lost, framing.GetStats().CrcErrors + output.BadFrames);
+    }
+
+    return (framing.GetStats().CrcErrors != 0 || output.BadFrames != 0) ? 1 : 0;
+}
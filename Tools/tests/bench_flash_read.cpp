@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_flash_read - bulk reads of the W25Q16 at boot, on the SPI bus model
+//
+// The reads the firmware does when it starts, on the flash of
+// host_platform.cpp (host_flash.h), timed on the bus of spi_ports.cpp (fast
+// read at 21 MHz, DMA from 32 bytes on) and as they were before (plain read
+// at 5.25 MHz, all polled):
+//
+//  - loading the settings (Settings_Manager::Initialize): a fresh journal
+//    with its full copy, and one after JOURNAL_SAVES single setting saves
+//    (small records replayed one by one)
+//  - finding the newest job checkpoint (JobCheckpoint::Initialize), which
+//    reads every record of the ring
+//
+// Prints the reads, the bytes, the bus time now and before, the part of it
+// the CPU waits for (polled reads) and the host time of the call, best of
+// BENCH_ROUNDS. The settings load at power up comes before the scheduler
+// starts, where every read is polled: its CPU time is the whole bus time.
+// The data read has to be the same either way: the settings are the last
+// ones saved.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "host_test.h"
+#include "host_flash.h"
+#include "settings_manager.h"
+#include "JobCheckpoint.h"
+
+#define JOURNAL_SAVES       2000
+#define BENCH_ROUNDS        5
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void load_settings(void)
+{
+    Settings_Manager::Initialize();
+}
+
+static void load_checkpoints(void)
+{
+    JobCheckpoint::Initialize();
+}
+
+static void bench(const char* name, void (*load)(void))
+{
+    HOST_FLASH_STATS start;
+    HOST_FLASH_STATS stats;
+    double seconds;
+    double best = 0;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        host_flash_get_stats(&start);
+
+        seconds = host_test_seconds();
+        load();
+        seconds = host_test_seconds() - seconds;
+
+        host_flash_get_stats(&stats);
+        best = (round == 0 || seconds < best) ? seconds : best;
+    }
+
+    stats.Reads -= start.Reads;
+    stats.ReadBytes -= start.ReadBytes;
+    stats.ReadMicroseconds -= start.ReadMicroseconds;
+    stats.PolledReadMicroseconds -= start.PolledReadMicroseconds;
+    stats.OldReadMicroseconds -= start.OldReadMicroseconds;
+
+    printf("  %-22s %5u reads %6u bytes: bus %7.2f ms (CPU waits %6.2f ms), before %7.2f ms, host %6.3f ms\n",
+           name, stats.Reads, stats.ReadBytes, stats.ReadMicroseconds / 1000.0, stats.PolledReadMicroseconds / 1000.0,
+           stats.OldReadMicroseconds / 1000.0, best * 1000.0);
+
+    if (stats.ReadMicroseconds > stats.OldReadMicroseconds)
+        host_test_fail("%s: %.2f ms on the bus, %.2f ms before", name, stats.ReadMicroseconds / 1000.0, stats.OldReadMicroseconds / 1000.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    uint32_t index;
+    float expected = 0;
+
+    printf("bench_flash_read: SPI %.2f MHz fast read, DMA from %u bytes, before %.2f MHz plain read, best of %d\n",
+           HOST_FLASH_SPI_HZ / 1e6, HOST_FLASH_DMA_MIN_LENGTH, HOST_FLASH_OLD_SPI_HZ / 1e6, BENCH_ROUNDS);
+
+    host_flash_reset();
+    Settings_Manager::Initialize();
+
+    bench("settings, full copy", load_settings);
+
+    for (index = 0; index < JOURNAL_SAVES; index++)
+    {
+        expected = 0.001f * (index % 50 + 1);
+        Settings_Manager::SetJunctionDeviation_mm(expected);
+        Settings_Manager::Save();
+    }
+
+    bench("settings, journal", load_settings);
+
+    if (fabsf(Settings_Manager::GetJunctionDeviation_mm() - expected) > 1e-6f)
+        host_test_fail("junction deviation %.4f after the load, %.4f saved", Settings_Manager::GetJunctionDeviation_mm(), expected);
+
+    bench("job checkpoints", load_checkpoints);
+
+    return host_test_result("bench_flash_read");
+}
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_parser - lines per second of GCodeParser::ParseLine
+//
+// Parses the same generated CAM lines (gcode_corpus.cpp) with the single-pass
+// tokenizer and the way the two-pass parser did, cleaned first by the old
+// cleanup_and_lowercase_line() (legacy_cleanup.cpp). Each way runs in scan
+// mode, where lines only update the parser state, and in check mode, where
+// the moves are planned as well. Files given on the command line are used
+// instead of the generated lines.
+//
+//  bench_parser [file...]
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include "host_test.h"
+#include "gcode_corpus.h"
+#include "legacy_cleanup.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+
+#define GENERATED_LINES     500000
+#define BENCH_ROUNDS        3           // Best of
+
+extern MachineCore* machine;
+
+static double run_lines(const std::vector<std::string> & lines, bool legacy, bool scan)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t line_len;
+    double start, best = 0;
+    size_t index;
+    int round;
+    
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        host_test_start_machine();
+        machine->SetScanMode(scan);
+        
+        start = host_test_seconds();
+        
+        for (index = 0; index < lines.size(); index++)
+        {
+            // Both ways copy the line, as the parsing task gets it in its own buffer
+            strncpy(line, lines[index].c_str(), GCODE_MAX_LINE_LENGTH);
+            line[GCODE_MAX_LINE_LENGTH] = '\0';
+            
+            if (legacy != false)
+            {
+                if (legacy_cleanup_and_lowercase_line(line, line_len) != GCODE_OK || line_len == 0)
+                    continue;
+            }
+            
+            machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+        
+        start = host_test_seconds() - start;
+        
+        if (round == 0 || start < best)
+            best = start;
+    }
+    
+    return lines.size() / best;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    char line[GCODE_MAX_LINE_LENGTH + 2];
+    uint32_t seed = 0x2026;
+    uint32_t count;
+    size_t length;
+    double single_pass, two_pass;
+    int arg, mode;
+    FILE* file;
+    
+    for (arg = 1; arg < argc; arg++)
+    {
+        if ((file = fopen(argv[arg], "r")) == NULL)
+        {
+            fprintf(stderr, "bench_parser: can't read %s\n", argv[arg]);
+            return 2;
+        }
+        
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            length = strlen(line);
+            
+            while (length != 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                line[--length] = '\0';
+            
+            lines.push_back(line);
+        }
+        
+        fclose(file);
+    }
+    
+    if (argc == 1)
+    {
+        for (count = 0; count < GENERATED_LINES; count++)
+        {
+            corpus_cam_line(seed, line);
+            lines.push_back(line);
+        }
+    }
+    
+    printf("%u lines, best of %d\n", (uint32_t)lines.size(), BENCH_ROUNDS);
+    
+    for (mode = 0; mode < 2; mode++)
+    {
+        single_pass = run_lines(lines, false, (mode == 0));
+        two_pass = run_lines(lines, true, (mode == 0));
+        
+        printf("%-11s single-pass %9.0f lines/s, two-pass %9.0f lines/s, x%.2f\n", 
+            (mode == 0) ? "scan mode" : "check mode", single_pass, two_pass, single_pass / two_pass);
+    }
+    
+    return 0;
+}
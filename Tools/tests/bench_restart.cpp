@@ -0,0 +1,297 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_restart - time to reach the restart line of a large job ($FL)
+//
+// A generated file of FILE_LINES lines (G1 moves, G2 arcs, work coordinate
+// systems, incremental and inch blocks, tool changes, comments and blank
+// lines) goes through the parser the way the disk and parsing tasks send it,
+// without the tasks: the blank lines are counted but not parsed, and
+// JobIndex::OnLine comes before each parsed line. RESTART_LINE is reached
+//
+//  - by a scan from line 1, the first run of the file that builds the index
+//  - by a restart from the entry of JobIndex::Find: its resume lines
+//    (JobCheckpoint::BuildResumeLine) in scan mode, then the scan from its
+//    line
+//
+// The parser state at the restart line has to be the same on both paths, and
+// the one of a run in check mode (positions within 0.1 um, the resume lines
+// have 4 decimals). Prints the time and lines scanned of each path, best of
+// BENCH_ROUNDS. Times are those of the host, the parsing task and its line
+// hand-off add to them on the controller.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#include "host_test.h"
+#include "MachineCore.h"
+#include "GCodeParser.h"
+#include "JobIndex.h"
+#include "JobCheckpoint.h"
+#include "gcode_parsing_task.h"
+#include "settings_manager.h"
+
+#define FILE_LINES          1100000
+#define RESTART_LINE        1000000
+#define BENCH_ROUNDS        3           // Best of
+#define POSITION_TOLERANCE  0.0001f     // mm
+
+#define FILE_NAME           "restart.nc"
+
+extern MachineCore* machine;
+
+static std::string job;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void add_line(const char* text)
+{
+    job += text;
+    job += "\n";
+}
+
+// Lines in mm average about 25 bytes, like the ones of CAM post processors
+static uint32_t make_job(uint32_t seed)
+{
+    char text[128];
+    uint32_t lines;
+    uint32_t count;
+    uint32_t wcs = 0;
+
+    job.clear();
+
+    add_line("(bench_restart)");
+    add_line("G21 G90 G17 G94");
+    add_line("G54 T1 S12000 M3");
+    add_line("G0 X0 Y0 Z5");
+    add_line("G1 Z-1 F600");
+
+    for (lines = 5; lines < FILE_LINES; lines++)
+    {
+        if ((lines % 211) == 0)
+        {
+            wcs ^= 1;
+            add_line((wcs != 0) ? "G55" : "G54");
+        }
+        else if ((lines % 97) == 0)
+        {
+            sprintf(text, "T%u S%u M%u", 1 + host_test_random(seed) % 8, 1000 * (1 + host_test_random(seed) % 20), 3 + (lines % 2));
+            add_line(text);
+        }
+        else if ((lines % 301) == 0)
+        {
+            add_line("G91");
+
+            for (count = 0; count < 10; count++, lines++)
+            {
+                sprintf(text, "G1 X%d Y%d", (int)(host_test_random(seed) % 11) - 5, (int)(host_test_random(seed) % 11) - 5);
+                add_line(text);
+            }
+
+            add_line("G90");
+            lines++;
+        }
+        else if ((lines % 401) == 0)
+        {
+            add_line("G20");
+
+            for (count = 0; count < 10; count++, lines++)
+            {
+                sprintf(text, "G1 X%u.%03u Y%u.%03u F%u", host_test_random(seed) % 8, host_test_random(seed) % 1000,
+                        host_test_random(seed) % 8, host_test_random(seed) % 1000, 10 + host_test_random(seed) % 40);
+                add_line(text);
+            }
+
+            add_line("G21");
+            lines++;
+        }
+        else if ((lines % 251) == 0)
+        {
+            add_line("G1 X100 Y100");
+            add_line("G2 X120 Y100 I10 J0");
+            add_line("X140 I10 J0");
+            add_line("G1 X150");
+            lines += 3;
+        }
+        else if ((lines % 59) == 0)
+        {
+            sprintf(text, "(pass %u)", lines / 59);
+            add_line(text);
+        }
+        else if ((lines % 67) == 0)
+        {
+            add_line("");
+        }
+        else
+        {
+            sprintf(text, "G1 X%u.%03u Y%u.%03u F%u", host_test_random(seed) % 200, host_test_random(seed) % 1000,
+                    host_test_random(seed) % 200, host_test_random(seed) % 1000, 600 + 100 * (host_test_random(seed) % 20));
+            add_line(text);
+        }
+    }
+
+    return lines;
+}
+
+// The job goes below Z0 and past the default travel
+static void start_machine(void)
+{
+    host_test_start_machine();
+    Settings_Manager::DisableSoftLimits();
+}
+
+static bool same_state(const GCodeJobState & a, const GCodeJobState & b)
+{
+    uint32_t axis;
+
+    if (memcmp(&a.modal_state, &b.modal_state, sizeof(a.modal_state)) != 0 ||
+        fabsf(a.feed_rate - b.feed_rate) > (a.feed_rate * 1e-5f) ||
+        a.spindle_speed != b.spindle_speed || a.tool_number != b.tool_number)
+        return false;
+
+    for (axis = 0; axis < TOTAL_AXES_COUNT; axis++)
+    {
+        if (fabsf(a.work_coord_sys[axis] - b.work_coord_sys[axis]) > POSITION_TOLERANCE ||
+            fabsf(a.g92_coord_offset[axis] - b.g92_coord_offset[axis]) > POSITION_TOLERANCE ||
+            fabsf(a.machine_pos[axis] - b.machine_pos[axis]) > POSITION_TOLERANCE)
+            return false;
+    }
+
+    return true;
+}
+
+// The file lines from the one at offset up to the restart line, as disk_task.cpp splits them.
+// Returns the lines parsed, 0 after an error
+static uint32_t run_lines(uint32_t offset, uint32_t number, bool index)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    const char* eol;
+    uint32_t length;
+    uint32_t parsed = 0;
+    int result;
+
+    for ( ; number < RESTART_LINE; number++)
+    {
+        eol = (const char*)memchr(job.data() + offset, '\n', job.size() - offset);
+        length = (uint32_t)(eol - (job.data() + offset));
+
+        if (length != 0)
+        {
+            memcpy(line, job.data() + offset, length);
+            line[length] = '\0';
+
+            if (index != false)
+                JobIndex::OnLine(machine, offset, number);
+
+            if ((result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line)) != GCODE_OK)
+            {
+                host_test_fail("line %u \"%s\": error %d", number, line, result);
+                return 0;
+            }
+
+            parsed++;
+        }
+
+        offset += length + 1;
+    }
+
+    return parsed;
+}
+
+// $FL from the index entry: the resume lines of its state in scan mode, then the scan
+static uint32_t restart(const JOB_INDEX_ENTRY & entry)
+{
+    char text[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t index;
+    uint32_t length;
+    int result;
+
+    machine->SetScanMode(true);
+
+    for (index = 0; index < JOB_RESUME_LINES; index++)
+    {
+        if ((length = JobCheckpoint::BuildResumeLine(entry.State, index, text)) == 0)
+            continue;
+
+        text[length] = '\0';
+
+        if ((result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, text)) != GCODE_OK)
+        {
+            host_test_fail("resume line \"%s\" of line %u: error %d", text, entry.LineNumber, result);
+            return 0;
+        }
+    }
+
+    return run_lines(entry.LineOffset, entry.LineNumber, true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    GCodeJobState reference;
+    GCodeJobState state;
+    JOB_INDEX_ENTRY entry;
+    uint32_t lines;
+    uint32_t scanned = 0;
+    double start;
+    double scan_time = 0;
+    double restart_time = 0;
+    int round;
+
+    lines = make_job(0x5CA0048);
+
+    printf("bench_restart: %u lines, %u bytes, restart at line %u, best of %d\n", lines, (uint32_t)job.size(), RESTART_LINE, BENCH_ROUNDS);
+
+    // The state of a run in check mode
+    start_machine();
+
+    if (run_lines(0, 1, false) == 0 || machine->ReadJobState(&reference) == false)
+        host_test_fail("no state at line %u in check mode", RESTART_LINE);
+
+    for (round = 0; round < BENCH_ROUNDS && host_test_failures() == 0; round++)
+    {
+        // The first run of the file: a new index
+        JobIndex::Invalidate();
+        JobIndex::BeginJob(FILE_NAME, job.size());
+        start_machine();
+
+        start = host_test_seconds();
+        machine->SetScanMode(true);
+        run_lines(0, 1, true);
+        start = host_test_seconds() - start;
+
+        scan_time = (round == 0 || start < scan_time) ? start : scan_time;
+
+        if (machine->ReadJobState(&state) == false || same_state(state, reference) == false)
+            host_test_fail("scan from line 1: not the state of the run in check mode");
+
+        // Again, from the index
+        JobIndex::BeginJob(FILE_NAME, job.size());
+
+        if (JobIndex::Find(FILE_NAME, job.size(), RESTART_LINE, &entry) == false)
+        {
+            host_test_fail("no index entry before line %u", RESTART_LINE);
+            break;
+        }
+
+        start_machine();
+
+        start = host_test_seconds();
+        scanned = restart(entry);
+        start = host_test_seconds() - start;
+
+        restart_time = (round == 0 || start < restart_time) ? start : restart_time;
+
+        if (machine->ReadJobState(&state) == false || same_state(state, reference) == false)
+            host_test_fail("restart from the entry of line %u: not the state of the scan from line 1", entry.LineNumber);
+    }
+
+    printf("  scan from line 1       %8.1f ms, %7u lines, %.3f us/line\n", scan_time * 1000.0, RESTART_LINE - 1, scan_time * 1e6 / (RESTART_LINE - 1));
+    printf("  restart from the index %8.1f ms, %7u lines parsed from the entry of line %u\n", restart_time * 1000.0, scanned, entry.LineNumber);
+
+    return host_test_result("bench_restart");
+}
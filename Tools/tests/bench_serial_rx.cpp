@@ -0,0 +1,156 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_serial_rx - receive path of the serial task
+//
+// Runs the serial and parsing tasks (task_test.cpp) and reports:
+//
+//  - bytes per second the serial task takes in, with a counting sender
+//    keeping the RX capacity in flight. Once with generated CAM lines
+//    (gcode_corpus.cpp), where the parser sets the pace, once with comment
+//    lines, which the parser drops right away, so the receive path and line
+//    splitting set it
+//  - the latency from a line arriving to its response, for lines sent one at
+//    a time after the port was idle (the task asleep on its notification).
+//    The response comes right after the parse, so this bounds the time to
+//    the parse
+//
+// Lines run in check mode. Times are those of the host threads, not of the
+// controller.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "gcode_corpus.h"
+#include "gcode_parsing_task.h"
+
+#define STREAM_BYTES        (8 * 1024 * 1024)
+#define LATENCY_LINES       500
+#define LATENCY_IDLE_US     2000        // Port idle before each line
+
+// Counting sender, capacity is the one of the $I report. Returns bytes per second, 0 if a
+// response went missing
+static double stream_lines(const std::vector<std::string> & lines, uint32_t capacity)
+{
+    std::deque<uint32_t> in_flight;
+    char response[64];
+    uint32_t in_flight_bytes = 0;
+    uint64_t bytes = 0;
+    size_t next = 0;
+    size_t answered = 0;
+    double start;
+
+    start = host_test_seconds();
+
+    while (answered < lines.size())
+    {
+        if (next < lines.size() && (in_flight.empty() != false || (in_flight_bytes + lines[next].size()) <= capacity))
+        {
+            task_test_send(lines[next].data(), (uint32_t)lines[next].size());
+
+            in_flight.push_back((uint32_t)lines[next].size());
+            in_flight_bytes += (uint32_t)lines[next].size();
+            bytes += lines[next].size();
+            next++;
+            continue;
+        }
+
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+        {
+            host_test_fail("no response to line %u", (uint32_t)answered + 1);
+            return 0;
+        }
+
+        in_flight_bytes -= in_flight.front();
+        in_flight.pop_front();
+        answered++;
+    }
+
+    return bytes / (host_test_seconds() - start);
+}
+
+static void measure_latency(void)
+{
+    std::vector<double> latencies;
+    char response[64];
+    const char* line = "G1 X10.5 Y-3.25 F1200\n";
+    double start;
+    uint32_t index;
+
+    for (index = 0; index < LATENCY_LINES; index++)
+    {
+        usleep(LATENCY_IDLE_US);
+
+        start = host_test_seconds();
+        task_test_send(line, strlen(line));
+
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+        {
+            host_test_fail("no response to latency line %u", index + 1);
+            return;
+        }
+
+        latencies.push_back((host_test_seconds() - start) * 1e6);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("line arrival to response, %u lines after %u us idle: median %.0f us, 99%% %.0f us, max %.0f us\n",
+           LATENCY_LINES, LATENCY_IDLE_US, latencies[latencies.size() / 2],
+           latencies[(latencies.size() * 99) / 100], latencies.back());
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> cam_lines;
+    std::vector<std::string> comment_lines;
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t seed = 0x5EED0031;
+    uint32_t capacity;
+    uint32_t bytes;
+    char* src;
+    char* dst;
+
+    // Real-time bytes left out, '$' lines are commands of the serial task
+    for (bytes = 0; bytes < STREAM_BYTES; bytes += (uint32_t)cam_lines.back().size())
+    {
+        corpus_cam_line(seed, line);
+
+        for (src = dst = line; *src != '\0'; src++)
+        {
+            if (*src != '?' && *src != '!' && *src != '~' && *src != '$')
+                *dst++ = *src;
+        }
+
+        *dst = '\0';
+        cam_lines.push_back(std::string(line) + "\n");
+    }
+
+    for (bytes = 0; bytes < STREAM_BYTES; bytes += (uint32_t)comment_lines.back().size())
+        comment_lines.push_back("(T1 D=6.0 CR=0. - ZMIN=-5. - FLAT END MILL roughing pass)\n");
+
+    task_test_start(0);
+
+    if (task_test_open() == false || (capacity = task_test_rx_capacity()) == 0)
+    {
+        host_test_fail("no greeting or $I report");
+        task_test_exit(host_test_result("bench_serial_rx"));
+    }
+
+    printf("CAM lines     %7.2f MB/s\n", stream_lines(cam_lines, capacity) / 1e6);
+    printf("comment lines %7.2f MB/s\n", stream_lines(comment_lines, capacity) / 1e6);
+
+    measure_latency();
+
+    task_test_exit((host_test_failures() != 0) ? host_test_result("bench_serial_rx") : 0);
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_status_report - cost of the status reports of the serial task
+//
+// Runs the serial and parsing tasks (task_test.cpp) and reports:
+//
+//  - full reports ('?' one at a time, every field): the CPU time of the
+//    serial task per report (host_rtos.h, the query byte and the flush
+//    included), the bytes of a report and the link bandwidth they take at
+//    SERIAL_STATUS_MAX_RATE_HZ, next to the one of the longest report
+//  - automatic reports ($R50) with the port otherwise idle and while CAM
+//    lines stream in (counting sender): reports per second, their share of
+//    the bytes sent to the host and the CPU time of the serial task per
+//    second, against the same stream without reports
+//
+// The work offsets are set to 7 digit values so the WCO field is at its
+// longest, the first full report is printed. Times are those of the host
+// threads, not of the controller.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_rtos.h"
+#include "gcode_corpus.h"
+#include "serial_task.h"
+#include "gcode_parsing_task.h"
+
+#define REPORT_RATE_HZ      50          // SERIAL_STATUS_MAX_RATE_HZ
+#define REPORT_MAX_LENGTH   163         // STATUS_REPORT_MAX_LENGTH of 3 axes, with \r\n
+#define FULL_REPORTS        2000
+#define IDLE_SECONDS        2.0
+#define STREAM_LINES        40000
+
+typedef struct STREAM_RESULT
+{
+    double      Seconds;
+    double      CpuSeconds;             // Of the serial task
+    uint32_t    Reports;
+    uint64_t    ReportBytes;
+    uint64_t    OtherBytes;             // Responses
+
+}STREAM_RESULT;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void count_line(const char* text, STREAM_RESULT & result)
+{
+    if (text[0] == '<')
+    {
+        result.Reports++;
+        result.ReportBytes += strlen(text) + 2;
+    }
+    else
+    {
+        result.OtherBytes += strlen(text) + 2;
+    }
+}
+
+static bool set_rate(uint32_t rate)
+{
+    char line[16];
+    char response[64];
+
+    sprintf(line, "$R%u", rate);
+
+    if (task_test_command(line, response, sizeof(response)) == false)
+        return false;
+
+    // Reports already on their way
+    while (strcmp(response, "ok") != 0)
+    {
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+            return false;
+    }
+
+    return true;
+}
+
+static void full_reports(void)
+{
+    char response[256];
+    uint64_t bytes = 0;
+    uint32_t longest = 0;
+    uint32_t index;
+    double cpu;
+    double start;
+
+    cpu = host_rtos_cpu_seconds(serial_task_handle);
+    start = host_test_seconds();
+
+    for (index = 0; index < FULL_REPORTS; index++)
+    {
+        task_test_send("?", 1);
+
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false || response[0] != '<' ||
+            strstr(response, "|WCO:") == NULL || strstr(response, "|Ln:") == NULL)
+        {
+            host_test_fail("report %u: \"%s\"", index + 1, response);
+            return;
+        }
+
+        if (index == 0)
+            printf("  %s\n", response);
+
+        bytes += strlen(response) + 2;
+        longest = std::max(longest, (uint32_t)strlen(response) + 2);
+    }
+
+    start = host_test_seconds() - start;
+    cpu = host_rtos_cpu_seconds(serial_task_handle) - cpu;
+
+    printf("  full reports  %5.2f us CPU, %.1f us round trip, %u bytes (up to %u): %5.0f B/s at %u Hz, longest report %5.0f B/s\n",
+           cpu * 1e6 / FULL_REPORTS, start * 1e6 / FULL_REPORTS, (uint32_t)(bytes / FULL_REPORTS), longest,
+           (double)bytes * REPORT_RATE_HZ / FULL_REPORTS, REPORT_RATE_HZ, (double)REPORT_MAX_LENGTH * REPORT_RATE_HZ);
+
+    if (longest > REPORT_MAX_LENGTH)
+        host_test_fail("report of %u bytes, %u the longest", longest, REPORT_MAX_LENGTH);
+}
+
+static void idle_reports(void)
+{
+    STREAM_RESULT result;
+    char response[256];
+    double end;
+
+    memset(&result, 0, sizeof(result));
+
+    if (set_rate(REPORT_RATE_HZ) == false)
+    {
+        host_test_fail("no ok to $R%u", REPORT_RATE_HZ);
+        return;
+    }
+
+    result.CpuSeconds = host_rtos_cpu_seconds(serial_task_handle);
+    result.Seconds = host_test_seconds();
+    end = result.Seconds + IDLE_SECONDS;
+
+    while (host_test_seconds() < end)
+    {
+        if (task_test_read_line(response, sizeof(response), pdMS_TO_TICKS(100)) != false)
+            count_line(response, result);
+    }
+
+    result.Seconds = host_test_seconds() - result.Seconds;
+    result.CpuSeconds = host_rtos_cpu_seconds(serial_task_handle) - result.CpuSeconds;
+
+    set_rate(0);
+
+    printf("  idle, $R%u    %5.1f reports/s, %5.0f B/s, serial task %.2f ms CPU/s\n", REPORT_RATE_HZ,
+           result.Reports / result.Seconds, result.ReportBytes / result.Seconds, result.CpuSeconds * 1e3 / result.Seconds);
+
+    if (result.Reports < (uint32_t)(REPORT_RATE_HZ * IDLE_SECONDS / 2))
+        host_test_fail("%u reports in %.1f s at %u Hz", result.Reports, result.Seconds, REPORT_RATE_HZ);
+}
+
+// Counting sender, the reports that come between the responses are counted apart
+static void stream_lines(const std::vector<std::string> & lines, uint32_t capacity, STREAM_RESULT & result)
+{
+    std::deque<uint32_t> in_flight;
+    char response[256];
+    uint32_t in_flight_bytes = 0;
+    size_t next = 0;
+    size_t answered = 0;
+
+    memset(&result, 0, sizeof(result));
+
+    result.CpuSeconds = host_rtos_cpu_seconds(serial_task_handle);
+    result.Seconds = host_test_seconds();
+
+    while (answered < lines.size())
+    {
+        if (next < lines.size() && (in_flight.empty() != false || (in_flight_bytes + lines[next].size()) <= capacity))
+        {
+            task_test_send(lines[next].data(), (uint32_t)lines[next].size());
+
+            in_flight.push_back((uint32_t)lines[next].size());
+            in_flight_bytes += (uint32_t)lines[next].size();
+            next++;
+            continue;
+        }
+
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+        {
+            host_test_fail("no response to line %u", (uint32_t)answered + 1);
+            return;
+        }
+
+        count_line(response, result);
+
+        if (response[0] == '<')
+            continue;
+
+        in_flight_bytes -= in_flight.front();
+        in_flight.pop_front();
+        answered++;
+    }
+
+    result.Seconds = host_test_seconds() - result.Seconds;
+    result.CpuSeconds = host_rtos_cpu_seconds(serial_task_handle) - result.CpuSeconds;
+}
+
+static void print_stream(const char* name, const STREAM_RESULT & result, uint32_t lines)
+{
+    printf("  %-13s %5.1f reports/s, %5.0f B/s of reports (%4.1f%% of the bytes sent), %6.0f lines/s, serial task %.0f ms CPU/s\n",
+           name, result.Reports / result.Seconds, result.ReportBytes / result.Seconds,
+           100.0 * result.ReportBytes / (result.ReportBytes + result.OtherBytes), lines / result.Seconds,
+           result.CpuSeconds * 1e3 / result.Seconds);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    STREAM_RESULT without;
+    STREAM_RESULT with;
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    char response[64];
+    uint32_t seed = 0x5EED0035;
+    uint32_t capacity;
+    char* src;
+    char* dst;
+
+    // Real-time bytes left out, '$' lines are commands of the serial task
+    while (lines.size() < STREAM_LINES)
+    {
+        corpus_cam_line(seed, line);
+
+        for (src = dst = line; *src != '\0'; src++)
+        {
+            if (*src != '?' && *src != '!' && *src != '~' && *src != '$')
+                *dst++ = *src;
+        }
+
+        *dst = '\0';
+        lines.push_back(std::string(line) + "\n");
+    }
+
+    task_test_start(0);
+
+    if (task_test_open() == false || (capacity = task_test_rx_capacity()) == 0)
+    {
+        host_test_fail("no greeting or $I report");
+        task_test_exit(host_test_result("bench_status_report"));
+    }
+
+    if (task_test_command("G10 L2 P1 X-1234567.891 Y-1987654.321 Z-2034567.125", response, sizeof(response)) == false ||
+        strcmp(response, "ok") != 0 || task_test_command("G54", response, sizeof(response)) == false)
+    {
+        host_test_fail("work offsets not set");
+        task_test_exit(host_test_result("bench_status_report"));
+    }
+
+    printf("bench_status_report: %u Hz, %u lines streamed\n", REPORT_RATE_HZ, (uint32_t)lines.size());
+
+    full_reports();
+    idle_reports();
+
+    stream_lines(lines, capacity, without);
+
+    if (set_rate(REPORT_RATE_HZ) == false)
+        host_test_fail("no ok to $R%u", REPORT_RATE_HZ);
+
+    stream_lines(lines, capacity, with);
+    set_rate(0);
+
+    print_stream("stream", without, (uint32_t)lines.size());
+    print_stream("stream, $R50", with, (uint32_t)lines.size());
+
+    task_test_exit((host_test_failures() != 0) ? host_test_result("bench_status_report") : 0);
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bench_toolpath - G-code lines against precompiled toolpath records
+//
+// Runs the same generated CAM lines (gcode_corpus.cpp) as text, through
+// GCodeParser::ParseLine, and as records of the compiled toolpath, decoded by
+// BinaryToolpath::ReadRecord and run through MachineCore::ExecuteToolpathRecord.
+// Both in check mode, so the moves are planned as well, the work the parsing
+// task does per line on the controller. Also reports the compile speed and the
+// size of the toolpath against the text. Arcs stay whole in the toolpath (ARC
+// records), both runs cut them into the same lines. Soft limits are off, the
+// compiler doesn't check them. Files given on the command line are used
+// instead of the generated lines (G10, G28 and M0 can't be compiled).
+//
+//  bench_toolpath [file...]
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include "host_test.h"
+#include "gcode_corpus.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+#include "BinaryToolpath.h"
+#include "settings_manager.h"
+
+#define GENERATED_LINES     500000
+#define BENCH_ROUNDS        3           // Best of
+
+extern MachineCore* machine;
+
+static void append_output(const uint8_t* data, uint32_t size, void* context)
+{
+    std::vector<uint8_t>* output = (std::vector<uint8_t>*)context;
+
+    output->insert(output->end(), data, data + size);
+}
+
+static double compile_lines(const std::vector<std::string> & lines, std::vector<uint8_t> & output)
+{
+    BinaryToolpath writer;
+    double start, best = 0;
+    size_t index;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        host_test_start_machine();
+        Settings_Manager::DisableSoftLimits();
+        machine->SetCheckMode(false);
+
+        output.clear();
+        writer.AssociateOutput(append_output, &output);
+        writer.WriteHeader();
+        machine->AssociateToolpathWriter(&writer);
+
+        start = host_test_seconds();
+
+        for (index = 0; index < lines.size(); index++)
+            machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, lines[index].c_str());
+
+        start = host_test_seconds() - start;
+
+        machine->AssociateToolpathWriter(NULL);
+        writer.WriteEnd();
+
+        if (round == 0 || start < best)
+            best = start;
+    }
+
+    return lines.size() / best;
+}
+
+static double run_lines(const std::vector<std::string> & lines)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    double start, best = 0;
+    size_t index;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        host_test_start_machine();
+        Settings_Manager::DisableSoftLimits();
+
+        start = host_test_seconds();
+
+        for (index = 0; index < lines.size(); index++)
+        {
+            // The parsing task gets the line in its own buffer
+            strncpy(line, lines[index].c_str(), GCODE_MAX_LINE_LENGTH);
+            line[GCODE_MAX_LINE_LENGTH] = '\0';
+
+            machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+
+        start = host_test_seconds() - start;
+
+        if (round == 0 || start < best)
+            best = start;
+    }
+
+    return lines.size() / best;
+}
+
+// Records per second, count gets the records
+static double run_records(const std::vector<uint8_t> & toolpath, uint32_t & count)
+{
+    BinaryToolpath reader;
+    TOOLPATH_RECORD record;
+    uint32_t position, used;
+    double start, best = 0;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        host_test_start_machine();
+        Settings_Manager::DisableSoftLimits();
+
+        count = 0;
+        start = host_test_seconds();
+
+        reader.ReadHeader(&toolpath[0], toolpath.size(), used);
+
+        for (position = used; position < toolpath.size(); position += used)
+        {
+            if (reader.ReadRecord(&toolpath[position], toolpath.size() - position, record, used) != GCODE_OK || used == 0)
+                break;
+
+            machine->ExecuteToolpathRecord(GCODE_SOURCE_SD_STORAGE, record);
+            count++;
+        }
+
+        start = host_test_seconds() - start;
+
+        if (round == 0 || start < best)
+            best = start;
+    }
+
+    return count / best;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    std::vector<uint8_t> toolpath;
+    char line[GCODE_MAX_LINE_LENGTH + 2];
+    uint32_t seed = 0x2028;
+    uint32_t records;
+    uint64_t text_bytes = 0;
+    size_t length, index;
+    double compiled, parsed, replayed;
+    int arg;
+    FILE* file;
+
+    for (arg = 1; arg < argc; arg++)
+    {
+        if ((file = fopen(argv[arg], "r")) == NULL)
+        {
+            fprintf(stderr, "bench_toolpath: can't read %s\n", argv[arg]);
+            return 2;
+        }
+
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            length = strlen(line);
+
+            while (length != 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                line[--length] = '\0';
+
+            lines.push_back(line);
+        }
+
+        fclose(file);
+    }
+
+    while (argc == 1 && lines.size() < GENERATED_LINES)
+    {
+        corpus_cam_line(seed, line);
+
+        if (strstr(line, "G10") == NULL && strstr(line, "G28") == NULL && strstr(line, "M0") == NULL)
+            lines.push_back(line);
+    }
+
+    for (index = 0; index < lines.size(); index++)
+        text_bytes += lines[index].size() + 1;
+
+    compiled = compile_lines(lines, toolpath);
+    parsed = run_lines(lines);
+    replayed = run_records(toolpath, records);
+
+    printf("%u lines (%llu bytes) -> %u records (%u bytes, %.0f%%), best of %d\n", (uint32_t)lines.size(),
+        (unsigned long long)text_bytes, records, (uint32_t)toolpath.size(), 100.0 * toolpath.size() / text_bytes, BENCH_ROUNDS);
+
+    printf("compile     %9.0f lines/s\n", compiled);
+
+    // Per line of the program, lines without motion or machine commands make no record
+    printf("check mode  text %9.0f lines/s, toolpath %9.0f lines/s (%9.0f records/s), x%.2f\n",
+        parsed, replayed * lines.size() / records, replayed, (replayed * lines.size() / records) / parsed);
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include "frame_sender.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+FrameSender::FrameSender()
+{
+    m_output = NULL;
+    m_output_context = NULL;
+    m_deliver = NULL;
+    m_deliver_context = NULL;
+
+    Reset(FRAME_MAX_WINDOW);
+}
+
+void FrameSender::Reset(uint32_t window)
+{
+    if (window == 0 || window > FRAME_MAX_WINDOW)
+        window = FRAME_MAX_WINDOW;
+
+    m_window = window;
+    m_next_seq = 0;
+    m_acked_seq = 0;
+    m_held_mask = 0;
+    m_rx_count = 0;
+
+    memset(m_resent, 0, sizeof(m_resent));
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+// Same as the STM32 CRC unit: CRC-32 0x04C11DB7, init 0xFFFFFFFF, MSB first over little endian
+// words, no reflection, no final xor
+uint32_t FrameSender::CalculateCRC(const uint8_t* data, uint32_t words)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t bit;
+
+    for ( ; words != 0; words--, data += 4)
+    {
+        crc ^= (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+
+        for (bit = 0; bit < 32; bit++)
+            crc = ((crc & 0x80000000) != 0) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+    }
+
+    return crc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t FrameSender::build_frame(uint8_t* frame, uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length)
+{
+    uint32_t padded = (length + 3) & ~3;
+    uint32_t crc;
+
+    frame[0] = FRAME_SOF;
+    frame[1] = type;
+    frame[2] = (uint8_t)(seq);
+    frame[3] = (uint8_t)(seq >> 8);
+    frame[4] = (uint8_t)(length);
+    frame[5] = (uint8_t)(length >> 8);
+    frame[6] = 0;
+    frame[7] = 0;
+
+    memcpy(&frame[FRAME_HEADER_SIZE], payload, length);
+    memset(&frame[FRAME_HEADER_SIZE + length], 0, padded - length);
+
+    crc = CalculateCRC(frame, (FRAME_HEADER_SIZE + padded) / 4);
+
+    frame[FRAME_HEADER_SIZE + padded + 0] = (uint8_t)(crc);
+    frame[FRAME_HEADER_SIZE + padded + 1] = (uint8_t)(crc >> 8);
+    frame[FRAME_HEADER_SIZE + padded + 2] = (uint8_t)(crc >> 16);
+    frame[FRAME_HEADER_SIZE + padded + 3] = (uint8_t)(crc >> 24);
+
+    return FRAME_HEADER_SIZE + padded + FRAME_CRC_SIZE;
+}
+
+uint16_t FrameSender::SendLine(const char* text, uint32_t length)
+{
+    uint16_t seq = m_next_seq++;
+    uint32_t slot = seq & (FRAME_MAX_WINDOW - 1);
+
+    if (length > FRAME_MAX_PAYLOAD)
+        length = FRAME_MAX_PAYLOAD;
+
+    m_frame_size[slot] = (uint16_t)build_frame(m_frames[slot], FRAME_TYPE_DATA, seq, (const uint8_t*)text, length);
+    m_resent[slot] = false;
+
+    m_stats.FramesSent++;
+
+    if (m_output != NULL)
+        m_output(m_frames[slot], m_frame_size[slot], m_output_context);
+
+    return seq;
+}
+
+// Control frames are not sequenced and not acknowledged
+void FrameSender::send_control(uint8_t type, const uint8_t* payload, uint32_t length)
+{
+    uint8_t frame[FRAME_HEADER_SIZE + 4 + FRAME_CRC_SIZE];
+    uint32_t size;
+
+    size = build_frame(frame, type, 0, payload, length);
+
+    if (m_output != NULL)
+        m_output(frame, size, m_output_context);
+}
+
+void FrameSender::SendRealtime(uint8_t command)
+{
+    send_control(FRAME_TYPE_REALTIME, &command, 1);
+}
+
+void FrameSender::SendExit()
+{
+    send_control(FRAME_TYPE_EXIT, (const uint8_t*)"", 0);
+}
+
+void FrameSender::resend(uint16_t seq)
+{
+    uint32_t slot = seq & (FRAME_MAX_WINDOW - 1);
+
+    m_resent[slot] = true;
+    m_stats.FramesResent++;
+
+    if (m_output != NULL)
+        m_output(m_frames[slot], m_frame_size[slot], m_output_context);
+}
+
+void FrameSender::Timeout()
+{
+    uint16_t seq;
+
+    if (GetUnacked() == 0)
+        return;
+
+    m_stats.Timeouts++;
+
+    for (seq = m_acked_seq; seq != m_next_seq; seq++)
+    {
+        if (seq == m_acked_seq || (m_held_mask & (1 << (uint16_t)(seq - m_acked_seq - 1))) == 0)
+            resend(seq);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void FrameSender::accept_ack(uint16_t next, uint32_t mask)
+{
+    uint16_t seq;
+    uint32_t last;
+
+    // A stale ACK, or one for frames never sent
+    if ((uint16_t)(next - m_acked_seq) > GetUnacked())
+        return;
+
+    m_acked_seq = next;
+    m_held_mask = mask;
+
+    if (mask == 0)
+        return;
+
+    // Frames before the last held one that are not held were lost on the way
+    for (last = 0; (mask >> (last + 1)) != 0; last++)
+        ;
+
+    for (seq = next; seq != (uint16_t)(next + 1 + last); seq++)
+    {
+        if (seq != next && (mask & (1 << (uint16_t)(seq - next - 1))) != 0)
+            continue;
+
+        if (m_resent[seq & (FRAME_MAX_WINDOW - 1)] == false)
+            resend(seq);
+    }
+}
+
+void FrameSender::accept_frame()
+{
+    const uint8_t* payload = &m_rx_frame[FRAME_HEADER_SIZE];
+    uint8_t type = m_rx_frame[1];
+    uint16_t seq = (uint16_t)(m_rx_frame[2] | (m_rx_frame[3] << 8));
+    uint32_t length = (uint32_t)m_rx_frame[4] | ((uint32_t)m_rx_frame[5] << 8);
+
+    if (type == FRAME_TYPE_ACK)
+    {
+        if (length >= 4)
+            accept_ack((uint16_t)(payload[0] | (payload[1] << 8)), (uint32_t)payload[2] | ((uint32_t)payload[3] << 8));
+
+        return;
+    }
+
+    if (m_deliver != NULL)
+        m_deliver(type, seq, payload, length, m_deliver_context);
+}
+
+// Drops the first byte of the frame being received and looks for the next SOF in what is left
+void FrameSender::resync()
+{
+    const uint8_t* sof = NULL;
+
+    if (m_rx_count > 1)
+        sof = (const uint8_t*)memchr(&m_rx_frame[1], FRAME_SOF, m_rx_count - 1);
+
+    if (sof == NULL)
+    {
+        m_rx_count = 0;
+        return;
+    }
+
+    m_rx_count -= (uint32_t)(sof - m_rx_frame);
+    memmove(m_rx_frame, sof, m_rx_count);
+}
+
+void FrameSender::Feed(const uint8_t* data, uint32_t size)
+{
+    uint32_t needed;
+    uint32_t count;
+    uint32_t crc;
+
+    while (size != 0 || m_rx_count >= FRAME_HEADER_SIZE)
+    {
+        if (m_rx_count == 0)
+        {
+            // Text responses and noise up to the start of a frame
+            const uint8_t* sof = (const uint8_t*)memchr(data, FRAME_SOF, size);
+
+            if (sof == NULL)
+                return;
+
+            size -= (uint32_t)(sof - data);
+            data = sof;
+        }
+
+        needed = FRAME_HEADER_SIZE;
+
+        if (m_rx_count >= FRAME_HEADER_SIZE)
+        {
+            uint32_t length = (uint32_t)m_rx_frame[4] | ((uint32_t)m_rx_frame[5] << 8);
+
+            if (length > FRAME_MAX_PAYLOAD || m_rx_frame[6] != 0 || m_rx_frame[7] != 0)
+            {
+                resync();
+                continue;
+            }
+
+            needed = FRAME_HEADER_SIZE + ((length + 3) & ~3) + FRAME_CRC_SIZE;
+        }
+
+        if (m_rx_count < needed)
+        {
+            if (size == 0)
+                return;
+
+            count = needed - m_rx_count;
+
+            if (count > size)
+                count = size;
+
+            memcpy(&m_rx_frame[m_rx_count], data, count);
+
+            m_rx_count += count;
+            data += count;
+            size -= count;
+            continue;
+        }
+
+        crc = (uint32_t)m_rx_frame[needed - 4] | ((uint32_t)m_rx_frame[needed - 3] << 8) |
+              ((uint32_t)m_rx_frame[needed - 2] << 16) | ((uint32_t)m_rx_frame[needed - 1] << 24);
+
+        if (CalculateCRC(m_rx_frame, (needed - FRAME_CRC_SIZE) / 4) != crc)
+        {
+            m_stats.CrcErrors++;
+
+            resync();
+            continue;
+        }
+
+        accept_frame();
+        m_rx_count = 0;
+    }
+}
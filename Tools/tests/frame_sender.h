@@ -0,0 +1,94 @@
+#ifndef FRAME_SENDER_H
+#define FRAME_SENDER_H
+
+#include <stdint.h>
+
+#include "BinaryFraming.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reference sender of the binary framed transport (BinaryFraming.h), the host
+// end of the $B mode. No firmware code and no hardware CRC: it builds and
+// checks frames on its own, so it also checks the format against the device.
+//
+// DATA frames are numbered from 0 after the $B reply. Up to the window of the
+// reply stay unacknowledged. An ACK releases the frames before its next
+// expected seq. Its mask tells which later frames the device holds, the ones
+// before the last held frame that are not held were lost and are sent again,
+// once. A frame lost with nothing sent behind it, or lost again, leaves the
+// device nothing to ACK: the host calls Timeout() when no frame came for a
+// while and everything not acknowledged or held goes again.
+//
+// RESULT and TELEMETRY frames go to the delivery function, bytes outside
+// frames (text responses) are skipped.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct FRAME_SENDER_STATS
+{
+    uint32_t    FramesSent;         // DATA frames, first time
+    uint32_t    FramesResent;
+    uint32_t    Timeouts;
+    uint32_t    CrcErrors;          // Device frames
+
+}FRAME_SENDER_STATS;
+
+class FrameSender
+{
+public:
+    FrameSender();
+
+    // window from the [BIN:<window>,<max payload>] reply
+    void Reset(uint32_t window);
+
+    void AssociateOutput(FRAME_OUTPUT_FUNC output, void* context) { m_output = output; m_output_context = context; }
+    void AssociateDelivery(FRAME_DELIVER_FUNC deliver, void* context) { m_deliver = deliver; m_deliver_context = context; }
+
+    inline bool CanSend() { return (uint16_t)(m_next_seq - m_acked_seq) < m_window; }
+    inline uint32_t GetUnacked() { return (uint16_t)(m_next_seq - m_acked_seq); }
+    inline const FRAME_SENDER_STATS& GetStats() { return m_stats; }
+
+    // One G-code line, without the end of line. Returns its seq, the one of its RESULT frame.
+    // Only when CanSend()
+    uint16_t SendLine(const char* text, uint32_t length);
+
+    void SendRealtime(uint8_t command);
+    void SendExit();
+
+    // Bytes from the device
+    void Feed(const uint8_t* data, uint32_t size);
+
+    // Nothing came from the device for a while
+    void Timeout();
+
+    static uint32_t CalculateCRC(const uint8_t* data, uint32_t words);
+
+protected:
+    uint8_t             m_frames[FRAME_MAX_WINDOW][FRAME_MAX_SIZE];     // Unacknowledged, by seq
+    uint16_t            m_frame_size[FRAME_MAX_WINDOW];
+    bool                m_resent[FRAME_MAX_WINDOW];
+
+    uint16_t            m_next_seq;
+    uint16_t            m_acked_seq;
+    uint32_t            m_held_mask;        // Of the last ACK
+    uint32_t            m_window;
+
+    uint8_t             m_rx_frame[FRAME_MAX_SIZE];
+    uint32_t            m_rx_count;
+
+    FRAME_SENDER_STATS  m_stats;
+
+    FRAME_OUTPUT_FUNC   m_output;
+    void*               m_output_context;
+    FRAME_DELIVER_FUNC  m_deliver;
+    void*               m_deliver_context;
+
+    uint32_t    build_frame(uint8_t* frame, uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length);
+    void        send_control(uint8_t type, const uint8_t* payload, uint32_t length);
+    void        resend(uint16_t seq);
+    void        accept_ack(uint16_t next, uint32_t mask);
+    void        accept_frame();
+    void        resync();
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gcode_corpus.h"
+#include "host_test.h"
+
+#define CORPUS_LINE_LIMIT   200     // Room for the fuzzing below GCODE_MAX_LINE_LENGTH
+
+static const char* const ModalWords[] =
+{
+    "G90", "G91", "G20", "G21", "G17", "G18", "G19", "G54", "G55", "G56", "G94", "G93",
+    "M3 S12000", "M4 S800", "M5", "M7", "M8", "M9", "G4 P0.5", "G92 X0 Y0", "G92.1",
+    "G10 L2 P1 X-10 Y-20", "G10 L20 P2 Z0", "G28", "G80", "G81 R2 Z-1", "G83 R2 Z-3 Q1",
+    "T2 M6", "M0", "M1", "F600", "S10000",
+};
+
+static const char* const Comments[] =
+{
+    "(Roughing)", "(T1 D=6.0 CR=0. - ZMIN=-5. - FLAT END MILL)", "( pass 2 of 4 )", "()",
+};
+
+static const char Stray[] = "#%*@!&$=<>?;:,[]{}\"'~`^_|\\";
+
+static uint32_t pick(uint32_t & seed, uint32_t count)
+{
+    return host_test_random(seed) % count;
+}
+
+// Value with 0 to 4 decimals in the way CAM writes them (no trailing zeros, .5, -0.25)
+static int put_number(uint32_t & seed, char* out, int32_t range)
+{
+    int32_t value = (int32_t)pick(seed, (uint32_t)range * 2 * 10000) - range * 10000;
+    int length;
+    
+    switch (pick(seed, 4))
+    {
+        case 0:     length = sprintf(out, "%d", value / 10000); break;
+        case 1:     length = sprintf(out, "%.1f", value / 10000.0); break;
+        case 2:     length = sprintf(out, "%.3f", value / 10000.0); break;
+        default:    length = sprintf(out, "%.4f", value / 10000.0); break;
+    }
+    
+    // Leading zeros left out now and then (.5, -.25)
+    if (pick(seed, 8) == 0 && length > 2 && out[0] == '0' && out[1] == '.')
+    {
+        memmove(out, out + 1, length);
+        length--;
+    }
+    
+    return length;
+}
+
+void corpus_cam_line(uint32_t & seed, char* line)
+{
+    static const char Axes[] = "XYZ";
+    char* out = line;
+    uint32_t kind = pick(seed, 20);
+    uint32_t axis;
+    
+    if (pick(seed, 4) == 0)
+        out += sprintf(out, "N%u ", pick(seed, 100000));
+    
+    if (kind < 2)
+    {
+        out += sprintf(out, "%s", ModalWords[pick(seed, sizeof(ModalWords) / sizeof(ModalWords[0]))]);
+    }
+    else if (kind < 3)
+    {
+        out += sprintf(out, "%s", Comments[pick(seed, sizeof(Comments) / sizeof(Comments[0]))]);
+    }
+    else
+    {
+        // Moves, arcs a few times in twenty
+        if (kind < 6)
+            out += sprintf(out, "G%u", 2 + pick(seed, 2));
+        else
+            out += sprintf(out, "G%u", pick(seed, 2));
+        
+        for (axis = 0; axis < 3; axis++)
+        {
+            if (pick(seed, 3) != 0)
+            {
+                out += sprintf(out, " %c", Axes[axis]);
+                out += put_number(seed, out, 100);
+            }
+        }
+        
+        if (kind < 5)
+        {
+            out += sprintf(out, " I");
+            out += put_number(seed, out, 20);
+            out += sprintf(out, " J");
+            out += put_number(seed, out, 20);
+        }
+        else if (kind < 6)
+        {
+            out += sprintf(out, " R");
+            out += put_number(seed, out, 50);
+        }
+        
+        if (pick(seed, 4) == 0)
+            out += sprintf(out, " F%u", 100 + pick(seed, 3000));
+        
+        if (pick(seed, 10) == 0)
+            out += sprintf(out, " %s", Comments[pick(seed, sizeof(Comments) / sizeof(Comments[0]))]);
+    }
+    
+    *out = '\0';
+}
+
+void corpus_fuzz_line(uint32_t & seed, char* line)
+{
+    char mangled[CORPUS_LINE_LIMIT + 64];
+    uint32_t length, position, edits;
+    
+    corpus_cam_line(seed, line);
+    
+    for (edits = 1 + pick(seed, 4); edits != 0; edits--)
+    {
+        length = (uint32_t)strlen(line);
+        
+        if (length >= CORPUS_LINE_LIMIT)
+            break;
+        
+        position = pick(seed, length + 1);
+        strcpy(mangled, line);
+        
+        switch (pick(seed, 10))
+        {
+            case 0:     // Blanks anywhere (inside numbers too)
+                sprintf(line + position, "%c%s", " \t\v\f\r"[pick(seed, 5)], mangled + position);
+                break;
+            case 1:     // Comment anywhere
+                sprintf(line + position, "(x%u)%s", pick(seed, 10), mangled + position);
+                break;
+            case 2:     // Malformed comment
+                sprintf(line + position, "%s%s", (pick(seed, 3) == 0) ? "((n))" : ((pick(seed, 2) == 0) ? "(" : ")"), mangled + position);
+                break;
+            case 3:     // Stray character
+                sprintf(line + position, "%c%s", Stray[pick(seed, sizeof(Stray) - 1)], mangled + position);
+                break;
+            case 4:     // Lower case
+                for ( ; line[position] != '\0'; position++)
+                {
+                    if (line[position] >= 'A' && line[position] <= 'Z')
+                        line[position] += 'a' - 'A';
+                }
+                break;
+            case 5:     // Character dropped
+                if (length != 0)
+                    strcpy(line + position - ((position == length) ? 1 : 0), mangled + position + ((position == length) ? 0 : 1));
+                break;
+            case 6:     // Block delete
+                sprintf(line, "/%s", mangled);
+                break;
+            case 7:     // Repeated word or extra sign, dot or letter
+                sprintf(line + position, "%s%s", (pick(seed, 2) == 0) ? " X1" : ((pick(seed, 2) == 0) ? "-" : "."), mangled + position);
+                break;
+            default:    // Another word
+                sprintf(line + position, " %c%u%s", 'A' + pick(seed, 26), pick(seed, 120), mangled + position);
+                break;
+        }
+    }
+}
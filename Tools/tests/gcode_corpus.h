@@ -0,0 +1,22 @@
+#ifndef GCODE_CORPUS_H
+#define GCODE_CORPUS_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Generated G-code for the parser tests and benchmarks. Lines are shorter than
+// GCODE_MAX_LINE_LENGTH and the same seed gives the same lines
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// A line as CAM post processors write them: mostly G0/G1/G2/G3 moves with a
+// few decimals, some modal codes, comments and line numbers
+void corpus_cam_line(uint32_t & seed, char* line);
+
+// A CAM line mangled the ways hand written and broken files are: mixed case,
+// blanks and comments inside words and numbers, malformed comments, stray
+// characters, block delete, missing or repeated values
+void corpus_fuzz_line(uint32_t & seed, char* line);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "host_test.h"
+#include "MachineCore.h"
+#include "settings_manager.h"
+
+extern MachineCore* machine;
+
+static uint32_t failures = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void host_test_fail(const char* format, ...)
+{
+    va_list args;
+    
+    // The first ones are enough to see what went wrong
+    if (failures < 20)
+    {
+        va_start(args, format);
+        printf("  FAIL: ");
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+    }
+    
+    failures++;
+}
+
+uint32_t host_test_failures(void)
+{
+    return failures;
+}
+
+int host_test_result(const char* name)
+{
+    if (failures != 0)
+    {
+        printf("%s: %u failed checks\n", name, failures);
+        return 1;
+    }
+    
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+void host_test_start_machine(void)
+{
+    Settings_Manager::Initialize();
+    Settings_Manager::ResetToDefaults();
+    
+    // Not deleted: the firmware never destroys its objects and some have no destructors
+    machine = new MachineCore();
+    machine->Initialize();
+    machine->SetCheckMode(true);
+}
+
+double host_test_seconds(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+uint32_t host_test_random(uint32_t & seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    
+    return seed;
+}
@@ -0,0 +1,31 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Helpers shared by the host tests and benchmarks of Tools/tests
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Reports a failed check, printf style, and counts it
+void host_test_fail(const char* format, ...);
+
+// Failed checks so far
+uint32_t host_test_failures(void);
+
+// Prints the outcome of the test, returns its exit status (0 if nothing failed)
+int host_test_result(const char* name);
+
+// Fresh machine (host_machine.cpp) in check mode on default settings, the way
+// gcheck starts a file. The previous one, if any, is dropped
+void host_test_start_machine(void);
+
+// Seconds from an arbitrary start, for the benchmarks
+double host_test_seconds(void);
+
+// Repeatable pseudo random numbers (xorshift32), seed must not be 0
+uint32_t host_test_random(uint32_t & seed);
+
+#endif
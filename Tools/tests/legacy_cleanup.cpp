@@ -0,0 +1,54 @@
+#include <ctype.h>
+
+#include "legacy_cleanup.h"
+#include "GCodeParser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// GCodeParser::cleanup_and_lowercase_line() before the single-pass tokenizer,
+// with m_line as the argument. The old ParseLine() ran it first and then read
+// the words of the cleaned line
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int legacy_cleanup_and_lowercase_line(char* line, uint32_t & line_len)
+{
+    char * rd_ptr = line;
+	char * wr_ptr = line;
+	bool inside_comment = false;
+	char ch;
+
+	while ((ch = *rd_ptr++) != '\0')
+	{
+		if (inside_comment != false)
+		{
+			if  (ch == ')')
+				inside_comment = false;
+			else if (ch == '(')
+				return GCODE_ERROR_NESTED_COMMENT;
+
+			continue;
+		}
+		else if (isspace(ch) != 0)
+		    continue;
+		else if (ch >= 'A' && ch <= 'Z')
+		    ch += 0x20; // make lower case
+		else if (ch == '(')
+		{
+			inside_comment = true;
+			continue;
+		}
+		else if (ch == ')')
+			return GCODE_ERROR_UNOPENED_COMMENT;
+
+		*wr_ptr++ = ch;
+	}
+
+	if (inside_comment != false)
+		return GCODE_ERROR_UNCLOSED_COMMENT;
+
+	*wr_ptr = '\0';
+    
+    line_len = (uint32_t)(wr_ptr - line);
+	return GCODE_OK;
+}
@@ -0,0 +1,11 @@
+#ifndef LEGACY_CLEANUP_H
+#define LEGACY_CLEANUP_H
+
+#include <stdint.h>
+
+// The first pass of the two-pass parser GCodeParser::ParseLine replaced: strips
+// blanks and comments and lower cases the line in place. Kept as it was for the
+// parser's differential test and benchmark
+int legacy_cleanup_and_lowercase_line(char* line, uint32_t & line_len);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "task_test.h"
+#include "host_test.h"
+#include "host_usb.h"
+#include "host_sddisk.h"
+
+#include "task_settings.h"
+#include "gcode_parsing_task.h"
+#include "serial_task.h"
+#include "disk_task.h"
+#include "settings_task.h"
+
+extern MachineCore* machine;
+
+static uint8_t  received[1024];
+static uint32_t received_count = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void task_test_start(uint32_t card_sectors)
+{
+    host_test_start_machine();
+    
+    if (card_sectors != 0)
+        host_sddisk_create(card_sectors);
+    
+    // Everything initialized before the first task: the tasks run as soon as they are created
+    // here (the firmware starts the scheduler after), the disk task registers for the results
+    // of the parser once the card is mounted
+    DiskTask_Initialize();
+    GCodeParsingTask_Initialize();
+    
+    xTaskCreate(DiskTask_Entry, "DSKTASK", DISK_TASK_STACK_SIZE, NULL, DISK_TASK_PRIORITY, &disk_task_handle);
+    xTaskCreate(GCodeParsingTask_Entry, "GCODE", GCODE_TASK_STACK_SIZE, (void*)machine, GCODE_TASK_PRIORITY, &gcode_task_handle);
+    xTaskCreate(GCodePlanningTask_Entry, "GPLAN", GCODE_PLAN_TASK_STACK_SIZE, (void*)machine, GCODE_PLAN_TASK_PRIORITY, &gcode_plan_task_handle);
+    xTaskCreate(SerialTask_Entry, "SERIAL", SERIAL_TASK_STACK_SIZE, (void*)machine, SERIAL_TASK_PRIORITY, &serial_task_handle);
+    xTaskCreate(SettingsTask_Entry, "SETTASK", SETTINGS_TASK_STACK_SIZE, NULL, SETTINGS_TASK_PRIORITY, &settings_task_handle);
+}
+
+bool task_test_open(void)
+{
+    char text[64];
+    
+    host_usb_connect(true);
+    
+    // Empty line first
+    while (task_test_read_line(text, sizeof(text), TASK_TEST_WAIT) != false)
+    {
+        if (strncmp(text, "Grbl ", 5) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+bool task_test_send(const void* data, uint32_t size)
+{
+    return (host_usb_send(data, size, TASK_TEST_WAIT) == size);
+}
+
+uint32_t task_test_receive(void* data, uint32_t size, TickType_t wait)
+{
+    if (received_count == 0)
+        return host_usb_receive(data, size, wait);
+    
+    if (size > received_count)
+        size = received_count;
+    
+    memcpy(data, received, size);
+    memmove(received, &received[size], received_count - size);
+    received_count -= size;
+    
+    return size;
+}
+
+bool task_test_read_line(char* text, uint32_t size, TickType_t wait)
+{
+    uint8_t* eol;
+    uint32_t length;
+    
+    while ((eol = (uint8_t*)memchr(received, '\n', received_count)) == NULL)
+    {
+        if (received_count == sizeof(received))
+            return false;
+        
+        length = host_usb_receive(&received[received_count], sizeof(received) - received_count, wait);
+        
+        if (length == 0)
+            return false;
+        
+        received_count += length;
+    }
+    
+    length = (uint32_t)(eol - received);
+    
+    if (length < size)
+    {
+        memcpy(text, received, length);
+        text[length] = '\0';
+        
+        if (length != 0 && text[length - 1] == '\r')
+            text[length - 1] = '\0';
+    }
+    else
+    {
+        text[0] = '\0';
+    }
+    
+    received_count -= length + 1;
+    memmove(received, eol + 1, received_count);
+    
+    return true;
+}
+
+bool task_test_command(const char* line, char* response, uint32_t size)
+{
+    if (task_test_send(line, strlen(line)) == false || task_test_send("\n", 1) == false)
+        return false;
+    
+    return task_test_read_line(response, size, TASK_TEST_WAIT);
+}
+
+uint32_t task_test_rx_capacity(void)
+{
+    char response[64];
+    const char* options;
+    uint32_t capacity;
+    
+    // [VER:...] [OPT:,<blocks>,<rx bytes>] ok
+    if (task_test_command("$I", response, sizeof(response)) == false || strncmp(response, "[VER:", 5) != 0)
+        return 0;
+    
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false ||
+        (options = strstr(response, "[OPT:")) == NULL || (options = strrchr(options, ',')) == NULL)
+        return 0;
+    
+    capacity = (uint32_t)atoi(options + 1);
+    
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false || strcmp(response, "ok") != 0)
+        return 0;
+    
+    return capacity;
+}
+
+void task_test_exit(int status)
+{
+    fflush(stdout);
+    fflush(stderr);
+    
+    _exit(status);
+}
@@ -0,0 +1,46 @@
+#ifndef TASK_TEST_H
+#define TASK_TEST_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Helpers of the tests that run the firmware tasks (test_task_*). The tasks
+// run on the threads of host_rtos.cpp, the test thread is the USB host of
+// host_usb.cpp
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define TASK_TEST_WAIT      pdMS_TO_TICKS(5000)     // Longest a response may take
+
+// Creates the tasks the way Init_UserTasks_and_Objects does, on a fresh machine
+// in check mode (host_test_start_machine). With card_sectors set the disk task
+// finds a formatted SD card of that size. The port is left closed
+void task_test_start(uint32_t card_sectors);
+
+// Opens the port, true once the greeting came
+bool task_test_open(void);
+
+// Sends the bytes, true if they all went before the wait ran out
+bool task_test_send(const void* data, uint32_t size);
+
+// Takes received bytes (the ones already split into lines first), waits up to
+// wait ticks for the first one. Returns the bytes read
+uint32_t task_test_receive(void* data, uint32_t size, TickType_t wait);
+
+// Next line received, without its \r\n. False if none came in time
+bool task_test_read_line(char* text, uint32_t size, TickType_t wait);
+
+// Sends the line (adds the \n) and returns the next line received
+bool task_test_command(const char* line, char* response, uint32_t size);
+
+// RX capacity of the $I report ([OPT:,<blocks>,<rx bytes>]), the bytes a counting sender
+// keeps in flight. 0 if the report is not the expected one
+uint32_t task_test_rx_capacity(void);
+
+// The task threads never return, the test ends the process
+void task_test_exit(int status);
+
+#endif
@@ -0,0 +1,197 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_check_estimate - job time of check mode ($C) against hand calculation
+//
+// Small programs are planned in check mode with 200 steps/mm, 100 mm/s and
+// 500 mm/s^2 on every axis and a junction deviation of 0.01 mm. The time
+// MachineCore::GetCheckTime_ms gives once check mode ends has to be the one
+// worked out by hand from trapezoid profiles (to 1 ms per block, the ticks of
+// each block are whole), the blocks have to be the ones of the program:
+//
+//  - A single 100 mm line at the max rate
+//  - A 100 mm square at the max rate, the corners at the junction speed of
+//    the junction deviation (v^2 = a * dev * sin(t/2) / (1 - sin(t/2)))
+//  - A zigzag of 2000 lines, reversals stop
+//  - Moves with dwells (G4) between them
+//  - A full circle after a rapid, the length of its chords at the feed. The
+//    count is the parser's, it has to be the one of the max arc error
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include "host_test.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+#include "settings_manager.h"
+
+#define STEPS_PER_MM        200.0f
+#define MAX_RATE            100.0           // mm/s
+#define ACCELERATION        500.0           // mm/s^2
+#define JUNCTION_DEVIATION  0.01
+#define ZIGZAG_LINES        2000
+
+extern MachineCore* machine;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Trapezoid (or triangle) from entry to exit speed, mm and mm/s
+static double move_time(double length, double entry, double cruise, double exit)
+{
+    double accel_length = (cruise * cruise - entry * entry) / (2.0 * ACCELERATION);
+    double decel_length = (cruise * cruise - exit * exit) / (2.0 * ACCELERATION);
+    double peak;
+
+    if ((accel_length + decel_length) > length)
+    {
+        peak = sqrt((2.0 * ACCELERATION * length + entry * entry + exit * exit) / 2.0);
+
+        return (peak - entry) / ACCELERATION + (peak - exit) / ACCELERATION;
+    }
+
+    return (cruise - entry) / ACCELERATION + (cruise - exit) / ACCELERATION +
+           (length - accel_length - decel_length) / cruise;
+}
+
+// Junction speed for a turn between two directions, cos_turn of the angle between them
+static double junction_speed(double cos_turn)
+{
+    double sin_half = sqrt((1.0 + cos_turn) / 2.0);     // Of the angle at the corner
+
+    return sqrt(ACCELERATION * JUNCTION_DEVIATION * sin_half / (1.0 - sin_half));
+}
+
+// Of the chords of a full circle cut into segments
+static double sagitta(double radius, uint32_t segments)
+{
+    return radius * (1.0 - cos(M_PI / segments));
+}
+
+static void start_machine(void)
+{
+    uint32_t axis;
+
+    Settings_Manager::Initialize();
+    Settings_Manager::ResetToDefaults();
+
+    for (axis = COORD_X; axis < COORDINATE_LINEAR_AXES_COUNT; axis++)
+    {
+        Settings_Manager::SetStepsPer_mm_Axis(axis, STEPS_PER_MM);
+        Settings_Manager::SetMaxSpeed_mm_sec_axis(axis, (float)MAX_RATE);
+        Settings_Manager::SetAcceleration_mm_sec2_axis(axis, (float)ACCELERATION);
+    }
+
+    Settings_Manager::SetJunctionDeviation_mm((float)JUNCTION_DEVIATION);
+    Settings_Manager::DisableSoftLimits();
+
+    machine = new MachineCore();
+    machine->Initialize();
+    machine->SetCheckMode(true);
+}
+
+// Plans the lines, returns the estimate in seconds
+static double run_program(const char* name, const std::vector<std::string> & lines, uint32_t & blocks)
+{
+    size_t index;
+    int result;
+
+    start_machine();
+
+    for (index = 0; index < lines.size(); index++)
+    {
+        if ((result = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, lines[index].c_str())) != GCODE_OK)
+            host_test_fail("%s: line %u \"%s\", error %d", name, (uint32_t)index + 1, lines[index].c_str(), result);
+    }
+
+    // Leaving retires the blocks still queued
+    machine->SetCheckMode(false);
+
+    blocks = machine->GetCheckBlocks();
+
+    return machine->GetCheckTime_ms() / 1000.0;
+}
+
+static void check_program(const char* name, const std::vector<std::string> & lines, double expected, uint32_t expected_blocks)
+{
+    uint32_t blocks;
+    double estimate = run_program(name, lines, blocks);
+
+    printf("  %-16s %9.3f s, hand calculated %9.3f s, %4u blocks\n", name, estimate, expected, blocks);
+
+    if (fabs(estimate - expected) > (0.001 * (blocks + 1)))
+        host_test_fail("%s: %.3f s, %.3f s expected", name, estimate, expected);
+
+    if (blocks != expected_blocks)
+        host_test_fail("%s: %u blocks, %u expected", name, blocks, expected_blocks);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    uint32_t index;
+    uint32_t blocks;
+    double corner = junction_speed(0.0);
+    uint32_t segments;
+    double chords;
+    double expected;
+    double estimate;
+
+    printf("test_check_estimate: %.0f steps/mm, %.0f mm/s, %.0f mm/s^2, junction deviation %.2f mm\n",
+           STEPS_PER_MM, MAX_RATE, ACCELERATION, JUNCTION_DEVIATION);
+
+    lines.push_back("G21 G90 G17 G94");
+    lines.push_back("G1 X100 F6000");
+    check_program("single line", lines, move_time(100.0, 0.0, MAX_RATE, 0.0), 1);
+
+    lines.push_back("Y100");
+    lines.push_back("X0");
+    lines.push_back("Y0");
+    check_program("square", lines, 2.0 * move_time(100.0, 0.0, MAX_RATE, corner) + 2.0 * move_time(100.0, corner, MAX_RATE, corner), 4);
+
+    lines.clear();
+    lines.push_back("G21 G90 G17 G94 F3000");
+
+    for (index = 0; index < ZIGZAG_LINES; index++)
+        lines.push_back(((index % 2) == 0) ? "G1 X100" : "G1 X0");
+
+    check_program("zigzag", lines, ZIGZAG_LINES * move_time(100.0, 0.0, 50.0, 0.0), ZIGZAG_LINES);
+
+    lines.clear();
+    lines.push_back("G21 G90 G17 G94");
+    lines.push_back("G1 X50 F6000");
+    lines.push_back("G4 P1.5");
+    lines.push_back("G1 X0");
+    lines.push_back("G4 P0.25");
+    lines.push_back("G1 X5");
+    check_program("dwells", lines, 2.0 * move_time(50.0, 0.0, MAX_RATE, 0.0) + 1.5 + 0.25 + move_time(5.0, 0.0, MAX_RATE, 0.0), 3);
+
+    // Radius 10 at 10 mm/s, 10 mm/s^2 to the center: the chords keep the feed. The rapid to
+    // its start turns 90 degrees into it
+    lines.clear();
+    lines.push_back("G21 G90 G17 G94");
+    lines.push_back("G0 X10");
+    lines.push_back("G2 X10 Y0 I-10 J0 F600");
+
+    estimate = run_program("circle", lines, blocks);
+    segments = blocks - 1;
+    chords = 2.0 * segments * 10.0 * sin(M_PI / segments);
+    expected = move_time(10.0, 0.0, MAX_RATE, corner) + move_time(chords, corner, 10.0, 0.0);
+
+    printf("  %-16s %9.3f s, hand calculated %9.3f s, %4u blocks\n", "circle", estimate, expected, blocks);
+
+    // Chords as long as the max arc error allows, the parser rounds the count down
+    if (segments < 3 || sagitta(10.0, segments + 1) > Settings_Manager::GetMaxArcError_mm() ||
+        sagitta(10.0, segments - 1) <= Settings_Manager::GetMaxArcError_mm())
+        host_test_fail("circle: %u segments for a max arc error of %.3f mm", segments, Settings_Manager::GetMaxArcError_mm());
+
+    if (fabs(estimate - expected) > (0.001 * (blocks + 1)))
+        host_test_fail("circle: %.3f s, %.3f s expected", estimate, expected);
+
+    return host_test_result("test_check_estimate");
+}
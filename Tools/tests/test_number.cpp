@@ -0,0 +1,233 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_number - decimal to float conversion against strtof()
+//
+// DataConverter::StringToFloat2 (the conversion the G-code tokenizer shares)
+// has to give the same float as the C library's strtof(), the nearest one with
+// ties to even, for:
+//
+//  - every value of up to 6 digits with 0 to 6 decimals, the way CAM writes them
+//  - the exact midpoints between floats across the whole range, those plus a
+//    digit (just above) and cut to 9..40 significant digits (just below)
+//  - random numbers of 1 to 130 digits with leading zeros
+//  - a list of known hard cases
+//
+// A sample of the same strings also goes through GCodeParser as X words.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "host_test.h"
+#include "DataConverter.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+
+#define MIDPOINT_FLOAT_STEP     4099        // Floats skipped between midpoints tried
+#define RANDOM_NUMBERS          3000000
+#define PARSER_SAMPLE_EVERY     97          // Strings sent through the parser as well
+
+extern MachineCore* machine;
+
+static const char* const HardCases[] =
+{
+    "1.0000000596046448",                   // Digits past the 9th decide it
+    "1.00000005960464477539062500000001",
+    "1.000000059604644775390625",           // Exact midpoint, ties to even
+    "1.0000001788139343261718750",
+    "0.1", "0.2", "0.3", "123.4567", "9999.9999", "0.0001", "-0", "-0.000",
+    "16777216", "16777217", "16777218", "16777219", "4294967295", "4294967296",
+    "340282346638528859811704183484516925440", "340282356779733661637539395458142568447", 
+    "340282356779733661637539395458142568448", "340282356779733661637539395458142568449",
+    "1000000000000000000000000000000000000000",
+    "0.000000000000000000000000000000000000011754942106924410754870294448492873488270524287458933338571745305715888704756189042655023",
+    "0.0000000000000000000000000000000000000000000014012984643248170709237295832899161312802619418765157717570682838897910826858606014866381883621215820312",
+    "0.000000000000000000000000000000000000000000000700649232162408535461864791644958065640130970938257885878534141944895541342930300743319094181060791015625",
+    "0.000000000000000000000000000000000000000000000700649232162408535461864791644958065640130970938257885878534141944895541342930300743319094181060791015626",
+    "0.0000000000000000000000000000000000000000000007006492321624085354618647916449580656401309709382578858785341419448955413429303007433190941810607910156249999",
+    "0.00000000000000000000000000000000000000000000000000001",
+    "000000000000000000000000000000000000000012.5", ".5", "5.", "0", "0.000",
+    "179769313486231570000000000000000000000000000000000000000000000000000000000",
+    "2.50000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000001",
+};
+
+static uint32_t mismatches = 0;
+
+static uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static void check_number(const char* text, bool parser)
+{
+    char* stop = NULL;
+    uint32_t success = 0;
+    float expected, value;
+    
+    expected = strtof(text, NULL);
+    value = DataConverter::StringToFloat2((char*)text, &stop, &success);
+    
+    if (memcmp(&expected, &value, sizeof(value)) != 0)
+    {
+        host_test_fail("\"%s\": %.9g (0x%08x), strtof %.9g (0x%08x)", text, value, float_bits(value), expected, float_bits(expected));
+        mismatches++;
+    }
+    
+    // Through the tokenizer too, plain coordinates only (no scientific notation, inside the line)
+    if (parser != false && strlen(text) < (GCODE_MAX_LINE_LENGTH - 8) && strchr(text, 'e') == NULL && expected < 1e30f)
+    {
+        char line[GCODE_MAX_LINE_LENGTH];
+        GCodeJobState state;
+        
+        sprintf(line, "G0 X%s", text);
+        
+        if (machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line) != GCODE_OK)
+            host_test_fail("\"%s\": not parsed", line);
+        else
+        {
+            machine->ReadJobState(&state);
+            
+            if (state.machine_pos[0] != expected)
+                host_test_fail("\"%s\": parsed as %.9g, strtof %.9g", line, state.machine_pos[0], expected);
+        }
+    }
+}
+
+// Plain decimal of a double, exact (the C library prints every digit), no trailing zeros
+static void print_exact(double value, char* text)
+{
+    char* end;
+    
+    sprintf(text, "%.160f", value);
+    end = text + strlen(text) - 1;
+    
+    while (*end == '0')
+        *end-- = '\0';
+    
+    if (*end == '.')
+        *end = '\0';
+}
+
+// The midpoint between the float and the next one up, exactly and around it
+static void check_midpoint(uint32_t low_bits, uint32_t & count)
+{
+    static const uint32_t CutDigits[] = { 9, 10, 11, 12, 17, 25, 40 };
+    char text[400], cut[400];
+    float low, high;
+    double midpoint;
+    uint32_t index, digits;
+    char* pos;
+    
+    memcpy(&low, &low_bits, sizeof(low));
+    low_bits++;
+    memcpy(&high, &low_bits, sizeof(high));
+    
+    // Above FLT_MAX, where the next float would be 2^128
+    if (low_bits == 0x7F800000UL)
+        midpoint = (double)low + ldexp(1.0, 103);
+    else
+        midpoint = ((double)low + (double)high) / 2;
+    
+    print_exact(midpoint, text);
+    check_number(text, (count % PARSER_SAMPLE_EVERY) == 0);
+    count++;
+    
+    strcpy(cut, text);
+    strcat(cut, "000001");
+    check_number(cut, false);
+    count++;
+    
+    for (index = 0; index < sizeof(CutDigits) / sizeof(CutDigits[0]); index++)
+    {
+        strcpy(cut, text);
+        
+        // Skip to the first significant digit, then count
+        for (pos = cut; *pos == '0' || *pos == '.'; pos++)
+            ;
+        
+        for (digits = 0; *pos != '\0' && digits < CutDigits[index]; pos++)
+        {
+            if (*pos != '.')
+                digits++;
+        }
+        
+        // Integer digits are zeroed, not dropped
+        for ( ; *pos != '\0' && *pos != '.'; pos++)
+            *pos = '0';
+        
+        *pos = '\0';
+        check_number(cut, false);
+        count++;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    char text[400];
+    uint32_t seed = 0x2027;
+    uint32_t count = 0;
+    uint32_t value, decimals, length, index, dot, zeros;
+    uint64_t bits;
+    
+    host_test_start_machine();
+    machine->SetScanMode(true);
+    
+    for (index = 0; index < sizeof(HardCases) / sizeof(HardCases[0]); index++, count++)
+        check_number(HardCases[index], true);
+    
+    // CAM style values, 0.000001 to 999999
+    for (value = 0; value < 1000000; value++)
+    {
+        for (decimals = 0; decimals <= 6; decimals++, count++)
+        {
+            length = sprintf(text, "%0*u", decimals + 1, value);
+            
+            if (decimals != 0)
+            {
+                memmove(text + length - decimals + 1, text + length - decimals, decimals + 1);
+                text[length - decimals] = '.';
+            }
+            
+            check_number(text, (count % (PARSER_SAMPLE_EVERY * 100)) == 0);
+        }
+    }
+    
+    // Midpoints from zero and the smallest subnormal up to FLT_MAX and infinity
+    for (bits = 0; bits < 0x7F800000ULL; bits += MIDPOINT_FLOAT_STEP)
+        check_midpoint((uint32_t)bits, count);
+    
+    check_midpoint(0x7F7FFFFFUL, count);
+    
+    // Random digit strings
+    for (index = 0; index < RANDOM_NUMBERS; index++, count++)
+    {
+        char* pos = text;
+        
+        length = 1 + host_test_random(seed) % ((index % 10 == 0) ? 130 : 30);
+        zeros = (host_test_random(seed) % 4 == 0) ? host_test_random(seed) % 50 : 0;
+        dot = host_test_random(seed) % (zeros + length + 1);
+        
+        if (host_test_random(seed) % 2 == 0)
+            *pos++ = '-';
+        
+        for (value = 0; value < zeros + length; value++)
+        {
+            if (value == dot)
+                *pos++ = '.';
+            
+            *pos++ = (value < zeros) ? '0' : (char)('0' + host_test_random(seed) % 10);
+        }
+        
+        *pos = '\0';
+        check_number(text, (index % PARSER_SAMPLE_EVERY) == 0);
+    }
+    
+    printf("%u numbers, %u differ from strtof\n", count, mismatches);
+    return host_test_result("test_number");
+}
@@ -0,0 +1,496 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_sddisk - the SD card driver of the target on a card model
+//
+// The STM32F4xx driver itself (portable/STM32F4xx/ff_sddisk.c) on the SPI
+// mode card of host_sdcard.cpp, formatted as cards come. FF_SDDiskInit has to
+// identify the card (its size from the CSD) and mount it, then:
+//
+//  - file: a file is written, read back in pieces of random size into word
+//    aligned and unaligned buffers, part of it rewritten and read again
+//    (the IO manager path, sequential reads through the read-ahead)
+//  - bench: the reads of $FB (run_benchmark in disk_task.cpp) through
+//    FF_BlockRead, each request size into a word aligned and an unaligned
+//    buffer: in order (read ahead, the transfers of the first request and
+//    one multi-block read for the rest) and from the last request down (the
+//    transfers of each, one or one per BOUNCE_SECTORS unaligned)
+//  - raw: unmounted, random sector reads and writes of FF_SDDiskReadSectors
+//    and FF_SDDiskWriteSectors (the USB mass storage path) on the whole card:
+//    sequential runs, jumps, writes on the sectors read ahead and on the one
+//    in flight, unaligned buffers and buffers in the CCM of the heap
+//    (host_ccm_ram, through the bounce buffer), the last sectors of the
+//    card. Raw access is refused while mounted
+//  - slow card: sequential reads of a sector each, BLOCK_TIME for each DMA
+//    transfer and as long a wait in the caller between the reads, against
+//    the same reads in reverse order (no read-ahead, a command each). The
+//    next sector comes while the caller waits, the sequential reads have to
+//    take well under the time of the others
+//
+// Every read has to give the data of a copy of the card kept by the test,
+// the image has to be that copy at the end and the card has to see no
+// protocol error. Prints the commands and blocks of each part.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "host_test.h"
+#include "host_sdcard.h"
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "ff_headers.h"
+#include "ff_sddisk.h"
+
+#define CARD_SECTORS        ((uint32_t)64 * HOST_SDCARD_CSD_SECTORS)
+#define HIDDEN_SECTORS      8
+#define FILE_BYTES          300000
+#define REWRITE_OFFSET      100001
+#define REWRITE_BYTES       20000
+#define RAW_OPERATIONS      20000
+#define RAW_MAX_SECTORS     16
+#define BLOCK_TIME          1000        // us
+#define TIMED_SECTORS       200
+#define TIMED_FIRST         20000
+#define BENCH_SECTORS       512         // DISK_BENCH_BYTES / 512 (disk_task.h)
+#define BOUNCE_SECTORS      4           // sdBOUNCE_SECTORS (ff_sddisk.c)
+
+#define FILE_NAME           "/data.bin"
+
+static uint8_t* shadow;                 // What the card has to hold
+static uint8_t  buffer[(RAW_MAX_SECTORS + 1) * HOST_SDCARD_SECTOR_SIZE] __attribute__((aligned(8)));
+static uint8_t  file_data[FILE_BYTES];
+static uint8_t  file_read[FILE_BYTES + 8];
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int32_t image_read(uint8_t* data, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    uint8_t* image;
+
+    host_sdcard_image(&image);
+    memcpy(data, &image[sector * HOST_SDCARD_SECTOR_SIZE], count * HOST_SDCARD_SECTOR_SIZE);
+
+    return count;
+}
+
+static int32_t image_write(uint8_t* data, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    uint8_t* image;
+
+    host_sdcard_image(&image);
+    memcpy(&image[sector * HOST_SDCARD_SECTOR_SIZE], data, count * HOST_SDCARD_SECTOR_SIZE);
+
+    return count;
+}
+
+// One partition over the whole card, large clusters, written straight to the image
+static void format_card(void)
+{
+    FF_CreationParameters_t parameters;
+    FF_PartitionParameters_t partition;
+    FF_Disk_t disk;
+    FF_Error_t error;
+
+    memset(&disk, 0, sizeof(disk));
+    disk.ulNumberOfSectors = CARD_SECTORS;
+
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.ulMemorySize = 4096;
+    parameters.ulSectorSize = HOST_SDCARD_SECTOR_SIZE;
+    parameters.fnWriteBlocks = image_write;
+    parameters.fnReadBlocks = image_read;
+    parameters.pxDisk = &disk;
+    parameters.xBlockDeviceIsReentrant = pdFALSE;
+    parameters.pvSemaphore = (void*)xSemaphoreCreateRecursiveMutex();
+
+    disk.pxIOManager = FF_CreateIOManger(&parameters, &error);
+    disk.xStatus.bIsInitialised = pdTRUE;
+
+    memset(&partition, 0, sizeof(partition));
+    partition.ulSectorCount = CARD_SECTORS;
+    partition.ulHiddenSectors = HIDDEN_SECTORS;
+    partition.xPrimaryCount = 1;
+    partition.eSizeType = eSizeIsQuota;
+
+    FF_Partition(&disk, &partition);
+    FF_Format(&disk, 0, pdTRUE, pdFALSE);
+    FF_DeleteIOManager(disk.pxIOManager);
+}
+
+static void print_stats(const char* name, const HOST_SDCARD_STATS & start)
+{
+    HOST_SDCARD_STATS stats;
+
+    host_sdcard_get_stats(&stats);
+
+    printf("  %-10s %6u commands, %5u reads (%6u blocks), %5u writes (%6u blocks)\n", name,
+           stats.Commands - start.Commands, stats.ReadCommands - start.ReadCommands, stats.BlocksRead - start.BlocksRead,
+           stats.WriteCommands - start.WriteCommands, stats.BlocksWritten - start.BlocksWritten);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static bool write_file(FF_IOManager_t* manager, uint8_t mode, uint32_t offset, uint32_t length, uint32_t & seed)
+{
+    FF_Error_t error;
+    FF_FILE* file;
+    uint32_t size;
+    uint32_t done;
+
+    if ((file = FF_Open(manager, FILE_NAME, mode, &error)) == NULL || FF_isERR(FF_Seek(file, (int32_t)offset, FF_SEEK_SET)) != pdFALSE)
+    {
+        host_test_fail("%s not opened for writing at %u", FILE_NAME, offset);
+        return false;
+    }
+
+    for (done = 0; done < length; done += size)
+    {
+        size = std::min(1 + host_test_random(seed) % 5000, length - done);
+
+        if (FF_Write(file, 1, size, &file_data[offset + done]) != (int32_t)size)
+        {
+            host_test_fail("%s: write of %u bytes at %u failed", FILE_NAME, size, offset + done);
+            break;
+        }
+    }
+
+    FF_Close(file);
+
+    return (done >= length);
+}
+
+static void read_file(FF_IOManager_t* manager, uint32_t & seed)
+{
+    FF_Error_t error;
+    FF_FILE* file;
+    uint32_t size;
+    uint32_t done;
+    uint32_t offset;
+    uint8_t* data;
+
+    if ((file = FF_Open(manager, FILE_NAME, FF_MODE_READ, &error)) == NULL)
+    {
+        host_test_fail("%s not opened for reading", FILE_NAME);
+        return;
+    }
+
+    for (done = 0; done < FILE_BYTES; done += size)
+    {
+        size = std::min(1 + host_test_random(seed) % 5000, (uint32_t)FILE_BYTES - done);
+        offset = host_test_random(seed) % 4;
+        data = &file_read[offset];
+
+        if (FF_Read(file, 1, size, data) != (int32_t)size || memcmp(data, &file_data[done], size) != 0)
+        {
+            host_test_fail("%s: %u bytes at %u read wrong (buffer offset %u)", FILE_NAME, size, done, offset);
+            break;
+        }
+    }
+
+    FF_Close(file);
+}
+
+static void test_file(FF_Disk_t* disk)
+{
+    HOST_SDCARD_STATS start;
+    uint32_t seed = 0x5EED0043;
+    uint32_t index;
+
+    for (index = 0; index < FILE_BYTES; index++)
+        file_data[index] = (uint8_t)host_test_random(seed);
+
+    host_sdcard_get_stats(&start);
+
+    if (write_file(disk->pxIOManager, FF_MODE_WRITE | FF_MODE_CREATE | FF_MODE_TRUNCATE, 0, FILE_BYTES, seed) == false)
+        return;
+
+    read_file(disk->pxIOManager, seed);
+
+    // Rewritten in the middle, the sectors read before must not come back
+    for (index = REWRITE_OFFSET; index < (REWRITE_OFFSET + REWRITE_BYTES); index++)
+        file_data[index] = (uint8_t)host_test_random(seed);
+
+    if (write_file(disk->pxIOManager, FF_MODE_READ | FF_MODE_WRITE, REWRITE_OFFSET, REWRITE_BYTES, seed) != false)
+        read_file(disk->pxIOManager, seed);
+
+    print_stats("file", start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// As bench_pass of disk_task.cpp, the data checked against the image. Returns the read commands
+static uint32_t bench_pass(FF_Disk_t* disk, uint32_t offset, uint32_t first, uint32_t size, bool ascending)
+{
+    HOST_SDCARD_STATS start;
+    HOST_SDCARD_STATS stats;
+    uint32_t requests = BENCH_SECTORS / size;
+    uint32_t request;
+    uint32_t sector;
+    uint8_t* image;
+
+    host_sdcard_image(&image);
+    host_sdcard_get_stats(&start);
+
+    for (request = 0; request < requests; request++)
+    {
+        sector = first + size * ((ascending != false) ? request : (requests - 1 - request));
+        memset(&buffer[offset], 0xA5, size * HOST_SDCARD_SECTOR_SIZE);
+
+        if (FF_isERR(FF_BlockRead(disk->pxIOManager, sector, size, &buffer[offset], pdFALSE)) != pdFALSE ||
+            memcmp(&buffer[offset], &image[sector * HOST_SDCARD_SECTOR_SIZE], size * HOST_SDCARD_SECTOR_SIZE) != 0)
+        {
+            host_test_fail("bench: %u sectors at %u (buffer offset %u): wrong data", size, sector, offset);
+            break;
+        }
+    }
+
+    host_sdcard_get_stats(&stats);
+
+    return stats.ReadCommands - start.ReadCommands;
+}
+
+static void test_bench(FF_Disk_t* disk)
+{
+    static const uint32_t sizes[] = { 1, 4, 8, 15 };
+    HOST_SDCARD_STATS start;
+    uint32_t ahead;
+    uint32_t direct;
+    uint32_t transfers;                 // Read commands of a request read directly
+    uint32_t size;
+    uint32_t offset;
+
+    host_sdcard_get_stats(&start);
+
+    for (offset = 0; offset < 2; offset++)
+    {
+        for (size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++)
+        {
+            transfers = (offset == 0) ? 1 : ((sizes[size] + BOUNCE_SECTORS - 1) / BOUNCE_SECTORS);
+            ahead = bench_pass(disk, offset, BENCH_SECTORS, sizes[size], true);
+            direct = bench_pass(disk, offset, 0, sizes[size], false);
+
+            if (ahead > (transfers + 1) || direct != (transfers * (BENCH_SECTORS / sizes[size])))
+                host_test_fail("bench: %u sectors, offset %u: %u read commands in order, %u from the end for %u requests",
+                               sizes[size], offset, ahead, direct, BENCH_SECTORS / sizes[size]);
+        }
+    }
+
+    print_stats("bench", start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static bool raw_read(FF_Disk_t* disk, uint32_t sector, uint32_t count, uint8_t* base, uint32_t offset)
+{
+    uint8_t* data = &base[offset];
+
+    memset(data, 0xA5, count * HOST_SDCARD_SECTOR_SIZE);
+
+    if (FF_SDDiskReadSectors(disk, sector, count, data) != 0 ||
+        memcmp(data, &shadow[sector * HOST_SDCARD_SECTOR_SIZE], count * HOST_SDCARD_SECTOR_SIZE) != 0)
+    {
+        host_test_fail("raw read of %u sectors at %u (buffer offset %u): wrong data", count, sector, offset);
+        return false;
+    }
+
+    return true;
+}
+
+static bool raw_write(FF_Disk_t* disk, uint32_t sector, uint32_t count, uint8_t* base, uint32_t offset, uint32_t & seed)
+{
+    uint8_t* data = &base[offset];
+    uint32_t index;
+
+    for (index = 0; index < count * HOST_SDCARD_SECTOR_SIZE; index++)
+        data[index] = (uint8_t)host_test_random(seed);
+
+    if (FF_SDDiskWriteSectors(disk, sector, count, data) != 0)
+    {
+        host_test_fail("raw write of %u sectors at %u (buffer offset %u) failed", count, sector, offset);
+        return false;
+    }
+
+    memcpy(&shadow[sector * HOST_SDCARD_SECTOR_SIZE], data, count * HOST_SDCARD_SECTOR_SIZE);
+
+    return true;
+}
+
+static void test_raw(FF_Disk_t* disk)
+{
+    HOST_SDCARD_STATS start;
+    uint32_t seed = 0x5EED0039;
+    uint32_t position = 0;              // Where the last sequential read ended
+    uint32_t operation;
+    uint32_t choice;
+    uint32_t sector;
+    uint32_t count;
+    uint32_t offset;
+    uint8_t* base;
+    uint8_t* image;
+    bool ok = true;
+
+    if (FF_SDDiskReadSectors(disk, 0, 1, buffer) == 0)
+        host_test_fail("raw read while mounted");
+
+    if (FF_SDDiskUnmount(disk) != pdPASS)
+    {
+        host_test_fail("not unmounted");
+        return;
+    }
+
+    host_sdcard_image(&image);
+    memcpy(shadow, image, (size_t)CARD_SECTORS * HOST_SDCARD_SECTOR_SIZE);
+    host_sdcard_get_stats(&start);
+
+    for (operation = 0; operation < RAW_OPERATIONS && ok != false; operation++)
+    {
+        choice = host_test_random(seed) % 100;
+        count = 1 + host_test_random(seed) % RAW_MAX_SECTORS;
+        offset = ((host_test_random(seed) % 4) == 0) ? (1 + host_test_random(seed) % 3) : 0;
+        base = buffer;
+
+        // Some in the CCM, where the DMA can't go
+        if ((host_test_random(seed) % 8) == 0)
+        {
+            base = host_ccm_ram;
+            count = std::min(count, (HOST_CCM_RAM_SIZE - offset) / HOST_SDCARD_SECTOR_SIZE);
+        }
+
+        if (choice < 50)
+        {
+            // On from the last one, up to the end of the card
+            if (position >= CARD_SECTORS)
+                position = host_test_random(seed) % CARD_SECTORS;
+
+            count = std::min(count, CARD_SECTORS - position);
+            ok = raw_read(disk, position, count, base, offset);
+            position += count;
+        }
+        else if (choice < 60)
+        {
+            sector = host_test_random(seed) % (CARD_SECTORS - count + 1);
+            ok = raw_read(disk, sector, count, base, offset);
+        }
+        else if (choice < 65)
+        {
+            // A sequential run to the last sector of the card
+            position = CARD_SECTORS - 1 - host_test_random(seed) % (2 * RAW_MAX_SECTORS);
+        }
+        else if (choice < 90)
+        {
+            // On the sectors read ahead, the one in flight and those after
+            count = 1 + count % 4;
+            sector = (position > 2) ? (position - 2 + host_test_random(seed) % 5) : 0;
+            sector = std::min(sector, CARD_SECTORS - count);
+            ok = raw_write(disk, sector, count, base, offset, seed);
+        }
+        else
+        {
+            sector = host_test_random(seed) % (CARD_SECTORS - count + 1);
+            ok = raw_write(disk, sector, count, base, offset, seed);
+        }
+    }
+
+    if (memcmp(image, shadow, (size_t)CARD_SECTORS * HOST_SDCARD_SECTOR_SIZE) != 0)
+        host_test_fail("raw: the card is not what was written");
+
+    print_stats("raw", start);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void caller_wait(void)
+{
+    struct timespec delay;
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = BLOCK_TIME * 1000L;
+
+    nanosleep(&delay, NULL);
+}
+
+// Seconds per sector
+static double timed_reads(FF_Disk_t* disk, bool reverse)
+{
+    uint32_t index;
+    uint32_t sector;
+    double seconds = host_test_seconds();
+
+    for (index = 0; index < TIMED_SECTORS; index++)
+    {
+        sector = (reverse != false) ? (TIMED_FIRST + TIMED_SECTORS - 1 - index) : (TIMED_FIRST + index);
+
+        if (raw_read(disk, sector, 1, buffer, 0) == false)
+            break;
+
+        caller_wait();
+    }
+
+    return (host_test_seconds() - seconds) / TIMED_SECTORS;
+}
+
+static void test_slow_card(FF_Disk_t* disk)
+{
+    HOST_SDCARD_STATS start;
+    double sequential;
+    double reverse;
+
+    host_sdcard_set_block_time(BLOCK_TIME);
+    host_sdcard_get_stats(&start);
+
+    reverse = timed_reads(disk, true);
+    print_stats("reverse", start);
+
+    host_sdcard_get_stats(&start);
+    sequential = timed_reads(disk, false);
+    print_stats("sequential", start);
+
+    host_sdcard_set_block_time(0);
+
+    printf("  slow card  %u us per block, as long between the reads: %.0f us per sector sequential, %.0f us in reverse\n",
+           BLOCK_TIME, sequential * 1e6, reverse * 1e6);
+
+    if (sequential > (0.75 * reverse))
+        host_test_fail("slow card: %.0f us per sector sequential, %.0f us in reverse", sequential * 1e6, reverse * 1e6);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    HOST_SDCARD_STATS stats;
+    FF_Disk_t* disk;
+
+    shadow = (uint8_t*)malloc((size_t)CARD_SECTORS * HOST_SDCARD_SECTOR_SIZE);
+
+    host_sdcard_create(CARD_SECTORS);
+    format_card();
+
+    printf("test_sddisk: %u sector SDHC card, %u byte file, %u raw operations\n", CARD_SECTORS, FILE_BYTES, RAW_OPERATIONS);
+
+    if ((disk = FF_SDDiskInit("/")) == NULL)
+    {
+        host_test_fail("card not mounted");
+        return host_test_result("test_sddisk");
+    }
+
+    if (disk->ulNumberOfSectors != CARD_SECTORS)
+        host_test_fail("%u sectors from the CSD, %u on the card", disk->ulNumberOfSectors, CARD_SECTORS);
+
+    test_file(disk);
+    test_bench(disk);
+    test_raw(disk);
+    test_slow_card(disk);
+
+    host_sdcard_get_stats(&stats);
+
+    if (stats.Errors != 0)
+        host_test_fail("%u protocol errors", stats.Errors);
+
+    return host_test_result("test_sddisk");
+}
@@ -0,0 +1,301 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_settings_journal - the settings journal in the W25Q16 under power cuts
+//
+// Settings_Manager saves to the flash of host_platform.cpp (host_flash.h),
+// each reboot is a Load() into cleared settings:
+//
+//  - Settings in the old single copy format are loaded, the first save moves
+//    them into the journal
+//  - Saves of a mixed workload (one setting, a coordinate system, many words
+//    at once), with a power cut in a random program or erase of some of them,
+//    then saves of many words (a new sector every few), cut more often.
+//    After a cut the reboot has to give the settings from before the save or
+//    the ones saved, never defaults or a mix. Without a cut it has to give
+//    the ones saved
+//  - Saves of a single setting each: every one has to be a single page
+//    program well under a millisecond (erases apart), and the erases have to
+//    go round the whole ring
+//
+// Prints the bytes programmed and the flash busy time per save (typical
+// W25Q16 times) and the endurance of each workload: saves until the most
+// erased sector of the journal reaches FLASH_ERASE_CYCLES.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host_test.h"
+#include "host_flash.h"
+#include "settings_manager.h"
+#include "spi_ports.h"
+
+#define MIXED_SAVES             100000
+#define MIXED_CUT_EVERY         64          // Saves, on average
+#define LARGE_SAVES             10000
+#define LARGE_CUT_EVERY         4
+#define SINGLE_SAVES            50000
+#define CUT_OPERATIONS          6           // The cut falls on one of the first of a save
+#define REBOOT_EVERY            50          // Saves without a cut between checked reboots
+#define FLASH_ERASE_CYCLES      100000      // Per sector, W25Q16 datasheet minimum
+#define APPEND_MAX_US           1000
+
+#define SETTINGS_WORDS          SETTINGS_DATA_SIZE_WORDS_NO_CRC
+
+typedef enum WORKLOAD
+{
+    WORKLOAD_SINGLE,                        // One setting per save
+    WORKLOAD_MIXED,                         // Mostly one setting or a coordinate system
+    WORKLOAD_LARGE,                         // Many words, a new sector every few saves
+
+}WORKLOAD;
+
+// The settings as Settings_Manager holds them
+class JournalProbe : public Settings_Manager
+{
+public:
+
+    static uint32_t* Words() { return (uint32_t*)m_data; }
+
+    // Power up: nothing in RAM, settings from the flash
+    static bool Reboot(void)
+    {
+        memset(m_data, 0, SETTINGS_DATA_SIZE_BYTES);
+        memset(m_saved, 0, SETTINGS_DATA_SIZE_BYTES);
+
+        return (Load() == 0);
+    }
+};
+
+typedef struct WORKLOAD_REPORT
+{
+    uint32_t    Saves;
+    uint32_t    Bytes;
+    uint64_t    BusyMicroseconds;
+    uint32_t    MinErases;
+    uint32_t    MaxErases;
+
+}WORKLOAD_REPORT;
+
+static bool same_settings(const uint32_t* a, const uint32_t* b)
+{
+    return (memcmp(a, b, SETTINGS_WORDS * 4) == 0);
+}
+
+// Word 0 is the header, it stays
+static void change_settings(uint32_t & seed, WORKLOAD workload)
+{
+    uint32_t* words = JournalProbe::Words();
+    float values[6];
+    uint32_t choice = (workload == WORKLOAD_MIXED) ? (host_test_random(seed) % 10) : 9;
+    uint32_t count;
+    uint32_t index;
+
+    if (workload == WORKLOAD_SINGLE || choice < 6)
+    {
+        words[1 + host_test_random(seed) % (SETTINGS_WORDS - 1)] = host_test_random(seed);
+    }
+    else if (choice < 9)
+    {
+        for (index = 0; index < 6; index++)
+            values[index] = (float)(host_test_random(seed) % 100000) / 100.0f;
+
+        Settings_Manager::WriteCoordinateValues(host_test_random(seed) % 9, values);
+    }
+    else
+    {
+        count = (workload == WORKLOAD_MIXED) ? (20 + host_test_random(seed) % 40) : (60 + host_test_random(seed) % 100);
+
+        for (index = 0; index < count; index++)
+            words[1 + host_test_random(seed) % (SETTINGS_WORDS - 1)] = host_test_random(seed);
+    }
+}
+
+static void erase_spread(WORKLOAD_REPORT & report, const uint32_t* erases_before)
+{
+    uint32_t sector;
+    uint32_t erases;
+
+    report.MinErases = 0xFFFFFFFF;
+    report.MaxErases = 0;
+
+    for (sector = 0; sector < SETTINGS_JOURNAL_SECTORS; sector++)
+    {
+        erases = host_flash_sector_erases(SETTINGS_DATA_START_ADDRESS / HOST_FLASH_SECTOR_SIZE + sector) - erases_before[sector];
+
+        report.MinErases = (erases < report.MinErases) ? erases : report.MinErases;
+        report.MaxErases = (erases > report.MaxErases) ? erases : report.MaxErases;
+    }
+}
+
+static void print_report(const char* name, const WORKLOAD_REPORT & report)
+{
+    printf("  %-22s %6u saves, %5.1f bytes %5.3f ms per save, erases %u..%u per sector, endurance %.0fM saves\n",
+           name, report.Saves, (double)report.Bytes / report.Saves, report.BusyMicroseconds / 1000.0 / report.Saves,
+           report.MinErases, report.MaxErases, (double)FLASH_ERASE_CYCLES * report.Saves / report.MaxErases / 1e6);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void check_old_format(void)
+{
+    SETTINGS_DATA old;
+    uint32_t* words;
+
+    // The settings in RAM, then a blank flash again
+    Settings_Manager::Initialize();
+    host_flash_reset();
+
+    words = JournalProbe::Words();
+
+    // The single copy at the start of the flash, as Save() wrote it before the journal
+    Settings_Manager::ResetToDefaults();
+    Settings_Manager::SetJunctionDeviation_mm(0.0123f);
+    words[SETTINGS_WORDS] = Settings_Manager::CalculateCRC(words, SETTINGS_WORDS);
+    memcpy(&old, words, sizeof(old));
+
+    W25QXX_Write_Page((uint8_t*)&old, SETTINGS_DATA_START_ADDRESS, 256);
+    W25QXX_Write_Page((uint8_t*)&old + 256, SETTINGS_DATA_START_ADDRESS + 256, sizeof(old) - 256);
+
+    if (JournalProbe::Reboot() == false || same_settings(words, (uint32_t*)&old) == false)
+        host_test_fail("old format: not loaded");
+
+    Settings_Manager::Save();
+
+    if (host_flash_sector_erases(SETTINGS_DATA_START_ADDRESS / HOST_FLASH_SECTOR_SIZE) != 0)
+        host_test_fail("old format: the old copy was erased by the first save");
+
+    if (JournalProbe::Reboot() == false || same_settings(words, (uint32_t*)&old) == false)
+        host_test_fail("old format: not in the journal after the first save");
+}
+
+static void run_cuts(const char* name, WORKLOAD workload, uint32_t saves, uint32_t cut_every, uint32_t & seed)
+{
+    static uint32_t before[SETTINGS_WORDS];
+    static uint32_t after[SETTINGS_WORDS];
+    uint32_t erases_before[SETTINGS_JOURNAL_SECTORS] = { 0 };
+    uint32_t* words = JournalProbe::Words();
+    uint32_t cuts = 0;
+    uint32_t old_kept = 0;
+    uint32_t reboots = 0;
+    uint32_t save;
+    bool cut;
+    WORKLOAD_REPORT report;
+    HOST_FLASH_STATS stats;
+
+    host_flash_reset();
+    Settings_Manager::Initialize();
+
+    for (save = 0; save < saves && host_test_failures() == 0; save++)
+    {
+        memcpy(before, words, sizeof(before));
+        change_settings(seed, workload);
+        memcpy(after, words, sizeof(after));
+
+        if ((host_test_random(seed) % cut_every) == 0)
+            host_flash_power_cut(1 + host_test_random(seed) % CUT_OPERATIONS, host_test_random(seed));
+
+        Settings_Manager::Save();
+
+        cut = host_flash_is_cut();
+        host_flash_power_on();
+
+        if (cut == false && (save % REBOOT_EVERY) != 0)
+            continue;
+
+        reboots++;
+
+        if (JournalProbe::Reboot() == false)
+        {
+            host_test_fail("%s, save %u: defaults after the reboot%s", name, save, (cut != false) ? " (cut)" : "");
+        }
+        else if (same_settings(words, after) == false)
+        {
+            if (cut == false || same_settings(words, before) == false)
+                host_test_fail("%s, save %u: settings not the ones saved%s", name, save, (cut != false) ? " or the previous ones (cut)" : "");
+
+            old_kept++;
+        }
+
+        cuts += (cut != false) ? 1 : 0;
+    }
+
+    host_flash_get_stats(&stats);
+
+    report.Saves = saves;
+    report.Bytes = stats.ProgrammedBytes;
+    report.BusyMicroseconds = stats.BusyMicroseconds;
+    erase_spread(report, erases_before);
+
+    print_report(name, report);
+    printf("  %u power cuts, %u reboots: previous settings after %u cuts, the new ones after %u\n", cuts, reboots, old_kept, cuts - old_kept);
+}
+
+static void run_single(uint32_t & seed)
+{
+    uint32_t erases_before[SETTINGS_JOURNAL_SECTORS];
+    uint32_t sector;
+    uint32_t save;
+    uint64_t longest = 0;
+    HOST_FLASH_STATS start, previous, stats;
+    WORKLOAD_REPORT report;
+
+    for (sector = 0; sector < SETTINGS_JOURNAL_SECTORS; sector++)
+        erases_before[sector] = host_flash_sector_erases(SETTINGS_DATA_START_ADDRESS / HOST_FLASH_SECTOR_SIZE + sector);
+
+    host_flash_get_stats(&start);
+    previous = start;
+
+    for (save = 0; save < SINGLE_SAVES; save++)
+    {
+        change_settings(seed, WORKLOAD_SINGLE);
+        Settings_Manager::Save();
+
+        host_flash_get_stats(&stats);
+
+        if (stats.Erases == previous.Erases)
+        {
+            if (stats.Programs != (previous.Programs + 1) && stats.Programs != (previous.Programs + 2))
+                host_test_fail("single setting: %u page programs", stats.Programs - previous.Programs);
+
+            if ((stats.BusyMicroseconds - previous.BusyMicroseconds) > longest)
+                longest = stats.BusyMicroseconds - previous.BusyMicroseconds;
+        }
+
+        previous = stats;
+    }
+
+    report.Saves = SINGLE_SAVES;
+    report.Bytes = stats.ProgrammedBytes - start.ProgrammedBytes;
+    report.BusyMicroseconds = stats.BusyMicroseconds - start.BusyMicroseconds;
+    erase_spread(report, erases_before);
+
+    print_report("single setting", report);
+    printf("  longest append %.3f ms\n", longest / 1000.0);
+
+    if (longest > APPEND_MAX_US)
+        host_test_fail("single setting: %.3f ms append", longest / 1000.0);
+
+    if ((report.MaxErases - report.MinErases) > 1)
+        host_test_fail("single setting: erases %u..%u, not round the ring", report.MinErases, report.MaxErases);
+
+    if (JournalProbe::Reboot() == false)
+        host_test_fail("single setting: defaults after the reboot");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    uint32_t seed = 0x5E77044;
+
+    printf("test_settings_journal: %u sectors, %u byte settings\n", SETTINGS_JOURNAL_SECTORS, (uint32_t)SETTINGS_DATA_SIZE_BYTES);
+
+    check_old_format();
+    run_cuts("mixed, with cuts", WORKLOAD_MIXED, MIXED_SAVES, MIXED_CUT_EVERY, seed);
+    run_cuts("large, with cuts", WORKLOAD_LARGE, LARGE_SAVES, LARGE_CUT_EVERY, seed);
+    run_single(seed);
+
+    return host_test_result("test_settings_journal");
+}
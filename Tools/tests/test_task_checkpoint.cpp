@@ -0,0 +1,490 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_checkpoint - job checkpoints in the W25Q16 under power cuts, and
+// the resume from them
+//
+// The test is the disk task and the parsing task of a job: it parses the
+// lines of a generated job on a machine of its own, around each one the
+// JobCheckpoint calls of gcode_parsing_task.cpp. The machine is in check
+// mode, nothing steps: the test starts the tagged block of a candidate line
+// as soon as the line is parsed (the step ticker's OnBlockStarted) and a
+// line is a candidate whenever the test says so (the interval is skipped).
+// The settings task writes the checkpoints to the flash of host_platform.cpp
+// (host_flash.h), with a power cut in some of the writes.
+//
+// After each cut the controller reboots (JobCheckpoint::Initialize) and the
+// job is resumed the way $FR does it: the resume lines of the checkpoint on
+// a fresh machine, then the file from the checkpoint line. Checked:
+//
+//  - The checkpoint is the last one written before the cut or the one being
+//    written, with the offset of its line in the file
+//  - Its state is the one of the parser before that line in a run without
+//    cuts, and the resume lines rebuild it (positions within 0.1 um)
+//  - The job that went through all the cuts ends in the same state as the
+//    run without cuts, and once it completes there is nothing to resume
+//  - A job of another file (a toolpath, no checkpoints) that completes in
+//    between leaves the checkpoint of this one
+//
+// The job switches work coordinate systems, G92 offsets, tools, spindle,
+// coolant, units and distance modes, and has arcs (not checkpointed).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_flash.h"
+#include "MachineCore.h"
+#include "GCodeParser.h"
+#include "JobCheckpoint.h"
+#include "gcode_parsing_task.h"
+#include "settings_manager.h"
+
+#define JOB_LINES               6000
+#define CHECKPOINT_EVERY        3           // Lines, on average
+#define CUT_EVERY               8           // Checkpoints, on average
+#define WRITE_TIMEOUT           1.0         // Seconds
+#define SETTLE_TIME             pdMS_TO_TICKS(20)
+#define POSITION_TOLERANCE      0.0001f     // mm, the resume lines have 4 decimals
+
+#define JOB_NAME                "job.nc"
+
+// The state of JobCheckpoint.cpp the test looks into, and the reboot
+class CheckpointProbe : public JobCheckpoint
+{
+public:
+
+    static uint32_t Sequence() { return m_latest.Sequence; }
+    static uint32_t LineNumber() { return m_latest.LineNumber; }
+    static bool Completed() { return (m_latest_index != JOB_CHECKPOINT_NONE && m_latest.Completed != 0); }
+    static bool ClearPending() { return m_clear_request; }
+
+    // Next line is a candidate
+    static void Due() { m_last_tick = xTaskGetTickCount() - JOB_CHECKPOINT_INTERVAL; }
+
+    // The first block of the candidate starts. False if there is none (idle: no candidate or
+    // no motion from its line)
+    static bool StartBlock()
+    {
+        if (m_stage == 0)
+            return false;
+
+        OnBlockStarted(m_tag);
+        return true;
+    }
+
+    // Power up: nothing in RAM, the newest record from the flash
+    static void Reboot()
+    {
+        m_latest_index = JOB_CHECKPOINT_NONE;
+        m_loaded = false;
+        m_stage = 0;
+        m_active = false;
+        m_clear_request = false;
+        memset(&m_latest, 0, sizeof(m_latest));
+
+        Initialize();
+    }
+};
+
+typedef struct JOB_LINE
+{
+    std::string     Text;
+    uint32_t        Offset;
+    bool            Valid;              // ReadJobState before the line
+    GCodeJobState   State;
+
+}JOB_LINE;
+
+static std::vector<JOB_LINE> job;       // Line 1 is job[1]
+static GCodeJobState final_state;
+static uint32_t job_size;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void add_line(const char* text)
+{
+    JOB_LINE line;
+
+    line.Text = text;
+    line.Offset = job_size;
+    line.Valid = false;
+
+    job.push_back(line);
+    job_size += line.Text.size() + 1;
+}
+
+static void make_job(uint32_t seed)
+{
+    char text[128];
+    uint32_t index;
+    uint32_t count;
+    uint32_t wcs = 0;
+
+    job.clear();
+    job_size = 0;
+    add_line("");       // No line 0
+
+    add_line("G21 G90 G17 G94");
+    add_line("G10 L2 P1 X10 Y20 Z-5");
+    add_line("G10 L2 P2 X100 Y50 Z-10");
+    add_line("G54 T1 S8000 M3");
+    add_line("M8");
+    add_line("G0 X0 Y0 Z5");
+    add_line("G1 Z-1 F600");
+
+    for (index = 0; job.size() <= JOB_LINES; index++)
+    {
+        if ((index % 211) == 210)
+        {
+            wcs ^= 1;
+            add_line((wcs != 0) ? "G55" : "G54");
+        }
+
+        if ((index % 157) == 156)
+        {
+            if ((host_test_random(seed) % 2) == 0)
+            {
+                sprintf(text, "G92 X%u.5 Y%u", host_test_random(seed) % 100, host_test_random(seed) % 100);
+                add_line(text);
+            }
+            else
+            {
+                add_line("G92.1");
+            }
+        }
+
+        if ((index % 97) == 96)
+        {
+            sprintf(text, "T%u S%u %s", 1 + host_test_random(seed) % 8, 1000 * (1 + host_test_random(seed) % 20), ((index % 2) == 0) ? "M3" : "M4");
+            add_line(text);
+            add_line(((index % 3) == 0) ? "M9" : (((index % 3) == 1) ? "M7" : "M8"));
+        }
+
+        if ((index % 301) == 300)
+        {
+            add_line("G91");
+
+            for (count = 0; count < 20; count++)
+            {
+                sprintf(text, "G1 X%d Y%d", (int)(host_test_random(seed) % 11) - 5, (int)(host_test_random(seed) % 11) - 5);
+                add_line(text);
+            }
+
+            add_line("G90");
+        }
+
+        if ((index % 401) == 400)
+        {
+            add_line("G20");
+
+            for (count = 0; count < 10; count++)
+            {
+                sprintf(text, "G1 X%u.%03u Y%u.%03u F%u", host_test_random(seed) % 8, host_test_random(seed) % 1000,
+                        host_test_random(seed) % 8, host_test_random(seed) % 1000, 10 + host_test_random(seed) % 40);
+                add_line(text);
+            }
+
+            add_line("G21");
+        }
+
+        if ((index % 251) == 250)
+        {
+            add_line("G1 X100 Y100");
+            add_line("G2 X120 Y100 I10 J0");
+            add_line("X140 I10 J0");
+            add_line("G1 X150");
+        }
+
+        if ((index % 53) == 52)
+        {
+            add_line("G0 Z5");
+            sprintf(text, "G0 X%u Y%u", host_test_random(seed) % 200, host_test_random(seed) % 200);
+            add_line(text);
+            sprintf(text, "G1 Z-%u.%u F%u", host_test_random(seed) % 3, host_test_random(seed) % 10, 300 + host_test_random(seed) % 600);
+            add_line(text);
+        }
+
+        sprintf(text, "G1 X%u.%03u Y%u.%03u Z-%u.%02u F%u", host_test_random(seed) % 200, host_test_random(seed) % 1000,
+                host_test_random(seed) % 200, host_test_random(seed) % 1000, host_test_random(seed) % 3, host_test_random(seed) % 100,
+                600 + 100 * (host_test_random(seed) % 20));
+        add_line(text);
+    }
+
+    add_line("G0 Z5");
+    add_line("M5 M9");
+    add_line("G0 X0 Y0");
+}
+
+// G92 offsets and the coordinate system are kept in the settings: every run starts from none
+static void start_settings(void)
+{
+    static const float zero[TOTAL_AXES_COUNT] = { 0 };
+
+    Settings_Manager::WriteCoordinateValues(92, zero);
+    Settings_Manager::SetActiveCoordinateSystemIndex(0);
+}
+
+static MachineCore* new_machine(void)
+{
+    MachineCore* core = new MachineCore();
+
+    core->Initialize();
+    core->SetCheckMode(true);
+
+    return core;
+}
+
+static bool same_state(const GCodeJobState & a, const GCodeJobState & b)
+{
+    uint32_t axis;
+
+    if (memcmp(&a.modal_state, &b.modal_state, sizeof(a.modal_state)) != 0 ||
+        fabsf(a.feed_rate - b.feed_rate) > (a.feed_rate * 1e-5f) ||
+        a.spindle_speed != b.spindle_speed || a.tool_number != b.tool_number)
+        return false;
+
+    for (axis = 0; axis < TOTAL_AXES_COUNT; axis++)
+    {
+        if (fabsf(a.work_coord_sys[axis] - b.work_coord_sys[axis]) > POSITION_TOLERANCE ||
+            fabsf(a.g92_coord_offset[axis] - b.g92_coord_offset[axis]) > POSITION_TOLERANCE ||
+            fabsf(a.machine_pos[axis] - b.machine_pos[axis]) > POSITION_TOLERANCE)
+            return false;
+    }
+
+    return true;
+}
+
+// The run without cuts: the state before each line and at the end
+static void reference_run(void)
+{
+    MachineCore* core;
+    uint32_t number;
+    int result;
+
+    start_settings();
+    core = new_machine();
+
+    for (number = 1; number < job.size(); number++)
+    {
+        job[number].Valid = core->ReadJobState(&job[number].State);
+
+        if ((result = core->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, job[number].Text.c_str())) != GCODE_OK)
+            host_test_fail("line %u \"%s\": error %d", number, job[number].Text.c_str(), result);
+    }
+
+    if (core->ReadJobState(&final_state) == false)
+        host_test_fail("no state at the end of the job");
+}
+
+// $FR: the resume lines on a fresh machine
+static MachineCore* resume(const JOB_CHECKPOINT & checkpoint)
+{
+    MachineCore* core = new_machine();
+    GCodeJobState state;
+    char text[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t index;
+    uint32_t length;
+    int result;
+
+    for (index = 0; index < JOB_RESUME_LINES; index++)
+    {
+        if ((length = JobCheckpoint::BuildResumeLine(checkpoint.State, index, text)) == 0)
+            continue;
+
+        text[length] = '\0';
+
+        if ((result = core->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, text)) != GCODE_OK)
+            host_test_fail("line %u: resume line \"%s\", error %d", checkpoint.LineNumber, text, result);
+    }
+
+    if (core->ReadJobState(&state) == false || same_state(state, checkpoint.State) == false)
+        host_test_fail("line %u: the resume lines don't rebuild the checkpoint state", checkpoint.LineNumber);
+
+    return core;
+}
+
+// Waits for the settings task to write the checkpoint (the sequence moves) or for the cut
+static bool wait_for_write(uint32_t sequence)
+{
+    double start = host_test_seconds();
+
+    while (CheckpointProbe::Sequence() == sequence && host_flash_is_cut() == false)
+    {
+        if ((host_test_seconds() - start) > WRITE_TIMEOUT)
+            return false;
+
+        vTaskDelay(1);
+    }
+
+    // A cut write goes on trying other slots for a moment
+    if (host_flash_is_cut() != false)
+        vTaskDelay(SETTLE_TIME);
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    MachineCore* core;
+    JOB_CHECKPOINT checkpoint;
+    GCodeJobState state;
+    uint32_t seed = 0xC4EC0047;
+    uint32_t number;
+    uint32_t written = 0;           // Line of the last checkpoint written, 0 = none
+    uint32_t attempted;
+    uint32_t sequence;
+    uint32_t checkpoints = 0;
+    uint32_t cuts = 0;
+    uint32_t restarts = 0;
+    uint32_t lines_run = 0;
+    bool cut;
+
+    host_flash_reset();
+    task_test_start(0);
+    Settings_Manager::DisableSoftLimits();
+
+    make_job(0x10B0047);
+    reference_run();
+
+    printf("test_task_checkpoint: %u lines, checkpoint every %u lines, cut every %u checkpoints\n", (uint32_t)job.size() - 1, CHECKPOINT_EVERY, CUT_EVERY);
+
+    start_settings();
+    core = new_machine();
+    JobCheckpoint::BeginJob(JOB_NAME, job_size);
+
+    for (number = 1; number < job.size() && host_test_failures() == 0; number++)
+    {
+        attempted = 0;
+        sequence = CheckpointProbe::Sequence();
+
+        if ((host_test_random(seed) % CHECKPOINT_EVERY) == 0)
+        {
+            CheckpointProbe::Due();
+
+            if ((host_test_random(seed) % CUT_EVERY) == 0)
+                host_flash_power_cut(1 + host_test_random(seed) % 2, host_test_random(seed));
+        }
+
+        // gcode_parsing_task.cpp
+        JobCheckpoint::BeginLine(core, job[number].Offset, number);
+        core->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, job[number].Text.c_str());
+        JobCheckpoint::EndLine(core);
+
+        lines_run++;
+
+        if (CheckpointProbe::StartBlock() != false)
+            attempted = number;
+
+        if (attempted != 0 && wait_for_write(sequence) == false)
+        {
+            host_test_fail("line %u: checkpoint not written", number);
+            break;
+        }
+
+        if (CheckpointProbe::Sequence() != sequence)
+        {
+            written = CheckpointProbe::LineNumber();
+            checkpoints++;
+
+            if (written != number || job[number].Valid == false)
+                host_test_fail("line %u: checkpoint of line %u", number, written);
+        }
+
+        cut = host_flash_is_cut();
+        host_flash_power_cut(0, 1);
+        host_flash_power_on();
+
+        if (cut == false)
+            continue;
+
+        // Power back: the checkpoint left in the flash
+        cuts++;
+        CheckpointProbe::Reboot();
+
+        if (JobCheckpoint::GetLatest(&checkpoint) == false)
+        {
+            if (written != 0)
+                host_test_fail("line %u: no checkpoint after the cut, line %u written", number, written);
+
+            // Nothing to resume, the job starts again
+            start_settings();
+            core = new_machine();
+            JobCheckpoint::BeginJob(JOB_NAME, job_size);
+            number = 0;
+            restarts++;
+            continue;
+        }
+
+        if (checkpoint.LineNumber != written && checkpoint.LineNumber != attempted)
+        {
+            host_test_fail("line %u: checkpoint of line %u after the cut, %u or %u expected", number, checkpoint.LineNumber, written, attempted);
+            break;
+        }
+
+        if (strcmp(checkpoint.FileName, JOB_NAME) != 0 || checkpoint.FileSize != job_size || checkpoint.LineNumber >= job.size() ||
+            checkpoint.LineOffset != job[checkpoint.LineNumber].Offset)
+        {
+            host_test_fail("line %u: checkpoint of %s, %u bytes, line %u at %u", number, checkpoint.FileName, checkpoint.FileSize,
+                           checkpoint.LineNumber, checkpoint.LineOffset);
+            break;
+        }
+
+        if (same_state(checkpoint.State, job[checkpoint.LineNumber].State) == false)
+            host_test_fail("line %u: state of the checkpoint of line %u not the one of the run without cuts", number, checkpoint.LineNumber);
+
+        // $FR: the resume lines, then the file from the checkpoint line
+        written = checkpoint.LineNumber;
+        core = resume(checkpoint);
+        JobCheckpoint::BeginJob(checkpoint.FileName, checkpoint.FileSize);
+        number = checkpoint.LineNumber - 1;
+    }
+
+    if (core->ReadJobState(&state) == false || same_state(state, final_state) == false)
+        host_test_fail("the job resumed after the cuts doesn't end as the one without");
+
+    // Another job completes: not the checkpoint of this one to clear
+    if (JobCheckpoint::GetLatest(&checkpoint) != false)
+    {
+        sequence = CheckpointProbe::Sequence();
+        JobCheckpoint::BeginJob("other.tp", job_size + 1);
+        JobCheckpoint::EndJob(true);
+
+        while (CheckpointProbe::ClearPending() != false)
+            vTaskDelay(1);
+
+        vTaskDelay(SETTLE_TIME);
+
+        if (CheckpointProbe::Sequence() != sequence || JobCheckpoint::GetLatest(&checkpoint) == false)
+            host_test_fail("the checkpoint of %s cleared by the end of another job", JOB_NAME);
+
+        JobCheckpoint::BeginJob(JOB_NAME, job_size);
+    }
+
+    // Completed: the clear record
+    sequence = CheckpointProbe::Sequence();
+    JobCheckpoint::EndJob(true);
+
+    if (wait_for_write(sequence) == false || CheckpointProbe::Completed() == false)
+        host_test_fail("no clear record at the end of the job");
+
+    CheckpointProbe::Reboot();
+
+    if (JobCheckpoint::GetLatest(&checkpoint) != false)
+        host_test_fail("checkpoint of line %u after the job completed", checkpoint.LineNumber);
+
+    printf("  %u checkpoints written, %u power cuts (%u before the first checkpoint), %u lines run for %u\n",
+           checkpoints, cuts, restarts, lines_run, (uint32_t)job.size() - 1);
+
+    task_test_exit(host_test_result("test_task_checkpoint"));
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_framing - the binary framed transport ($B) on the serial task
+//
+// Loopback of the reference sender (frame_sender.cpp) and the serial and
+// parsing tasks, through the USB port. The lines go once over a clean link
+// and once over one that drops and corrupts DATA frames (one bit flipped)
+// and cuts what is sent into packets at random points. The device to host
+// direction is left alone: RESULT frames are never sent again, the protocol
+// only recovers what the host sends.
+//
+// Each line has to get exactly one RESULT frame, in order, with the result of
+// the line: ok, or TARGET_OUTSIDE_LIMIT for the lines meant to fail. EXIT has
+// to bring back the text protocol with an "ok".
+//
+// Prints the throughput of both links and, for the damaged frames, the time
+// from the damage to the result of the line (the recovery).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_usb.h"
+#include "frame_sender.h"
+#include "GCodeParser.h"
+
+#define LINES               20000
+#define FAILING_LINE_EVERY  97
+#define DROP_PER_MILLE      50
+#define CORRUPT_PER_MILLE   50
+#define RESEND_TIMEOUT      0.02        // Seconds without a frame from the device
+#define PHASE_TIMEOUT       60.0
+
+typedef struct FRAMING_PHASE
+{
+    const char* Name;
+    uint32_t    DropPerMille;
+    uint32_t    CorruptPerMille;
+    bool        Split;
+
+}FRAMING_PHASE;
+
+static const FRAMING_PHASE phases[] =
+{
+    { "clean link",             0,              0,                  false },
+    { "5% dropped, 5% corrupt", DROP_PER_MILLE, CORRUPT_PER_MILLE,  true },
+};
+
+static std::vector<std::string> lines;
+static std::vector<int32_t>     expected;
+
+// Shared with the reader thread
+static pthread_mutex_t      sender_lock = PTHREAD_MUTEX_INITIALIZER;
+static FrameSender          sender;
+static std::string          outgoing;
+static const FRAMING_PHASE* phase;
+static uint32_t             random_seed = 0x5EED0034;
+static uint32_t             split_seed = 0x5EED1034;    // Main thread only
+static std::vector<double>  damage_time;        // By seq, first time a frame of the line was damaged
+static std::vector<double>  recovery_ms;
+static uint32_t             results_received;
+static uint32_t             frames_damaged;
+static double               last_frame_time;
+static volatile bool        reader_stop;
+
+static void make_lines(void)
+{
+    char text[64];
+    uint32_t index;
+
+    for (index = 0; index < LINES; index++)
+    {
+        if ((index % FAILING_LINE_EVERY) == (FAILING_LINE_EVERY - 1))
+        {
+            sprintf(text, "G1 X999 Y%u F1500", index % 300);
+            expected.push_back(GCODE_ERROR_TARGET_OUTSIDE_LIMIT_VALUES);
+        }
+        else
+        {
+            sprintf(text, "G1 X%u.%03u Y%u.%03u F1500", (index * 7) % 300, index % 1000, (index * 13) % 300, (index * 3) % 1000);
+            expected.push_back(GCODE_OK);
+        }
+
+        lines.push_back(text);
+    }
+}
+
+// [sender_lock] The link: drops and damages DATA frames
+static void sender_output(const uint8_t* data, uint32_t size, void* context)
+{
+    std::string frame((const char*)data, size);
+    uint16_t seq = (uint16_t)(data[2] | (data[3] << 8));
+    uint32_t roll;
+
+    if (data[1] == FRAME_TYPE_DATA)
+    {
+        roll = host_test_random(random_seed) % 1000;
+
+        if (roll < (phase->DropPerMille + phase->CorruptPerMille))
+        {
+            if (damage_time[seq] < 0)
+                damage_time[seq] = host_test_seconds();
+
+            frames_damaged++;
+
+            if (roll < phase->DropPerMille)
+                return;
+
+            frame[host_test_random(random_seed) % size] ^= (char)(1 << (host_test_random(random_seed) % 8));
+        }
+    }
+
+    outgoing += frame;
+}
+
+// [sender_lock]
+static void sender_deliver(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length, void* context)
+{
+    int32_t result;
+
+    if (type != FRAME_TYPE_RESULT)
+        return;
+
+    result = (int32_t)((uint32_t)payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24));
+
+    if (length != 4 || results_received >= LINES || seq != (uint16_t)results_received)
+    {
+        host_test_fail("RESULT frame seq %u after %u results", seq, results_received);
+        return;
+    }
+
+    if (result != expected[results_received])
+        host_test_fail("line %u \"%s\": result %d, expected %d", results_received + 1, lines[results_received].c_str(), result, expected[results_received]);
+
+    if (damage_time[seq] >= 0)
+        recovery_ms.push_back((host_test_seconds() - damage_time[seq]) * 1000);
+
+    results_received++;
+}
+
+static void* reader_thread(void* param)
+{
+    uint8_t data[256];
+    uint32_t count;
+
+    while (reader_stop == false)
+    {
+        count = host_usb_receive(data, sizeof(data), pdMS_TO_TICKS(10));
+
+        if (count == 0)
+            continue;
+
+        pthread_mutex_lock(&sender_lock);
+
+        sender.Feed(data, count);
+        last_frame_time = host_test_seconds();
+
+        pthread_mutex_unlock(&sender_lock);
+    }
+
+    return NULL;
+}
+
+// What the sender put out, in packets of random sizes when the phase splits them
+static bool write_outgoing(const std::string & data)
+{
+    uint32_t offset = 0;
+    uint32_t size;
+
+    while (offset < data.size())
+    {
+        size = (uint32_t)data.size() - offset;
+
+        if (phase->Split != false)
+            size = std::min(size, 1 + (host_test_random(split_seed) % HOST_USB_PACKET_SIZE));
+
+        if (host_usb_send(&data[offset], size, TASK_TEST_WAIT) != size)
+            return false;
+
+        offset += size;
+    }
+
+    return true;
+}
+
+static uint32_t enter_binary_mode(void)
+{
+    char reply[64];
+    char response[64];
+
+    // [BIN:<window>,<max payload>] ok
+    if (task_test_command("$B8", reply, sizeof(reply)) == false || strncmp(reply, "[BIN:", 5) != 0)
+        return 0;
+
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false || strcmp(response, "ok") != 0)
+        return 0;
+
+    return (uint32_t)atoi(&reply[5]);
+}
+
+static void run_phase(const FRAMING_PHASE & current)
+{
+    pthread_t reader;
+    std::string data;
+    uint32_t window;
+    uint32_t sent = 0;
+    uint64_t bytes = 0;
+    double start;
+    double now;
+    char response[64];
+
+    if ((window = enter_binary_mode()) == 0)
+    {
+        host_test_fail("%s: no [BIN:] reply to $B8", current.Name);
+        return;
+    }
+
+    phase = &current;
+    damage_time.assign(LINES, -1);
+    recovery_ms.clear();
+    results_received = 0;
+    frames_damaged = 0;
+
+    sender.Reset(window);
+    sender.AssociateOutput(sender_output, NULL);
+    sender.AssociateDelivery(sender_deliver, NULL);
+
+    reader_stop = false;
+    last_frame_time = host_test_seconds();
+    pthread_create(&reader, NULL, reader_thread, NULL);
+
+    start = host_test_seconds();
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&sender_lock);
+
+        if (results_received == LINES)
+        {
+            pthread_mutex_unlock(&sender_lock);
+            break;
+        }
+
+        while (sent < LINES && sender.CanSend() != false)
+        {
+            sender.SendLine(lines[sent].data(), (uint32_t)lines[sent].size());
+            bytes += lines[sent].size();
+            sent++;
+        }
+
+        now = host_test_seconds();
+
+        if (sender.GetUnacked() != 0 && (now - last_frame_time) > RESEND_TIMEOUT)
+        {
+            sender.Timeout();
+            last_frame_time = now;
+        }
+
+        data.swap(outgoing);
+        outgoing.clear();
+
+        pthread_mutex_unlock(&sender_lock);
+
+        if (data.empty() != false)
+        {
+            if ((now - start) > PHASE_TIMEOUT)
+            {
+                host_test_fail("%s: %u lines sent, %u results", current.Name, sent, results_received);
+                break;
+            }
+
+            usleep(100);
+            continue;
+        }
+
+        if (write_outgoing(data) == false)
+        {
+            host_test_fail("%s: frames not taken", current.Name);
+            break;
+        }
+    }
+
+    now = host_test_seconds();
+
+    reader_stop = true;
+    pthread_join(reader, NULL);
+
+    // The last ACKs, then back to text
+    while (host_usb_receive(response, sizeof(response), pdMS_TO_TICKS(50)) != 0)
+        ;
+
+    phase = &phases[0];
+    sender.SendExit();
+
+    if (write_outgoing(outgoing) == false || task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false || strcmp(response, "ok") != 0)
+        host_test_fail("%s: no ok after EXIT", current.Name);
+
+    outgoing.clear();
+
+    std::sort(recovery_ms.begin(), recovery_ms.end());
+
+    printf("  %-24s %6.0f lines/s, %5.2f MB/s of lines, %u frames damaged, %u sent again, %u timeouts",
+           current.Name, LINES / (now - start), bytes / (now - start) / 1e6, frames_damaged,
+           sender.GetStats().FramesResent, sender.GetStats().Timeouts);
+
+    if (recovery_ms.empty() == false)
+        printf(", recovery median %.2f ms, max %.2f ms", recovery_ms[recovery_ms.size() / 2], recovery_ms.back());
+
+    printf("\n");
+
+    if (sender.GetStats().CrcErrors != 0)
+        host_test_fail("%s: %u device frames with a bad CRC", current.Name, sender.GetStats().CrcErrors);
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t index;
+
+    make_lines();
+
+    task_test_start(0);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_framing"));
+    }
+
+    printf("test_task_framing: %u lines each way\n", LINES);
+
+    for (index = 0; index < (sizeof(phases) / sizeof(phases[0])); index++)
+        run_phase(phases[index]);
+
+    task_test_exit(host_test_result("test_task_framing"));
+
+    return 0;
+}
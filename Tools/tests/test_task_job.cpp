@@ -0,0 +1,216 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_job - G-code jobs streamed from the SD card by the disk task ($F=)
+//
+// The job file is written to the FAT image of host_sddisk.cpp, then run with
+// $F= and followed with $F until it ends. Its lines break if a single byte is
+// lost or moved where a line continues in the other buffer ("45 Y6.789" is
+// an error), some end in \r\n and blank lines are mixed in.
+//
+//  - Card in RAM, parser at full speed: the rate of the streaming itself
+//  - Slow card (latency per read call) with the parser held back per line
+//    the way the planner holds it while the machine moves: the reads have to
+//    hide behind the parser, no underrun
+//  - Very slow card with the parser at full speed: the card sets the pace,
+//    the job still has to run every line
+//  - A line with an error in the middle of the file: the job stops with its
+//    result
+//
+// Each job has to end Done with every line submitted. Prints the lines per
+// second, the lowest read-ahead margin and the underruns the device reports.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_sddisk.h"
+#include "host_machine.h"
+#include "disk_task.h"
+#include "GCodeParser.h"
+
+#define CARD_SECTORS        65536       // 32 MB
+#define JOB_LINES           30000
+#define BLANK_LINE_EVERY    101
+#define CRLF_LINE_EVERY     7
+#define JOB_TIMEOUT         60.0
+
+typedef struct JOB_PHASE
+{
+    const char* Name;
+    uint32_t    CardLatencyUs;          // Per read call (4 KB)
+    uint32_t    LineTimeUs;             // Parser held per line
+    bool        NoUnderrun;
+
+}JOB_PHASE;
+
+static const JOB_PHASE phases[] =
+{
+    { "card in RAM",                0,      0,      false },
+    { "2 ms card, 100 us per line", 2000,   100,    true },
+    { "10 ms card, full speed",     10000,  0,      false },
+};
+
+typedef struct JOB_REPORT
+{
+    char        State[16];
+    uint32_t    Lines;
+    uint32_t    LinesPerSecond;
+    uint32_t    MinMargin;
+    uint32_t    Underruns;
+
+}JOB_REPORT;
+
+// The lines with text, blank ones are not submitted
+static std::string make_job(uint32_t lines, uint32_t error_line, uint32_t & submitted)
+{
+    std::string job;
+    char text[64];
+    uint32_t index;
+
+    submitted = 0;
+
+    for (index = 0; index < lines; index++)
+    {
+        if ((index % BLANK_LINE_EVERY) == (BLANK_LINE_EVERY - 1))
+        {
+            job += "\n";
+            continue;
+        }
+
+        if (index == error_line)
+            strcpy(text, "G1 X999 Y1 F3000");
+        else
+            sprintf(text, "G1 X%u.%03u Y%u.%03u F3000", (index * 7) % 300, index % 1000, (index * 13) % 300, (index * 3) % 1000);
+
+        job += text;
+        job += ((index % CRLF_LINE_EVERY) == 0) ? "\r\n" : "\n";
+        submitted++;
+    }
+
+    return job;
+}
+
+static bool write_card_file(const char* name, const std::string & data)
+{
+    FF_FILE* file;
+    bool result = false;
+
+    if (DiskTask_AcquireVolume(DISK_OWNER_FIRMWARE) == false)
+        return false;
+
+    if ((file = ff_fopen(name, "w")) != NULL)
+    {
+        result = (ff_fwrite(data.data(), 1, data.size(), file) == data.size());
+        result = (ff_fclose(file) == 0 && result != false);
+    }
+
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+    return result;
+}
+
+// [JOB:<state>[:<result>],<lines>,<lines/s>,<margin>,<underruns>] once the job is over
+static bool run_job(const char* name, JOB_REPORT & report)
+{
+    char line[80];
+    char response[64];
+    double start = host_test_seconds();
+
+    sprintf(line, "$F=%s", name);
+
+    if (task_test_command(line, response, sizeof(response)) == false || strcmp(response, "ok") != 0)
+    {
+        host_test_fail("%s: \"%s\"", line, response);
+        return false;
+    }
+
+    while ((host_test_seconds() - start) < JOB_TIMEOUT)
+    {
+        vTaskDelay(pdMS_TO_TICKS(20));
+
+        if (task_test_command("$F", line, sizeof(line)) == false ||
+            task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false ||
+            sscanf(line, "[JOB:%15[^,],%u,%u,%u,%u]", report.State, &report.Lines, &report.LinesPerSecond, &report.MinMargin, &report.Underruns) != 5)
+        {
+            host_test_fail("%s: job report \"%s\"", name, line);
+            return false;
+        }
+
+        if (strcmp(report.State, "Run") != 0)
+            return true;
+    }
+
+    host_test_fail("%s: still running after %.0f s", name, JOB_TIMEOUT);
+    return false;
+}
+
+static void run_phase(const JOB_PHASE & phase, const std::string & job, uint32_t submitted)
+{
+    JOB_REPORT report;
+
+    host_sddisk_set_latency(phase.CardLatencyUs);
+    host_machine_set_line_time(phase.LineTimeUs);
+
+    if (run_job("job.nc", report) != false)
+    {
+        printf("  %-28s %7u lines/s, min margin %5u bytes, %4u underruns\n", phase.Name, report.LinesPerSecond, report.MinMargin, report.Underruns);
+
+        if (strcmp(report.State, "Done") != 0 || report.Lines != submitted)
+            host_test_fail("%s: %s after %u lines, %u expected", phase.Name, report.State, report.Lines, submitted);
+
+        if (phase.NoUnderrun != false && report.Underruns != 0)
+            host_test_fail("%s: %u underruns", phase.Name, report.Underruns);
+    }
+
+    host_sddisk_set_latency(0);
+    host_machine_set_line_time(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    JOB_REPORT report;
+    std::string job;
+    uint32_t submitted;
+    uint32_t index;
+    char expected[16];
+
+    task_test_start(CARD_SECTORS);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_job"));
+    }
+
+    job = make_job(JOB_LINES, JOB_LINES, submitted);
+
+    if (write_card_file("/job.nc", job) == false)
+    {
+        host_test_fail("job.nc not written to the card");
+        task_test_exit(host_test_result("test_task_job"));
+    }
+
+    printf("test_task_job: %u lines, %u bytes, %u byte buffers\n", JOB_LINES, (uint32_t)job.size(), DISK_JOB_BUFFER_SIZE);
+
+    for (index = 0; index < (sizeof(phases) / sizeof(phases[0])); index++)
+        run_phase(phases[index], job, submitted);
+
+    // Error in the middle of the file
+    job = make_job(JOB_LINES, JOB_LINES / 2, submitted);
+    sprintf(expected, "Error:%d", GCODE_ERROR_TARGET_OUTSIDE_LIMIT_VALUES);
+
+    if (write_card_file("/error.nc", job) == false)
+        host_test_fail("error.nc not written to the card");
+    else if (run_job("error.nc", report) != false && strcmp(report.State, expected) != 0)
+        host_test_fail("error.nc: %s, %s expected", report.State, expected);
+
+    task_test_exit(host_test_result("test_task_job"));
+
+    return 0;
+}
@@ -0,0 +1,292 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_realtime - real-time commands with the receive path full
+//
+// A sender thread streams G-code with the RX capacity of the $I report in
+// flight, while each line holds the parser for LINE_TIME_US (host_machine.h),
+// the way a full planner does while the machine moves. The line buffer of the
+// parsing task stays full and the rest of the capacity waits in the CDC RX
+// FIFO.
+//
+// Meanwhile '!', '?' and '~' are sent, each in a packet of its own, and the
+// time to the feed hold (MachineCore::IsFeedHoldActive), to the status report
+// line (sent during the hold, it has to say so) and to the end of the hold is
+// measured. Each must take less than MAX_REACTION_MS, a small part of the
+// time the G-code queued ahead of them takes to drain, which is what a
+// real-time byte waited before it was picked out of the packets. The feed
+// hold stops the parser with the capacity in flight, so the '~' only gets in
+// if the capacity leaves a packet of room in the FIFO.
+//
+// Every line still gets its "ok", real-time bytes never take one.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_usb.h"
+#include "host_machine.h"
+#include "MachineCore.h"
+
+#define LINE_TIME_US        5000
+#define SAMPLES             30
+#define SAMPLE_INTERVAL_US  120000      // Longer than the feed hold poll of the parser (GCodeParser.cpp)
+#define HOLD_TIME_US        20000
+#define MAX_REACTION_MS     40.0
+
+extern MachineCore* machine;
+
+static const char           stream_line[] = "G1 X12.345 Y6.789 F1500\n";
+
+static uint32_t             rx_capacity;
+static volatile bool        sender_stop = false;
+static volatile uint32_t    lines_sent = 0;
+static volatile uint32_t    bytes_in_flight = 0;
+
+static pthread_mutex_t      output_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t             oks_received = 0;
+static uint32_t             reports_received = 0;
+static uint32_t             others_received = 0;
+static char                 last_report[128];
+
+static uint32_t read_count(const uint32_t & counter)
+{
+    uint32_t value;
+
+    pthread_mutex_lock(&output_lock);
+    value = counter;
+    pthread_mutex_unlock(&output_lock);
+
+    return value;
+}
+
+// Counting sender, as fast as the capacity allows
+static void* sender_thread(void* param)
+{
+    std::deque<uint32_t> in_flight;
+    uint32_t in_flight_bytes = 0;
+    uint32_t answered = 0;
+    uint32_t oks;
+
+    while (sender_stop == false)
+    {
+        for (oks = read_count(oks_received); answered < oks; answered++)
+        {
+            in_flight_bytes -= in_flight.front();
+            in_flight.pop_front();
+        }
+
+        bytes_in_flight = in_flight_bytes;
+
+        if ((in_flight_bytes + sizeof(stream_line) - 1) > rx_capacity)
+        {
+            usleep(100);
+            continue;
+        }
+
+        if (task_test_send(stream_line, sizeof(stream_line) - 1) == false)
+        {
+            host_test_fail("line %u not taken", lines_sent + 1);
+            break;
+        }
+
+        in_flight.push_back(sizeof(stream_line) - 1);
+        in_flight_bytes += sizeof(stream_line) - 1;
+        lines_sent++;
+    }
+
+    return NULL;
+}
+
+// Takes the output as the serial task writes it, so its TX FIFO never holds it back
+static void* reader_thread(void* param)
+{
+    char line[sizeof(last_report)];
+    uint32_t length = 0;
+    uint8_t data[HOST_USB_PACKET_SIZE];
+    uint32_t count, index;
+
+    for ( ; ; )
+    {
+        count = host_usb_receive(data, sizeof(data), pdMS_TO_TICKS(100));
+
+        for (index = 0; index < count; index++)
+        {
+            if (data[index] != '\n')
+            {
+                if (length < (sizeof(line) - 1))
+                    line[length++] = (char)data[index];
+                continue;
+            }
+
+            if (length != 0 && line[length - 1] == '\r')
+                length--;
+
+            line[length] = '\0';
+            length = 0;
+
+            pthread_mutex_lock(&output_lock);
+
+            if (strcmp(line, "ok") == 0)
+            {
+                oks_received++;
+            }
+            else if (line[0] == '<')
+            {
+                strcpy(last_report, line);
+                reports_received++;
+            }
+            else if (line[0] != '\0')
+            {
+                others_received++;
+            }
+
+            pthread_mutex_unlock(&output_lock);
+        }
+    }
+
+    return NULL;
+}
+
+// Milliseconds until the condition holds, -1 after TASK_TEST_WAIT
+static double wait_for(bool (*condition)(void), double start)
+{
+    while (condition() == false)
+    {
+        if ((host_test_seconds() - start) > (TASK_TEST_WAIT / (double)configTICK_RATE_HZ))
+            return -1;
+
+        usleep(50);
+    }
+
+    return (host_test_seconds() - start) * 1000;
+}
+
+static bool feed_hold_on(void)      { return machine->IsFeedHoldActive() != false; }
+static bool feed_hold_off(void)     { return machine->IsFeedHoldActive() == false; }
+
+static uint32_t reports_before;
+static bool report_arrived(void)    { return read_count(reports_received) != reports_before; }
+
+static uint32_t lines_before_drain;
+static bool drained(void)           { return read_count(oks_received) >= lines_before_drain; }
+
+// Sends the real-time command and keeps the time to the condition
+static void measure(char command, bool (*condition)(void), std::vector<double> & times, uint32_t sample)
+{
+    double start, elapsed;
+
+    start = host_test_seconds();
+
+    if (host_usb_send(&command, 1, TASK_TEST_WAIT) != 1)
+    {
+        host_test_fail("'%c' not taken (sample %u)", command, sample);
+        return;
+    }
+
+    elapsed = wait_for(condition, start);
+
+    if (elapsed < 0)
+        host_test_fail("no reaction to '%c' (sample %u)", command, sample);
+    else
+        times.push_back(elapsed);
+}
+
+static void report(const char* name, std::vector<double> & times)
+{
+    if (times.empty() != false)
+        return;
+
+    std::sort(times.begin(), times.end());
+
+    printf("  %-14s median %6.2f ms, max %6.2f ms\n", name, times[times.size() / 2], times.back());
+
+    if (times.back() > MAX_REACTION_MS)
+        host_test_fail("%s took %.2f ms", name, times.back());
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<double> hold_times;
+    std::vector<double> report_times;
+    std::vector<double> resume_times;
+    pthread_t sender, reader;
+    uint32_t sample;
+    uint32_t full_samples = 0;
+    double drain_ms;
+
+    task_test_start(0);
+
+    if (task_test_open() == false || (rx_capacity = task_test_rx_capacity()) == 0)
+    {
+        host_test_fail("no greeting or $I report");
+        task_test_exit(host_test_result("test_task_realtime"));
+    }
+
+    host_machine_set_line_time(LINE_TIME_US);
+
+    pthread_create(&reader, NULL, reader_thread, NULL);
+    pthread_create(&sender, NULL, sender_thread, NULL);
+
+    for (sample = 0; sample < SAMPLES; sample++)
+    {
+        usleep(SAMPLE_INTERVAL_US);
+
+        if ((bytes_in_flight + sizeof(stream_line) - 1) > rx_capacity)
+            full_samples++;
+
+        measure('!', feed_hold_on, hold_times, sample);
+
+        // The sender fills whatever room is left while the parser is held
+        usleep(HOLD_TIME_US);
+
+        reports_before = read_count(reports_received);
+        measure('?', report_arrived, report_times, sample);
+
+        pthread_mutex_lock(&output_lock);
+
+        if (strncmp(last_report, "<Hold|", 6) != 0)
+            host_test_fail("report during the hold: %s", last_report);
+
+        pthread_mutex_unlock(&output_lock);
+
+        measure('~', feed_hold_off, resume_times, sample);
+    }
+
+    // What the queued lines take to go through, once nothing more comes
+    sender_stop = true;
+    pthread_join(sender, NULL);
+
+    lines_before_drain = lines_sent;
+    drain_ms = wait_for(drained, host_test_seconds());
+
+    if (drain_ms < 0)
+        host_test_fail("%u lines sent, %u answered", lines_sent, read_count(oks_received));
+
+    if (full_samples < (SAMPLES * 9) / 10)
+        host_test_fail("capacity in flight for only %u of %u samples", full_samples, SAMPLES);
+
+    // Nothing but the responses and the reports
+    usleep(50000);
+
+    if (read_count(oks_received) != lines_sent || read_count(others_received) != 0)
+        host_test_fail("%u lines sent, %u ok and %u other lines received", lines_sent, read_count(oks_received), read_count(others_received));
+
+    printf("test_task_realtime: %u ms per line, %u bytes in flight in %u of %u samples, they drain in %.0f ms\n",
+           LINE_TIME_US / 1000, rx_capacity, full_samples, SAMPLES, drain_ms);
+
+    report("feed hold", hold_times);
+    report("status report", report_times);
+    report("cycle start", resume_times);
+
+    task_test_exit(host_test_result("test_task_realtime"));
+
+    return 0;
+}
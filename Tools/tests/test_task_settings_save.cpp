@@ -0,0 +1,180 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_settings_save - deferred settings saves of the settings task
+//
+// Runs the serial, parsing and settings tasks (task_test.cpp) on the flash of
+// host_platform.cpp (host_flash.h). A sender changes a setting (the G54 work
+// offset, G10 L2) BURST_CHANGES times, one line at a time, each change
+// followed by M38 (save):
+//
+//  - coalesced: nothing is written during the burst, and the quiet time
+//    (SETTINGS_SAVE_QUIET_TIME) after it makes a single journal record
+//  - not coalesced: $S after every M38 forces the write before its "ok"
+//    comes, the way every change was written before the settings task
+//
+// Prints the time of the burst, the page programs and erases and the busy
+// time of the flash (typical W25Q16 times) of both. Checked: $S forces the
+// write (the record is in the flash when "ok" comes, well before the quiet
+// time), and the settings read back after a reboot are the last ones sent.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_flash.h"
+#include "settings_task.h"
+#include "settings_manager.h"
+#include "GCodeParser.h"
+
+#define BURST_CHANGES       50
+#define QUIET_WAIT          (SETTINGS_SAVE_QUIET_TIME + pdMS_TO_TICKS(500))
+
+typedef struct BURST_RESULT
+{
+    double              Seconds;        // Of the burst, to the last "ok"
+    HOST_FLASH_STATS    During;         // Flash work during the burst
+    HOST_FLASH_STATS    Total;          // Once the settings task is done
+
+}BURST_RESULT;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void stats_since(const HOST_FLASH_STATS & start, HOST_FLASH_STATS & stats)
+{
+    host_flash_get_stats(&stats);
+
+    stats.Programs -= start.Programs;
+    stats.ProgrammedBytes -= start.ProgrammedBytes;
+    stats.Erases -= start.Erases;
+    stats.BusyMicroseconds -= start.BusyMicroseconds;
+}
+
+static bool command_ok(const char* line)
+{
+    char response[64];
+
+    if (task_test_command(line, response, sizeof(response)) == false || strcmp(response, "ok") != 0)
+    {
+        host_test_fail("\"%s\": \"%s\"", line, response);
+        return false;
+    }
+
+    return true;
+}
+
+// X of the G54 offset of a change
+static float change_value(uint32_t index)
+{
+    return 10.0f + 0.5f * index;
+}
+
+static void burst(bool flush_each, uint32_t offset, BURST_RESULT & result)
+{
+    HOST_FLASH_STATS start;
+    char line[64];
+    uint32_t index;
+
+    host_flash_get_stats(&start);
+    result.Seconds = host_test_seconds();
+
+    for (index = 0; index < BURST_CHANGES; index++)
+    {
+        sprintf(line, "G10 L2 P1 X%.1f", change_value(offset + index));
+
+        if (command_ok(line) == false || command_ok("M38") == false)
+            return;
+
+        if (flush_each != false && command_ok("$S") == false)
+            return;
+    }
+
+    result.Seconds = host_test_seconds() - result.Seconds;
+    stats_since(start, result.During);
+
+    vTaskDelay(QUIET_WAIT);
+    stats_since(start, result.Total);
+}
+
+static void print_burst(const char* name, const BURST_RESULT & result)
+{
+    printf("  %-14s %6.1f ms for the burst, %3u page programs (%5u bytes), %u erases, flash busy %6.1f ms (%5.1f ms during the burst)\n",
+           name, result.Seconds * 1000.0, result.Total.Programs, result.Total.ProgrammedBytes, result.Total.Erases,
+           result.Total.BusyMicroseconds / 1000.0, result.During.BusyMicroseconds / 1000.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    BURST_RESULT coalesced;
+    BURST_RESULT flushed;
+    HOST_FLASH_STATS start;
+    HOST_FLASH_STATS stats;
+    char line[64];
+    double seconds;
+    float expected;
+    float offset[TOTAL_AXES_COUNT];
+
+    memset(&coalesced, 0, sizeof(coalesced));
+    memset(&flushed, 0, sizeof(flushed));
+
+    host_flash_reset();
+    task_test_start(0);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_settings_save"));
+    }
+
+    printf("test_task_settings_save: %u changes, each with M38, quiet time %u ms\n", BURST_CHANGES, (uint32_t)SETTINGS_SAVE_QUIET_TIME);
+
+    burst(false, 0, coalesced);
+    burst(true, BURST_CHANGES, flushed);
+
+    print_burst("coalesced", coalesced);
+    print_burst("$S each", flushed);
+
+    // Much faster than the quiet time on the host, it never ran out during the burst
+    if (coalesced.Seconds < (SETTINGS_SAVE_QUIET_TIME / 2000.0) && coalesced.During.Programs != 0)
+        host_test_fail("coalesced: %u programs during the burst", coalesced.During.Programs);
+
+    if (coalesced.Total.Programs == 0 || coalesced.Total.Programs > flushed.Total.Programs / BURST_CHANGES + 1)
+        host_test_fail("coalesced: %u programs, %u for %u saves", coalesced.Total.Programs, flushed.Total.Programs, BURST_CHANGES);
+
+    if (flushed.During.Programs < BURST_CHANGES || flushed.Total.Programs != flushed.During.Programs)
+        host_test_fail("$S each: %u programs during the burst, %u in all", flushed.During.Programs, flushed.Total.Programs);
+
+    // $S right after a change: in the flash before its ok
+    sprintf(line, "G10 L2 P1 X%.1f", change_value(2 * BURST_CHANGES));
+    expected = change_value(2 * BURST_CHANGES);
+
+    host_flash_get_stats(&start);
+    command_ok(line);
+    command_ok("M38");
+
+    seconds = host_test_seconds();
+    command_ok("$S");
+    seconds = host_test_seconds() - seconds;
+    stats_since(start, stats);
+
+    printf("  $S after a change: ok in %.1f ms, %u programs\n", seconds * 1000.0, stats.Programs);
+
+    if (stats.Programs == 0 || seconds >= (SETTINGS_SAVE_QUIET_TIME / 2000.0))
+        host_test_fail("$S: %u programs, ok after %.1f ms", stats.Programs, seconds * 1000.0);
+
+    // Power up: the journal gives the last value
+    Settings_Manager::Initialize();
+    Settings_Manager::ReadCoordinateValues(0, offset);
+
+    if (fabsf(offset[COORD_X] - expected) > 0.001f)
+        host_test_fail("G54 X offset %.3f after a reboot, %.3f sent", offset[COORD_X], expected);
+
+    task_test_exit(host_test_result("test_task_settings_save"));
+
+    return 0;
+}
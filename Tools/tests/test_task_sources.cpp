@@ -0,0 +1,369 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_sources - arbitration of the parsing task between its sources
+//
+// The serial console goes through the USB port and the serial task. A jog
+// thread and an SD thread stand in for the jog sender and the disk task and
+// call the parsing task API (gcode_parsing_task.h) directly, the SD thread
+// with GCODE_JOB_LINEs and several lines in flight.
+//
+//  - Each block keeps the source of its line: a move from one source, then
+//    G4 P0 from another retires it, the status data has to name the source
+//    of the move, for every pair of sources
+//  - The three sources stream at once while every line holds the parser for
+//    LINE_TIME_US. Each line gets exactly one result, in order, through its
+//    own source (some lines of each source fail, at different places). Jog
+//    lines are served before the SD lines queued ahead of them, so they wait
+//    far less than the SD backlog takes to drain
+//  - With a job begun by the SD source, no other source can begin one, the
+//    serial and jog lines are answered with SOURCE_LOCKED while the SD lines
+//    run, and the real-time commands still work. Once the job ends the
+//    others are served again
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_usb.h"
+#include "host_machine.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+
+#define LINE_TIME_US        1000
+#define SD_LINES            2000
+#define SD_IN_FLIGHT        16          // Below GCODE_RESULT_QUEUE_LENGTH
+#define INTERACTIVE_LINES   200         // Serial and jog
+#define INTERACTIVE_PAUSE   5000        // us between two jog or serial lines
+#define MAX_REACTION_MS     40.0
+
+extern MachineCore* machine;
+
+typedef struct SOURCE_RUN
+{
+    const char*             Name;
+    GCODE_SOURCE_OPTIONS    Source;
+    uint32_t                FailEvery;      // Lines meant to fail
+    uint32_t                Lines;
+    bool                    Locked;         // Another source owns the job
+
+    uint32_t                Results;
+    std::vector<double>     Latencies;      // ms, submit to result
+
+}SOURCE_RUN;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void line_text(const SOURCE_RUN & run, uint32_t index, char* text, int32_t & expected)
+{
+    if ((index % run.FailEvery) == (run.FailEvery - 1))
+    {
+        sprintf(text, "G1 X999 Y%u F3000", index % 300);
+        expected = GCODE_ERROR_TARGET_OUTSIDE_LIMIT_VALUES;
+    }
+    else
+    {
+        sprintf(text, "G1 X%u.%03u Y%u F3000", (index * 7) % 300, index % 1000, (index * 11) % 300);
+        expected = GCODE_OK;
+    }
+
+    if (run.Locked != false)
+        expected = GCODE_ERROR_SOURCE_LOCKED;
+}
+
+// Sends a line on the serial port and reads its response
+static bool serial_line(const char* text, int32_t & result)
+{
+    char response[64];
+
+    if (task_test_command(text, response, sizeof(response)) == false)
+        return false;
+
+    if (strcmp(response, "ok") == 0)
+        result = GCODE_OK;
+    else if (strncmp(response, "error:", 6) == 0)
+        result = atoi(&response[6]);
+    else
+        return false;
+
+    return true;
+}
+
+// One line from a source, waiting for its result
+static bool run_line(GCODE_SOURCE_OPTIONS source, const char* text, int32_t & result)
+{
+    GCODE_JOB_LINE line;
+
+    if (source == GCODE_SOURCE_SERIAL_CONSOLE)
+        return serial_line(text, result);
+
+    if (source == GCODE_SOURCE_SD_STORAGE)
+    {
+        line.Offset = 0;
+        line.Number = 0;
+        line.Flags = 0;
+        strcpy(line.Text, text);
+
+        if (GCodeParsingTask_SubmitJobLine(source, &line, (uint32_t)strlen(text), TASK_TEST_WAIT) == false)
+            return false;
+    }
+    else if (GCodeParsingTask_SubmitLine(source, text, (uint32_t)strlen(text), TASK_TEST_WAIT) == false)
+    {
+        return false;
+    }
+
+    return GCodeParsingTask_GetResult(source, &result, TASK_TEST_WAIT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const char* source_names[GCODE_SOURCE_MAX_VALUE] = { "serial", "SD", "jog" };
+
+static void check_block_sources(void)
+{
+    GLOBAL_STATUS_REPORT_DATA status;
+    uint32_t mover, retirer;
+    int32_t result;
+    char text[32];
+
+    for (mover = 0; mover < GCODE_SOURCE_MAX_VALUE; mover++)
+    {
+        for (retirer = 0; retirer < GCODE_SOURCE_MAX_VALUE; retirer++)
+        {
+            sprintf(text, "G1 X%u Y%u F3000", 10 + mover * 30 + retirer, 20 + retirer * 30);
+
+            if (run_line((GCODE_SOURCE_OPTIONS)mover, text, result) == false || result != GCODE_OK ||
+                run_line((GCODE_SOURCE_OPTIONS)retirer, "G4 P0", result) == false || result != GCODE_OK)
+            {
+                host_test_fail("move from %s, G4 from %s: no result or error", source_names[mover], source_names[retirer]);
+                continue;
+            }
+
+            machine->GetGlobalStatusReport(status);
+
+            if (status.GCodeSource != (GCODE_SOURCE_OPTIONS)mover)
+                host_test_fail("move from %s retired by a G4 from %s: block of source %u", source_names[mover], source_names[retirer], status.GCodeSource);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Serial and jog: one line at a time, with pauses
+static void* interactive_thread(void* param)
+{
+    SOURCE_RUN* run = (SOURCE_RUN*)param;
+    char text[GCODE_MAX_LINE_LENGTH + 1];
+    int32_t expected, result;
+    uint32_t index;
+    double start;
+
+    for (index = 0; index < run->Lines; index++)
+    {
+        usleep(INTERACTIVE_PAUSE);
+
+        line_text(*run, index, text, expected);
+        start = host_test_seconds();
+
+        if (run_line(run->Source, text, result) == false)
+        {
+            host_test_fail("%s line %u: no result", run->Name, index + 1);
+            break;
+        }
+
+        run->Latencies.push_back((host_test_seconds() - start) * 1000);
+        run->Results++;
+
+        if (result != expected)
+            host_test_fail("%s line %u \"%s\": result %d, expected %d", run->Name, index + 1, text, result, expected);
+    }
+
+    return NULL;
+}
+
+// Stands in for the disk task: keeps SD_IN_FLIGHT job lines ahead of the results
+static void* sd_thread(void* param)
+{
+    SOURCE_RUN* run = (SOURCE_RUN*)param;
+    std::deque<int32_t> in_flight;
+    GCODE_JOB_LINE line;
+    int32_t expected, result;
+    uint32_t offset = 0;
+    uint32_t sent = 0;
+
+    while (run->Results < run->Lines)
+    {
+        if (sent < run->Lines && in_flight.size() < SD_IN_FLIGHT)
+        {
+            line_text(*run, sent, line.Text, expected);
+            line.Offset = offset;
+            line.Number = sent + 1;
+            line.Flags = 0;
+
+            if (GCodeParsingTask_SubmitJobLine(GCODE_SOURCE_SD_STORAGE, &line, (uint32_t)strlen(line.Text), TASK_TEST_WAIT) == false)
+            {
+                host_test_fail("SD line %u not taken", sent + 1);
+                break;
+            }
+
+            in_flight.push_back(expected);
+            offset += (uint32_t)strlen(line.Text) + 1;
+            sent++;
+            continue;
+        }
+
+        if (GCodeParsingTask_GetResult(GCODE_SOURCE_SD_STORAGE, &result, TASK_TEST_WAIT) == false)
+        {
+            host_test_fail("SD line %u: no result", run->Results + 1);
+            break;
+        }
+
+        if (result != in_flight.front())
+            host_test_fail("SD line %u: result %d, expected %d", run->Results + 1, result, in_flight.front());
+
+        in_flight.pop_front();
+        run->Results++;
+    }
+
+    return NULL;
+}
+
+static void run_sources(SOURCE_RUN* runs, uint32_t count)
+{
+    pthread_t threads[GCODE_SOURCE_MAX_VALUE];
+    uint32_t index;
+
+    for (index = 0; index < count; index++)
+        pthread_create(&threads[index], NULL, (runs[index].Source == GCODE_SOURCE_SD_STORAGE) ? sd_thread : interactive_thread, &runs[index]);
+
+    for (index = 0; index < count; index++)
+        pthread_join(threads[index], NULL);
+
+    for (index = 0; index < count; index++)
+    {
+        if (runs[index].Results != runs[index].Lines)
+            host_test_fail("%s: %u lines, %u results", runs[index].Name, runs[index].Lines, runs[index].Results);
+    }
+}
+
+static double percentile(std::vector<double> & values, uint32_t percent)
+{
+    if (values.empty() != false)
+        return 0;
+
+    std::sort(values.begin(), values.end());
+
+    return values[((values.size() - 1) * percent) / 100];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void check_realtime_during_job(void)
+{
+    char response[256];
+    double start;
+
+    start = host_test_seconds();
+    host_usb_send("!", 1, TASK_TEST_WAIT);
+
+    while (machine->IsFeedHoldActive() == false && (host_test_seconds() - start) < (MAX_REACTION_MS / 1000))
+        usleep(100);
+
+    if (machine->IsFeedHoldActive() == false)
+        host_test_fail("no feed hold during the job");
+
+    host_usb_send("?", 1, TASK_TEST_WAIT);
+
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false || strncmp(response, "<Hold|", 6) != 0)
+        host_test_fail("status report during the job: \"%s\"", response);
+
+    host_usb_send("~", 1, TASK_TEST_WAIT);
+
+    for (start = host_test_seconds(); machine->IsFeedHoldActive() != false && (host_test_seconds() - start) < (MAX_REACTION_MS / 1000); )
+        usleep(100);
+
+    if (machine->IsFeedHoldActive() != false)
+        host_test_fail("feed hold not cleared during the job");
+}
+
+int main(int argc, char* argv[])
+{
+    SOURCE_RUN runs[GCODE_SOURCE_MAX_VALUE] =
+    {
+        { "serial",     GCODE_SOURCE_SERIAL_CONSOLE,    41, INTERACTIVE_LINES,  false },
+        { "SD",         GCODE_SOURCE_SD_STORAGE,        53, SD_LINES,           false },
+        { "jog",        GCODE_SOURCE_JOG,               67, INTERACTIVE_LINES,  false },
+    };
+    SOURCE_RUN locked_runs[GCODE_SOURCE_MAX_VALUE] =
+    {
+        { "serial (locked)",    GCODE_SOURCE_SERIAL_CONSOLE,    41, INTERACTIVE_LINES,  true },
+        { "SD (job)",           GCODE_SOURCE_SD_STORAGE,        53, SD_LINES,           false },
+        { "jog (locked)",       GCODE_SOURCE_JOG,               67, INTERACTIVE_LINES,  true },
+    };
+    double sd_backlog_ms;
+    int32_t result;
+
+    task_test_start(0);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_sources"));
+    }
+
+    check_block_sources();
+
+    host_machine_set_line_time(LINE_TIME_US);
+
+    // Lines of the SD buffer ahead of a jog line, at the shortest they can be
+    sd_backlog_ms = (GCODE_LINE_BUFFER_SIZE_SD / (offsetof(GCODE_JOB_LINE, Text) + strlen("G1 X0.000 Y0 F3000") + sizeof(size_t))) * (LINE_TIME_US / 1000.0);
+
+    run_sources(runs, GCODE_SOURCE_MAX_VALUE);
+
+    printf("test_task_sources: %u SD lines, %u serial and jog lines at once, %u us per line\n", SD_LINES, INTERACTIVE_LINES, LINE_TIME_US);
+    printf("  jog line to result     median %5.2f ms, 90%% %5.2f ms (SD backlog %.0f ms)\n",
+           percentile(runs[2].Latencies, 50), percentile(runs[2].Latencies, 90), sd_backlog_ms);
+    printf("  serial line to result  median %5.2f ms, 90%% %5.2f ms\n",
+           percentile(runs[0].Latencies, 50), percentile(runs[0].Latencies, 90));
+
+    if (percentile(runs[2].Latencies, 90) > (sd_backlog_ms / 2))
+        host_test_fail("jog lines wait behind the SD lines");
+
+    // The SD source runs a job
+    if (GCodeParsingTask_BeginJob(GCODE_SOURCE_SD_STORAGE) == false ||
+        GCodeParsingTask_BeginJob(GCODE_SOURCE_JOG) != false ||
+        GCodeParsingTask_BeginJob(GCODE_SOURCE_SERIAL_CONSOLE) != false ||
+        GCodeParsingTask_GetJobOwner() != GCODE_SOURCE_SD_STORAGE)
+    {
+        host_test_fail("job not given to the SD source alone");
+    }
+
+    run_sources(locked_runs, GCODE_SOURCE_MAX_VALUE);
+    check_realtime_during_job();
+
+    GCodeParsingTask_EndJob(GCODE_SOURCE_JOG);
+
+    if (GCodeParsingTask_GetJobOwner() != GCODE_SOURCE_SD_STORAGE)
+        host_test_fail("job ended by the jog source");
+
+    GCodeParsingTask_EndJob(GCODE_SOURCE_SD_STORAGE);
+
+    if (GCodeParsingTask_GetJobOwner() != GCODE_SOURCE_MAX_VALUE ||
+        run_line(GCODE_SOURCE_SERIAL_CONSOLE, "G1 X1 Y1 F3000", result) == false || result != GCODE_OK ||
+        run_line(GCODE_SOURCE_JOG, "G1 X2 Y2 F3000", result) == false || result != GCODE_OK)
+    {
+        host_test_fail("serial and jog not served after the job");
+    }
+
+    task_test_exit(host_test_result("test_task_sources"));
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_storage - the SD card as USB mass storage (usb_storage.cpp)
+//
+// The test thread is the USB task and the PC: it calls the class callbacks the
+// way the MSC driver does for the commands of a host (TEST UNIT READY, READ
+// CAPACITY, READ10 / WRITE10 in pieces of the class buffer, eject), and the
+// PC side is a FreeRTOS+FAT IO manager of its own on top of them, as the file
+// system of the PC would be.
+//
+// The PC copies a job and a large file to the card, ejects the drive and the
+// job runs from the card ($F=). Checked on the way: the volume interlock (no
+// job while the host holds the card, no card for the host while a job runs,
+// no sector access after the eject), the file system the firmware mounts
+// again is the one the PC wrote, the card goes back on a USB disconnect.
+//
+// Prints the MB/s of the PC writing and reading the large file through the
+// callbacks. The card is in RAM, so they are the cost of the class glue and
+// the two FAT layers, not what a card on SPI or USB FS allows.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "ff_headers.h"
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_sddisk.h"
+#include "host_usb.h"
+#include "disk_task.h"
+#include "usb_storage.h"
+#include "GCodeParser.h"
+
+#include "tusb.h"
+
+#define CARD_SECTORS        65536       // 32 MB
+#define JOB_LINES           20000
+#define LARGE_FILE_SIZE     (8 * 1024 * 1024)
+#define PC_CACHE_SIZE       (16 * 1024)
+#define JOB_CARD_LATENCY_US 5000        // Keeps the job running while the host asks for the card
+#define JOB_TIMEOUT         30.0
+
+#define SENSE_MEDIUM_NOT_PRESENT    ((SCSI_SENSE_NOT_READY << 8) | 0x3A)
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// The PC
+//
+///////////////////////////////////////////////////////////////////////////////
+
+static FF_Disk_t            pc_disk;
+static SemaphoreHandle_t    pc_mutex;
+
+static bool host_ready(void)
+{
+    host_usb_msc_sense();
+
+    return tud_msc_test_unit_ready_cb(0);
+}
+
+static uint32_t host_capacity(void)
+{
+    uint32_t block_count;
+    uint16_t block_size;
+
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+
+    return (block_size == HOST_SDDISK_SECTOR_SIZE) ? block_count : 0;
+}
+
+// READ10 / WRITE10 of the whole request, split as the class driver does
+static int32_t pc_read_blocks(uint8_t* buffer, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    uint32_t total = count;
+    uint32_t piece;
+
+    for ( ; count != 0; count -= piece, sector += piece, buffer += piece * HOST_SDDISK_SECTOR_SIZE)
+    {
+        piece = std::min(count, (uint32_t)(CFG_TUD_MSC_EP_BUFSIZE / HOST_SDDISK_SECTOR_SIZE));
+
+        if (tud_msc_read10_cb(0, sector, 0, buffer, piece * HOST_SDDISK_SECTOR_SIZE) != (int32_t)(piece * HOST_SDDISK_SECTOR_SIZE))
+            return FF_ERR_IOMAN_DRIVER_FATAL_ERROR | FF_ERRFLAG;
+    }
+
+    return (int32_t)total;
+}
+
+static int32_t pc_write_blocks(uint8_t* buffer, uint32_t sector, uint32_t count, FF_Disk_t* disk)
+{
+    uint32_t total = count;
+    uint32_t piece;
+
+    for ( ; count != 0; count -= piece, sector += piece, buffer += piece * HOST_SDDISK_SECTOR_SIZE)
+    {
+        piece = std::min(count, (uint32_t)(CFG_TUD_MSC_EP_BUFSIZE / HOST_SDDISK_SECTOR_SIZE));
+
+        if (tud_msc_write10_cb(0, sector, 0, buffer, piece * HOST_SDDISK_SECTOR_SIZE) != (int32_t)(piece * HOST_SDDISK_SECTOR_SIZE))
+            return FF_ERR_IOMAN_DRIVER_FATAL_ERROR | FF_ERRFLAG;
+    }
+
+    return (int32_t)total;
+}
+
+static bool pc_mount(void)
+{
+    FF_CreationParameters_t parameters;
+    FF_Error_t error;
+
+    memset(&pc_disk, 0, sizeof(pc_disk));
+    pc_disk.ulNumberOfSectors = host_capacity();
+
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.ulMemorySize = PC_CACHE_SIZE;
+    parameters.ulSectorSize = HOST_SDDISK_SECTOR_SIZE;
+    parameters.fnWriteBlocks = pc_write_blocks;
+    parameters.fnReadBlocks = pc_read_blocks;
+    parameters.pxDisk = &pc_disk;
+    parameters.xBlockDeviceIsReentrant = pdFALSE;
+    parameters.pvSemaphore = (void*)pc_mutex;
+
+    if ((pc_disk.pxIOManager = FF_CreateIOManger(&parameters, &error)) == NULL)
+        return false;
+
+    pc_disk.xStatus.bIsInitialised = pdTRUE;
+
+    if (FF_isERR(FF_Mount(&pc_disk, 0)) != pdFALSE)
+    {
+        FF_DeleteIOManager(pc_disk.pxIOManager);
+        return false;
+    }
+
+    return true;
+}
+
+static bool pc_unmount(void)
+{
+    bool result = (FF_isERR(FF_FlushCache(pc_disk.pxIOManager)) == pdFALSE && FF_isERR(FF_Unmount(&pc_disk)) == pdFALSE);
+
+    FF_DeleteIOManager(pc_disk.pxIOManager);
+    return result;
+}
+
+static bool pc_write_file(const char* name, const std::string & data)
+{
+    FF_Error_t error;
+    FF_FILE* file;
+    bool result;
+
+    file = FF_Open(pc_disk.pxIOManager, name, FF_MODE_WRITE | FF_MODE_CREATE | FF_MODE_TRUNCATE, &error);
+
+    if (file == NULL)
+        return false;
+
+    result = (FF_Write(file, 1, (uint32_t)data.size(), (uint8_t*)&data[0]) == (int32_t)data.size());
+
+    return (FF_isERR(FF_Close(file)) == pdFALSE && result != false);
+}
+
+static bool pc_read_file(const char* name, std::string & data)
+{
+    FF_Error_t error;
+    FF_FILE* file;
+    bool result;
+
+    file = FF_Open(pc_disk.pxIOManager, name, FF_MODE_READ, &error);
+
+    if (file == NULL)
+        return false;
+
+    data.resize(file->ulFileSize);
+    result = (FF_Read(file, 1, (uint32_t)data.size(), (uint8_t*)&data[0]) == (int32_t)data.size());
+
+    FF_Close(file);
+    return result;
+}
+
+// Eject from the file manager: START STOP UNIT, LoEj set and Start clear
+static void host_eject(void)
+{
+    tud_msc_start_stop_cb(0, 0, false, true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void make_files(std::string & job, std::string & large)
+{
+    char text[64];
+    uint32_t seed = 0x5EED0039;
+    uint32_t index;
+
+    for (index = 0; index < JOB_LINES; index++)
+    {
+        sprintf(text, "G1 X%u.%03u Y%u.%03u F3000\n", (index * 7) % 300, index % 1000, (index * 13) % 300, (index * 3) % 1000);
+        job += text;
+    }
+
+    large.resize(LARGE_FILE_SIZE);
+
+    for (index = 0; index < LARGE_FILE_SIZE; index += 4)
+    {
+        uint32_t value = host_test_random(seed);
+        memcpy(&large[index], &value, 4);
+    }
+}
+
+static bool expect_response(const char* line, int32_t result)
+{
+    char response[64];
+    char expected[16];
+
+    if (result == GCODE_OK)
+        strcpy(expected, "ok");
+    else
+        sprintf(expected, "error:%d", result);
+
+    if (task_test_command(line, response, sizeof(response)) == false || strcmp(response, expected) != 0)
+    {
+        host_test_fail("%s: \"%s\", expected \"%s\"", line, response, expected);
+        return false;
+    }
+
+    return true;
+}
+
+// [JOB:<state>,<lines>,...] once the job is over
+static bool wait_for_job(uint32_t & lines)
+{
+    char report[80];
+    char response[64];
+    double start = host_test_seconds();
+
+    while ((host_test_seconds() - start) < JOB_TIMEOUT)
+    {
+        if (task_test_command("$F", report, sizeof(report)) == false ||
+            task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+            break;
+
+        if (strncmp(report, "[JOB:Run,", 9) == 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+
+        if (strncmp(report, "[JOB:Done,", 10) != 0)
+        {
+            host_test_fail("job report %s", report);
+            return false;
+        }
+
+        lines = (uint32_t)atoi(&report[10]);
+        return true;
+    }
+
+    host_test_fail("the job did not end");
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    std::string job, large, data;
+    USB_STORAGE_STATS stats;
+    uint8_t sector[HOST_SDDISK_SECTOR_SIZE];
+    double start, write_time, read_time;
+    uint32_t lines = 0;
+
+    make_files(job, large);
+
+    task_test_start(CARD_SECTORS);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_storage"));
+    }
+
+    pc_mutex = xSemaphoreCreateRecursiveMutex();
+
+    // The disk task mounts the card
+    for (start = host_test_seconds(); DiskTask_IsMounted() == false && (host_test_seconds() - start) < 5.0; )
+        vTaskDelay(pdMS_TO_TICKS(10));
+
+    // Plugged in: the host takes the card, jobs are refused
+    UsbStorage_Connected();
+
+    if (host_ready() == false || DiskTask_GetOwner() != DISK_OWNER_USB_HOST || DiskTask_IsMounted() != false)
+        host_test_fail("the host did not get the card (owner %u)", DiskTask_GetOwner());
+
+    if (host_capacity() != CARD_SECTORS)
+        host_test_fail("capacity %u sectors, card of %u", host_capacity(), CARD_SECTORS);
+
+    expect_response("$F=job.nc", GCODE_ERROR_DISK_NOT_AVAILABLE);
+
+    // The PC copies the files
+    if (pc_mount() == false)
+    {
+        host_test_fail("the PC can't mount the card");
+        task_test_exit(host_test_result("test_task_storage"));
+    }
+
+    start = host_test_seconds();
+
+    if (pc_write_file("/job.nc", job) == false || pc_write_file("/large.bin", large) == false || pc_unmount() == false)
+        host_test_fail("the PC can't write the files");
+
+    write_time = host_test_seconds() - start;
+
+    pc_mount();
+    start = host_test_seconds();
+
+    if (pc_read_file("/large.bin", data) == false || data != large)
+        host_test_fail("the PC reads back something else");
+
+    read_time = host_test_seconds() - start;
+    pc_unmount();
+
+    UsbStorage_GetStats(&stats);
+
+    printf("test_task_storage: PC write %.1f MB/s, read %.1f MB/s (%u sectors written, %u read, %u errors)\n",
+           (job.size() + large.size()) / write_time / 1e6, large.size() / read_time / 1e6,
+           stats.SectorsWritten, stats.SectorsRead, stats.Errors);
+
+    // Ejected: the firmware has the card back and the host gets no sectors
+    host_eject();
+
+    if (DiskTask_GetOwner() != DISK_OWNER_NONE || DiskTask_IsMounted() == false)
+        host_test_fail("the card is not back after the eject");
+
+    if (host_ready() != false || host_usb_msc_sense() != SENSE_MEDIUM_NOT_PRESENT)
+        host_test_fail("ready after the eject");
+
+    if (tud_msc_read10_cb(0, 0, 0, sector, sizeof(sector)) >= 0)
+        host_test_fail("sector read after the eject");
+
+    // The job copied by the PC runs. Meanwhile a new USB mount finds the card busy
+    host_sddisk_set_latency(JOB_CARD_LATENCY_US);
+
+    if (expect_response("$F=job.nc", GCODE_OK) != false)
+    {
+        UsbStorage_Connected();
+
+        if (host_ready() != false || DiskTask_GetOwner() != DISK_OWNER_FIRMWARE)
+            host_test_fail("the host got the card during the job (owner %u)", DiskTask_GetOwner());
+
+        if (wait_for_job(lines) != false && lines != JOB_LINES)
+            host_test_fail("job of %u lines, %u ran", JOB_LINES, lines);
+    }
+
+    host_sddisk_set_latency(0);
+
+    // Job over: the host gets the card again and the files are as the PC left them
+    if (host_ready() == false || pc_mount() == false)
+    {
+        host_test_fail("the host did not get the card after the job");
+    }
+    else
+    {
+        if (pc_read_file("/job.nc", data) == false || data != job || pc_read_file("/large.bin", data) == false || data != large)
+            host_test_fail("the files changed on the card");
+
+        pc_unmount();
+    }
+
+    // Unplugged: the firmware mounts the card again
+    UsbStorage_Disconnected();
+
+    if (DiskTask_GetOwner() != DISK_OWNER_NONE || DiskTask_IsMounted() == false)
+        host_test_fail("the card is not back after the disconnect");
+
+    task_test_exit(host_test_result("test_task_storage"));
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_streaming - the character-counting protocol on the serial task
+//
+// Streams generated lines (gcode_corpus.cpp) through the USB port of the
+// serial and parsing tasks the way a Grbl sender does: the length of every
+// line still waiting for its response is counted and up to the RX capacity
+// of the $I report is kept in flight. Then some more lines one at a time,
+// waiting for each response (the send-and-wait protocol it replaced).
+//
+// Each line has to get exactly one response, in order, and nothing else is
+// sent (no echo): "ok" or "error:N" with the result the same line gets when
+// parsed directly on a fresh machine. Lines longer than the RX buffer get a
+// single error:LINE_TOO_LONG, and the count stays valid after them.
+//
+// Prints the lines per second of both ways and the USB IN packets per
+// response (host_usb.h). Counted, the responses of the lines in flight have
+// to share packets (batched in serial_task.cpp): fewer than
+// MAX_COUNTED_PACKETS per line. One at a time each response is one packet.
+// Lines run in check mode, so the parser and planner set the pace and not
+// the motion.
+//
+// Then the $P report of the parsing and planning stages: every line that
+// reached the parser counted, the line buffer peak within the buffers of the
+// sources, the peak of moves between the stages within the planner queue
+// (GCODE_PLANNER_QUEUE_LENGTH, the move being planned and the one the parser
+// is handing over), busy times within 100%.
+//
+// Last the $M report: the heap (configTOTAL_HEAP_SIZE, free within it and
+// the minimum free within that, host sizes of host_rtos.cpp) and a stack
+// line for each of the tasks the test runs.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <deque>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_usb.h"
+#include "gcode_corpus.h"
+#include "gcode_parsing_task.h"
+#include "serial_task.h"
+#include "MachineCore.h"
+
+#define COUNTED_LINES       40000
+#define WAITED_LINES        4000
+#define LONG_LINE_EVERY     997         // Over-long lines among the generated ones
+#define LONG_LINE_LENGTH    (RX_BUFFER_SIZE + 40)
+#define MAX_COUNTED_PACKETS 0.5         // IN packets per response
+#define PACKETS_SETTLE      pdMS_TO_TICKS(20)
+#define STATS_SETTLE        pdMS_TO_TICKS(1500)         // The stage statistics are updated every second
+
+extern MachineCore* machine;
+
+// Real-time command bytes never reach the line, '$' lines are commands of the serial task
+static void clean_line(char* line)
+{
+    char* src;
+    char* dst = line;
+
+    for (src = line; *src != '\0'; src++)
+    {
+        if (*src != '?' && *src != '!' && *src != '~' && *src != 0x18 && *src != '\b')
+            *dst++ = *src;
+    }
+
+    *dst = '\0';
+
+    if (line[0] == '$')
+        line[0] = ' ';
+}
+
+static void make_lines(std::vector<std::string> & lines, uint32_t count)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t seed = 0x5EED0030;
+    uint32_t index;
+
+    for (index = 0; index < count; index++)
+    {
+        if ((index % LONG_LINE_EVERY) == (LONG_LINE_EVERY - 1))
+        {
+            lines.push_back(std::string("G1 X1 (") + std::string(LONG_LINE_LENGTH, 'a') + ")");
+            continue;
+        }
+
+        if ((index % 8) == 7)
+            corpus_fuzz_line(seed, line);
+        else
+            corpus_cam_line(seed, line);
+
+        clean_line(line);
+        lines.push_back(line);
+    }
+}
+
+// Results on a fresh machine, as the parsing task gets the lines
+static void direct_results(const std::vector<std::string> & lines, std::vector<int32_t> & results)
+{
+    size_t index;
+
+    host_test_start_machine();
+
+    for (index = 0; index < lines.size(); index++)
+    {
+        if (lines[index].size() > RX_BUFFER_SIZE)
+            results.push_back(GCODE_ERROR_LINE_TOO_LONG);
+        else
+            results.push_back(machine->ParseGCodeLine(GCODE_SOURCE_SERIAL_CONSOLE, lines[index].c_str()));
+    }
+}
+
+static void check_response(const char* response, int32_t expected, size_t index)
+{
+    char text[20];
+
+    if (expected == GCODE_OK || expected == GCODE_INFO_BLOCK_DELETE)
+        strcpy(text, "ok");
+    else
+        sprintf(text, "error:%d", expected);
+
+    if (strcmp(response, text) != 0)
+        host_test_fail("line %u: \"%s\" instead of \"%s\"", (uint32_t)index + 1, response, text);
+}
+
+// Sends lines [first, last) keeping up to capacity bytes in flight, or one at a time with capacity 0
+static double stream_lines(const std::vector<std::string> & lines, const std::vector<int32_t> & results,
+                           size_t first, size_t last, uint32_t capacity)
+{
+    std::deque<uint32_t> in_flight;
+    char response[64];
+    std::string text;
+    uint32_t in_flight_bytes = 0;
+    size_t next = first;
+    size_t answered = first;
+    double start;
+
+    start = host_test_seconds();
+
+    while (answered < last)
+    {
+        if (next < last)
+        {
+            text = lines[next] + "\n";
+
+            if (in_flight.empty() != false || (capacity != 0 && (in_flight_bytes + text.size()) <= capacity))
+            {
+                if (task_test_send(text.data(), (uint32_t)text.size()) == false)
+                {
+                    host_test_fail("line %u not taken", (uint32_t)next + 1);
+                    return 0;
+                }
+
+                in_flight.push_back((uint32_t)text.size());
+                in_flight_bytes += (uint32_t)text.size();
+                next++;
+                continue;
+            }
+        }
+
+        if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+        {
+            host_test_fail("no response to line %u (%u in flight)", (uint32_t)answered + 1, (uint32_t)in_flight.size());
+            return 0;
+        }
+
+        check_response(response, results[answered], answered);
+
+        in_flight_bytes -= in_flight.front();
+        in_flight.pop_front();
+        answered++;
+    }
+
+    return (last - first) / (host_test_seconds() - start);
+}
+
+// [PIPE:<lines>,<lines/s>,<parser %>,<planner %>,<line buffer peak>,<planner lines peak>,<blocks>] ok
+static bool pipeline_report(GCODE_PIPELINE_STATS & stats)
+{
+    char response[128];
+
+    if (task_test_command("$P", response, sizeof(response)) == false ||
+        sscanf(response, "[PIPE:%u,%u,%u,%u,%u,%u,%u]", &stats.LinesProcessed, &stats.LinesPerSecond, &stats.ParserBusyPercent,
+               &stats.PlannerBusyPercent, &stats.LineBufferPeak, &stats.PlannerLinesPeak, &stats.PlannerQueueBlocks) != 7)
+    {
+        host_test_fail("$P: \"%s\"", response);
+        return false;
+    }
+
+    printf("  %s\n", response);
+
+    return (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) != false && strcmp(response, "ok") == 0);
+}
+
+static void check_pipeline(const std::vector<std::string> & lines)
+{
+    GCODE_PIPELINE_STATS stats;
+    uint32_t parsed = 0;
+    size_t index;
+
+    for (index = 0; index < lines.size(); index++)
+    {
+        if (lines[index].size() <= RX_BUFFER_SIZE)
+            parsed++;
+    }
+
+    vTaskDelay(STATS_SETTLE);
+
+    if (pipeline_report(stats) == false)
+        return;
+
+    if (stats.LinesProcessed != parsed)
+        host_test_fail("$P: %u lines processed, %u sent to the parser", stats.LinesProcessed, parsed);
+
+    if (stats.LineBufferPeak == 0 || stats.LineBufferPeak > (GCODE_LINE_BUFFER_SIZE_SERIAL + GCODE_LINE_BUFFER_SIZE_SD + GCODE_LINE_BUFFER_SIZE_JOG))
+        host_test_fail("$P: line buffer peak %u bytes", stats.LineBufferPeak);
+
+    if (stats.PlannerLinesPeak == 0 || stats.PlannerLinesPeak > (GCODE_PLANNER_QUEUE_LENGTH + 2))
+        host_test_fail("$P: %u moves between the stages, %u queued at most", stats.PlannerLinesPeak, GCODE_PLANNER_QUEUE_LENGTH);
+
+    if (stats.ParserBusyPercent > 100 || stats.PlannerBusyPercent > 100)
+        host_test_fail("$P: parser busy %u%%, planner busy %u%%", stats.ParserBusyPercent, stats.PlannerBusyPercent);
+}
+
+// [MEM:<free>,<minimum free>,<size>] [STK:<name>,<words>]... ok
+static void check_memory(void)
+{
+    char response[64];
+    char name[16];
+    uint32_t free_bytes, minimum, size, words;
+    uint32_t stacks = 0;
+
+    if (task_test_command("$M", response, sizeof(response)) == false ||
+        sscanf(response, "[MEM:%u,%u,%u]", &free_bytes, &minimum, &size) != 3)
+    {
+        host_test_fail("$M: \"%s\"", response);
+        return;
+    }
+
+    printf("  %s\n", response);
+
+    if (size != configTOTAL_HEAP_SIZE || free_bytes > size || minimum > free_bytes)
+        host_test_fail("$M: %u bytes free, %u at least, of %u", free_bytes, minimum, size);
+
+    while (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) != false && strcmp(response, "ok") != 0)
+    {
+        if (sscanf(response, "[STK:%15[^,],%u]", name, &words) != 2 || words == 0)
+        {
+            host_test_fail("$M: \"%s\"", response);
+            return;
+        }
+
+        stacks++;
+    }
+
+    // DSKTASK GCODE GPLAN SERIAL SETTASK (task_test_start)
+    if (strcmp(response, "ok") != 0 || stacks != 5)
+        host_test_fail("$M: %u stacks, then \"%s\"", stacks, response);
+}
+
+// The serial task may flush the last response after it was read already: its packet is counted
+// once the task is idle again
+static uint32_t settled_in_packets(void)
+{
+    vTaskDelay(PACKETS_SETTLE);
+
+    return host_usb_in_packets();
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    std::vector<int32_t> results;
+    char response[64];
+    uint32_t capacity = 0;
+    uint32_t packets;
+    double counted_rate, waited_rate;
+    double counted_packets, waited_packets;
+
+    make_lines(lines, COUNTED_LINES + WAITED_LINES);
+    direct_results(lines, results);
+
+    task_test_start(0);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_streaming"));
+    }
+
+    if ((capacity = task_test_rx_capacity()) == 0)
+    {
+        host_test_fail("$I report");
+        task_test_exit(host_test_result("test_task_streaming"));
+    }
+
+    packets = settled_in_packets();
+    counted_rate = stream_lines(lines, results, 0, COUNTED_LINES, capacity);
+    counted_packets = (double)(settled_in_packets() - packets) / COUNTED_LINES;
+
+    packets = host_usb_in_packets();
+    waited_rate = stream_lines(lines, results, COUNTED_LINES, lines.size(), 0);
+    waited_packets = (double)(settled_in_packets() - packets) / WAITED_LINES;
+
+    // Nothing after the last response
+    if (task_test_receive(response, sizeof(response), pdMS_TO_TICKS(50)) != 0)
+        host_test_fail("unexpected output after the last response");
+
+    printf("test_task_streaming: %u lines, %.0f lines/s counting %u bytes, %.0f lines/s one at a time\n",
+           (uint32_t)lines.size(), counted_rate, capacity, waited_rate);
+    printf("  IN packets per response: %.3f counting, %.3f one at a time\n", counted_packets, waited_packets);
+
+    if (counted_packets >= MAX_COUNTED_PACKETS)
+        host_test_fail("%.3f IN packets per response counting, the responses are not batched", counted_packets);
+
+    if (waited_packets > 1.0)
+        host_test_fail("%.3f IN packets per response one at a time", waited_packets);
+
+    check_pipeline(lines);
+    check_memory();
+
+    task_test_exit(host_test_result("test_task_streaming"));
+
+    return 0;
+}
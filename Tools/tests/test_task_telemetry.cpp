@@ -0,0 +1,328 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_telemetry - motion telemetry ($T) on the serial task
+//
+// A thread stands in for the step ticker ISR: it ticks MotionTelemetry at the
+// step frequency, in bursts that fill the frames, and writes a sample
+// whenever Tick() says so, with values the test can check from the seq.
+// Meanwhile G-code streams with the RX capacity in flight and '?' asks for
+// status reports, so TELEMETRY frames share the port with text responses.
+//
+// Every frame has to be whole, between two text lines, no larger than the TX
+// buffer of the serial task, with a good CRC (checked by frame_sender.cpp).
+// The samples have to come in seq order without gaps and hold what was
+// written, every line still gets its "ok".
+//
+// With a file name, the bytes from the port are also written to it (input of
+// Tools/tdecode).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_usb.h"
+#include "frame_sender.h"
+#include "serial_task.h"
+#include "MotionTelemetry.h"
+#include "Block.h"
+
+#define SAMPLE_RATE_HZ      1000
+#define RUN_TIME_US         3000000
+#define TICK_BURST_US       20000       // More samples at once than a frame holds
+#define REPORT_INTERVAL_US  50000
+
+static const char           stream_line[] = "G1 X12.345 Y6.789 F1500\n";
+
+static volatile bool        ticker_stop = false;
+static volatile uint32_t    samples_written = 0;
+
+static pthread_mutex_t      output_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool        reader_stop = false;
+static uint32_t             oks_received = 0;
+static uint32_t             reports_received = 0;
+static uint32_t             others_received = 0;
+static uint32_t             frames_received = 0;
+static uint32_t             samples_received = 0;
+static uint32_t             largest_frame = 0;
+static FILE*                capture = NULL;
+
+static FrameSender          frames;
+
+static uint32_t read_count(const uint32_t & counter)
+{
+    uint32_t value;
+
+    pthread_mutex_lock(&output_lock);
+    value = counter;
+    pthread_mutex_unlock(&output_lock);
+
+    return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// What the sample of a seq holds
+static void make_sample(uint16_t seq, TELEMETRY_SAMPLE & sample)
+{
+    uint32_t axis;
+
+    sample.seq = seq;
+    sample.block = (uint16_t)(seq / 50);
+    sample.phase = (uint8_t)(seq % 4);
+    sample.primary_axis = (uint8_t)(seq % 3);
+    sample.reserved = 0;
+    sample.rate = (uint32_t)seq * 12345;
+
+    for (axis = 0; axis < TOTAL_AXES_COUNT; axis++)
+        sample.steps[axis] = (int32_t)(seq * (axis + 1)) - (int32_t)(axis * 1000);
+}
+
+// Stands in for the step ticker ISR
+static void* ticker_thread(void* param)
+{
+    TELEMETRY_SAMPLE sample;
+    uint32_t tick;
+
+    while (ticker_stop == false)
+    {
+        for (tick = 0; tick < (STEP_TICKER_FREQUENCY / (1000000 / TICK_BURST_US)); tick++)
+        {
+            if (MotionTelemetry::IsEnabled() != false && MotionTelemetry::Tick() != false)
+            {
+                make_sample((uint16_t)samples_written, sample);
+                MotionTelemetry::Write(sample.block, sample.phase, sample.primary_axis, sample.rate, sample.steps);
+
+                samples_written++;
+            }
+        }
+
+        usleep(TICK_BURST_US);
+    }
+
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// [output_lock]
+static void frame_deliver(uint8_t type, uint16_t seq, const uint8_t* payload, uint32_t length, void* context)
+{
+    TELEMETRY_SAMPLE received;
+    TELEMETRY_SAMPLE expected;
+    uint32_t offset;
+
+    if (type != FRAME_TYPE_TELEMETRY || (length % sizeof(TELEMETRY_SAMPLE)) != 0)
+    {
+        host_test_fail("frame type 0x%02X of %u bytes", type, length);
+        return;
+    }
+
+    if (seq != (uint16_t)frames_received++)
+        host_test_fail("TELEMETRY frame seq %u, expected %u", seq, (uint16_t)(frames_received - 1));
+
+    for (offset = 0; offset < length; offset += sizeof(TELEMETRY_SAMPLE))
+    {
+        memcpy(&received, &payload[offset], sizeof(received));
+        make_sample((uint16_t)samples_received, expected);
+
+        if (memcmp(&received, &expected, sizeof(received)) != 0)
+            host_test_fail("sample %u holds seq %u", samples_received, received.seq);
+
+        samples_received++;
+    }
+}
+
+// [output_lock]
+static void text_line(const std::string & line)
+{
+    if (line == "ok")
+        oks_received++;
+    else if (line.size() > 2 && line[0] == '<' && line[line.size() - 1] == '>')
+        reports_received++;
+    else if (line.empty() == false && line.compare(0, 5, "Grbl ") != 0)
+        others_received++;
+}
+
+// Splits frames from text lines. A frame has to come whole between two lines
+static void* reader_thread(void* param)
+{
+    std::string frame;
+    std::string line;
+    uint8_t data[HOST_USB_PACKET_SIZE];
+    uint32_t count, index;
+    uint32_t length;
+
+    while (reader_stop == false)
+    {
+        count = host_usb_receive(data, sizeof(data), pdMS_TO_TICKS(10));
+
+        if (capture != NULL)
+            fwrite(data, 1, count, capture);
+
+        pthread_mutex_lock(&output_lock);
+
+        for (index = 0; index < count; index++)
+        {
+            if (frame.empty() == false)
+            {
+                frame += (char)data[index];
+
+                if (frame.size() < FRAME_HEADER_SIZE)
+                    continue;
+
+                length = (uint8_t)frame[4] | ((uint8_t)frame[5] << 8);
+
+                if (frame.size() < (FRAME_HEADER_SIZE + ((length + 3) & ~3) + FRAME_CRC_SIZE))
+                    continue;
+
+                if (frame.size() > largest_frame)
+                    largest_frame = (uint32_t)frame.size();
+
+                frames.Feed((const uint8_t*)frame.data(), (uint32_t)frame.size());
+                frame.clear();
+            }
+            else if (data[index] == FRAME_SOF)
+            {
+                if (line.empty() == false)
+                    host_test_fail("frame inside the text line \"%s\"", line.c_str());
+
+                frame += (char)data[index];
+            }
+            else if (data[index] == '\n')
+            {
+                if (line.empty() == false && line[line.size() - 1] == '\r')
+                    line.erase(line.size() - 1);
+
+                text_line(line);
+                line.clear();
+            }
+            else
+            {
+                line += (char)data[index];
+            }
+        }
+
+        pthread_mutex_unlock(&output_lock);
+    }
+
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    std::deque<uint32_t> in_flight;
+    pthread_t ticker, reader;
+    uint32_t capacity;
+    uint32_t in_flight_bytes = 0;
+    uint32_t lines_sent = 0;
+    uint32_t answered = 0;
+    uint32_t reports_sent = 0;
+    char command[16];
+    double start, next_report;
+
+    if (argc > 1 && (capture = fopen(argv[1], "wb")) == NULL)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    task_test_start(0);
+
+    if (task_test_open() == false || (capacity = task_test_rx_capacity()) == 0)
+    {
+        host_test_fail("no greeting or $I report");
+        task_test_exit(host_test_result("test_task_telemetry"));
+    }
+
+    frames.AssociateDelivery(frame_deliver, NULL);
+
+    pthread_create(&reader, NULL, reader_thread, NULL);
+    pthread_create(&ticker, NULL, ticker_thread, NULL);
+
+    sprintf(command, "$T%u\n", SAMPLE_RATE_HZ);
+    task_test_send(command, (uint32_t)strlen(command));
+    in_flight.push_back((uint32_t)strlen(command));
+    in_flight_bytes += in_flight.back();
+    lines_sent++;
+
+    start = host_test_seconds();
+    next_report = start;
+
+    while ((host_test_seconds() - start) < (RUN_TIME_US / 1e6))
+    {
+        for ( ; answered < read_count(oks_received); answered++)
+        {
+            in_flight_bytes -= in_flight.front();
+            in_flight.pop_front();
+        }
+
+        if (host_test_seconds() >= next_report)
+        {
+            task_test_send("?", 1);
+            reports_sent++;
+            next_report += REPORT_INTERVAL_US / 1e6;
+        }
+
+        if ((in_flight_bytes + sizeof(stream_line) - 1) > capacity)
+        {
+            usleep(100);
+            continue;
+        }
+
+        task_test_send(stream_line, sizeof(stream_line) - 1);
+        in_flight.push_back(sizeof(stream_line) - 1);
+        in_flight_bytes += sizeof(stream_line) - 1;
+        lines_sent++;
+    }
+
+    // The samples left in the ring go out within a poll of the serial task
+    ticker_stop = true;
+    pthread_join(ticker, NULL);
+
+    for (start = host_test_seconds(); (host_test_seconds() - start) < 2.0; usleep(1000))
+    {
+        if (read_count(samples_received) == samples_written && read_count(oks_received) == lines_sent &&
+            read_count(reports_received) == reports_sent)
+            break;
+    }
+
+    task_test_send("$T0\n", 4);
+    lines_sent++;
+
+    usleep(100000);
+
+    reader_stop = true;
+    pthread_join(reader, NULL);
+
+    if (capture != NULL)
+        fclose(capture);
+
+    printf("test_task_telemetry: %u samples in %u frames (up to %u bytes), %u lines, %u status reports\n",
+           samples_received, frames_received, largest_frame, oks_received, reports_received);
+
+    if (samples_received != samples_written || MotionTelemetry::GetOverflowCount() != 0)
+        host_test_fail("%u samples written, %u received, %u lost in the ring", samples_written, samples_received, MotionTelemetry::GetOverflowCount());
+
+    if (largest_frame > TX_BUFFER_SIZE)
+        host_test_fail("frame of %u bytes, TX buffer of %u", largest_frame, TX_BUFFER_SIZE);
+
+    if (frames.GetStats().CrcErrors != 0)
+        host_test_fail("%u frames with a bad CRC", frames.GetStats().CrcErrors);
+
+    if (oks_received != lines_sent || reports_received != reports_sent || others_received != 0)
+        host_test_fail("%u lines and %u '?' sent, %u ok, %u reports and %u other lines received",
+                       lines_sent, reports_sent, oks_received, reports_received, others_received);
+
+    task_test_exit(host_test_result("test_task_telemetry"));
+
+    return 0;
+}
@@ -0,0 +1,255 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_task_upload - file upload to the SD card over the serial port ($U)
+//
+// The test is the host script of the protocol in FileUpload.h: it sends
+// $U<size>,<name>, then the data and its CRC-32, and checks the [UPL:] line
+// and the result. The card is the FAT image of host_sddisk.cpp, each upload
+// is read back from it through FreeRTOS+FAT and compared.
+//
+//  - A large file on a card as slow as a real one (write latency per call),
+//    the double buffering has to keep the rate at UPLOAD_MIN_KBPS or more
+//  - The same name again with a bad CRC: error, the first file stays
+//  - An upload while a job runs from the card (the case MSC can't serve),
+//    the job has to run all its lines
+//
+// Prints the rate of each upload as the device reports it.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "host_test.h"
+#include "task_test.h"
+#include "host_sddisk.h"
+#include "disk_task.h"
+#include "GCodeParser.h"
+
+#define CARD_SECTORS        65536       // 32 MB
+#define LARGE_FILE_SIZE     (2 * 1024 * 1024)
+#define JOB_LINES           20000
+#define CARD_LATENCY_US     2000        // Per read or write call, 2 MB/s for 4 KB
+#define UPLOAD_MIN_KBPS     500
+#define SEND_PIECE          4096
+#define JOB_TIMEOUT         30.0
+
+// zlib CRC-32, as the host computes it
+static uint32_t crc32(const std::string & data)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t index, bit;
+
+    for (index = 0; index < data.size(); index++)
+    {
+        crc ^= (uint8_t)data[index];
+
+        for (bit = 0; bit < 8; bit++)
+            crc = ((crc & 1) != 0) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+static std::string random_data(uint32_t size, uint32_t seed)
+{
+    std::string data(size, '\0');
+    uint32_t index;
+
+    for (index = 0; index < size; index++)
+        data[index] = (char)host_test_random(seed);
+
+    return data;
+}
+
+static std::string job_lines(void)
+{
+    std::string job;
+    char text[64];
+    uint32_t index;
+
+    for (index = 0; index < JOB_LINES; index++)
+    {
+        sprintf(text, "G1 X%u.%03u Y%u.%03u F3000\n", (index * 7) % 300, index % 1000, (index * 13) % 300, (index * 3) % 1000);
+        job += text;
+    }
+
+    return job;
+}
+
+// The file as FreeRTOS+FAT reads it from the card
+static bool read_card_file(const char* name, std::string & data)
+{
+    FF_FILE* file;
+    bool result = false;
+
+    if (DiskTask_AcquireVolume(DISK_OWNER_FIRMWARE) == false)
+        return false;
+
+    if ((file = ff_fopen(name, "r")) != NULL)
+    {
+        data.resize(ff_filelength(file));
+        result = (data.empty() != false || ff_fread(&data[0], 1, data.size(), file) == data.size());
+
+        ff_fclose(file);
+    }
+
+    DiskTask_ReleaseVolume(DISK_OWNER_FIRMWARE);
+    return result;
+}
+
+// Sends the file, returns the result line ("ok" / "error:N") and the KB/s of the [UPL:] line
+static bool upload(const char* name, const std::string & data, uint32_t crc, std::string & result, uint32_t & kbps)
+{
+    char line[96];
+    char response[64];
+    uint8_t crc_bytes[4];
+    uint32_t offset;
+    uint32_t bytes, milliseconds;
+
+    sprintf(line, "$U%u,%s", (uint32_t)data.size(), name);
+
+    if (task_test_command(line, response, sizeof(response)) == false || strcmp(response, "ok") != 0)
+    {
+        host_test_fail("%s: \"%s\"", line, response);
+        return false;
+    }
+
+    for (offset = 0; offset < data.size(); offset += SEND_PIECE)
+    {
+        if (task_test_send(&data[offset], (uint32_t)std::min(data.size() - offset, (size_t)SEND_PIECE)) == false)
+        {
+            host_test_fail("%s: data not taken at %u", name, offset);
+            return false;
+        }
+    }
+
+    crc_bytes[0] = (uint8_t)(crc);
+    crc_bytes[1] = (uint8_t)(crc >> 8);
+    crc_bytes[2] = (uint8_t)(crc >> 16);
+    crc_bytes[3] = (uint8_t)(crc >> 24);
+
+    task_test_send(crc_bytes, 4);
+
+    // [UPL:<bytes>,<ms>,<KB/s>]
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false ||
+        sscanf(response, "[UPL:%u,%u,%u]", &bytes, &milliseconds, &kbps) != 3 || bytes != data.size())
+    {
+        host_test_fail("%s: \"%s\" instead of the [UPL:] line", name, response);
+        return false;
+    }
+
+    if (task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+    {
+        host_test_fail("%s: no result", name);
+        return false;
+    }
+
+    result = response;
+    return true;
+}
+
+static bool wait_for_job(uint32_t & lines)
+{
+    char report[80];
+    char response[64];
+    double start = host_test_seconds();
+
+    while ((host_test_seconds() - start) < JOB_TIMEOUT)
+    {
+        if (task_test_command("$F", report, sizeof(report)) == false ||
+            task_test_read_line(response, sizeof(response), TASK_TEST_WAIT) == false)
+            break;
+
+        if (strncmp(report, "[JOB:Run,", 9) == 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+
+        lines = (uint32_t)atoi(&report[10]);
+        return (strncmp(report, "[JOB:Done,", 10) == 0);
+    }
+
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+    std::string large = random_data(LARGE_FILE_SIZE, 0x5EED0040);
+    std::string small = random_data(100000, 0x5EED1040);
+    std::string job = job_lines();
+    std::string result, data;
+    char error[16];
+    char response[64];
+    uint32_t kbps = 0;
+    uint32_t lines = 0;
+
+    task_test_start(CARD_SECTORS);
+
+    if (task_test_open() == false)
+    {
+        host_test_fail("no greeting");
+        task_test_exit(host_test_result("test_task_upload"));
+    }
+
+    printf("test_task_upload: card latency %u us per call\n", CARD_LATENCY_US);
+    host_sddisk_set_latency(CARD_LATENCY_US);
+
+    // Large file
+    if (upload("large.bin", large, crc32(large), result, kbps) != false)
+    {
+        printf("  %-28s %7u bytes, %5u KB/s\n", "large file", (uint32_t)large.size(), kbps);
+
+        if (result != "ok" || read_card_file("/large.bin", data) == false || data != large)
+            host_test_fail("large.bin: %s, not on the card as sent", result.c_str());
+
+        if (kbps < UPLOAD_MIN_KBPS)
+            host_test_fail("large.bin: %u KB/s, %u expected", kbps, UPLOAD_MIN_KBPS);
+    }
+
+    // Bad CRC: the file on the card stays
+    sprintf(error, "error:%d", GCODE_ERROR_UPLOAD_CRC);
+
+    if (upload("large.bin", small, crc32(small) ^ 1, result, kbps) != false)
+    {
+        if (result != error)
+            host_test_fail("bad CRC: %s, %s expected", result.c_str(), error);
+
+        if (read_card_file("/large.bin", data) == false || data != large)
+            host_test_fail("bad CRC: large.bin replaced");
+    }
+
+    // Upload during a job run from the card
+    if (upload("job.nc", job, crc32(job), result, kbps) == false || result != "ok")
+        host_test_fail("job.nc: %s", result.c_str());
+
+    if (task_test_command("$F=job.nc", response, sizeof(response)) == false || strcmp(response, "ok") != 0)
+    {
+        host_test_fail("$F=job.nc: \"%s\"", response);
+    }
+    else
+    {
+        if (upload("during.bin", small, crc32(small), result, kbps) != false)
+        {
+            printf("  %-28s %7u bytes, %5u KB/s\n", "during a job", (uint32_t)small.size(), kbps);
+
+            if (result != "ok")
+                host_test_fail("during.bin: %s", result.c_str());
+        }
+
+        if (wait_for_job(lines) == false || lines != JOB_LINES)
+            host_test_fail("job of %u lines: %u ran", JOB_LINES, lines);
+
+        if (read_card_file("/during.bin", data) == false || data != small)
+            host_test_fail("during.bin not on the card as sent");
+    }
+
+    task_test_exit(host_test_result("test_task_upload"));
+
+    return 0;
+}
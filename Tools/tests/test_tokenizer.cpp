@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_tokenizer - differential test of the single-pass tokenizer
+//
+// Runs every line twice on a fresh machine in check mode: as it is, through
+// GCodeParser::ParseLine, and the way the two-pass parser did, cleaned by the
+// old cleanup_and_lowercase_line() first (legacy_cleanup.cpp, its errors
+// returned as they are). After each line the status, the parser state
+// (ReadJobState) and the planned blocks, time and extents have to be the same.
+//
+// The lines are generated (gcode_corpus.cpp): CAM lines and mangled ones with
+// mixed case, blanks and comments inside numbers, malformed comments, stray
+// characters and block deletes. Files given on the command line are added.
+//
+//  test_tokenizer [file...]
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include "host_test.h"
+#include "gcode_corpus.h"
+#include "legacy_cleanup.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+#include "settings_manager.h"
+
+#define GENERATED_CAM_LINES     100000
+#define GENERATED_FUZZ_LINES    100000
+
+extern MachineCore* machine;
+
+typedef struct LINE_TRACE
+{
+    int             status;
+    bool            state_valid;
+    GCodeJobState   state;
+    uint32_t        blocks;
+    uint64_t        time_ms;
+    float           min_mm[TOTAL_AXES_COUNT];
+    float           max_mm[TOTAL_AXES_COUNT];
+    
+}LINE_TRACE;
+
+static void trace_line(int status, LINE_TRACE & trace)
+{
+    memset(&trace, 0, sizeof(trace));
+    
+    trace.status = status;
+    trace.state_valid = machine->ReadJobState(&trace.state);
+    trace.blocks = machine->GetCheckBlocks();
+    trace.time_ms = machine->GetCheckTime_ms();
+    machine->GetCheckExtents(trace.min_mm, trace.max_mm);
+}
+
+static void run_lines(const std::vector<std::string> & lines, bool legacy, std::vector<LINE_TRACE> & traces)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint32_t line_len;
+    int status;
+    size_t index;
+    
+    host_test_start_machine();
+    
+    // Moves anywhere, the generated ones don't keep to the machine
+    Settings_Manager::DisableSoftLimits();
+    
+    traces.resize(lines.size());
+    
+    for (index = 0; index < lines.size(); index++)
+    {
+        strncpy(line, lines[index].c_str(), GCODE_MAX_LINE_LENGTH);
+        line[GCODE_MAX_LINE_LENGTH] = '\0';
+        
+        if (legacy != false)
+        {
+            status = legacy_cleanup_and_lowercase_line(line, line_len);
+            
+            if (status == GCODE_OK && line_len != 0)
+                status = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+        else
+        {
+            status = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, line);
+        }
+        
+        trace_line(status, traces[index]);
+    }
+}
+
+static bool read_file(const char* path, std::vector<std::string> & lines)
+{
+    char line[GCODE_MAX_LINE_LENGTH + 2];
+    size_t length;
+    FILE* file = fopen(path, "r");
+    
+    if (file == NULL)
+        return false;
+    
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        length = strlen(line);
+        
+        while (length != 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        
+        lines.push_back(line);
+    }
+    
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    std::vector<LINE_TRACE> single_pass, two_pass;
+    char line[GCODE_MAX_LINE_LENGTH];
+    uint32_t seed = 0x2026;
+    uint32_t count, errors = 0;
+    size_t index;
+    int arg;
+    
+    for (count = 0; count < GENERATED_CAM_LINES; count++)
+    {
+        corpus_cam_line(seed, line);
+        lines.push_back(line);
+        
+        corpus_fuzz_line(seed, line);
+        lines.push_back(line);
+    }
+    
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (read_file(argv[arg], lines) == false)
+            host_test_fail("can't read %s", argv[arg]);
+    }
+    
+    run_lines(lines, false, single_pass);
+    run_lines(lines, true, two_pass);
+    
+    for (index = 0; index < lines.size(); index++)
+    {
+        const LINE_TRACE & a = single_pass[index];
+        const LINE_TRACE & b = two_pass[index];
+        
+        if (a.status != GCODE_OK)
+            errors++;
+        
+        if (a.status != b.status)
+            host_test_fail("line %u \"%s\": status %d, two-pass %d", (uint32_t)index + 1, lines[index].c_str(), a.status, b.status);
+        else if (memcmp(&a, &b, sizeof(a)) != 0)
+            host_test_fail("line %u \"%s\": parser state or plan differs", (uint32_t)index + 1, lines[index].c_str());
+    }
+    
+    printf("%u lines (%u with errors), %u blocks planned\n", (uint32_t)lines.size(), errors, 
+        single_pass.empty() ? 0 : single_pass.back().blocks);
+    
+    return host_test_result("test_tokenizer");
+}
@@ -0,0 +1,354 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// test_toolpath - round trip of the precompiled toolpath format
+//
+// Compiles generated CAM lines (gcode_corpus.cpp) with a BinaryToolpath
+// writer attached to the parser, the way gcompile does, then runs the records
+// through MachineCore::ExecuteToolpathRecord in check mode. The planned blocks,
+// time, peak feed and extents have to match those of the same lines parsed in
+// check mode (the extents within the 0.1 um steps of the format).
+//
+// The compile has to leave the settings alone (G92 offsets not saved, active
+// coordinate system unchanged). The records are decoded from chunks of random
+// size, as the disk task gets them from its buffers, and have to be the same
+// as when the whole toolpath is available.
+//
+// Arcs are compiled into ARC records, cut into lines when the records run.
+// A record written by hand has to come back the same, and records with flag
+// or mask bits their type does not define have to be rejected.
+//
+// The lines the compiler rejects by design (G10, G28, M0) are left out of the
+// corpus. Files given on the command line are used instead of the generated
+// lines.
+//
+//  test_toolpath [file...]
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+
+#include "host_test.h"
+#include "gcode_corpus.h"
+#include "gcode_parsing_task.h"
+#include "MachineCore.h"
+#include "BinaryToolpath.h"
+#include "settings_manager.h"
+
+#define GENERATED_LINES         100000
+#define EXTENTS_TOLERANCE_MM    0.0002f
+#define TIME_TOLERANCE          0.0001      // Relative
+
+extern MachineCore* machine;
+
+typedef struct PLAN_SUMMARY
+{
+    uint32_t        blocks;
+    uint64_t        time_ms;
+    float           peak_speed;
+    float           min_mm[TOTAL_AXES_COUNT];
+    float           max_mm[TOTAL_AXES_COUNT];
+
+}PLAN_SUMMARY;
+
+static void summarize_plan(PLAN_SUMMARY & summary)
+{
+    memset(&summary, 0, sizeof(summary));
+
+    // Leaving check mode retires the blocks still queued
+    machine->SetCheckMode(false);
+
+    summary.blocks = machine->GetCheckBlocks();
+    summary.time_ms = machine->GetCheckTime_ms();
+    summary.peak_speed = machine->GetCheckPeakSpeed();
+    machine->GetCheckExtents(summary.min_mm, summary.max_mm);
+}
+
+static void append_output(const uint8_t* data, uint32_t size, void* context)
+{
+    std::vector<uint8_t>* output = (std::vector<uint8_t>*)context;
+
+    output->insert(output->end(), data, data + size);
+}
+
+static void parse_lines(const std::vector<std::string> & lines, std::vector<int> & statuses, PLAN_SUMMARY & summary)
+{
+    size_t index;
+
+    host_test_start_machine();
+    Settings_Manager::DisableSoftLimits();
+
+    statuses.resize(lines.size());
+
+    for (index = 0; index < lines.size(); index++)
+        statuses[index] = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, lines[index].c_str());
+
+    summarize_plan(summary);
+}
+
+static void compile_lines(const std::vector<std::string> & lines, const std::vector<int> & statuses, std::vector<uint8_t> & output)
+{
+    BinaryToolpath writer;
+    float offsets[TOTAL_AXES_COUNT];
+    uint32_t axis;
+    size_t index;
+    int status;
+
+    host_test_start_machine();
+    Settings_Manager::DisableSoftLimits();
+    machine->SetCheckMode(false);
+
+    writer.AssociateOutput(append_output, &output);
+    writer.WriteHeader();
+    machine->AssociateToolpathWriter(&writer);
+
+    for (index = 0; index < lines.size(); index++)
+    {
+        status = machine->ParseGCodeLine(GCODE_SOURCE_SD_STORAGE, lines[index].c_str());
+
+        if (status != statuses[index])
+            host_test_fail("line %u: compiled %d, parsed %d: %s", (uint32_t)index + 1, status, statuses[index], lines[index].c_str());
+    }
+
+    machine->AssociateToolpathWriter(NULL);
+    writer.WriteEnd();
+
+    // Nothing reaches the settings while compiling
+    Settings_Manager::ReadCoordinateValues(92, &offsets[0]);
+
+    for (axis = COORD_X; axis < TOTAL_AXES_COUNT; axis++)
+    {
+        if (offsets[axis] != 0.0f)
+            host_test_fail("compile saved the G92 offset of axis %u: %f", axis, offsets[axis]);
+    }
+
+    if (Settings_Manager::GetActiveCoordinateSystemIndex() != 0)
+        host_test_fail("compile changed the active coordinate system: %u", Settings_Manager::GetActiveCoordinateSystemIndex());
+}
+
+// Every record of the toolpath, decoded with all of it available
+static void decode_whole(const std::vector<uint8_t> & data, std::vector<TOOLPATH_RECORD> & records)
+{
+    BinaryToolpath reader;
+    TOOLPATH_RECORD record;
+    uint32_t position, used;
+
+    if (reader.ReadHeader(&data[0], data.size(), used) != GCODE_OK || used == 0)
+    {
+        host_test_fail("toolpath header not accepted");
+        return;
+    }
+
+    for (position = used; position < data.size(); position += used)
+    {
+        memset(&record, 0, sizeof(record));
+
+        if (reader.ReadRecord(&data[position], data.size() - position, record, used) != GCODE_OK || used == 0)
+        {
+            host_test_fail("record at byte %u not decoded", position);
+            return;
+        }
+
+        records.push_back(record);
+    }
+}
+
+// The same, from chunks of 1 to 64 bytes. A record cut short asks for more (used = 0)
+static void decode_chunks(const std::vector<uint8_t> & data, const std::vector<TOOLPATH_RECORD> & records)
+{
+    BinaryToolpath reader;
+    TOOLPATH_RECORD record;
+    uint32_t position = TOOLPATH_HEADER_SIZE;
+    uint32_t available, used;
+    uint32_t seed = 0x7001;
+    size_t count = 0;
+
+    reader.ReadHeader(&data[0], data.size(), used);
+
+    while (position < data.size() && count < records.size())
+    {
+        available = 1 + (host_test_random(seed) % 64);
+
+        if (available > data.size() - position)
+            available = data.size() - position;
+
+        // Grows the chunk until the record fits, as the disk task joins its buffers
+        for ( ; ; )
+        {
+            memset(&record, 0, sizeof(record));
+
+            if (reader.ReadRecord(&data[position], available, record, used) != GCODE_OK)
+            {
+                host_test_fail("record %u: error in a chunk of %u bytes", (uint32_t)count, available);
+                return;
+            }
+
+            if (used != 0 || available == data.size() - position)
+                break;
+
+            available++;
+        }
+
+        if (used == 0 || memcmp(&record, &records[count], sizeof(record)) != 0)
+        {
+            host_test_fail("record %u: decoded differently from chunks", (uint32_t)count);
+            return;
+        }
+
+        position += used;
+        count++;
+    }
+
+    if (count != records.size())
+        host_test_fail("%u of %u records decoded from chunks", (uint32_t)count, (uint32_t)records.size());
+}
+
+// An arc in the YZ plane and back, then records no writer makes
+static void check_records(void)
+{
+    static const uint8_t Invalid[][2] =
+    {
+        { TOOLPATH_RECORD_LINE | (1 << 7), 0x01 },                  // Clockwise line
+        { TOOLPATH_RECORD_LINE, 0x01 | (1 << TOOLPATH_PLANE_SHIFT) },  // Line with a plane
+        { TOOLPATH_RECORD_ARC, 0x01 | (3 << TOOLPATH_PLANE_SHIFT) },   // No plane 3
+        { TOOLPATH_RECORD_COOLANT | TOOLPATH_FLAG_FEED, 0 },
+        { TOOLPATH_RECORD_END | (1 << 7), 0 },
+    };
+
+    std::vector<uint8_t> data;
+    BinaryToolpath writer;
+    BinaryToolpath reader;
+    TOOLPATH_RECORD record;
+    float target[TOTAL_AXES_COUNT] = { 1.0f, 12.5f, -3.25f, 0.0f, 0.0f, 0.0f };
+    float offset[2] = { 2.5f, -0.0001f };
+    uint32_t used;
+    uint32_t index;
+
+    writer.AssociateOutput(append_output, &data);
+    writer.WriteHeader();
+
+    if (writer.WriteArc(target, offset, true, TOOLPATH_PLANE_YZ, 10.0f, false, 0.0f) != GCODE_OK)
+        host_test_fail("arc record not written");
+
+    reader.ReadHeader(&data[0], data.size(), used);
+    memset(&record, 0, sizeof(record));
+
+    if (reader.ReadRecord(&data[used], data.size() - used, record, used) != GCODE_OK || used != data.size() - TOOLPATH_HEADER_SIZE ||
+        record.type != TOOLPATH_RECORD_ARC || record.plane != TOOLPATH_PLANE_YZ || record.clockwise == false || record.rate != 10.0f ||
+        fabsf(record.target[COORD_Z] - target[COORD_Z]) > 0.0001f || fabsf(record.offset[0] - offset[0]) > 0.0001f ||
+        fabsf(record.offset[1] - offset[1]) > 0.0001f)
+    {
+        host_test_fail("arc record read back differently (%u bytes)", used);
+    }
+
+    for (index = 0; index < sizeof(Invalid) / sizeof(Invalid[0]); index++)
+    {
+        if (reader.ReadRecord(Invalid[index], sizeof(Invalid[index]), record, used) != GCODE_ERROR_INVALID_TOOLPATH_DATA)
+            host_test_fail("record %02x %02x accepted", Invalid[index][0], Invalid[index][1]);
+    }
+}
+
+static void run_records(const std::vector<TOOLPATH_RECORD> & records, PLAN_SUMMARY & summary)
+{
+    size_t index;
+    int status;
+
+    host_test_start_machine();
+    Settings_Manager::DisableSoftLimits();
+
+    for (index = 0; index < records.size(); index++)
+    {
+        status = machine->ExecuteToolpathRecord(GCODE_SOURCE_SD_STORAGE, records[index]);
+
+        if (status != GCODE_OK)
+            host_test_fail("record %u (type %u): status %d", (uint32_t)index, records[index].type, status);
+    }
+
+    summarize_plan(summary);
+}
+
+static void compare_plans(const PLAN_SUMMARY & parsed, const PLAN_SUMMARY & replayed)
+{
+    uint32_t axis;
+
+    if (parsed.blocks != replayed.blocks)
+        host_test_fail("blocks: parsed %u, replayed %u", parsed.blocks, replayed.blocks);
+
+    if (fabs((double)parsed.time_ms - (double)replayed.time_ms) > (TIME_TOLERANCE * parsed.time_ms + 1))
+        host_test_fail("time: parsed %llu ms, replayed %llu ms", (unsigned long long)parsed.time_ms, (unsigned long long)replayed.time_ms);
+
+    if (fabsf(parsed.peak_speed - replayed.peak_speed) > 0.001f * parsed.peak_speed)
+        host_test_fail("peak speed: parsed %f, replayed %f", parsed.peak_speed, replayed.peak_speed);
+
+    for (axis = COORD_X; axis < TOTAL_AXES_COUNT; axis++)
+    {
+        if (fabsf(parsed.min_mm[axis] - replayed.min_mm[axis]) > EXTENTS_TOLERANCE_MM ||
+            fabsf(parsed.max_mm[axis] - replayed.max_mm[axis]) > EXTENTS_TOLERANCE_MM)
+        {
+            host_test_fail("extents of axis %u: parsed %f .. %f, replayed %f .. %f", axis,
+                parsed.min_mm[axis], parsed.max_mm[axis], replayed.min_mm[axis], replayed.max_mm[axis]);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> lines;
+    std::vector<int> statuses;
+    std::vector<uint8_t> toolpath;
+    std::vector<TOOLPATH_RECORD> records;
+    PLAN_SUMMARY parsed, replayed;
+    char line[GCODE_MAX_LINE_LENGTH + 2];
+    uint32_t seed = 0x2028;
+    size_t length;
+    int arg;
+    FILE* file;
+
+    for (arg = 1; arg < argc; arg++)
+    {
+        if ((file = fopen(argv[arg], "r")) == NULL)
+        {
+            fprintf(stderr, "test_toolpath: can't read %s\n", argv[arg]);
+            return 2;
+        }
+
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            length = strlen(line);
+
+            while (length != 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                line[--length] = '\0';
+
+            lines.push_back(line);
+        }
+
+        fclose(file);
+    }
+
+    while (argc == 1 && lines.size() < GENERATED_LINES)
+    {
+        corpus_cam_line(seed, line);
+
+        if (strstr(line, "G10") == NULL && strstr(line, "G28") == NULL && strstr(line, "M0") == NULL)
+            lines.push_back(line);
+    }
+
+    parse_lines(lines, statuses, parsed);
+    compile_lines(lines, statuses, toolpath);
+
+    decode_whole(toolpath, records);
+    decode_chunks(toolpath, records);
+
+    run_records(records, replayed);
+    compare_plans(parsed, replayed);
+
+    check_records();
+
+    printf("test_toolpath: %u lines, %u blocks -> %u records, %u bytes\n", (uint32_t)lines.size(),
+        parsed.blocks, (uint32_t)records.size(), (uint32_t)toolpath.size());
+
+    return host_test_result("test_toolpath");
+}